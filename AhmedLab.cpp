@@ -1,5 +1,7 @@
-#include "AhmedLab.h"
+﻿#include "AhmedLab.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
 
 void PrintMessage(MessageLevel level, const char* message)
 {
@@ -14,128 +16,602 @@ void PrintMessage(MessageLevel level, const char* message)
     PrintToConsole("\n");
 }
 
-const Variable* FindVariable(const State& state, const char* name)
+namespace
 {
-    for (const Variable& var : state.vars)
+    struct NameTable
     {
-        if (CompareStrings(name, var.name))
-        {
-            return &var;
-        }
+        HashTable<String, NameId> ids;
+        Array<String> names;
+    };
+
+    NameTable& GetNameTable()
+    {
+        static NameTable table;
+        return table;
     }
-    return NULL;
 }
 
-Variable* FindVariable(State& state, const char* name)
+NameId InternName(const char* name, size_t length)
 {
-    for (Variable& var : state.vars)
+    NameTable& table = GetNameTable();
+    StringView view;
+    view.data = name;
+    view.size = length;
+    const NameId* found = table.ids.find(view);
+    if (found)
     {
-        if (CompareStrings(name, var.name))
-        {
-            return &var;
-        }
+        return *found;
     }
-    return NULL;
+    String s;
+    Append(s, name, length);
+    const NameId id = (NameId)table.names.size();
+    table.names.push_back(s);
+    table.ids.insert(s, id);
+    return id;
 }
 
-void PrintVariable(const Variable& var)
+NameId InternName(const char* name)
 {
-    char buffer[200] = {};
-    MemoryBlock block;
-    block.size = sizeof(buffer);
-    block.data = (uint8_t*)buffer;
+    return InternName(name, StringLength(name));
+}
 
-    PrintToConsole("Name: ");
-    for (char c : var.name)
+bool LookupName(const char* name, NameId& id)
+{
+    const NameId* found = GetNameTable().ids.find(CreateStringView(name));
+    if (found)
     {
-        PrintToConsole(c);
+        id = *found;
     }
-    PrintToConsole("\n");
-    ZeroMemoryBlock(block);
+    return found != NULL;
+}
 
-    PrintToConsole("\n");
+const String& GetName(NameId id)
+{
+    return GetNameTable().names[id];
+}
+
+const Variable* FindVariable(const State& state, NameId id)
+{
+    const size_t* index = state.indices.find(id);
+    return index ? &state.vars[*index] : NULL;
+}
+
+Variable* FindVariable(State& state, NameId id)
+{
+    const size_t* index = state.indices.find(id);
+    return index ? &state.vars[*index] : NULL;
+}
+
+const Variable* FindVariable(const State& state, const char* name)
+{
+    NameId id = 0;
+    return LookupName(name, id) ? FindVariable(state, id) : NULL;
+}
+
+Variable* FindVariable(State& state, const char* name)
+{
+    NameId id = 0;
+    return LookupName(name, id) ? FindVariable(state, id) : NULL;
+}
 
-    sprintf(buffer, "Size = (%zu X %zu).\n", var.value.rows, var.value.cols);
-    PrintToConsole(buffer);
-    ZeroMemoryBlock(block);
+namespace
+{
+    // matrices with more elements print PRINT_EDGE_ITEMS rows and columns from
+    // each end.
+    static const size_t PRINT_MAX_ELEMENTS = 1000;
+    static const size_t PRINT_EDGE_ITEMS = 3;
+
+    // collects the text of a variable and prints it in large pieces.
+    struct PrintBuffer
+    {
+        char data[4096];
+        size_t used = 0;
+    };
+
+    void Flush(PrintBuffer& buffer)
+    {
+        PrintToConsole(buffer.data, buffer.used);
+        buffer.used = 0;
+    }
+
+    void Append(PrintBuffer& buffer, const char* text, size_t size)
+    {
+        if (buffer.used + size > sizeof(buffer.data))
+        {
+            Flush(buffer);
+        }
+        if (size > sizeof(buffer.data))
+        {
+            PrintToConsole(text, size);
+            return;
+        }
+        memcpy(buffer.data + buffer.used, text, size);
+        buffer.used += size;
+    }
+
+    void Append(PrintBuffer& buffer, const char* text)
+    {
+        Append(buffer, text, StringLength(text));
+    }
+
+    // singles print the digits of the float, not of the double it widens to.
+    void AppendNumber(PrintBuffer& buffer, double value, MatrixDataType type)
+    {
+        if (buffer.used + FLOAT_TO_STRING_SIZE > sizeof(buffer.data))
+        {
+            Flush(buffer);
+        }
+        char* text = buffer.data + buffer.used;
+        buffer.used += type == MatrixDataType::FLOAT32 ? FloatToString((float)value, text) : FloatToString(value, text);
+    }
 
-    sprintf(buffer, "Data = [");
-    PrintToConsole(buffer);
-    ZeroMemoryBlock(block);
+    // the index of the next row or column to print, skips the middle of
+    // truncated matrices.
+    size_t NextIndex(size_t i, size_t count, bool truncate)
+    {
+        if (truncate && i + 1 == PRINT_EDGE_ITEMS && count > 2 * PRINT_EDGE_ITEMS)
+        {
+            return count - PRINT_EDGE_ITEMS;
+        }
+        return i + 1;
+    }
 
-    for (size_t i = 0; i < var.value.rows; ++i)
+    // the elements that are not 0 as "(row, col) value" in column major order
+    // with 1 based indices, like MATLAB.
+    void AppendSparse(PrintBuffer& buffer, const SparseMatrix& sparse)
     {
-        for (size_t j = 0; j < var.value.cols; ++j)
+        char text[100] = {};
+        snprintf(text, sizeof(text), "Size = (%zu X %zu), sparse with %zu non zeros.\n",
+                 sparse.rows, sparse.cols, sparse.nonZeros);
+        Append(buffer, text);
+        Append(buffer, "Data = [");
+        SparseMatrix m = ConvertSparseMatrix(sparse, SparseFormat::CSC);
+        defer(FreeSparseMatrix(m));
+        const bool truncate = m.nonZeros > PRINT_MAX_ELEMENTS;
+        size_t j = 0;
+        for (size_t k = 0; k < m.nonZeros; k = NextIndex(k, m.nonZeros, truncate))
         {
-            if (j == (var.value.cols - 1))
+            while (m.offsets[j + 1] <= k)
             {
-                sprintf(buffer, "%f", At(var.value, i, j));
+                j++;
             }
-            else
+            if (k)
             {
-                sprintf(buffer, "%f , ", At(var.value, i, j));
+                Append(buffer, truncate && k == m.nonZeros - PRINT_EDGE_ITEMS ? "\n        ...\n        "
+                                                                            : "\n        ");
             }
-            PrintToConsole(buffer);
-            ZeroMemoryBlock(block);
+            snprintf(text, sizeof(text), "(%zu, %zu) ", (size_t)m.indices[k] + 1, j + 1);
+            Append(buffer, text);
+            AppendNumber(buffer, m.values[k], MatrixDataType::FLOAT64);
         }
-        if (i != (var.value.rows - 1))
+        Append(buffer, "]\n");
+    }
+}
+
+void PrintVariable(const Variable& var)
+{
+    const Matrix& m = var.value;
+    PrintBuffer buffer;
+    Append(buffer, "Name: ");
+    Append(buffer, var.name.data(), var.name.size());
+    Append(buffer, "\n\n");
+    if (var.isSparse)
+    {
+        AppendSparse(buffer, var.sparse);
+        Flush(buffer);
+        return;
+    }
+
+    char text[100] = {};
+    if (m.type == MatrixDataType::FLOAT64)
+    {
+        snprintf(text, sizeof(text), "Size = (%zu X %zu).\n", m.rows, m.cols);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "Size = (%zu X %zu), %s.\n", m.rows, m.cols, GetTypeName(m.type));
+    }
+    Append(buffer, text);
+    Append(buffer, "Data = [");
+
+    const bool truncate = m.rows * m.cols > PRINT_MAX_ELEMENTS;
+    const bool empty = m.rows * m.cols == 0;
+    for (size_t i = 0; i < m.rows && !empty; i = NextIndex(i, m.rows, truncate))
+    {
+        if (i)
         {
-            PrintToConsole("\n        ");
+            Append(buffer, truncate && i == m.rows - PRINT_EDGE_ITEMS && m.rows > 2 * PRINT_EDGE_ITEMS
+                               ? "\n        ...\n        " : "\n        ");
         }
-        else
+        for (size_t j = 0; j < m.cols; j = NextIndex(j, m.cols, truncate))
         {
-            PrintToConsole("]\n");
+            if (j)
+            {
+                Append(buffer, truncate && j == m.cols - PRINT_EDGE_ITEMS && m.cols > 2 * PRINT_EDGE_ITEMS
+                                   ? " , ... , " : " , ");
+            }
+            AppendNumber(buffer, GetElement(m, i, j), m.type);
         }
     }
+    Append(buffer, "]\n");
+    Flush(buffer);
 }
 
-Variable* AddVariable(State& state, const char* name, Matrix data)
+namespace
 {
-    Variable* var = FindVariable(state, name);
-    if (var)
-    {
-        FreeMatrix(var->value);
-        var->value = data;
-        return var;
-    }
-    else
+    // the variable id without a value, it is added when it doesn't exist.
+    Variable* ResetVariable(State& state, NameId id)
     {
+        Variable* var = FindVariable(state, id);
+        if (var)
+        {
+            FreeMatrix(var->value);
+            FreeSparseMatrix(var->sparse);
+            var->isSparse = false;
+            var->isLogical = false;
+            return var;
+        }
         Variable newVar = {};
-        newVar.value = data;
-        newVar.name = CreateString(name);
+        newVar.id = id;
+        newVar.name = GetName(id);
+        state.indices.insert(id, state.vars.size());
         state.vars.push_back(newVar);
         return &state.vars[state.vars.size() - 1];
     }
 }
 
+Variable* AddVariable(State& state, NameId id, Matrix data)
+{
+    // the scratch arena is reset after the statement, variables outlive it.
+    if (state.scratch && data.storage && data.storage->allocator == state.scratch)
+    {
+        Matrix promoted = CopyMatrix(data);
+        FreeMatrix(data);
+        data = promoted;
+    }
+    Variable* var = ResetVariable(state, id);
+    var->value = data;
+    return var;
+}
+
+Variable* AddVariable(State& state, const char* name, Matrix data)
+{
+    return AddVariable(state, InternName(name), data);
+}
+
+Variable* AddVariable(State& state, NameId id, SparseMatrix data)
+{
+    if (state.scratch && data.storage && data.storage->allocator == state.scratch)
+    {
+        SparseMatrix promoted = CopySparseMatrix(data);
+        FreeSparseMatrix(data);
+        data = promoted;
+    }
+    Variable* var = ResetVariable(state, id);
+    var->isSparse = true;
+    var->sparse = data;
+    return var;
+}
+
+Variable* AddVariable(State& state, const char* name, SparseMatrix data)
+{
+    return AddVariable(state, InternName(name), data);
+}
+
+Variable* AddVariable(State& state, NameId id, const MatrixExpression& expression, size_t root)
+{
+    return AddVariable(state, id, Evaluate(expression, root));
+}
+
+Variable* AddVariable(State& state, const char* name, const MatrixExpression& expression, size_t root)
+{
+    return AddVariable(state, InternName(name), Evaluate(expression, root));
+}
+
 void DeleteVariable(State& state, const char* name)
 {
     Variable* var = FindVariable(state, name);
     if (var)
     {
+        const size_t index = var - state.vars.data();
         Variable& lastVar = state.vars[state.vars.size() - 1];
+        state.indices.remove(var->id);
+        if (&lastVar != var)
+        {
+            state.indices.insert(lastVar.id, index);
+        }
+        Swap(lastVar.id, var->id);
         Swap(lastVar.name, var->name);
         Swap(lastVar.value, var->value);
+        Swap(lastVar.isSparse, var->isSparse);
+        Swap(lastVar.sparse, var->sparse);
+        Swap(lastVar.isLogical, var->isLogical);
         FreeMatrix(lastVar.value);
+        FreeSparseMatrix(lastVar.sparse);
         state.vars.pop_back();
     }
 }
 
+State::~State()
+{
+    for (Variable& var : vars)
+    {
+        FreeMatrix(var.value);
+        FreeSparseMatrix(var.sparse);
+    }
+    if (scratch)
+    {
+        FreeScratchAllocator(scratch);
+    }
+    delete session;
+}
+
+namespace
+{
+    bool IsBlank(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // the next word of input starting at i, skips the blanks around it.
+    StringView NextWord(const char* input, size_t size, size_t& i)
+    {
+        while (i < size && IsBlank(input[i]))
+        {
+            i++;
+        }
+        const size_t start = i;
+        while (i < size && !IsBlank(input[i]))
+        {
+            i++;
+        }
+        StringView word;
+        word.data = input + start;
+        word.size = i - start;
+        return word;
+    }
+
+    // "profile on|off|report|tree|reset|trace file" as the whole input, it is
+    // not valid syntax otherwise so it can't hide a statement.
+    bool ProcessProfileCommand(State& state, const char* input, size_t size)
+    {
+        size_t i = 0;
+        if (!CompareStrings(NextWord(input, size, i), CreateStringView("profile")))
+        {
+            return false;
+        }
+        const StringView command = NextWord(input, size, i);
+        const StringView argument = NextWord(input, size, i);
+        if (NextWord(input, size, i).size)
+        {
+            return false;
+        }
+        if (CompareStrings(command, CreateStringView("trace")) && argument.size)
+        {
+            char fileName[260] = {};
+            if (argument.size >= sizeof(fileName))
+            {
+                PrintMessage(MessageLevel::ERROR, "The trace file name is too long.");
+                return true;
+            }
+            memcpy(fileName, argument.data, argument.size);
+            if (!WriteProfileTrace(fileName))
+            {
+                PrintMessage(MessageLevel::ERROR, "Can't write the profile trace.");
+            }
+            return true;
+        }
+        if (argument.size)
+        {
+            return false;
+        }
+        if (CompareStrings(command, CreateStringView("on")))
+        {
+            state.profile.enabled = true;
+            EnableProfiler(true);
+        }
+        else if (CompareStrings(command, CreateStringView("off")))
+        {
+            state.profile.enabled = false;
+            EnableProfiler(false);
+        }
+        else if (CompareStrings(command, CreateStringView("report")))
+        {
+            PrintExecutionProfile(state.profile);
+            PrintToConsole("\n");
+            PrintProfileReport(false);
+        }
+        else if (CompareStrings(command, CreateStringView("tree")))
+        {
+            PrintProfileReport(true);
+        }
+        else if (CompareStrings(command, CreateStringView("reset")))
+        {
+            const bool enabled = state.profile.enabled;
+            state.profile = ExecutionProfile();
+            state.profile.enabled = enabled;
+            ResetProfiler();
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+}
+
 void ProcessInput(State& state, const char* input)
 {
-    Buffer buffer = CreateBufferFromString(input);
+    ProcessInput(state, input, StringLength(input));
+}
+
+namespace
+{
+    // prints the error of the lexer.
+    bool TokenizeInput(const char* input, size_t size, LexerResult& lexResults)
+    {
+        Buffer buffer;
+        buffer.data = input;
+        buffer.size = size;
+        lexResults = Tokenize(buffer);
+        if (!lexResults.success)
+        {
+            PrintMessage(MessageLevel::ERROR, "Error parsing the input text:\n");
+            // only the line with the error is printed.
+            size_t lineStart = Min(lexResults.errorLocation, size);
+            while (lineStart && input[lineStart - 1] != '\n')
+            {
+                lineStart--;
+            }
+            for (size_t i = lineStart; i < size && input[i] != '\n'; ++i)
+            {
+                PrintToConsole(input[i]);
+            }
+            PrintToConsole("\n");
+            for (size_t i = lineStart; i < lexResults.errorLocation; ++i)
+            {
+                PrintToConsole(" ");
+            }
+            PrintToConsole("^\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool CheckCompileResult(const CompileResult& compileResult)
+    {
+        if (!compileResult.success)
+        {
+            char text[300] = {};
+            snprintf(text, sizeof(text), "Error at line %zu: %s", compileResult.errorLine, compileResult.errorMessage);
+            PrintMessage(MessageLevel::ERROR, text);
+        }
+        return compileResult.success;
+    }
+
+    // the lines of the tokens, the text after the last new line is one more.
+    size_t CountLines(const char* input, size_t size)
+    {
+        size_t lines = size && input[size - 1] != '\n';
+        for (size_t i = 0; i < size; ++i)
+        {
+            lines += input[i] == '\n';
+        }
+        return lines;
+    }
+
+    bool CompileInput(const char* input, size_t size, Program& program)
+    {
+        LexerResult lexResults;
+        return TokenizeInput(input, size, lexResults) && CheckCompileResult(Compile(lexResults, program));
+    }
+}
+
+void ProcessInput(State& state, const char* input, size_t size)
+{
+    if (ProcessProfileCommand(state, input, size))
+    {
+        return;
+    }
+    SetThreadCount(state.threadCount);
+    if (!state.session)
+    {
+        state.session = new Session();
+    }
+    Program& program = state.session->program;
+    const size_t codeSize = program.code.size();
+    const size_t numberCount = program.numbers.size();
+    const size_t stringCount = program.strings.size();
+    const size_t functionCount = program.functions.size();
+    LexerResult lexResults;
+    size_t entry = 0;
+    const size_t lineBase = state.session->lineCount;
+    const bool compiled = TokenizeInput(input, size, lexResults) &&
+        CheckCompileResult(Compile(lexResults, *state.session, entry));
+    // the profile numbers the lines of the session, an input that ends with a
+    // new line doesn't start the next one.
+    state.session->lineCount += CountLines(input, size);
+    if (!compiled)
+    {
+        return;
+    }
+    Execute(state, program, entry, lineBase);
+    // only the functions are called again, the statements of an input without
+    // them are dropped. the global slots stay, they are one per name.
+    if (program.functions.size() == functionCount)
+    {
+        program.code.resize(codeSize);
+        program.numbers.resize(numberCount);
+        program.strings.resize(stringCount);
+    }
+}
+
+bool IsInputComplete(const char* input, size_t size)
+{
+    Buffer buffer;
+    buffer.data = input;
+    buffer.size = size;
     const LexerResult lexResults = Tokenize(buffer);
     if (!lexResults.success)
     {
-        PrintMessage(MessageLevel::ERROR, "Error parsing the input text:\n");
-        PrintToConsole(input);
-        PrintToConsole("\n");
-        for (size_t i = 0; i < lexResults.errorLocation; ++i)
+        // more lines won't fix it, ProcessInput reports the error.
+        return true;
+    }
+    int64_t blocks = 0;
+    int64_t nesting = 0;
+    for (const Token& t : lexResults.tokens)
+    {
+        switch (t.type)
+        {
+        case TokenType::KEYWORD_IF:
+        case TokenType::KEYWORD_WHILE:
+        case TokenType::KEYWORD_FUNC:
+            blocks++;
+            break;
+        case TokenType::KEYWORD_END:
+            // m(end) doesn't close a block.
+            blocks -= nesting <= 0;
+            break;
+        case TokenType::LEFT_PARAN:
+        case TokenType::LEFT_SQUARE_BRACKET:
+            nesting++;
+            break;
+        case TokenType::RIGHT_PARAN:
+        case TokenType::RIGHT_SQUARE_BRACKET:
+            if (--nesting < 0)
+            {
+                // more lines can't balance it.
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return blocks <= 0 && nesting <= 0;
+}
+
+void ProcessScript(State& state, const char* input, size_t size, const char* cacheFile)
+{
+    if (ProcessProfileCommand(state, input, size))
+    {
+        return;
+    }
+    SetThreadCount(state.threadCount);
+    Program program;
+    if (!cacheFile || !LoadProgramCache(cacheFile, input, size, program))
+    {
+        if (!CompileInput(input, size, program))
+        {
+            return;
+        }
+        if (cacheFile)
         {
-            PrintToConsole(" ");
+            // a read only directory just means no cache.
+            SaveProgramCache(cacheFile, program, input, size);
         }
-        PrintToConsole("^\n");
     }
+    Execute(state, program);
 }
 
 namespace
@@ -144,87 +620,5019 @@ namespace
     {
         TokenType type;
         const char* string;
+        size_t length;
     };
 
-    static const TokenString tokensStrings[]
-    {
-        {TokenType::KEYWORD_IF,             "if"},
-        {TokenType::KEYWORD_ELIF,           "elif"},
-        {TokenType::KEYWORD_FUNC,           "func"},
-        {TokenType::KEYWORD_ELSE,           "else"},
-        {TokenType::KEYWORD_WHILE,          "while"},
-        {TokenType::LOGICAL_GTE,            ">="},
-        {TokenType::LOGICAL_LTE,            "<="},
-        {TokenType::LOGICAL_EQUALS,         "=="},
-        {TokenType::LOGICAL_NOT_EQUALS,     "!="},
-        {TokenType::LOGICAL_LT,             "<"},
-        {TokenType::LOGICAL_GT,             ">"},
-        {TokenType::LOGICAL_NOT,            "!"},
-        {TokenType::LOGICAL_AND,            "&&"},
-        {TokenType::LOGICAL_OR,             "||"},
-        {TokenType::OPERATOR_PLUS,          "+"},
-        {TokenType::OPERATOR_MINUS,         "-"},
-        {TokenType::OPERATOR_MULTIPLY,      "*"},
-        {TokenType::OPERATOR_DIVIDE,        "/"},
-        {TokenType::OPERATOR_ASSIGN,        "="},
-        {TokenType::LEFT_PARAN,             "("},
-        {TokenType::RIGHT_PARAN,            ")"},
-        {TokenType::COMMA,                  ","},
-        {TokenType::SEMICOL,                ";"},
-        {TokenType::LEFT_SQUARE_BRACKET,    "["},
-        {TokenType::RIGHT_SQUARE_BRACKET,   "]"}
+    static const TokenString keywords[]
+    {
+        {TokenType::KEYWORD_IF,     "if",     2},
+        {TokenType::KEYWORD_ELIF,   "elif",   4},
+        {TokenType::KEYWORD_FUNC,   "func",   4},
+        {TokenType::KEYWORD_ELSE,   "else",   4},
+        {TokenType::KEYWORD_WHILE,  "while",  5},
+        {TokenType::KEYWORD_END,    "end",    3},
+        {TokenType::KEYWORD_RETURN, "return", 6}
     };
+
+    bool MatchKeyword(const StringView word, TokenType& type)
+    {
+        for (const TokenString& keyword : keywords)
+        {
+            if (keyword.length == word.size && keyword.string[0] == word.data[0] &&
+                CompareStrings(CreateStringView(keyword.string), word))
+            {
+                type = keyword.type;
+                return true;
+            }
+        }
+        return false;
+    }
 }
 
+// one pass over the input, the first character of a token decides what it is.
 LexerResult Tokenize(Buffer& buffer)
 {
-    const size_t count = ArrayCount(tokensStrings);
+    GEDO_PROFILE_ZONE("Tokenize");
     LexerResult result;
-    while (buffer.cursor < buffer.size)
+    const char* data = buffer.data;
+    const size_t size = buffer.size;
+    size_t line = 1;
+    while (buffer.cursor < size)
     {
-        Token token;
-        SkipSingleLineComment(buffer);
-        SkipWhiteSpaces(buffer);
-        if (buffer.cursor >= buffer.size)
+        const char c = data[buffer.cursor];
+        const char next = buffer.cursor + 1 < size ? data[buffer.cursor + 1] : 0;
+        if (c == '\n')
         {
-            goto NEXT_ITERATION;
+            line++;
+            buffer.cursor++;
+            continue;
         }
-
-        for (size_t i = 0; i < count; ++i)
+        if (IsWhiteSpace(c))
         {
-            if (CompareWordAndSkip(buffer, tokensStrings[i].string))
-            {
-                token.type = tokensStrings[i].type;
-                result.tokens.push_back(token);
-                goto NEXT_ITERATION;
-            }
+            buffer.cursor++;
+            continue;
         }
-        if (ParseIdentifier(buffer, token.name))
+        if (c == '\\' && next == '\\')
         {
-            token.type = TokenType::IDENTIFIER;
-            result.tokens.push_back(token);
-            goto NEXT_ITERATION;
+            SkipToNextLine(buffer);
+            continue;
         }
-        else if (ParseStringLiteral(buffer, token.stringLiteral))
+
+        Token token;
+        token.line = line;
+        token.offset = buffer.cursor;
+        size_t length = 1;
+        switch (c)
         {
-            token.type = TokenType::STRING_LITERAL;
-            result.tokens.push_back(token);
-            goto NEXT_ITERATION;
-        }
-        else if (ParseFloat(buffer, token.numericLiteral))
+        case '+': token.type = TokenType::OPERATOR_PLUS;          break;
+        case '-': token.type = TokenType::OPERATOR_MINUS;         break;
+        case '*': token.type = TokenType::OPERATOR_MULTIPLY;      break;
+        case '/': token.type = TokenType::OPERATOR_DIVIDE;        break;
+        case '\\': token.type = TokenType::OPERATOR_LEFT_DIVIDE;  break;
+        case '(': token.type = TokenType::LEFT_PARAN;             break;
+        case ')': token.type = TokenType::RIGHT_PARAN;            break;
+        case '[': token.type = TokenType::LEFT_SQUARE_BRACKET;    break;
+        case ']': token.type = TokenType::RIGHT_SQUARE_BRACKET;   break;
+        case ',': token.type = TokenType::COMMA;                  break;
+        case ':': token.type = TokenType::COLON;                  break;
+        case ';': token.type = TokenType::SEMICOL;                break;
+        case '<':
+            token.type = next == '=' ? TokenType::LOGICAL_LTE : TokenType::LOGICAL_LT;
+            length += next == '=';
+            break;
+        case '>':
+            token.type = next == '=' ? TokenType::LOGICAL_GTE : TokenType::LOGICAL_GT;
+            length += next == '=';
+            break;
+        case '=':
+            token.type = next == '=' ? TokenType::LOGICAL_EQUALS : TokenType::OPERATOR_ASSIGN;
+            length += next == '=';
+            break;
+        case '!':
+            token.type = next == '=' ? TokenType::LOGICAL_NOT_EQUALS : TokenType::LOGICAL_NOT;
+            length += next == '=';
+            break;
+        case '&':
+        case '|':
+            if (next != c)
+            {
+                result.errorLocation = buffer.cursor;
+                return result;
+            }
+            token.type = c == '&' ? TokenType::LOGICAL_AND : TokenType::LOGICAL_OR;
+            length = 2;
+            break;
+        case '"':
         {
-            token.type = TokenType::NUMERIC_LITERAL;
-            result.tokens.push_back(token);
-            goto NEXT_ITERATION;
+            // can span lines.
+            ParseStringLiteral(buffer, token.stringLiteral);
+            if (buffer.cursor > size)
+            {
+                result.errorLocation = token.offset;
+                return result;
+            }
+            for (char s : token.stringLiteral)
+            {
+                line += s == '\n';
+            }
+            token.type = TokenType::STRING_LITERAL;
+            length = 0;
+            break;
         }
-        else
-        {
-            result.success = false;
-            result.errorLocation = buffer.cursor;
-            return result;
+        default:
+            if (ParseIdentifier(buffer, token.name))
+            {
+                if (!MatchKeyword(token.name, token.type))
+                {
+                    token.type = TokenType::IDENTIFIER;
+                    token.id = InternName(token.name.data, token.name.size);
+                }
+            }
+            else if (ParseFloat(buffer, token.numericLiteral))
+            {
+                token.type = TokenType::NUMERIC_LITERAL;
+            }
+            else
+            {
+                result.errorLocation = buffer.cursor;
+                return result;
+            }
+            length = 0;
+            break;
         }
-    NEXT_ITERATION:;
+        buffer.cursor += length;
+        result.tokens.push_back(token);
     }
     result.success = true;
     return result;
 }
+
+//---------------------------Interpreter---------------------
+namespace
+{
+    enum class ValueType : uint8_t
+    {
+        NONE,
+        NUMBER,
+        MATRIX,
+        SPARSE,
+        LAZY,
+        STRING
+    };
+
+    // NUMBER is the fast path for 1 X 1 matrices, LAZY is a node of VM::graph
+    // that hasn't been evaluated yet. a MATRIX or a SPARSE either owns its
+    // data or references a variable that outlives the value.
+    struct Value
+    {
+        ValueType type = ValueType::NONE;
+        bool owned = false;
+        double number = 0;              // when type == NUMBER.
+        size_t node = 0;                // when type == LAZY.
+        const String* string = NULL;    // when type == STRING.
+        Matrix matrix;                  // when type == MATRIX.
+        SparseMatrix sparse;            // when type == SPARSE.
+        bool logical = false;           // the result of a comparison or !.
+    };
+
+    struct Frame
+    {
+        size_t function = 0;
+        size_t returnAddress = 0;
+        size_t base = 0;
+        size_t line = 0;    // line of the call, restored on return.
+        size_t lineBase = 0;
+    };
+
+    struct ProfileMark
+    {
+        int64_t time = 0;
+        size_t bytes = 0;
+    };
+
+    static const size_t VM_STACK_SIZE = 4096;
+    static const size_t VM_MAX_FRAMES = 256;
+    // pages of the arena are only touched when used, bigger temporaries go to
+    // the default allocator.
+    static const size_t SCRATCH_ARENA_SIZE = 64ULL * 1024 * 1024;
+
+    struct VM
+    {
+        State* state = NULL;
+        const Program* program = NULL;
+        Array<Value> stack;
+        size_t top = 0;
+        Array<Frame> frames;
+        // Program::globalNames index -> State::vars index, -1 until linked.
+        Array<int64_t> globals;
+        // element wise operations of the current statement, materialized when
+        // stored or used by a non fusable operation.
+        MatrixExpression graph;
+        Array<Matrix> graphTemps;   // data referenced by graph, freed with it.
+        // owner of the temporaries, reset at the start of a statement when
+        // none of them is alive.
+        ScratchAllocator* scratch = NULL;
+        size_t line = 0;
+        bool failed = false;
+        // NULL unless "profile on", the current line is charged when it changes.
+        // the counters of the session are indexed by lineBase + line, the base
+        // of the input that defined the running code.
+        ExecutionProfile* profile = NULL;
+        size_t lineBase = 0;
+        size_t profileLine = 0;
+        ProfileMark lineMark;
+        int64_t lineElements = 0;
+    };
+
+    typedef bool (*BuiltinFunction)(VM& vm, Value* args, size_t count, Value& result);
+
+    struct Builtin
+    {
+        const char* name;
+        size_t minArgs;
+        size_t maxArgs;
+        BuiltinFunction function;
+    };
+
+    bool RuntimeError(VM& vm, const char* format, ...)
+    {
+        char message[300] = {};
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        char text[400] = {};
+        snprintf(text, sizeof(text), "Error at line %zu: %s", vm.line, message);
+        PrintMessage(MessageLevel::ERROR, text);
+        vm.failed = true;
+        return false;
+    }
+
+    void RuntimeWarning(VM& vm, const char* format, ...)
+    {
+        char message[300] = {};
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        char text[400] = {};
+        snprintf(text, sizeof(text), "Warning at line %zu: %s", vm.line, message);
+        PrintMessage(MessageLevel::WARNING, text);
+    }
+
+    String ToCString(const String& s)
+    {
+        String result = s;
+        Append(result, (char)0);
+        return result;
+    }
+
+    Value MakeNumber(double v)
+    {
+        Value result;
+        result.type = ValueType::NUMBER;
+        result.number = v;
+        return result;
+    }
+
+    Value MakeLazy(size_t node)
+    {
+        Value result;
+        result.type = ValueType::LAZY;
+        result.node = node;
+        return result;
+    }
+
+    // 1 X 1 doubles become numbers, the other types keep their matrix.
+    Value MakeMatrix(const Matrix& m, bool owned)
+    {
+        Value result;
+        if (m.rows == 1 && m.cols == 1 && m.type == MatrixDataType::FLOAT64)
+        {
+            result.type = ValueType::NUMBER;
+            result.number = m.data[0];
+            if (owned)
+            {
+                Matrix copy = m;
+                FreeMatrix(copy);
+            }
+            return result;
+        }
+        result.type = ValueType::MATRIX;
+        result.owned = owned;
+        result.matrix = m;
+        return result;
+    }
+
+    Value MakeSparse(const SparseMatrix& m, bool owned)
+    {
+        Value result;
+        result.type = ValueType::SPARSE;
+        result.owned = owned;
+        result.sparse = m;
+        return result;
+    }
+
+    void FreeValue(Value& v)
+    {
+        if (v.type == ValueType::MATRIX && v.owned)
+        {
+            FreeMatrix(v.matrix);
+        }
+        if (v.type == ValueType::SPARSE && v.owned)
+        {
+            FreeSparseMatrix(v.sparse);
+        }
+        v = Value();
+    }
+
+    bool Push(VM& vm, const Value& v)
+    {
+        if (vm.top >= VM_STACK_SIZE)
+        {
+            return RuntimeError(vm, "stack overflow.");
+        }
+        vm.stack[vm.top++] = v;
+        return true;
+    }
+
+    Value Pop(VM& vm)
+    {
+        GEDO_ASSERT(vm.top > 0);
+        Value result = vm.stack[--vm.top];
+        vm.stack[vm.top] = Value();
+        return result;
+    }
+
+    void Drop(VM& vm)
+    {
+        Value v = Pop(vm);
+        FreeValue(v);
+    }
+
+    void GetShape(const VM& vm, const Value& v, size_t& rows, size_t& cols)
+    {
+        switch (v.type)
+        {
+        case ValueType::NUMBER: rows = 1; cols = 1; break;
+        case ValueType::MATRIX: rows = v.matrix.rows; cols = v.matrix.cols; break;
+        case ValueType::SPARSE: rows = v.sparse.rows; cols = v.sparse.cols; break;
+        case ValueType::LAZY:
+            rows = vm.graph.nodes[v.node].rows;
+            cols = vm.graph.nodes[v.node].cols;
+            break;
+        default: rows = 0; cols = 0; break;
+        }
+    }
+
+    bool IsScalarShaped(const VM& vm, const Value& v)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        GetShape(vm, v, rows, cols);
+        return rows == 1 && cols == 1;
+    }
+
+    int64_t CountElements(const VM& vm, const Value& v)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        GetShape(vm, v, rows, cols);
+        return int64_t(rows * cols);
+    }
+
+    // the profile functions are only called when vm.profile is set.
+    ProfileMark MarkProfile()
+    {
+        ProfileMark mark;
+        mark.time = GetTimeNanoseconds();
+        mark.bytes = GetAllocatedBytes();
+        return mark;
+    }
+
+    void CountWork(VM& vm, ExecutionCounter& counter, const ProfileMark& start, int64_t elements)
+    {
+        const ProfileMark end = MarkProfile();
+        counter.count++;
+        counter.elements += elements;
+        counter.nanoseconds += end.time - start.time;
+        counter.bytes += end.bytes - start.bytes;
+        vm.lineElements += elements;
+    }
+
+    // charges the current line with what happened since it was last charged.
+    void ChargeLine(VM& vm)
+    {
+        Array<ExecutionCounter>& lines = vm.profile->lines;
+        if (lines.size() <= vm.profileLine)
+        {
+            lines.resize(vm.profileLine + 1);
+        }
+        const ProfileMark now = MarkProfile();
+        ExecutionCounter& counter = lines[vm.profileLine];
+        counter.elements += vm.lineElements;
+        counter.nanoseconds += now.time - vm.lineMark.time;
+        counter.bytes += now.bytes - vm.lineMark.bytes;
+        vm.lineMark = now;
+        vm.lineElements = 0;
+    }
+
+    const char* TypeName(ValueType type)
+    {
+        switch (type)
+        {
+        case ValueType::NONE:   return "nothing";
+        case ValueType::STRING: return "a string";
+        default:                return "a matrix";
+        }
+    }
+
+    // adds v to the graph, the graph takes the ownership of v.
+    size_t ToNode(VM& vm, Value& v)
+    {
+        size_t node = 0;
+        switch (v.type)
+        {
+        case ValueType::NUMBER: node = PushScalar(vm.graph, v.number); break;
+        case ValueType::LAZY:   node = v.node; break;
+        case ValueType::MATRIX:
+        {
+            // leaves point to contiguous data, small matrices live in the
+            // stackBuffer of the value so they are copied to the heap as views.
+            Matrix leaf = v.matrix;
+            if (v.matrix.data == v.matrix.stackBuffer || !IsContiguous(v.matrix))
+            {
+                leaf = CreateHeapMatrix(v.matrix.rows, v.matrix.cols, v.matrix.type, *vm.scratch);
+                CopyElements(v.matrix, leaf);
+                if (v.owned)
+                {
+                    FreeMatrix(v.matrix);
+                }
+                vm.graphTemps.push_back(leaf);
+            }
+            else if (v.owned)
+            {
+                vm.graphTemps.push_back(leaf);
+            }
+            node = PushMatrix(vm.graph, leaf);
+            break;
+        }
+        default: GEDO_ASSERT_MSG("value can't be part of an expression."); break;
+        }
+        v = Value();
+        return node;
+    }
+
+    void ResetGraph(VM& vm)
+    {
+        for (Matrix& m : vm.graphTemps)
+        {
+            FreeMatrix(m);
+        }
+        vm.graphTemps.clear();
+        ClearExpression(vm.graph);
+    }
+
+    // evaluates lazy values, other values are left as they are.
+    void Materialize(VM& vm, Value& v)
+    {
+        if (v.type == ValueType::LAZY)
+        {
+            const bool logical = v.logical;
+            if (vm.profile)
+            {
+                const ProfileMark start = MarkProfile();
+                const int64_t elements = CountElements(vm, v);
+                v = MakeMatrix(Evaluate(vm.graph, v.node, *vm.scratch), true);
+                CountWork(vm, vm.profile->elementWise, start, elements);
+                v.logical = logical;
+                return;
+            }
+            v = MakeMatrix(Evaluate(vm.graph, v.node, *vm.scratch), true);
+            v.logical = logical;
+        }
+    }
+
+    // a sparse matrix used where a dense one is needed, bigger ones are likely
+    // a mistake that would exhaust the memory.
+    static const size_t SPARSE_DENSIFY_LIMIT = 64ULL * 1024 * 1024;
+
+    // replaces a SPARSE by its dense matrix, the other values are unchanged.
+    bool Densify(VM& vm, Value& v)
+    {
+        if (v.type != ValueType::SPARSE)
+        {
+            return true;
+        }
+        const SparseMatrix& m = v.sparse;
+        if (m.cols && m.rows > SPARSE_DENSIFY_LIMIT / m.cols)
+        {
+            return RuntimeError(vm, "the sparse matrix (%zu X %zu) is too big to be used as a dense matrix.",
+                                m.rows, m.cols);
+        }
+        Matrix dense = SparseToDense(m, *vm.scratch);
+        FreeValue(v);
+        v = MakeMatrix(dense, true);
+        return true;
+    }
+
+    // the result is owned when owned is set.
+    bool ToMatrix(VM& vm, Value& v, Matrix& result, bool& owned)
+    {
+        Materialize(vm, v);
+        if (!Densify(vm, v))
+        {
+            return false;
+        }
+        switch (v.type)
+        {
+        case ValueType::NUMBER:
+            result = CreateMatrix(1, 1);
+            result.data[0] = v.number;
+            owned = true;
+            return true;
+        case ValueType::MATRIX:
+            result = v.matrix;
+            owned = v.owned;
+            v.owned = false;
+            return true;
+        default:
+            return RuntimeError(vm, "expected a matrix but got %s.", TypeName(v.type));
+        }
+    }
+
+    bool IsTrue(VM& vm, Value& v, bool& result)
+    {
+        Materialize(vm, v);
+        switch (v.type)
+        {
+        case ValueType::NUMBER:
+            result = v.number != 0.0;
+            return true;
+        case ValueType::MATRIX:
+        {
+            // like matlab, true when not empty and all elements are not zero.
+            result = v.matrix.rows * v.matrix.cols != 0;
+            for (size_t i = 0; i < v.matrix.rows && result; ++i)
+            {
+                for (size_t j = 0; j < v.matrix.cols && result; ++j)
+                {
+                    result = GetElement(v.matrix, i, j) != 0.0;
+                }
+            }
+            return true;
+        }
+        case ValueType::SPARSE:
+        {
+            size_t nonZeros = 0;
+            for (size_t k = 0; k < v.sparse.nonZeros; ++k)
+            {
+                nonZeros += v.sparse.values[k] != 0.0;
+            }
+            result = v.sparse.rows * v.sparse.cols != 0 && nonZeros == v.sparse.rows * v.sparse.cols;
+            return true;
+        }
+        default:
+            return RuntimeError(vm, "can't use %s as a condition.", TypeName(v.type));
+        }
+    }
+
+    bool ArgToNumber(VM& vm, Value& v, const char* builtin, double& result)
+    {
+        Materialize(vm, v);
+        if (v.type == ValueType::MATRIX && v.matrix.rows == 1 && v.matrix.cols == 1)
+        {
+            result = GetElement(v.matrix, 0, 0);
+            return true;
+        }
+        if (v.type == ValueType::SPARSE && v.sparse.rows == 1 && v.sparse.cols == 1)
+        {
+            result = GetElement(v.sparse, 0, 0);
+            return true;
+        }
+        if (v.type != ValueType::NUMBER)
+        {
+            return RuntimeError(vm, "%s expects a scalar argument.", builtin);
+        }
+        result = v.number;
+        return true;
+    }
+
+    bool ArgToSize(VM& vm, Value& v, const char* builtin, size_t& result)
+    {
+        double d = 0;
+        if (!ArgToNumber(vm, v, builtin, d))
+        {
+            return false;
+        }
+        if (d < 0 || d != floor(d))
+        {
+            return RuntimeError(vm, "%s expects a non negative integer.", builtin);
+        }
+        result = (size_t)d;
+        return true;
+    }
+
+    bool ArgToString(VM& vm, Value& v, const char* builtin, String& result)
+    {
+        if (v.type != ValueType::STRING)
+        {
+            return RuntimeError(vm, "%s expects a string argument.", builtin);
+        }
+        result = ToCString(*v.string);
+        return true;
+    }
+
+    bool ArgToShape(VM& vm, Value& v, const char* builtin, size_t& rows, size_t& cols)
+    {
+        if (v.type == ValueType::STRING)
+        {
+            return RuntimeError(vm, "%s expects a matrix argument.", builtin);
+        }
+        GetShape(vm, v, rows, cols);
+        return true;
+    }
+
+    StringView ToStringView(const String& s)
+    {
+        StringView result;
+        result.data = s.data();
+        result.size = s.size();
+        return result;
+    }
+
+    //---------------------------Builtins----------------------
+    bool GetSizeArgs(VM& vm, Value* args, size_t count, const char* name, size_t& rows, size_t& cols)
+    {
+        if (!ArgToSize(vm, args[0], name, rows))
+        {
+            return false;
+        }
+        cols = rows;
+        return count == 1 || ArgToSize(vm, args[1], name, cols);
+    }
+
+    bool BuiltinZeros(VM& vm, Value* args, size_t count, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!GetSizeArgs(vm, args, count, "zeros", rows, cols))
+        {
+            return false;
+        }
+        result = MakeMatrix(Zeros(rows, cols, *vm.scratch), true);
+        return true;
+    }
+
+    bool BuiltinOnes(VM& vm, Value* args, size_t count, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!GetSizeArgs(vm, args, count, "ones", rows, cols))
+        {
+            return false;
+        }
+        result = MakeMatrix(Ones(rows, cols, *vm.scratch), true);
+        return true;
+    }
+
+    bool BuiltinEye(VM& vm, Value* args, size_t count, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!GetSizeArgs(vm, args, count, "eye", rows, cols))
+        {
+            return false;
+        }
+        result = MakeMatrix(Eye(rows, cols, *vm.scratch), true);
+        return true;
+    }
+
+    bool UnaryBuiltin(VM& vm, Value& arg, ExpressionOp op, const char* name, Value& result)
+    {
+        if (arg.type == ValueType::NUMBER)
+        {
+            result = MakeNumber(ApplyUnary(op, arg.number));
+            return true;
+        }
+        if (!Densify(vm, arg))
+        {
+            return false;
+        }
+        if (arg.type != ValueType::MATRIX && arg.type != ValueType::LAZY)
+        {
+            return RuntimeError(vm, "%s expects a matrix but got %s.", name, TypeName(arg.type));
+        }
+        result = MakeLazy(PushUnary(vm.graph, op, ToNode(vm, arg)));
+        return true;
+    }
+
+    bool BuiltinAbs(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::ABS, "abs", result); }
+    bool BuiltinSin(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::SIN, "sin", result); }
+    bool BuiltinCos(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::COS, "cos", result); }
+    bool BuiltinTan(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::TAN, "tan", result); }
+    bool BuiltinASin(VM& vm, Value* args, size_t, Value& result) { return UnaryBuiltin(vm, args[0], ExpressionOp::ASIN, "asin", result); }
+    bool BuiltinACos(VM& vm, Value* args, size_t, Value& result) { return UnaryBuiltin(vm, args[0], ExpressionOp::ACOS, "acos", result); }
+    bool BuiltinATan(VM& vm, Value* args, size_t, Value& result) { return UnaryBuiltin(vm, args[0], ExpressionOp::ATAN, "atan", result); }
+    bool BuiltinExp(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::EXP, "exp", result); }
+    bool BuiltinLog(VM& vm, Value* args, size_t, Value& result)  { return UnaryBuiltin(vm, args[0], ExpressionOp::LOG, "log", result); }
+    bool BuiltinSqrt(VM& vm, Value* args, size_t, Value& result) { return UnaryBuiltin(vm, args[0], ExpressionOp::SQRT, "sqrt", result); }
+
+    // pow(a, b) is element wise and broadcasts like the operators.
+    bool BuiltinPow(VM& vm, Value* args, size_t, Value& result)
+    {
+        Value& a = args[0];
+        Value& b = args[1];
+        if (a.type == ValueType::NUMBER && b.type == ValueType::NUMBER)
+        {
+            result = MakeNumber(ApplyBinary(ExpressionOp::POW, a.number, b.number));
+            return true;
+        }
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (!Densify(vm, args[i]))
+            {
+                return false;
+            }
+            const ValueType type = args[i].type;
+            if (type != ValueType::NUMBER && type != ValueType::MATRIX && type != ValueType::LAZY)
+            {
+                return RuntimeError(vm, "pow expects a matrix but got %s.", TypeName(type));
+            }
+        }
+        size_t rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+        GetShape(vm, a, rowsA, colsA);
+        GetShape(vm, b, rowsB, colsB);
+        if (!CanBroadcast(rowsA, colsA, rowsB, colsB))
+        {
+            return RuntimeError(vm, "dimensions mismatch (%zu X %zu) and (%zu X %zu).", rowsA, colsA, rowsB, colsB);
+        }
+        const size_t left = ToNode(vm, a);
+        const size_t right = ToNode(vm, b);
+        result = MakeLazy(PushBinary(vm.graph, ExpressionOp::POW, left, right));
+        return true;
+    }
+
+    // the conversion is a node of the graph so uint8(a * 255) is one pass.
+    bool ConvertBuiltin(VM& vm, Value& arg, MatrixDataType type, const char* name, Value& result)
+    {
+        if (!Densify(vm, arg))
+        {
+            return false;
+        }
+        if (arg.type != ValueType::NUMBER && arg.type != ValueType::MATRIX && arg.type != ValueType::LAZY)
+        {
+            return RuntimeError(vm, "%s expects a matrix but got %s.", name, TypeName(arg.type));
+        }
+        result = MakeLazy(PushConvert(vm.graph, ToNode(vm, arg), type));
+        return true;
+    }
+
+    bool BuiltinDouble(VM& vm, Value* args, size_t, Value& result) { return ConvertBuiltin(vm, args[0], MatrixDataType::FLOAT64, "double", result); }
+    bool BuiltinSingle(VM& vm, Value* args, size_t, Value& result) { return ConvertBuiltin(vm, args[0], MatrixDataType::FLOAT32, "single", result); }
+    bool BuiltinInt32(VM& vm, Value* args, size_t, Value& result)  { return ConvertBuiltin(vm, args[0], MatrixDataType::INT32, "int32", result); }
+    bool BuiltinUint8(VM& vm, Value* args, size_t, Value& result)  { return ConvertBuiltin(vm, args[0], MatrixDataType::UINT8, "uint8", result); }
+
+    bool ReduceBuiltin(VM& vm, Value& arg, double (*reduce)(const Matrix&), Value& result)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, arg, m, owned))
+        {
+            return false;
+        }
+        result = MakeNumber(reduce(m));
+        if (owned)
+        {
+            FreeMatrix(m);
+        }
+        return true;
+    }
+
+    bool BuiltinTranspose(VM& vm, Value* args, size_t, Value& result)
+    {
+        if (args[0].type == ValueType::SPARSE)
+        {
+            // CSR and CSC swap, the arrays are shared.
+            result = MakeSparse(Transpose(args[0].sparse), true);
+            return true;
+        }
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, args[0], m, owned))
+        {
+            return false;
+        }
+        // a view of the argument, the data is not copied.
+        result = MakeMatrix(TransposedView(m), true);
+        if (owned)
+        {
+            FreeMatrix(m);
+        }
+        return true;
+    }
+
+    bool BuiltinSum(VM& vm, Value* args, size_t, Value& result) { return ReduceBuiltin(vm, args[0], Sum, result); }
+    bool BuiltinMin(VM& vm, Value* args, size_t, Value& result) { return ReduceBuiltin(vm, args[0], MinElement, result); }
+    bool BuiltinMax(VM& vm, Value* args, size_t, Value& result) { return ReduceBuiltin(vm, args[0], MaxElement, result); }
+
+    // the result of f is a new matrix of the scratch allocator.
+    bool MatrixBuiltin(VM& vm, Value& arg, Matrix (*f)(const Matrix&, Allocator&), Value& result)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, arg, m, owned))
+        {
+            return false;
+        }
+        result = MakeMatrix(f(m, *vm.scratch), true);
+        if (owned)
+        {
+            FreeMatrix(m);
+        }
+        return true;
+    }
+
+    bool BuiltinSort(VM& vm, Value* args, size_t, Value& result)     { return MatrixBuiltin(vm, args[0], Sort, result); }
+    bool BuiltinSortRows(VM& vm, Value* args, size_t, Value& result) { return MatrixBuiltin(vm, args[0], SortRows, result); }
+    bool BuiltinUnique(VM& vm, Value* args, size_t, Value& result)   { return MatrixBuiltin(vm, args[0], Unique, result); }
+    bool BuiltinFind(VM& vm, Value* args, size_t, Value& result)     { return MatrixBuiltin(vm, args[0], Find, result); }
+
+    bool BuiltinIsMember(VM& vm, Value* args, size_t, Value& result)
+    {
+        Matrix values;
+        bool ownedValues = false;
+        if (!ToMatrix(vm, args[0], values, ownedValues))
+        {
+            return false;
+        }
+        defer(if (ownedValues) FreeMatrix(values));
+        Matrix set;
+        bool ownedSet = false;
+        if (!ToMatrix(vm, args[1], set, ownedSet))
+        {
+            return false;
+        }
+        defer(if (ownedSet) FreeMatrix(set));
+        result = MakeMatrix(IsMember(values, set, *vm.scratch), true);
+        return true;
+    }
+
+    // f is only called for a square argument.
+    bool SquareMatrixBuiltin(VM& vm, Value& arg, const char* name,
+                             bool (*f)(VM&, const Matrix&, Value&), Value& result)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, arg, m, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(m));
+        if (m.rows != m.cols)
+        {
+            return RuntimeError(vm, "%s needs a square matrix, got (%zu X %zu).", name, m.rows, m.cols);
+        }
+        return f(vm, m, result);
+    }
+
+    bool BuiltinInv(VM& vm, Value* args, size_t, Value& result)
+    {
+        return SquareMatrixBuiltin(vm, args[0], "inv", [](VM& vm, const Matrix& m, Value& result) {
+            bool singular = false;
+            result = MakeMatrix(Inverse(m, *vm.scratch, &singular), true);
+            if (singular)
+            {
+                RuntimeWarning(vm, "matrix is singular to working precision.");
+            }
+            return true;
+        }, result);
+    }
+
+    bool BuiltinDet(VM& vm, Value* args, size_t, Value& result)
+    {
+        return SquareMatrixBuiltin(vm, args[0], "det", [](VM&, const Matrix& m, Value& result) {
+            result = MakeNumber(Determinant(m));
+            return true;
+        }, result);
+    }
+
+    bool BuiltinLU(VM& vm, Value* args, size_t, Value& result)
+    {
+        return SquareMatrixBuiltin(vm, args[0], "lu", [](VM& vm, const Matrix& m, Value& result) {
+            result = MakeMatrix(LU(m, *vm.scratch), true);
+            return true;
+        }, result);
+    }
+
+    bool BuiltinChol(VM& vm, Value* args, size_t, Value& result)
+    {
+        return SquareMatrixBuiltin(vm, args[0], "chol", [](VM& vm, const Matrix& m, Value& result) {
+            bool positiveDefinite = false;
+            Matrix r = Cholesky(m, *vm.scratch, &positiveDefinite);
+            if (!positiveDefinite)
+            {
+                FreeMatrix(r);
+                return RuntimeError(vm, "chol needs a symmetric positive definite matrix.");
+            }
+            result = MakeMatrix(r, true);
+            return true;
+        }, result);
+    }
+
+    bool BuiltinQR(VM& vm, Value* args, size_t, Value& result) { return MatrixBuiltin(vm, args[0], QR, result); }
+
+    // the 1 based indices of sparse(i, j, v, rows, cols).
+    bool ArgToIndices(VM& vm, Value& v, const char* builtin, Array<size_t>& result, size_t& largest)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, v, m, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(m));
+        largest = 0;
+        result.resize(m.rows * m.cols);
+        for (size_t i = 0; i < m.rows; ++i)
+        {
+            for (size_t j = 0; j < m.cols; ++j)
+            {
+                const double d = GetElement(m, i, j);
+                if (!(d >= 1 && d <= (double)UINT32_MAX) || d != floor(d))
+                {
+                    return RuntimeError(vm, "%s expects positive integer indices.", builtin);
+                }
+                result[i * m.cols + j] = (size_t)d - 1;
+                largest = Max(largest, (size_t)d);
+            }
+        }
+        return true;
+    }
+
+    // sparse(m), sparse(rows, cols) and sparse(i, j, v[, rows, cols]).
+    bool BuiltinSparse(VM& vm, Value* args, size_t count, Value& result)
+    {
+        if (count == 1)
+        {
+            if (args[0].type == ValueType::SPARSE)
+            {
+                result = MakeSparse(ShareSparseMatrix(args[0].sparse), true);
+                return true;
+            }
+            Matrix m;
+            bool owned = false;
+            if (!ToMatrix(vm, args[0], m, owned))
+            {
+                return false;
+            }
+            defer(if (owned) FreeMatrix(m));
+            if (m.rows > UINT32_MAX || m.cols > UINT32_MAX)
+            {
+                return RuntimeError(vm, "sparse matrices have at most %u rows and columns.", UINT32_MAX);
+            }
+            result = MakeSparse(SparseFromDense(m, SparseFormat::CSR, *vm.scratch), true);
+            return true;
+        }
+        if (count == 2)
+        {
+            size_t rows = 0;
+            size_t cols = 0;
+            if (!ArgToSize(vm, args[0], "sparse", rows) || !ArgToSize(vm, args[1], "sparse", cols))
+            {
+                return false;
+            }
+            if (rows > UINT32_MAX || cols > UINT32_MAX)
+            {
+                return RuntimeError(vm, "sparse matrices have at most %u rows and columns.", UINT32_MAX);
+            }
+            result = MakeSparse(CreateSparseMatrix(rows, cols, 0, SparseFormat::CSR, *vm.scratch), true);
+            GEDO_MEMSET(result.sparse.offsets, 0, (rows + 1) * sizeof(size_t));
+            return true;
+        }
+        if (count == 4)
+        {
+            return RuntimeError(vm, "sparse(i, j, v) needs both rows and cols.");
+        }
+        Array<size_t> rowIndices;
+        Array<size_t> colIndices;
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!ArgToIndices(vm, args[0], "sparse", rowIndices, rows) ||
+            !ArgToIndices(vm, args[1], "sparse", colIndices, cols))
+        {
+            return false;
+        }
+        Matrix v;
+        bool owned = false;
+        if (!ToMatrix(vm, args[2], v, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(v));
+        const size_t elements = rowIndices.size();
+        const bool scalar = v.rows * v.cols == 1;
+        if (colIndices.size() != elements || (!scalar && v.rows * v.cols != elements))
+        {
+            return RuntimeError(vm, "sparse(i, j, v) needs i, j and v of the same size.");
+        }
+        if (count == 5)
+        {
+            size_t r = 0;
+            size_t c = 0;
+            if (!ArgToSize(vm, args[3], "sparse", r) || !ArgToSize(vm, args[4], "sparse", c))
+            {
+                return false;
+            }
+            if (r < rows || c < cols || r > UINT32_MAX || c > UINT32_MAX)
+            {
+                return RuntimeError(vm, "the indices of sparse(i, j, v) don't fit in (%zu X %zu).", r, c);
+            }
+            rows = r;
+            cols = c;
+        }
+        Array<double> values;
+        values.resize(elements);
+        for (size_t k = 0; k < elements; ++k)
+        {
+            values[k] = scalar ? GetElement(v, 0, 0) : GetElement(v, k / v.cols, k % v.cols);
+        }
+        result = MakeSparse(CreateSparseFromTriplets(rows, cols, rowIndices.data(), colIndices.data(), values.data(),
+                                                     elements, SparseFormat::CSR, *vm.scratch), true);
+        return true;
+    }
+
+    bool BuiltinFull(VM& vm, Value* args, size_t, Value& result)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, args[0], m, owned))
+        {
+            return false;
+        }
+        result = MakeMatrix(m, owned);
+        return true;
+    }
+
+    bool BuiltinNnz(VM& vm, Value* args, size_t, Value& result)
+    {
+        if (args[0].type == ValueType::SPARSE)
+        {
+            // the operations can store zeros, like a - a.
+            const SparseMatrix& m = args[0].sparse;
+            size_t nonZeros = 0;
+            for (size_t k = 0; k < m.nonZeros; ++k)
+            {
+                nonZeros += m.values[k] != 0.0;
+            }
+            result = MakeNumber((double)nonZeros);
+            return true;
+        }
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, args[0], m, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(m));
+        size_t nonZeros = 0;
+        for (size_t i = 0; i < m.rows; ++i)
+        {
+            for (size_t j = 0; j < m.cols; ++j)
+            {
+                nonZeros += GetElement(m, i, j) != 0.0;
+            }
+        }
+        result = MakeNumber((double)nonZeros);
+        return true;
+    }
+
+    bool BuiltinIsSparse(VM& vm, Value* args, size_t, Value& result)
+    {
+        if (args[0].type == ValueType::STRING)
+        {
+            return RuntimeError(vm, "issparse expects a matrix argument.");
+        }
+        result = MakeNumber(args[0].type == ValueType::SPARSE ? 1.0 : 0.0);
+        return true;
+    }
+
+    bool BuiltinRows(VM& vm, Value* args, size_t, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!ArgToShape(vm, args[0], "rows", rows, cols))
+        {
+            return false;
+        }
+        result = MakeNumber((double)rows);
+        return true;
+    }
+
+    bool BuiltinCols(VM& vm, Value* args, size_t, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!ArgToShape(vm, args[0], "cols", rows, cols))
+        {
+            return false;
+        }
+        result = MakeNumber((double)cols);
+        return true;
+    }
+
+    bool BuiltinNumel(VM& vm, Value* args, size_t, Value& result)
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        if (!ArgToShape(vm, args[0], "numel", rows, cols))
+        {
+            return false;
+        }
+        result = MakeNumber((double)(rows * cols));
+        return true;
+    }
+
+    // threads() returns the thread count, threads(n) sets State::threadCount.
+    bool BuiltinThreads(VM& vm, Value* args, size_t count, Value& result)
+    {
+        if (count == 1)
+        {
+            size_t threads = 0;
+            if (!ArgToSize(vm, args[0], "threads", threads))
+            {
+                return false;
+            }
+            vm.state->threadCount = threads;
+            SetThreadCount(threads);
+        }
+        result = MakeNumber((double)GetThreadCount());
+        return true;
+    }
+
+    // save("file") writes all the variables, save("file", "a", "b") only
+    // writes a and b.
+    bool BuiltinSave(VM& vm, Value* args, size_t count, Value& result)
+    {
+        String path;
+        if (!ArgToString(vm, args[0], "save", path))
+        {
+            return false;
+        }
+        Array<const Variable*> vars;
+        if (count == 1)
+        {
+            vars.reserve(vm.state->vars.size());
+            for (const Variable& var : vm.state->vars)
+            {
+                vars.push_back(&var);
+            }
+        }
+        for (size_t i = 1; i < count; ++i)
+        {
+            String name;
+            if (!ArgToString(vm, args[i], "save", name))
+            {
+                return false;
+            }
+            const Variable* var = FindVariable(*vm.state, name.data());
+            if (!var)
+            {
+                return RuntimeError(vm, "undefined variable '%s'.", name.data());
+            }
+            vars.push_back(var);
+        }
+
+        FileWriter writer;
+        if (!OpenFileWriter(writer, path.data()))
+        {
+            return RuntimeError(vm, "can't open '%s' for writing.", path.data());
+        }
+        WriteMatrixFileHeader(writer, vars.size());
+        for (const Variable* var : vars)
+        {
+            if (var->isSparse)
+            {
+                WriteMatrixRecord(writer, ToStringView(var->name), var->sparse);
+            }
+            else
+            {
+                WriteMatrixRecord(writer, ToStringView(var->name), var->value);
+            }
+        }
+        if (!CloseFileWriter(writer))
+        {
+            return RuntimeError(vm, "failed to write '%s'.", path.data());
+        }
+        result = Value();
+        return true;
+    }
+
+    // load("file") restores all the variables of the file, load("file", "a")
+    // returns the matrix a.
+    bool BuiltinLoad(VM& vm, Value* args, size_t count, Value& result)
+    {
+        String path;
+        String name;
+        if (!ArgToString(vm, args[0], "load", path) ||
+            (count == 2 && !ArgToString(vm, args[1], "load", name)))
+        {
+            return false;
+        }
+        // replacing variables frees their data, that is only safe when
+        // nothing else on the stack can reference them.
+        if (count == 1 && (vm.frames.size() || vm.top != count))
+        {
+            return RuntimeError(vm, "load(\"file\") can only be used as a statement outside of functions.");
+        }
+        MatrixFile file;
+        if (!OpenMatrixFile(path.data(), file))
+        {
+            return RuntimeError(vm, "can't read the matrix file '%s'.", path.data());
+        }
+        defer(CloseMatrixFile(file));
+        if (count == 2)
+        {
+            StringView view = ToStringView(name);
+            view.size--; // the null terminator.
+            const MatrixRecord* record = FindMatrixRecord(file, view);
+            if (!record)
+            {
+                return RuntimeError(vm, "'%s' isn't in '%s'.", name.data(), path.data());
+            }
+            result = record->sparse ? MakeSparse(CreateSparseMatrixFromRecord(*record), true)
+                                    : MakeMatrix(CreateMatrixFromRecord(*record), true);
+            return true;
+        }
+        for (const MatrixRecord& record : file.records)
+        {
+            const NameId id = InternName(record.name.data, record.name.size);
+            if (record.sparse)
+            {
+                AddVariable(*vm.state, id, CreateSparseMatrixFromRecord(record));
+            }
+            else
+            {
+                AddVariable(*vm.state, id, CreateMatrixFromRecord(record));
+            }
+        }
+        result = Value();
+        return true;
+    }
+
+    // args[first] and args[first + 1] are the lines and the fields skipped,
+    // both are optional.
+    bool ReadTextBuiltin(VM& vm, Value* args, size_t count, size_t first, const char* name,
+                         TextMatrixOptions& options, Value& result)
+    {
+        String path;
+        if (!ArgToString(vm, args[0], name, path) ||
+            (count > first && !ArgToSize(vm, args[first], name, options.skipRows)) ||
+            (count > first + 1 && !ArgToSize(vm, args[first + 1], name, options.skipCols)))
+        {
+            return false;
+        }
+        TextMatrixResult text = ReadTextMatrix(path.data(), options);
+        if (!text.success)
+        {
+            if (text.errorLine)
+            {
+                return RuntimeError(vm, "'%s' line %zu: expected a number.", path.data(), text.errorLine);
+            }
+            return RuntimeError(vm, "can't read the file '%s'.", path.data());
+        }
+        result = MakeMatrix(text.matrix, true);
+        return true;
+    }
+
+    // csvread("file", r, c) skips r lines and c fields of every line like
+    // MATLAB, they can be a header and labels.
+    bool BuiltinCsvRead(VM& vm, Value* args, size_t count, Value& result)
+    {
+        TextMatrixOptions options;
+        options.delimiter = ',';
+        return ReadTextBuiltin(vm, args, count, 1, "csvread", options, result);
+    }
+
+    // dlmread("file", delimiter, r, c), the delimiter is one character, "\t"
+    // is a tab and " " any run of spaces. it is taken from the first line
+    // when it's missing.
+    bool BuiltinDlmRead(VM& vm, Value* args, size_t count, Value& result)
+    {
+        TextMatrixOptions options;
+        options.delimiter = 0;
+        if (count > 1)
+        {
+            String delimiter;
+            if (!ArgToString(vm, args[1], "dlmread", delimiter))
+            {
+                return false;
+            }
+            // size() counts the null terminator.
+            if (delimiter.size() == 2)
+            {
+                options.delimiter = delimiter[0];
+            }
+            else if (CompareStrings(delimiter.data(), "\\t"))
+            {
+                options.delimiter = '\t';
+            }
+            else
+            {
+                return RuntimeError(vm, "dlmread expects a delimiter of one character.");
+            }
+            if (options.delimiter == '\n' || options.delimiter == '\r' || IsDigit(options.delimiter) ||
+                options.delimiter == '.' || options.delimiter == '-' || options.delimiter == '+')
+            {
+                return RuntimeError(vm, "dlmread can't use '%c' as a delimiter.", options.delimiter);
+            }
+        }
+        return ReadTextBuiltin(vm, args, count, 2, "dlmread", options, result);
+    }
+
+    // the image channels from the extension of path, 0 if it isn't .pgm/.ppm.
+    size_t ImageChannels(const String& path)
+    {
+        // size() counts the null terminator.
+        const size_t size = path.size() - 1;
+        if (size < 4)
+        {
+            return 0;
+        }
+        const char* extension = path.data() + size - 4;
+        if (CompareStrings(extension, ".pgm") || CompareStrings(extension, ".PGM"))
+        {
+            return 1;
+        }
+        if (CompareStrings(extension, ".ppm") || CompareStrings(extension, ".PPM"))
+        {
+            return 3;
+        }
+        return 0;
+    }
+
+    // imread("file") returns the (channels * height X width) planes of the
+    // image, imread("a", "b", ...) decodes the images in parallel into a
+    // matrix with one image per row.
+    bool BuiltinImread(VM& vm, Value* args, size_t count, Value& result)
+    {
+        Array<String> paths;
+        paths.resize(count);
+        Array<const char*> names;
+        names.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!ArgToString(vm, args[i], "imread", paths[i]))
+            {
+                return false;
+            }
+            names[i] = paths[i].data();
+        }
+        Matrix m;
+        if (count == 1)
+        {
+            if (!ReadImage(names[0], m))
+            {
+                return RuntimeError(vm, "can't read the image '%s'.", names[0]);
+            }
+        }
+        else if (!ReadImages(names.data(), count, m))
+        {
+            return RuntimeError(vm, "can't read the images, they must be PGM/PPM files of the same size.");
+        }
+        result = MakeMatrix(m, true);
+        return true;
+    }
+
+    // imwrite("file.pgm", m) writes gray, imwrite("file.ppm", m) expects the
+    // r, g and b planes stacked.
+    bool BuiltinImwrite(VM& vm, Value* args, size_t, Value& result)
+    {
+        String path;
+        if (!ArgToString(vm, args[0], "imwrite", path))
+        {
+            return false;
+        }
+        const size_t channels = ImageChannels(path);
+        if (!channels)
+        {
+            return RuntimeError(vm, "imwrite supports .pgm and .ppm files.");
+        }
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, args[1], m, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(m));
+        if (!m.rows || !m.cols || m.rows % channels)
+        {
+            return RuntimeError(vm, "imwrite expects a non empty matrix with rows divisible by %zu.", channels);
+        }
+        if (!WriteImage(path.data(), m, channels))
+        {
+            return RuntimeError(vm, "failed to write '%s'.", path.data());
+        }
+        result = Value();
+        return true;
+    }
+
+    // the snapshot keeps its own reference, temporaries of the scratch arena
+    // die with the statement.
+    bool ArgToSnapshot(VM& vm, Value& v, Matrix& result)
+    {
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, v, m, owned))
+        {
+            return false;
+        }
+        if (m.storage && m.storage->allocator != vm.scratch)
+        {
+            result = owned ? m : ShareMatrix(m);
+            return true;
+        }
+        result = CopyMatrix(m);
+        if (owned)
+        {
+            FreeMatrix(m);
+        }
+        return true;
+    }
+
+    bool PostToRenderer(VM& vm, RenderSnapshot& snapshot, const char* builtin)
+    {
+        if (!vm.state->renderer)
+        {
+            FreeMatrix(snapshot.x);
+            FreeMatrix(snapshot.y);
+            return RuntimeError(vm, "%s needs a renderer, there is none in this session.", builtin);
+        }
+        snapshot.figure = vm.state->figure;
+        PostSnapshot(*vm.state->renderer, snapshot);
+        return true;
+    }
+
+    // imshow(m) shows a gray image, imshow(m, 3) the r, g and b planes stacked.
+    bool BuiltinImshow(VM& vm, Value* args, size_t count, Value& result)
+    {
+        RenderSnapshot snapshot;
+        snapshot.type = SnapshotType::IMAGE;
+        if (count == 2 && !ArgToSize(vm, args[1], "imshow", snapshot.channels))
+        {
+            return false;
+        }
+        if (snapshot.channels != 1 && snapshot.channels != 3)
+        {
+            return RuntimeError(vm, "imshow expects 1 or 3 channels.");
+        }
+        if (!ArgToSnapshot(vm, args[0], snapshot.y))
+        {
+            return false;
+        }
+        if (!snapshot.y.rows || !snapshot.y.cols || snapshot.y.rows % snapshot.channels)
+        {
+            FreeMatrix(snapshot.y);
+            return RuntimeError(vm, "imshow expects a non empty matrix with rows divisible by %zu.", snapshot.channels);
+        }
+        result = Value();
+        return PostToRenderer(vm, snapshot, "imshow");
+    }
+
+    // plot(y) draws the columns of y against their row numbers, a vector as a
+    // whole. plot(x, y) against the elements of x.
+    bool BuiltinPlot(VM& vm, Value* args, size_t count, Value& result)
+    {
+        RenderSnapshot snapshot;
+        snapshot.type = SnapshotType::PLOT;
+        if (!ArgToSnapshot(vm, args[count - 1], snapshot.y))
+        {
+            return false;
+        }
+        if (count == 2 && !ArgToSnapshot(vm, args[0], snapshot.x))
+        {
+            FreeMatrix(snapshot.y);
+            return false;
+        }
+        const Matrix& y = snapshot.y;
+        const size_t points = y.rows == 1 ? y.cols : y.rows;
+        const char* error = NULL;
+        if (!points)
+        {
+            error = "plot expects a non empty y.";
+        }
+        else if (count == 2 && snapshot.x.rows * snapshot.x.cols != points)
+        {
+            error = "plot expects an x with an element per point of y.";
+        }
+        if (error)
+        {
+            FreeMatrix(snapshot.x);
+            FreeMatrix(snapshot.y);
+            return RuntimeError(vm, "%s", error);
+        }
+        result = Value();
+        return PostToRenderer(vm, snapshot, "plot");
+    }
+
+    // figure() returns the figure imshow and plot draw to, figure(n) selects n.
+    bool BuiltinFigure(VM& vm, Value* args, size_t count, Value& result)
+    {
+        if (count == 1)
+        {
+            size_t figure = 0;
+            if (!ArgToSize(vm, args[0], "figure", figure))
+            {
+                return false;
+            }
+            if (!figure)
+            {
+                return RuntimeError(vm, "figure expects a number >= 1.");
+            }
+            vm.state->figure = figure;
+        }
+        result = MakeNumber((double)vm.state->figure);
+        return true;
+    }
+
+    static const Builtin builtins[]
+    {
+        {"zeros",     1, 2, BuiltinZeros},
+        {"ones",      1, 2, BuiltinOnes},
+        {"eye",       1, 2, BuiltinEye},
+        {"abs",       1, 1, BuiltinAbs},
+        {"sin",       1, 1, BuiltinSin},
+        {"cos",       1, 1, BuiltinCos},
+        {"tan",       1, 1, BuiltinTan},
+        {"asin",      1, 1, BuiltinASin},
+        {"acos",      1, 1, BuiltinACos},
+        {"atan",      1, 1, BuiltinATan},
+        {"exp",       1, 1, BuiltinExp},
+        {"log",       1, 1, BuiltinLog},
+        {"sqrt",      1, 1, BuiltinSqrt},
+        {"pow",       2, 2, BuiltinPow},
+        {"double",    1, 1, BuiltinDouble},
+        {"single",    1, 1, BuiltinSingle},
+        {"int32",     1, 1, BuiltinInt32},
+        {"uint8",     1, 1, BuiltinUint8},
+        {"transpose", 1, 1, BuiltinTranspose},
+        {"sum",       1, 1, BuiltinSum},
+        {"min",       1, 1, BuiltinMin},
+        {"max",       1, 1, BuiltinMax},
+        {"sort",      1, 1, BuiltinSort},
+        {"sortrows",  1, 1, BuiltinSortRows},
+        {"unique",    1, 1, BuiltinUnique},
+        {"find",      1, 1, BuiltinFind},
+        {"ismember",  2, 2, BuiltinIsMember},
+        {"inv",       1, 1, BuiltinInv},
+        {"det",       1, 1, BuiltinDet},
+        {"lu",        1, 1, BuiltinLU},
+        {"chol",      1, 1, BuiltinChol},
+        {"qr",        1, 1, BuiltinQR},
+        {"sparse",    1, 5, BuiltinSparse},
+        {"full",      1, 1, BuiltinFull},
+        {"nnz",       1, 1, BuiltinNnz},
+        {"issparse",  1, 1, BuiltinIsSparse},
+        {"rows",      1, 1, BuiltinRows},
+        {"cols",      1, 1, BuiltinCols},
+        {"numel",     1, 1, BuiltinNumel},
+        {"threads",   0, 1, BuiltinThreads},
+        {"save",      1, 255, BuiltinSave},
+        {"load",      1, 2, BuiltinLoad},
+        {"csvread",   1, 3, BuiltinCsvRead},
+        {"dlmread",   1, 4, BuiltinDlmRead},
+        {"imread",    1, 255, BuiltinImread},
+        {"imwrite",   2, 2, BuiltinImwrite},
+        {"imshow",    1, 2, BuiltinImshow},
+        {"plot",      1, 2, BuiltinPlot},
+        {"figure",    0, 1, BuiltinFigure}
+    };
+    //---------------------------------------------------------
+}
+//-----------------------------------------------------------
+
+//---------------------------Compiler------------------------
+namespace
+{
+    // the parser recurses for every nested expression and block, past this
+    // depth it fails instead of overflowing the stack.
+    static const size_t COMPILER_MAX_DEPTH = 1000;
+
+    struct Compiler
+    {
+        const Array<Token>* tokens = NULL;
+        size_t current = 0;
+        Program* program = NULL;
+        int64_t function = -1;      // function being compiled, -1 at top level.
+        size_t nesting = 0;         // open parentheses/brackets, new lines are ignored inside.
+        size_t depth = 0;           // nested expressions and blocks being parsed.
+        CompileResult* result = NULL;
+        HashTable<NameId, size_t>* globalSlots = NULL;  // name -> index in Program::globalNames.
+        HashTable<NameId, size_t>* functions = NULL;    // name -> index in Program::functions.
+        // the functions before it were defined by earlier inputs, they can be
+        // defined again.
+        size_t firstFunction = 0;
+        // the variable indexed by the innermost m(...), end is its size in
+        // dimension indexDimension of indexCount.
+        const Token* indexTarget = NULL;
+        size_t indexDimension = 0;
+        size_t indexCount = 0;
+    };
+
+    bool CompileError(Compiler& c, const char* format, ...)
+    {
+        if (!c.result->errorMessage[0])
+        {
+            const Array<Token>& tokens = *c.tokens;
+            c.result->errorLine = tokens.size()
+                ? tokens[Min(c.current, tokens.size() - 1)].line
+                : 0;
+            va_list args;
+            va_start(args, format);
+            vsnprintf(c.result->errorMessage, sizeof(c.result->errorMessage), format, args);
+            va_end(args);
+        }
+        return false;
+    }
+
+    const Token* PeekToken(const Compiler& c, size_t ahead = 0)
+    {
+        const size_t i = c.current + ahead;
+        return i < c.tokens->size() ? &(*c.tokens)[i] : NULL;
+    }
+
+    bool Check(const Compiler& c, TokenType type)
+    {
+        const Token* t = PeekToken(c);
+        return t && t->type == type;
+    }
+
+    bool Match(Compiler& c, TokenType type)
+    {
+        if (Check(c, type))
+        {
+            c.current++;
+            return true;
+        }
+        return false;
+    }
+
+    bool Consume(Compiler& c, TokenType type, const char* message)
+    {
+        return Match(c, type) || CompileError(c, "%s", message);
+    }
+
+    // binary operators and calls continue an expression only on the same
+    // line, so "a = 1 \n -2" is two statements.
+    bool OnSameLine(const Compiler& c)
+    {
+        const Token* t = PeekToken(c);
+        return t && (c.nesting || c.current == 0 || t->line == (*c.tokens)[c.current - 1].line);
+    }
+
+    bool CheckOperator(const Compiler& c, TokenType type)
+    {
+        return Check(c, type) && OnSameLine(c);
+    }
+
+    bool IsBlockEnd(const Compiler& c)
+    {
+        return Check(c, TokenType::KEYWORD_END) || Check(c, TokenType::KEYWORD_ELSE) ||
+            Check(c, TokenType::KEYWORD_ELIF);
+    }
+
+    void Emit(Compiler& c, OpCode op)
+    {
+        c.program->code.push_back((uint8_t)op);
+    }
+
+    void EmitOperand(Compiler& c, size_t operand)
+    {
+        GEDO_ASSERT(operand <= 0xFFFFFFFF);
+        for (size_t i = 0; i < 4; ++i)
+        {
+            c.program->code.push_back((uint8_t)(operand >> (8 * i)));
+        }
+    }
+
+    void Emit(Compiler& c, OpCode op, size_t operand)
+    {
+        Emit(c, op);
+        EmitOperand(c, operand);
+    }
+
+    void Emit(Compiler& c, OpCode op, size_t operand0, size_t operand1)
+    {
+        Emit(c, op);
+        EmitOperand(c, operand0);
+        EmitOperand(c, operand1);
+    }
+
+    // returns the position of the target operand to patch.
+    size_t EmitJump(Compiler& c, OpCode op)
+    {
+        Emit(c, op, 0);
+        return c.program->code.size() - 4;
+    }
+
+    void PatchJump(Compiler& c, size_t position)
+    {
+        const size_t target = c.program->code.size();
+        for (size_t i = 0; i < 4; ++i)
+        {
+            c.program->code[position + i] = (uint8_t)(target >> (8 * i));
+        }
+    }
+
+    int64_t FindLocal(const Array<NameId>& names, NameId name)
+    {
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            if (names[i] == name)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    size_t AddLocal(Array<NameId>& names, NameId name)
+    {
+        const int64_t index = FindLocal(names, name);
+        if (index >= 0)
+        {
+            return index;
+        }
+        names.push_back(name);
+        return names.size() - 1;
+    }
+
+    size_t AddGlobal(Compiler& c, NameId name)
+    {
+        const size_t* slot = c.globalSlots->find(name);
+        if (slot)
+        {
+            return *slot;
+        }
+        c.program->globalNames.push_back(name);
+        return c.globalSlots->insert(name, c.program->globalNames.size() - 1);
+    }
+
+    int64_t FindFunction(const Compiler& c, NameId name)
+    {
+        const size_t* index = c.functions->find(name);
+        return index ? (int64_t)*index : -1;
+    }
+
+    int64_t FindBuiltin(NameId name)
+    {
+        static HashTable<NameId, size_t> ids;
+        if (!ids.size())
+        {
+            for (size_t i = 0; i < ArrayCount(builtins); ++i)
+            {
+                ids.insert(InternName(builtins[i].name), i);
+            }
+        }
+        const size_t* index = ids.find(name);
+        return index ? (int64_t)*index : -1;
+    }
+
+    bool Expression(Compiler& c);
+    bool Block(Compiler& c);
+
+    bool Arguments(Compiler& c, size_t& count)
+    {
+        count = 0;
+        c.nesting++;
+        if (!Check(c, TokenType::RIGHT_PARAN))
+        {
+            do
+            {
+                if (!Expression(c))
+                {
+                    return false;
+                }
+                count++;
+            } while (Match(c, TokenType::COMMA));
+        }
+        c.nesting--;
+        return Consume(c, TokenType::RIGHT_PARAN, "expected ')' after the arguments.");
+    }
+
+    bool Call(Compiler& c, const Token& name)
+    {
+        size_t count = 0;
+        if (!Arguments(c, count))
+        {
+            return false;
+        }
+        const String cname = ToCString(GetName(name.id));
+        const int64_t function = FindFunction(c, name.id);
+        if (function >= 0)
+        {
+            const FunctionInfo& f = c.program->functions[function];
+            if (count != f.paramCount)
+            {
+                return CompileError(c, "%s expects %zu arguments but got %zu.", cname.data(), f.paramCount, count);
+            }
+            Emit(c, OpCode::CALL, function, count);
+            return true;
+        }
+        const int64_t builtin = FindBuiltin(name.id);
+        if (builtin >= 0)
+        {
+            const Builtin& b = builtins[builtin];
+            if (count < b.minArgs || count > b.maxArgs)
+            {
+                return CompileError(c, "wrong number of arguments for %s.", cname.data());
+            }
+            Emit(c, OpCode::CALL_BUILTIN, builtin, count);
+            return true;
+        }
+        return CompileError(c, "unknown function '%s'.", cname.data());
+    }
+
+    // the arguments of m(...) after the '(', the count is known before they are
+    // compiled so end can tell m(end) from m(end, 1). a lone ':' is the string
+    // ":", the whole dimension.
+    bool IndexArguments(Compiler& c, const Token& name, size_t& count)
+    {
+        const Array<Token>& tokens = *c.tokens;
+        count = 0;
+        size_t depth = 0;
+        size_t commas = 0;
+        for (size_t i = c.current; i < tokens.size(); ++i)
+        {
+            const TokenType type = tokens[i].type;
+            if (type == TokenType::LEFT_PARAN || type == TokenType::LEFT_SQUARE_BRACKET)
+            {
+                depth++;
+            }
+            else if (type == TokenType::RIGHT_PARAN || type == TokenType::RIGHT_SQUARE_BRACKET)
+            {
+                if (!depth--)
+                {
+                    count = i > c.current ? commas + 1 : 0;
+                    break;
+                }
+            }
+            else if (type == TokenType::COMMA && !depth)
+            {
+                commas++;
+            }
+        }
+        const Token* target = c.indexTarget;
+        const size_t dimension = c.indexDimension;
+        const size_t dimensions = c.indexCount;
+        c.indexTarget = &name;
+        c.indexCount = count;
+        c.nesting++;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (i && !Consume(c, TokenType::COMMA, "expected ',' between the indices."))
+            {
+                return false;
+            }
+            c.indexDimension = i;
+            const Token* next = PeekToken(c, 1);
+            if (Check(c, TokenType::COLON) && next &&
+                (next->type == TokenType::COMMA || next->type == TokenType::RIGHT_PARAN))
+            {
+                c.current++;
+                c.program->strings.push_back(CreateString(":"));
+                Emit(c, OpCode::STRING, c.program->strings.size() - 1);
+            }
+            else if (!Expression(c))
+            {
+                return false;
+            }
+        }
+        c.nesting--;
+        c.indexTarget = target;
+        c.indexDimension = dimension;
+        c.indexCount = dimensions;
+        return Consume(c, TokenType::RIGHT_PARAN, "expected ')' after the indices.");
+    }
+
+    bool LoadVariable(Compiler& c, const Token& name);
+
+    bool Index(Compiler& c, const Token& name)
+    {
+        size_t count = 0;
+        if (!LoadVariable(c, name) || !IndexArguments(c, name, count))
+        {
+            return false;
+        }
+        Emit(c, OpCode::INDEX, count);
+        return true;
+    }
+
+    bool LoadVariable(Compiler& c, const Token& name)
+    {
+        if (c.function >= 0)
+        {
+            const int64_t slot = FindLocal(c.program->functions[c.function].localNames, name.id);
+            if (slot < 0)
+            {
+                const String cname = ToCString(GetName(name.id));
+                return CompileError(c, "undefined variable '%s'.", cname.data());
+            }
+            Emit(c, OpCode::LOAD_LOCAL, slot);
+        }
+        else
+        {
+            Emit(c, OpCode::LOAD_GLOBAL, AddGlobal(c, name.id));
+        }
+        return true;
+    }
+
+    // [a, b; c, d]
+    bool MatrixLiteral(Compiler& c)
+    {
+        c.nesting++;
+        size_t rows = 0;
+        if (!Check(c, TokenType::RIGHT_SQUARE_BRACKET))
+        {
+            do
+            {
+                size_t elements = 0;
+                do
+                {
+                    if (!Expression(c))
+                    {
+                        return false;
+                    }
+                    elements++;
+                } while (Match(c, TokenType::COMMA));
+                if (elements > 1)
+                {
+                    Emit(c, OpCode::MATRIX_ROW, elements);
+                }
+                rows++;
+            } while (Match(c, TokenType::SEMICOL));
+        }
+        c.nesting--;
+        if (!Consume(c, TokenType::RIGHT_SQUARE_BRACKET, "expected ']' after the matrix elements."))
+        {
+            return false;
+        }
+        if (rows == 0)
+        {
+            Emit(c, OpCode::MATRIX_ROW, 0);
+        }
+        else if (rows > 1)
+        {
+            Emit(c, OpCode::MATRIX_STACK, rows);
+        }
+        return true;
+    }
+
+    bool Primary(Compiler& c)
+    {
+        const Token* t = PeekToken(c);
+        if (!t)
+        {
+            return CompileError(c, "unexpected end of input.");
+        }
+        c.current++;
+        switch (t->type)
+        {
+        case TokenType::NUMERIC_LITERAL:
+            c.program->numbers.push_back(t->numericLiteral);
+            Emit(c, OpCode::NUMBER, c.program->numbers.size() - 1);
+            return true;
+        case TokenType::STRING_LITERAL:
+        {
+            String literal;
+            Append(literal, t->stringLiteral.data, t->stringLiteral.size);
+            c.program->strings.push_back(literal);
+            Emit(c, OpCode::STRING, c.program->strings.size() - 1);
+            return true;
+        }
+        case TokenType::LEFT_PARAN:
+        {
+            c.nesting++;
+            if (!Expression(c))
+            {
+                return false;
+            }
+            c.nesting--;
+            return Consume(c, TokenType::RIGHT_PARAN, "expected ')'.");
+        }
+        case TokenType::LEFT_SQUARE_BRACKET:
+            return MatrixLiteral(c);
+        case TokenType::IDENTIFIER:
+            if (CheckOperator(c, TokenType::LEFT_PARAN))
+            {
+                c.current++;
+                if (FindFunction(c, t->id) >= 0 || FindBuiltin(t->id) >= 0)
+                {
+                    return Call(c, *t);
+                }
+                return Index(c, *t);
+            }
+            return LoadVariable(c, *t);
+        case TokenType::KEYWORD_END:
+            if (!c.indexTarget)
+            {
+                c.current--;
+                return CompileError(c, "'end' outside of an index.");
+            }
+            if (!LoadVariable(c, *c.indexTarget))
+            {
+                return false;
+            }
+            Emit(c, OpCode::INDEX_END, c.indexDimension, c.indexCount);
+            return true;
+        default:
+            c.current--;
+            return CompileError(c, "expected an expression.");
+        }
+    }
+
+    bool Unary(Compiler& c);
+
+    bool UnaryOperand(Compiler& c)
+    {
+        if (Match(c, TokenType::OPERATOR_MINUS))
+        {
+            if (!Unary(c))
+            {
+                return false;
+            }
+            Emit(c, OpCode::NEGATE);
+            return true;
+        }
+        if (Match(c, TokenType::LOGICAL_NOT))
+        {
+            if (!Unary(c))
+            {
+                return false;
+            }
+            Emit(c, OpCode::NOT);
+            return true;
+        }
+        if (Match(c, TokenType::OPERATOR_PLUS))
+        {
+            return Unary(c);
+        }
+        return Primary(c);
+    }
+
+    // every nested expression goes through it.
+    bool Unary(Compiler& c)
+    {
+        if (c.depth >= COMPILER_MAX_DEPTH)
+        {
+            return CompileError(c, "expression nested too deeply.");
+        }
+        c.depth++;
+        const bool success = UnaryOperand(c);
+        c.depth--;
+        return success;
+    }
+
+    struct BinaryOperator
+    {
+        TokenType token;
+        OpCode op;
+    };
+
+    // parses operand (op operand)* for the operators of one precedence level.
+    bool BinaryLevel(Compiler& c, bool (*operand)(Compiler&), const BinaryOperator* operators, size_t count)
+    {
+        if (!operand(c))
+        {
+            return false;
+        }
+        for (;;)
+        {
+            const BinaryOperator* found = NULL;
+            for (size_t i = 0; i < count && !found; ++i)
+            {
+                if (CheckOperator(c, operators[i].token))
+                {
+                    found = &operators[i];
+                }
+            }
+            if (!found)
+            {
+                return true;
+            }
+            c.current++;
+            if (!operand(c))
+            {
+                return false;
+            }
+            Emit(c, found->op);
+        }
+    }
+
+    bool Multiplicative(Compiler& c)
+    {
+        static const BinaryOperator operators[]
+        {
+            {TokenType::OPERATOR_MULTIPLY, OpCode::MULTIPLY},
+            {TokenType::OPERATOR_DIVIDE,   OpCode::DIVIDE},
+            {TokenType::OPERATOR_LEFT_DIVIDE, OpCode::LEFT_DIVIDE}
+        };
+        return BinaryLevel(c, Unary, operators, ArrayCount(operators));
+    }
+
+    bool Additive(Compiler& c)
+    {
+        static const BinaryOperator operators[]
+        {
+            {TokenType::OPERATOR_PLUS,  OpCode::ADD},
+            {TokenType::OPERATOR_MINUS, OpCode::SUBTRACT}
+        };
+        return BinaryLevel(c, Multiplicative, operators, ArrayCount(operators));
+    }
+
+    // first:last or first:step:last, a row.
+    bool Range(Compiler& c)
+    {
+        if (!Additive(c))
+        {
+            return false;
+        }
+        if (!CheckOperator(c, TokenType::COLON))
+        {
+            return true;
+        }
+        c.current++;
+        if (!Additive(c))
+        {
+            return false;
+        }
+        size_t count = 2;
+        if (CheckOperator(c, TokenType::COLON))
+        {
+            c.current++;
+            if (!Additive(c))
+            {
+                return false;
+            }
+            count = 3;
+        }
+        Emit(c, OpCode::RANGE, count);
+        return true;
+    }
+
+    bool Comparison(Compiler& c)
+    {
+        static const BinaryOperator operators[]
+        {
+            {TokenType::LOGICAL_LT,         OpCode::LESS},
+            {TokenType::LOGICAL_GT,         OpCode::GREATER},
+            {TokenType::LOGICAL_LTE,        OpCode::LESS_EQUAL},
+            {TokenType::LOGICAL_GTE,        OpCode::GREATER_EQUAL},
+            {TokenType::LOGICAL_EQUALS,     OpCode::EQUAL},
+            {TokenType::LOGICAL_NOT_EQUALS, OpCode::NOT_EQUAL}
+        };
+        return BinaryLevel(c, Range, operators, ArrayCount(operators));
+    }
+
+    // a && b: a JUMP_IF_FALSE_KEEP(end) b end: TRUTH
+    bool LogicalAnd(Compiler& c)
+    {
+        if (!Comparison(c))
+        {
+            return false;
+        }
+        while (CheckOperator(c, TokenType::LOGICAL_AND))
+        {
+            c.current++;
+            const size_t jump = EmitJump(c, OpCode::JUMP_IF_FALSE_KEEP);
+            if (!Comparison(c))
+            {
+                return false;
+            }
+            PatchJump(c, jump);
+            Emit(c, OpCode::TRUTH);
+        }
+        return true;
+    }
+
+    bool LogicalOr(Compiler& c)
+    {
+        if (!LogicalAnd(c))
+        {
+            return false;
+        }
+        while (CheckOperator(c, TokenType::LOGICAL_OR))
+        {
+            c.current++;
+            const size_t jump = EmitJump(c, OpCode::JUMP_IF_TRUE_KEEP);
+            if (!LogicalAnd(c))
+            {
+                return false;
+            }
+            PatchJump(c, jump);
+            Emit(c, OpCode::TRUTH);
+        }
+        return true;
+    }
+
+    bool Expression(Compiler& c)
+    {
+        return LogicalOr(c);
+    }
+
+    // consumes the statement separator, print is set when the result should
+    // be printed.
+    bool EndStatement(Compiler& c, bool& print)
+    {
+        print = true;
+        if (Match(c, TokenType::SEMICOL))
+        {
+            print = false;
+            return true;
+        }
+        if (Match(c, TokenType::COMMA) || !PeekToken(c) || IsBlockEnd(c) || !OnSameLine(c))
+        {
+            return true;
+        }
+        return CompileError(c, "expected ';', ',' or a new line after the statement.");
+    }
+
+    bool Assignment(Compiler& c, const Token& name)
+    {
+        c.current++; // '='
+        if (!Expression(c))
+        {
+            return false;
+        }
+        bool print = true;
+        if (!EndStatement(c, print))
+        {
+            return false;
+        }
+        if (c.function >= 0)
+        {
+            const size_t slot = AddLocal(c.program->functions[c.function].localNames, name.id);
+            Emit(c, OpCode::STORE_LOCAL, slot);
+            if (print)
+            {
+                Emit(c, OpCode::PRINT_LOCAL, slot);
+            }
+        }
+        else
+        {
+            const size_t slot = AddGlobal(c, name.id);
+            Emit(c, OpCode::STORE_GLOBAL, slot);
+            if (print)
+            {
+                Emit(c, OpCode::PRINT_GLOBAL, slot);
+            }
+        }
+        return true;
+    }
+
+    // m(i, j) = value: the indices, the value, STORE_INDEX_* slot count.
+    bool IndexedAssignment(Compiler& c, const Token& name)
+    {
+        if (FindFunction(c, name.id) >= 0 || FindBuiltin(name.id) >= 0)
+        {
+            const String cname = ToCString(GetName(name.id));
+            return CompileError(c, "can't assign to an index of the function '%s'.", cname.data());
+        }
+        // the slot exists before the indices so end in them can load it.
+        const bool local = c.function >= 0;
+        const size_t slot = local
+            ? AddLocal(c.program->functions[c.function].localNames, name.id)
+            : AddGlobal(c, name.id);
+        c.current += 2; // name '('
+        size_t count = 0;
+        if (!IndexArguments(c, name, count))
+        {
+            return false;
+        }
+        if (!Consume(c, TokenType::OPERATOR_ASSIGN, "expected '=' after the indices.") || !Expression(c))
+        {
+            return false;
+        }
+        bool print = true;
+        if (!EndStatement(c, print))
+        {
+            return false;
+        }
+        Emit(c, local ? OpCode::STORE_INDEX_LOCAL : OpCode::STORE_INDEX_GLOBAL, slot, count);
+        if (print)
+        {
+            Emit(c, local ? OpCode::PRINT_LOCAL : OpCode::PRINT_GLOBAL, slot);
+        }
+        return true;
+    }
+
+    // true when the '(' after the identifier at c.current closes before a '='.
+    bool IsIndexedAssignment(const Compiler& c)
+    {
+        const Array<Token>& tokens = *c.tokens;
+        size_t depth = 0;
+        for (size_t i = c.current + 1; i < tokens.size(); ++i)
+        {
+            const TokenType type = tokens[i].type;
+            if (type == TokenType::LEFT_PARAN || type == TokenType::LEFT_SQUARE_BRACKET)
+            {
+                depth++;
+            }
+            else if ((type == TokenType::RIGHT_PARAN || type == TokenType::RIGHT_SQUARE_BRACKET) && !--depth)
+            {
+                return i + 1 < tokens.size() && tokens[i + 1].type == TokenType::OPERATOR_ASSIGN;
+            }
+        }
+        return false;
+    }
+
+    bool ExpressionStatement(Compiler& c)
+    {
+        if (!Expression(c))
+        {
+            return false;
+        }
+        bool print = true;
+        if (!EndStatement(c, print))
+        {
+            return false;
+        }
+        if (c.function >= 0)
+        {
+            Emit(c, print ? OpCode::PRINT_POP : OpCode::POP);
+        }
+        else
+        {
+            Emit(c, OpCode::STORE_ANS, AddGlobal(c, InternName("ans")), print ? 1 : 0);
+        }
+        return true;
+    }
+
+    // if cond ... (elif cond ...)* (else ...)? end
+    bool If(Compiler& c)
+    {
+        Array<size_t> endJumps;
+        do
+        {
+            if (!Expression(c))
+            {
+                return false;
+            }
+            Match(c, TokenType::COMMA);
+            const size_t next = EmitJump(c, OpCode::JUMP_IF_FALSE);
+            if (!Block(c))
+            {
+                return false;
+            }
+            endJumps.push_back(EmitJump(c, OpCode::JUMP));
+            PatchJump(c, next);
+        } while (Match(c, TokenType::KEYWORD_ELIF));
+
+        if (Match(c, TokenType::KEYWORD_ELSE) && !Block(c))
+        {
+            return false;
+        }
+        for (size_t jump : endJumps)
+        {
+            PatchJump(c, jump);
+        }
+        return Consume(c, TokenType::KEYWORD_END, "expected 'end' to close the if.");
+    }
+
+    // start: LINE cond JUMP_IF_FALSE(end) body JUMP(start) end:
+    bool While(Compiler& c, size_t start)
+    {
+        if (!Expression(c))
+        {
+            return false;
+        }
+        Match(c, TokenType::COMMA);
+        const size_t exit = EmitJump(c, OpCode::JUMP_IF_FALSE);
+        if (!Block(c))
+        {
+            return false;
+        }
+        Emit(c, OpCode::JUMP, start);
+        PatchJump(c, exit);
+        return Consume(c, TokenType::KEYWORD_END, "expected 'end' to close the while.");
+    }
+
+    // the functions are declared before compiling so they can be called
+    // before their definition and recursively.
+    bool Function(Compiler& c)
+    {
+        if (c.function >= 0)
+        {
+            return CompileError(c, "functions can't be defined inside functions.");
+        }
+        const Token& name = (*c.tokens)[c.current++];
+        const int64_t index = FindFunction(c, name.id);
+        GEDO_ASSERT(index >= 0);
+        c.current++; // '('
+        while (!Check(c, TokenType::RIGHT_PARAN))
+        {
+            c.current++;
+        }
+        c.current++;
+
+        const size_t skip = EmitJump(c, OpCode::JUMP);
+        c.program->functions[index].entry = c.program->code.size();
+        c.function = index;
+        const bool success = Block(c);
+        c.function = -1;
+        if (!success)
+        {
+            return false;
+        }
+        Emit(c, OpCode::NONE);
+        Emit(c, OpCode::RETURN);
+        PatchJump(c, skip);
+        return Consume(c, TokenType::KEYWORD_END, "expected 'end' to close the function.");
+    }
+
+    bool Return(Compiler& c)
+    {
+        if (c.function < 0)
+        {
+            return CompileError(c, "return outside of a function.");
+        }
+        if (!PeekToken(c) || IsBlockEnd(c) || Check(c, TokenType::SEMICOL) || !OnSameLine(c))
+        {
+            Emit(c, OpCode::NONE);
+        }
+        else if (!Expression(c))
+        {
+            return false;
+        }
+        bool print = true;
+        if (!EndStatement(c, print))
+        {
+            return false;
+        }
+        Emit(c, OpCode::RETURN);
+        return true;
+    }
+
+    bool Statement(Compiler& c)
+    {
+        const Token& t = *PeekToken(c);
+        const size_t start = c.program->code.size();
+        Emit(c, OpCode::LINE, t.line);
+        switch (t.type)
+        {
+        case TokenType::KEYWORD_IF:
+            c.current++;
+            return If(c);
+        case TokenType::KEYWORD_WHILE:
+            c.current++;
+            return While(c, start);
+        case TokenType::KEYWORD_FUNC:
+            c.current++;
+            return Function(c);
+        case TokenType::KEYWORD_RETURN:
+            c.current++;
+            return Return(c);
+        case TokenType::IDENTIFIER:
+        {
+            const Token* next = PeekToken(c, 1);
+            if (next && next->type == TokenType::OPERATOR_ASSIGN)
+            {
+                c.current++;
+                return Assignment(c, t);
+            }
+            if (next && next->type == TokenType::LEFT_PARAN && next->line == t.line && IsIndexedAssignment(c))
+            {
+                return IndexedAssignment(c, t);
+            }
+            return ExpressionStatement(c);
+        }
+        case TokenType::SEMICOL:
+        case TokenType::COMMA:
+            c.current++;
+            return true;
+        default:
+            return ExpressionStatement(c);
+        }
+    }
+
+    bool Block(Compiler& c)
+    {
+        if (c.depth >= COMPILER_MAX_DEPTH)
+        {
+            return CompileError(c, "blocks nested too deeply.");
+        }
+        c.depth++;
+        while (PeekToken(c) && !IsBlockEnd(c))
+        {
+            if (!Statement(c))
+            {
+                return false;
+            }
+        }
+        c.depth--;
+        return true;
+    }
+
+    bool DeclareFunctions(Compiler& c)
+    {
+        const Array<Token>& tokens = *c.tokens;
+        for (size_t i = 0; i < tokens.size(); ++i)
+        {
+            if (tokens[i].type != TokenType::KEYWORD_FUNC)
+            {
+                continue;
+            }
+            c.current = i;
+            if (i + 2 >= tokens.size() || tokens[i + 1].type != TokenType::IDENTIFIER ||
+                tokens[i + 2].type != TokenType::LEFT_PARAN)
+            {
+                return CompileError(c, "expected 'func name(arguments)'.");
+            }
+            if (FindFunction(c, tokens[i + 1].id) >= (int64_t)c.firstFunction)
+            {
+                const String cname = ToCString(GetName(tokens[i + 1].id));
+                return CompileError(c, "function '%s' is already defined.", cname.data());
+            }
+            FunctionInfo f;
+            f.name = tokens[i + 1].id;
+            size_t j = i + 3;
+            while (j < tokens.size() && tokens[j].type != TokenType::RIGHT_PARAN)
+            {
+                if (tokens[j].type != TokenType::IDENTIFIER)
+                {
+                    c.current = j;
+                    return CompileError(c, "expected a parameter name.");
+                }
+                if (FindLocal(f.localNames, tokens[j].id) >= 0)
+                {
+                    c.current = j;
+                    return CompileError(c, "duplicate parameter name.");
+                }
+                f.localNames.push_back(tokens[j].id);
+                j++;
+                if (j < tokens.size() && tokens[j].type == TokenType::COMMA)
+                {
+                    j++;
+                }
+            }
+            if (j >= tokens.size())
+            {
+                return CompileError(c, "expected ')' after the parameters.");
+            }
+            f.paramCount = f.localNames.size();
+            c.functions->insert(f.name, c.program->functions.size());
+            c.program->functions.push_back(f);
+        }
+        c.current = 0;
+        return true;
+    }
+}
+
+namespace
+{
+    CompileResult CompileProgram(const LexerResult& lexResult, Program& program, HashTable<NameId, size_t>& globalSlots,
+                                 HashTable<NameId, size_t>& functions)
+    {
+        GEDO_PROFILE_ZONE("Compile");
+        CompileResult result;
+        Compiler c;
+        c.tokens = &lexResult.tokens;
+        c.program = &program;
+        c.result = &result;
+        c.globalSlots = &globalSlots;
+        c.functions = &functions;
+        c.firstFunction = program.functions.size();
+        if (!DeclareFunctions(c))
+        {
+            return result;
+        }
+        while (PeekToken(c))
+        {
+            if (IsBlockEnd(c))
+            {
+                CompileError(c, "unexpected '%s'.", Check(c, TokenType::KEYWORD_END) ? "end" : "else/elif");
+                return result;
+            }
+            if (!Statement(c))
+            {
+                return result;
+            }
+        }
+        Emit(c, OpCode::HALT);
+        result.success = true;
+        return result;
+    }
+}
+
+CompileResult Compile(const LexerResult& lexResult, Program& program)
+{
+    HashTable<NameId, size_t> globalSlots;
+    HashTable<NameId, size_t> functions;
+    return CompileProgram(lexResult, program, globalSlots, functions);
+}
+
+CompileResult Compile(const LexerResult& lexResult, Session& session, size_t& entry)
+{
+    Program& program = session.program;
+    const size_t codeSize = program.code.size();
+    const size_t numberCount = program.numbers.size();
+    const size_t stringCount = program.strings.size();
+    const size_t globalCount = program.globalNames.size();
+    const size_t functionCount = program.functions.size();
+    entry = codeSize;
+    const CompileResult result = CompileProgram(lexResult, program, session.globalSlots, session.functions);
+    if (!result.success)
+    {
+        // the session is left as it was before the input.
+        program.code.resize(codeSize);
+        program.numbers.resize(numberCount);
+        program.strings.resize(stringCount);
+        for (size_t i = globalCount; i < program.globalNames.size(); ++i)
+        {
+            session.globalSlots.remove(program.globalNames[i]);
+        }
+        program.globalNames.resize(globalCount);
+        program.functions.resize(functionCount);
+        session.functions.clear();
+        for (size_t i = 0; i < functionCount; ++i)
+        {
+            session.functions.insert(program.functions[i].name, i);
+        }
+        return result;
+    }
+    for (size_t i = functionCount; i < program.functions.size(); ++i)
+    {
+        program.functions[i].lineBase = session.lineCount;
+    }
+    // the code compiled before calls the new definition of a function.
+    for (size_t i = 0; i < functionCount; ++i)
+    {
+        const size_t latest = *session.functions.find(program.functions[i].name);
+        if (latest != i)
+        {
+            program.functions[i] = program.functions[latest];
+        }
+    }
+    return result;
+}
+//-----------------------------------------------------------
+
+//---------------------------Execution-----------------------
+namespace
+{
+    uint32_t ReadOperand(const uint8_t* code, size_t& ip)
+    {
+        const uint32_t result = (uint32_t)code[ip] | ((uint32_t)code[ip + 1] << 8) |
+            ((uint32_t)code[ip + 2] << 16) | ((uint32_t)code[ip + 3] << 24);
+        ip += 4;
+        return result;
+    }
+
+    // State::vars isn't modified outside of the VM while it runs so the links
+    // stay valid, variables are never deleted by the program.
+    Variable* GetGlobal(VM& vm, size_t slot)
+    {
+        int64_t& link = vm.globals[slot];
+        if (link < 0)
+        {
+            Variable* var = FindVariable(*vm.state, vm.program->globalNames[slot]);
+            if (!var)
+            {
+                return NULL;
+            }
+            link = var - vm.state->vars.data();
+        }
+        return &vm.state->vars[link];
+    }
+
+    // references can't outlive the statement that created them, shared data
+    // takes a new reference instead of a copy.
+    void Own(VM& vm, Value& v)
+    {
+        Materialize(vm, v);
+        if (v.type == ValueType::MATRIX && !v.owned)
+        {
+            v.matrix = v.matrix.storage ? ShareMatrix(v.matrix) : CopyMatrix(v.matrix, *vm.scratch);
+            v.owned = true;
+        }
+        if (v.type == ValueType::SPARSE && !v.owned)
+        {
+            v.sparse = ShareSparseMatrix(v.sparse);
+            v.owned = true;
+        }
+    }
+
+    Value LoadMatrix(const Matrix& m)
+    {
+        if (m.rows == 1 && m.cols == 1 && m.type == MatrixDataType::FLOAT64)
+        {
+            return MakeNumber(m.data[0]);
+        }
+        return MakeMatrix(m, false);
+    }
+
+    bool StoreGlobal(VM& vm, size_t slot, Value& v)
+    {
+        Variable* var = GetGlobal(vm, slot);
+        if (v.type == ValueType::NUMBER && var && var->value.rows == 1 && var->value.cols == 1 &&
+            var->value.type == MatrixDataType::FLOAT64)
+        {
+            var->value.data[0] = v.number;
+            var->isLogical = v.logical;
+            return true;
+        }
+        const NameId name = vm.program->globalNames[slot];
+        const bool logical = v.logical;
+        switch (v.type)
+        {
+        case ValueType::NUMBER:
+        {
+            Matrix m = CreateMatrix(1, 1);
+            m.data[0] = v.number;
+            var = AddVariable(*vm.state, name, m);
+            break;
+        }
+        case ValueType::LAZY:
+            if (vm.profile)
+            {
+                const ProfileMark start = MarkProfile();
+                var = AddVariable(*vm.state, name, vm.graph, v.node);
+                CountWork(vm, vm.profile->elementWise, start, CountElements(vm, v));
+                break;
+            }
+            var = AddVariable(*vm.state, name, vm.graph, v.node);
+            break;
+        case ValueType::MATRIX:
+            // b = a shares the data of a.
+            Own(vm, v);
+            var = AddVariable(*vm.state, name, v.matrix);
+            break;
+        case ValueType::SPARSE:
+            Own(vm, v);
+            var = AddVariable(*vm.state, name, v.sparse);
+            break;
+        default:
+            return RuntimeError(vm, "can't assign %s to '%s'.", TypeName(v.type), ToCString(GetName(name)).data());
+        }
+        var->isLogical = logical;
+        v = Value();
+        vm.globals[slot] = var - vm.state->vars.data();
+        return true;
+    }
+
+    void PrintValue(VM& vm, const String& name, Value& v)
+    {
+        if (v.type == ValueType::STRING)
+        {
+            PrintToConsole(ToCString(*v.string).data());
+            PrintToConsole("\n");
+            return;
+        }
+        if (v.type == ValueType::NONE)
+        {
+            return;
+        }
+        Variable var;
+        if (v.type == ValueType::SPARSE)
+        {
+            var.name = name;
+            var.isSparse = true;
+            var.sparse = v.sparse;
+            PrintVariable(var);
+            return;
+        }
+        bool owned = false;
+        ToMatrix(vm, v, var.value, owned);
+        var.name = name;
+        PrintVariable(var);
+        if (owned)
+        {
+            FreeMatrix(var.value);
+        }
+    }
+
+    // sparse operands the caller didn't handle become dense.
+    bool CheckOperand(VM& vm, Value& v)
+    {
+        if (v.type == ValueType::NONE || v.type == ValueType::STRING)
+        {
+            return RuntimeError(vm, "can't use %s in an expression.", TypeName(v.type));
+        }
+        return Densify(vm, v);
+    }
+
+    bool ExecuteUnary(VM& vm, ExpressionOp op)
+    {
+        Value& v = vm.stack[vm.top - 1];
+        if (v.type == ValueType::NUMBER)
+        {
+            v.number = ApplyUnary(op, v.number);
+            v.logical = op == ExpressionOp::NOT;
+            return true;
+        }
+        if (op == ExpressionOp::NEGATE && v.type == ValueType::SPARSE)
+        {
+            Value result = MakeSparse(Multiply(v.sparse, -1.0, *vm.scratch), true);
+            FreeValue(v);
+            v = result;
+            return true;
+        }
+        if (!CheckOperand(vm, v))
+        {
+            return false;
+        }
+        v = MakeLazy(PushUnary(vm.graph, op, ToNode(vm, v)));
+        v.logical = op == ExpressionOp::NOT;
+        return true;
+    }
+
+    bool MatrixProduct(VM& vm, Value& a, Value& b, Value& result)
+    {
+        Matrix m0;
+        Matrix m1;
+        bool owned0 = false;
+        bool owned1 = false;
+        ToMatrix(vm, a, m0, owned0);
+        ToMatrix(vm, b, m1, owned1);
+        const bool success = CanMultiply(m0, m1);
+        if (success)
+        {
+            const ProfileMark start = vm.profile ? MarkProfile() : ProfileMark();
+            result = MakeMatrix(Multiply(m0, m1, *vm.scratch), true);
+            if (vm.profile)
+            {
+                CountWork(vm, vm.profile->products, start, int64_t(m0.rows * m0.cols + m1.rows * m1.cols));
+            }
+        }
+        else
+        {
+            RuntimeError(vm, "can't multiply (%zu X %zu) by (%zu X %zu).", m0.rows, m0.cols, m1.rows, m1.cols);
+        }
+        if (owned0)
+        {
+            FreeMatrix(m0);
+        }
+        if (owned1)
+        {
+            FreeMatrix(m1);
+        }
+        return success;
+    }
+
+    // *, + and - with a sparse operand and the scaling of a sparse matrix,
+    // handled is false when they don't apply and the operands are densified.
+    bool ExecuteSparseBinary(VM& vm, ExpressionOp op, Value& a, Value& b, Value& result, bool& handled)
+    {
+        // CheckOperand reports the operands that can't be used.
+        handled = false;
+        if (a.type == ValueType::STRING || a.type == ValueType::NONE ||
+            b.type == ValueType::STRING || b.type == ValueType::NONE)
+        {
+            return true;
+        }
+        const bool sparseA = a.type == ValueType::SPARSE;
+        const bool sparseB = b.type == ValueType::SPARSE;
+        size_t rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+        GetShape(vm, a, rowsA, colsA);
+        GetShape(vm, b, rowsB, colsB);
+        const bool product = op == ExpressionOp::MULTIPLY && !IsScalarShaped(vm, a) && !IsScalarShaped(vm, b);
+        const bool sum = (op == ExpressionOp::ADD || op == ExpressionOp::SUBTRACT) && rowsA == rowsB && colsA == colsB;
+        const bool scale = (op == ExpressionOp::MULTIPLY && (a.type == ValueType::NUMBER || b.type == ValueType::NUMBER)) ||
+            (op == ExpressionOp::DIVIDE && sparseA && b.type == ValueType::NUMBER && b.number != 0 && isfinite(b.number));
+        if (!product && !sum && !scale)
+        {
+            return true;
+        }
+        if (product && colsA != rowsB)
+        {
+            return RuntimeError(vm, "can't multiply (%zu X %zu) by (%zu X %zu).", rowsA, colsA, rowsB, colsB);
+        }
+        handled = true;
+        Allocator& allocator = *vm.scratch;
+        const ProfileMark start = vm.profile ? MarkProfile() : ProfileMark();
+        const int64_t elements = int64_t((sparseA ? a.sparse.nonZeros : rowsA * colsA) +
+                                         (sparseB ? b.sparse.nonZeros : rowsB * colsB));
+        // the dense operand of a mixed product or sum.
+        Matrix dense;
+        bool owned = false;
+        defer(if (owned) FreeMatrix(dense));
+        if (sparseA != sparseB && !scale && !ToMatrix(vm, sparseA ? b : a, dense, owned))
+        {
+            return false;
+        }
+        if (scale && op == ExpressionOp::DIVIDE)
+        {
+            // x / 0 and x / inf change the zeros so they are dense.
+            SparseMatrix m = CopySparseMatrix(a.sparse, allocator);
+            for (size_t k = 0; k < m.nonZeros; ++k)
+            {
+                m.values[k] /= b.number;
+            }
+            result = MakeSparse(m, true);
+        }
+        else if (scale)
+        {
+            result = MakeSparse(Multiply(sparseA ? a.sparse : b.sparse, sparseA ? b.number : a.number, allocator), true);
+        }
+        else if (product)
+        {
+            if (sparseA && sparseB)
+            {
+                result = MakeSparse(Multiply(a.sparse, b.sparse, allocator), true);
+            }
+            else
+            {
+                result = MakeMatrix(sparseA ? Multiply(a.sparse, dense, allocator) : Multiply(dense, b.sparse, allocator), true);
+            }
+        }
+        else if (sparseA && sparseB)
+        {
+            result = MakeSparse(op == ExpressionOp::ADD ? Add(a.sparse, b.sparse, allocator)
+                                                        : Subtract(a.sparse, b.sparse, allocator), true);
+        }
+        else if (sparseA)
+        {
+            result = MakeMatrix(op == ExpressionOp::ADD ? Add(a.sparse, dense, allocator)
+                                                        : Subtract(a.sparse, dense, allocator), true);
+        }
+        else
+        {
+            result = MakeMatrix(op == ExpressionOp::ADD ? Add(dense, b.sparse, allocator)
+                                                        : Subtract(dense, b.sparse, allocator), true);
+        }
+        if (vm.profile)
+        {
+            CountWork(vm, product ? vm.profile->products : vm.profile->elementWise, start, elements);
+        }
+        return true;
+    }
+
+    // comparisons and logical operators give logical values.
+    bool IsLogicalOp(ExpressionOp op)
+    {
+        return op >= ExpressionOp::LESS && op <= ExpressionOp::OR;
+    }
+
+    bool ExecuteBinary(VM& vm, ExpressionOp op)
+    {
+        Value b = Pop(vm);
+        Value& a = vm.stack[vm.top - 1];
+        if (a.type == ValueType::NUMBER && b.type == ValueType::NUMBER)
+        {
+            a.number = ApplyBinary(op, a.number, b.number);
+            a.logical = IsLogicalOp(op);
+            return true;
+        }
+        if (a.type == ValueType::SPARSE || b.type == ValueType::SPARSE)
+        {
+            Value result;
+            bool handled = false;
+            if (!ExecuteSparseBinary(vm, op, a, b, result, handled))
+            {
+                FreeValue(b);
+                return false;
+            }
+            if (handled)
+            {
+                FreeValue(a);
+                FreeValue(b);
+                a = result;
+                return true;
+            }
+        }
+        if (!CheckOperand(vm, a) || !CheckOperand(vm, b))
+        {
+            FreeValue(b);
+            return false;
+        }
+        const bool scalarA = IsScalarShaped(vm, a);
+        const bool scalarB = IsScalarShaped(vm, b);
+        if (op == ExpressionOp::MULTIPLY && !scalarA && !scalarB)
+        {
+            Value result;
+            const bool success = MatrixProduct(vm, a, b, result);
+            FreeValue(a);
+            FreeValue(b);
+            a = result;
+            return success;
+        }
+        size_t rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+        GetShape(vm, a, rowsA, colsA);
+        GetShape(vm, b, rowsB, colsB);
+        if (!CanBroadcast(rowsA, colsA, rowsB, colsB))
+        {
+            FreeValue(b);
+            return RuntimeError(vm, "dimensions mismatch (%zu X %zu) and (%zu X %zu).", rowsA, colsA, rowsB, colsB);
+        }
+        const size_t left = ToNode(vm, a);
+        const size_t right = ToNode(vm, b);
+        a = MakeLazy(PushBinary(vm.graph, op, left, right));
+        a.logical = IsLogicalOp(op);
+        return true;
+    }
+
+    // a \ b divides b by a element wise when a is a scalar and solves
+    // a * x = b otherwise.
+    bool ExecuteLeftDivide(VM& vm)
+    {
+        Value b = Pop(vm);
+        Value& a = vm.stack[vm.top - 1];
+        if (!CheckOperand(vm, a) || !CheckOperand(vm, b))
+        {
+            FreeValue(b);
+            return false;
+        }
+        if (IsScalarShaped(vm, a))
+        {
+            Swap(a, b);
+            return Push(vm, b) && ExecuteBinary(vm, ExpressionOp::DIVIDE);
+        }
+        Matrix m0;
+        Matrix m1;
+        bool owned0 = false;
+        bool owned1 = false;
+        ToMatrix(vm, a, m0, owned0);
+        ToMatrix(vm, b, m1, owned1);
+        Value result;
+        const bool success = CanSolve(m0, m1);
+        if (success)
+        {
+            const ProfileMark start = vm.profile ? MarkProfile() : ProfileMark();
+            bool singular = false;
+            result = MakeMatrix(Solve(m0, m1, *vm.scratch, &singular), true);
+            if (singular)
+            {
+                RuntimeWarning(vm, "matrix is singular to working precision.");
+            }
+            if (vm.profile)
+            {
+                CountWork(vm, vm.profile->solves, start, int64_t(m0.rows * m0.cols + m1.rows * m1.cols));
+            }
+        }
+        else
+        {
+            RuntimeError(vm, "can't solve (%zu X %zu) \\ (%zu X %zu).", m0.rows, m0.cols, m1.rows, m1.cols);
+        }
+        if (owned0)
+        {
+            FreeMatrix(m0);
+        }
+        if (owned1)
+        {
+            FreeMatrix(m1);
+        }
+        FreeValue(a);
+        FreeValue(b);
+        a = result;
+        return success;
+    }
+
+    // [a, b] and [a; b], the values are replaced by their concatenation.
+    bool Concat(VM& vm, size_t count, bool horizontal)
+    {
+        GEDO_ASSERT(count <= vm.top);
+        Value* values = &vm.stack[vm.top - count];
+        const ProfileMark start = vm.profile ? MarkProfile() : ProfileMark();
+        Array<Matrix, 8> matrices;
+        Array<bool, 8> owned;
+        bool success = true;
+        for (size_t i = 0; i < count && success; ++i)
+        {
+            Matrix m;
+            bool o = false;
+            success = CheckOperand(vm, values[i]) && ToMatrix(vm, values[i], m, o);
+            if (success)
+            {
+                matrices.push_back(m);
+                owned.push_back(o);
+            }
+        }
+        // the elements are converted to the promoted type of the non empty ones.
+        MatrixDataType type = MatrixDataType::FLOAT64;
+        bool typed = false;
+        for (size_t i = 0; i < matrices.size(); ++i)
+        {
+            if (matrices[i].rows * matrices[i].cols != 0)
+            {
+                type = typed ? PromoteTypes(type, matrices[i].type) : matrices[i].type;
+                typed = true;
+            }
+        }
+        for (size_t i = 0; i < matrices.size(); ++i)
+        {
+            if (matrices[i].type != type && matrices[i].rows * matrices[i].cols != 0)
+            {
+                Matrix converted = ConvertMatrix(matrices[i], type, *vm.scratch);
+                if (owned[i])
+                {
+                    FreeMatrix(matrices[i]);
+                }
+                matrices[i] = converted;
+                owned[i] = true;
+            }
+        }
+        Value result;
+        if (success)
+        {
+            const bool can = horizontal ? CanConcatHorizontal(matrices.data(), count)
+                                        : CanConcatVertical(matrices.data(), count);
+            if (can)
+            {
+                result = MakeMatrix(horizontal ? ConcatHorizontal(matrices.data(), count, *vm.scratch)
+                                               : ConcatVertical(matrices.data(), count, *vm.scratch), true);
+                if (vm.profile)
+                {
+                    CountWork(vm, vm.profile->concats, start, CountElements(vm, result));
+                }
+            }
+            else
+            {
+                success = RuntimeError(vm, "dimensions of the matrix elements don't match.");
+            }
+        }
+        for (size_t i = 0; i < matrices.size(); ++i)
+        {
+            if (owned[i])
+            {
+                FreeMatrix(matrices[i]);
+            }
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            Drop(vm);
+        }
+        Push(vm, result);
+        return success;
+    }
+
+    //---------------------------Indexing------------------------
+    // one index of m(...) as 0 based positions (column major for a linear
+    // index). ':' doesn't list them, a linear mask keeps its matrix for
+    // FillMask and GatherMask.
+    struct IndexList
+    {
+        bool all = false;               // ':', the whole dimension.
+        const Matrix* mask = NULL;      // a mask with the shape of m.
+        Array<size_t, 8> positions;     // unless all or mask.
+        size_t count = 0;
+        size_t end = 0;                 // the largest position + 1.
+        // first + k * step, set for ranges with a step >= 1.
+        bool progression = false;
+        size_t step = 1;
+        size_t rows = 0;                // the shape of the index.
+        size_t cols = 0;
+    };
+
+    // v is materialized in place and stays on the stack while the list is used,
+    // extent is the size of the dimension (the elements of m for a linear
+    // index). a logical v with the shape maskRows X maskCols of a linear index
+    // is a mask, a logical row or column as long as the dimension becomes its
+    // positions.
+    bool ToIndexList(VM& vm, Value& v, size_t extent, size_t maskRows, size_t maskCols, bool linear,
+                     IndexList& list)
+    {
+        Materialize(vm, v);
+        if (!Densify(vm, v))
+        {
+            return false;
+        }
+        if (v.type == ValueType::STRING && v.string->size() == 1 && (*v.string)[0] == ':')
+        {
+            list.all = true;
+            list.count = extent;
+            list.end = extent;
+            list.progression = true;
+            list.rows = extent;
+            list.cols = 1;
+            return true;
+        }
+        if (v.type == ValueType::NUMBER && v.logical)
+        {
+            if (v.number != 0.0)
+            {
+                list.positions.push_back(0);
+            }
+            list.count = list.positions.size();
+            list.end = list.count;
+            list.progression = true;
+            list.rows = list.count;
+            list.cols = 1;
+            return true;
+        }
+        if (v.type == ValueType::NUMBER)
+        {
+            const double d = v.number;
+            if (!(d >= 1 && d <= 9007199254740992.0) || d != floor(d))
+            {
+                return RuntimeError(vm, "indices must be positive integers but got %g.", d);
+            }
+            list.positions.push_back((size_t)d - 1);
+            list.count = 1;
+            list.end = (size_t)d;
+            list.progression = true;
+            list.rows = 1;
+            list.cols = 1;
+            return true;
+        }
+        if (v.type != ValueType::MATRIX)
+        {
+            return RuntimeError(vm, "can't use %s as an index.", TypeName(v.type));
+        }
+        const Matrix& m = v.matrix;
+        list.rows = m.rows;
+        list.cols = m.cols;
+        if (v.logical)
+        {
+            if (linear && m.rows == maskRows && m.cols == maskCols)
+            {
+                list.mask = &m;
+                list.count = CountMask(m);
+                list.end = maskRows * maskCols;
+                return true;
+            }
+            if ((m.rows != 1 && m.cols != 1) || m.rows * m.cols != extent)
+            {
+                return RuntimeError(vm, "a (%zu X %zu) mask can't index a dimension of %zu elements.", m.rows,
+                                    m.cols, extent);
+            }
+            for (size_t k = 0; k < extent; ++k)
+            {
+                if (GetElement(m, k % m.rows, k / m.rows) != 0.0)
+                {
+                    list.positions.push_back(k);
+                }
+            }
+            list.count = list.positions.size();
+            list.end = list.count ? list.positions[list.count - 1] + 1 : 0;
+            list.rows = list.count;
+            list.cols = 1;
+            list.progression = true;
+            list.step = list.count > 1 ? list.positions[1] - list.positions[0] : 1;
+            for (size_t k = 1; k < list.count && list.progression; ++k)
+            {
+                list.progression = list.positions[k] - list.positions[k - 1] == list.step;
+            }
+            return true;
+        }
+        list.count = m.rows * m.cols;
+        list.positions.resize(list.count);
+        for (size_t j = 0, k = 0; j < m.cols; ++j)
+        {
+            for (size_t i = 0; i < m.rows; ++i, ++k)
+            {
+                const double d = GetElement(m, i, j);
+                if (!(d >= 1 && d <= 9007199254740992.0) || d != floor(d))
+                {
+                    return RuntimeError(vm, "indices must be positive integers but got %g.", d);
+                }
+                list.positions[k] = (size_t)d - 1;
+                list.end = Max(list.end, (size_t)d);
+            }
+        }
+        list.progression = list.count != 0;
+        if (list.count > 1)
+        {
+            list.progression = list.positions[1] > list.positions[0];
+            list.step = list.positions[1] - list.positions[0];
+        }
+        for (size_t k = 2; k < list.count && list.progression; ++k)
+        {
+            list.progression = list.positions[k] > list.positions[k - 1] &&
+                list.positions[k] - list.positions[k - 1] == list.step;
+        }
+        return true;
+    }
+
+    bool CheckIndexBounds(VM& vm, const IndexList& list, size_t extent)
+    {
+        if (list.end > extent)
+        {
+            return RuntimeError(vm, "index %zu is out of bounds, the dimension has %zu elements.", list.end, extent);
+        }
+        return true;
+    }
+
+    // a contiguous (n X 1) seen as (1 X n), the data doesn't move.
+    void ToRow(Matrix& m)
+    {
+        m.cols = m.rows;
+        m.rows = 1;
+        m.rowStride = m.cols;
+    }
+
+    // m(i): the shape of the index, a vector m keeps its orientation and a mask
+    // gives a column (a row for a row m). ranges of a vector are views.
+    bool IndexLinear(VM& vm, const Matrix& m, Value& index, Value& result)
+    {
+        const size_t numel = m.rows * m.cols;
+        IndexList list;
+        if (!ToIndexList(vm, index, numel, m.rows, m.cols, true, list) || !CheckIndexBounds(vm, list, numel))
+        {
+            return false;
+        }
+        const bool isVector = (m.rows == 1 || m.cols == 1) && numel != 1;
+        if (list.mask)
+        {
+            Matrix selected = GatherMask(m, *list.mask, *vm.scratch);
+            if (m.rows == 1)
+            {
+                ToRow(selected);
+            }
+            result = MakeMatrix(selected, true);
+            return true;
+        }
+        if (list.all)
+        {
+            // m(:) is a column.
+            if (m.cols == 1 || m.rows == 1)
+            {
+                result = MakeMatrix(m.cols == 1 ? ShareMatrix(m) : TransposedView(m), true);
+                return true;
+            }
+            list.positions.resize(numel);
+            for (size_t k = 0; k < numel; ++k)
+            {
+                list.positions[k] = k;
+            }
+        }
+        size_t rows = list.rows;
+        size_t cols = list.cols;
+        if (isVector && (rows == 1 || cols == 1))
+        {
+            rows = m.rows == 1 ? 1 : list.count;
+            cols = m.rows == 1 ? list.count : 1;
+            if (list.progression && list.count)
+            {
+                const size_t first = list.positions[0];
+                result = MakeMatrix(m.rows == 1 ? SliceView(m, 0, 1, 1, first, list.count, list.step)
+                                                : SliceView(m, first, list.count, list.step, 0, 1, 1), true);
+                return true;
+            }
+        }
+        result = MakeMatrix(GatherLinear(m, list.positions.data(), list.count, rows, cols, *vm.scratch), true);
+        return true;
+    }
+
+    // m(i, j): the rows i of the cols j, ranges give views.
+    bool IndexElements(VM& vm, const Matrix& m, Value* indices, Value& result)
+    {
+        IndexList rows;
+        IndexList cols;
+        if (!ToIndexList(vm, indices[0], m.rows, m.rows, 1, false, rows) || !CheckIndexBounds(vm, rows, m.rows) ||
+            !ToIndexList(vm, indices[1], m.cols, m.cols, 1, false, cols) || !CheckIndexBounds(vm, cols, m.cols))
+        {
+            return false;
+        }
+        if (rows.progression && cols.progression)
+        {
+            const size_t firstRow = rows.count && !rows.all ? rows.positions[0] : 0;
+            const size_t firstCol = cols.count && !cols.all ? cols.positions[0] : 0;
+            result = MakeMatrix(SliceView(m, firstRow, rows.count, rows.step, firstCol, cols.count, cols.step), true);
+            return true;
+        }
+        result = MakeMatrix(GatherElements(m, rows.all ? NULL : rows.positions.data(), rows.count,
+                                           cols.all ? NULL : cols.positions.data(), cols.count, *vm.scratch), true);
+        return true;
+    }
+
+    // replaces the value under the top count values by its index with them.
+    bool ExecuteIndex(VM& vm, size_t count)
+    {
+        if (!count)
+        {
+            return true;
+        }
+        Value* indices = &vm.stack[vm.top - count];
+        Value& object = indices[-1];
+        if (count > 2)
+        {
+            return RuntimeError(vm, "matrices have 2 dimensions but got %zu indices.", count);
+        }
+        if (!CheckOperand(vm, object))
+        {
+            return false;
+        }
+        // a number from a 1 X 1 variable.
+        const bool logical = object.logical;
+        Matrix m;
+        bool owned = false;
+        if (!ToMatrix(vm, object, m, owned))
+        {
+            return false;
+        }
+        defer(if (owned) FreeMatrix(m));
+        Value result;
+        const bool success = count == 1 ? IndexLinear(vm, m, indices[0], result)
+                                        : IndexElements(vm, m, indices, result);
+        if (!success)
+        {
+            return false;
+        }
+        result.logical = logical;
+        for (size_t i = 0; i <= count; ++i)
+        {
+            Drop(vm);
+        }
+        return Push(vm, result);
+    }
+
+    // first:last or first:step:last, empty when last is before first.
+    bool ExecuteRange(VM& vm, size_t count)
+    {
+        Value* args = &vm.stack[vm.top - count];
+        double first = 0;
+        double step = 1;
+        double last = 0;
+        if (!ArgToNumber(vm, args[0], "a range", first) ||
+            (count == 3 && !ArgToNumber(vm, args[1], "a range", step)) ||
+            !ArgToNumber(vm, args[count - 1], "a range", last))
+        {
+            return false;
+        }
+        // NaN isn't equal to itself.
+        if (first != first || step != step || last != last)
+        {
+            return RuntimeError(vm, "a range can't have NaN bounds.");
+        }
+        // the tolerance keeps 0:0.1:1 from losing 1 to rounding.
+        const double span = step != 0.0 ? (last - first) / step : -1.0;
+        const double elements = span >= 0.0 ? floor(span + 1e-10) + 1.0 : 0.0;
+        if (elements > (double)(1ULL << 31))
+        {
+            return RuntimeError(vm, "the range has too many elements.");
+        }
+        const size_t n = (size_t)elements;
+        Matrix range = CreateMatrix(1, n, *vm.scratch);
+        for (size_t k = 0; k < n; ++k)
+        {
+            range.data[k] = first + (double)k * step;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            Drop(vm);
+        }
+        return Push(vm, MakeMatrix(range, true));
+    }
+
+    // end in the index of dimension of count, the numel for a linear index.
+    void ExecuteIndexEnd(VM& vm, size_t dimension, size_t count)
+    {
+        Value v = Pop(vm);
+        size_t rows = 0;
+        size_t cols = 0;
+        GetShape(vm, v, rows, cols);
+        FreeValue(v);
+        const size_t size = count == 1 ? rows * cols : dimension == 0 ? rows : dimension == 1 ? cols : 1;
+        Push(vm, MakeNumber((double)size));
+    }
+
+    bool SharesData(const Matrix& a, const Matrix& b)
+    {
+        return a.storage ? a.storage == b.storage : a.data == b.data;
+    }
+
+    // positions 0, 1, ... count - 1.
+    void ListAll(IndexList& list, size_t count)
+    {
+        list.positions.resize(count);
+        for (size_t k = 0; k < count; ++k)
+        {
+            list.positions[k] = k;
+        }
+    }
+
+    /*
+     * target(indices) = value. target is the matrix of the variable (empty when
+     * defined is false), it is copied first when its data is shared and grows
+     * with zeros to the largest index. nothing changes when it fails. the
+     * values are converted to the type of target, a 1 X 1 value goes to every
+     * selected element.
+     */
+    bool AssignIndexed(VM& vm, Matrix& target, bool defined, Value* indices, size_t count, Value& value)
+    {
+        if (count == 0 || count > 2)
+        {
+            return RuntimeError(vm, "an indexed assignment needs 1 or 2 indices but got %zu.", count);
+        }
+        Matrix values;
+        bool ownedValues = false;
+        if (!CheckOperand(vm, value) || !ToMatrix(vm, value, values, ownedValues))
+        {
+            return false;
+        }
+        defer(if (ownedValues) FreeMatrix(values));
+        const MatrixDataType type = defined ? target.type : values.type;
+        const bool scalar = values.rows == 1 && values.cols == 1;
+        const size_t valueCount = values.rows * values.cols;
+
+        IndexList lists[2];
+        size_t newRows = target.rows;
+        size_t newCols = target.cols;
+        size_t selected = 0;
+        if (count == 1)
+        {
+            IndexList& list = lists[0];
+            const size_t numel = target.rows * target.cols;
+            if (!ToIndexList(vm, indices[0], numel, target.rows, target.cols, true, list))
+            {
+                return false;
+            }
+            if (list.end > numel)
+            {
+                if (target.rows > 1 && target.cols > 1)
+                {
+                    return RuntimeError(vm, "a linear index can't grow a (%zu X %zu) matrix.", target.rows,
+                                        target.cols);
+                }
+                newRows = target.cols == 1 && target.rows > 1 ? list.end : 1;
+                newCols = newRows == 1 ? list.end : 1;
+            }
+            selected = list.count;
+        }
+        else
+        {
+            const size_t extents[2] = {target.rows, target.cols};
+            const size_t valueExtents[2] = {values.rows, values.cols};
+            for (size_t d = 0; d < 2; ++d)
+            {
+                if (!ToIndexList(vm, indices[d], extents[d], extents[d], 1, false, lists[d]))
+                {
+                    return false;
+                }
+                // m = []; m(:, 1) = [1; 2] takes the rows of the value.
+                if (lists[d].all && !extents[d])
+                {
+                    lists[d].count = scalar ? 1 : valueExtents[d];
+                    lists[d].end = lists[d].count;
+                }
+            }
+            newRows = Max(target.rows, lists[0].end);
+            newCols = Max(target.cols, lists[1].end);
+            selected = lists[0].count * lists[1].count;
+        }
+        if (!scalar && valueCount != selected)
+        {
+            return RuntimeError(vm, "the assignment has %zu elements but the index selects %zu.", valueCount,
+                                selected);
+        }
+        if (newCols && newRows > SPARSE_DENSIFY_LIMIT / newCols)
+        {
+            return RuntimeError(vm, "the index makes a (%zu X %zu) matrix, it is too big.", newRows, newCols);
+        }
+
+        // the values and the mask are read while target is written.
+        if (values.type != type || SharesData(values, target))
+        {
+            Matrix converted = ConvertMatrix(values, type, *vm.scratch);
+            if (ownedValues)
+            {
+                FreeMatrix(values);
+            }
+            values = converted;
+            ownedValues = true;
+        }
+        Matrix mask;
+        bool ownedMask = false;
+        defer(if (ownedMask) FreeMatrix(mask));
+        if (lists[0].mask)
+        {
+            mask = *lists[0].mask;
+            if (SharesData(mask, target))
+            {
+                mask = CopyMatrix(mask, *vm.scratch);
+                ownedMask = true;
+            }
+        }
+
+        if (newRows != target.rows || newCols != target.cols || !defined)
+        {
+            Matrix grown = CreateMatrix(newRows, newCols, type);
+            GEDO_MEMSET(grown.data, 0, newRows * newCols * GetElementSize(type));
+            if (defined && target.rows * target.cols != 0)
+            {
+                ScatterElements(grown, NULL, target.rows, NULL, target.cols, target);
+            }
+            FreeMatrix(target);
+            target = grown;
+        }
+        else
+        {
+            MakeMatrixUnique(target);
+        }
+
+        if (count == 2)
+        {
+            // a vector value can fill a slice of another orientation.
+            if (!scalar && (values.rows != lists[0].count || values.cols != lists[1].count))
+            {
+                IndexList order;
+                ListAll(order, valueCount);
+                Matrix reshaped = GatherLinear(values, order.positions.data(), valueCount, lists[0].count,
+                                               lists[1].count, *vm.scratch);
+                if (ownedValues)
+                {
+                    FreeMatrix(values);
+                }
+                values = reshaped;
+                ownedValues = true;
+            }
+            ScatterElements(target, lists[0].all ? NULL : lists[0].positions.data(), lists[0].count,
+                            lists[1].all ? NULL : lists[1].positions.data(), lists[1].count, values);
+            return true;
+        }
+        IndexList& list = lists[0];
+        if (list.mask && scalar)
+        {
+            FillMask(target, mask, GetElement(values, 0, 0));
+            return true;
+        }
+        if (list.all && scalar)
+        {
+            ScatterElements(target, NULL, target.rows, NULL, target.cols, values);
+            return true;
+        }
+        if (list.all)
+        {
+            ListAll(list, list.count);
+        }
+        else if (list.mask)
+        {
+            for (size_t k = 0; k < target.rows * target.cols; ++k)
+            {
+                if (GetElement(mask, k % mask.rows, k / mask.rows) != 0.0)
+                {
+                    list.positions.push_back(k);
+                }
+            }
+        }
+        ScatterLinear(target, list.positions.data(), list.count, values);
+        return true;
+    }
+
+    // pops the value and the count indices under it.
+    bool StoreIndexGlobal(VM& vm, size_t slot, size_t count)
+    {
+        Value* indices = &vm.stack[vm.top - 1 - count];
+        Value& value = vm.stack[vm.top - 1];
+        Variable* var = GetGlobal(vm, slot);
+        if (var && var->isSparse)
+        {
+            const String name = ToCString(var->name);
+            return RuntimeError(vm, "can't assign to an index of the sparse matrix '%s', use full(%s).",
+                                name.data(), name.data());
+        }
+        // a logical matrix stays logical while logical values are assigned to it.
+        const bool logical = value.logical;
+        if (var)
+        {
+            if (!AssignIndexed(vm, var->value, true, indices, count, value))
+            {
+                return false;
+            }
+            var->isLogical &= logical;
+        }
+        else
+        {
+            Matrix m;
+            if (!AssignIndexed(vm, m, false, indices, count, value))
+            {
+                return false;
+            }
+            var = AddVariable(*vm.state, vm.program->globalNames[slot], m);
+            var->isLogical = logical;
+            vm.globals[slot] = var - vm.state->vars.data();
+        }
+        for (size_t i = 0; i <= count; ++i)
+        {
+            Drop(vm);
+        }
+        return true;
+    }
+
+    bool StoreIndexLocal(VM& vm, size_t slot, size_t count)
+    {
+        Value* indices = &vm.stack[vm.top - 1 - count];
+        Value& value = vm.stack[vm.top - 1];
+        const Frame& frame = vm.frames[vm.frames.size() - 1];
+        Value& local = vm.stack[frame.base + slot];
+        if (local.type == ValueType::SPARSE || local.type == ValueType::STRING)
+        {
+            const String name = ToCString(GetName(vm.program->functions[frame.function].localNames[slot]));
+            return RuntimeError(vm, "can't assign to an index of '%s', it is %s.", name.data(),
+                                local.type == ValueType::SPARSE ? "sparse" : TypeName(local.type));
+        }
+        Own(vm, local);
+        Matrix m;
+        const bool defined = local.type != ValueType::NONE;
+        const bool logical = value.logical && (!defined || local.logical);
+        if (local.type == ValueType::NUMBER)
+        {
+            m = CreateMatrix(1, 1);
+            m.data[0] = local.number;
+        }
+        else if (local.type == ValueType::MATRIX)
+        {
+            m = local.matrix;
+        }
+        if (!AssignIndexed(vm, m, defined, indices, count, value))
+        {
+            return false;
+        }
+        local = MakeMatrix(m, true);
+        local.logical = logical;
+        for (size_t i = 0; i <= count; ++i)
+        {
+            Drop(vm);
+        }
+        return true;
+    }
+
+    bool ExecuteCall(VM& vm, size_t function, size_t argc, size_t returnAddress, size_t& ip)
+    {
+        const FunctionInfo& f = vm.program->functions[function];
+        if (argc != f.paramCount)
+        {
+            // the call was compiled for a definition that was replaced.
+            const String cname = ToCString(GetName(f.name));
+            return RuntimeError(vm, "%s expects %zu arguments but got %zu.", cname.data(), f.paramCount, argc);
+        }
+        if (vm.frames.size() >= VM_MAX_FRAMES)
+        {
+            return RuntimeError(vm, "too many nested calls.");
+        }
+        if (vm.top + f.localNames.size() - argc > VM_STACK_SIZE)
+        {
+            return RuntimeError(vm, "stack overflow.");
+        }
+        // statements in the function reset the graph, so nothing on the
+        // stack can be lazy.
+        for (size_t i = 0; i < vm.top; ++i)
+        {
+            Materialize(vm, vm.stack[i]);
+        }
+        Frame frame;
+        frame.function = function;
+        frame.returnAddress = returnAddress;
+        frame.base = vm.top - argc;
+        frame.line = vm.line;
+        frame.lineBase = vm.lineBase;
+        vm.frames.push_back(frame);
+        vm.top += f.localNames.size() - argc;
+        // the first LINE of the function charges the line of the call.
+        vm.lineBase = f.lineBase;
+        ip = f.entry;
+        return true;
+    }
+
+    void ExecuteReturn(VM& vm, size_t& ip)
+    {
+        Value result = Pop(vm);
+        Own(vm, result);
+        const Frame frame = vm.frames[vm.frames.size() - 1];
+        vm.frames.pop_back();
+        while (vm.top > frame.base)
+        {
+            Drop(vm);
+        }
+        Push(vm, result);
+        ip = frame.returnAddress;
+        if (vm.profile)
+        {
+            ChargeLine(vm);
+        }
+        vm.line = frame.line;
+        vm.lineBase = frame.lineBase;
+        vm.profileLine = vm.lineBase + vm.line;
+    }
+
+    bool Run(VM& vm, size_t ip)
+    {
+        const Program& program = *vm.program;
+        const uint8_t* code = program.code.data();
+        for (;;)
+        {
+            const OpCode op = (OpCode)code[ip++];
+            switch (op)
+            {
+            case OpCode::HALT:
+                return true;
+            case OpCode::LINE:
+                if (vm.profile)
+                {
+                    ChargeLine(vm);
+                }
+                vm.line = ReadOperand(code, ip);
+                vm.profileLine = vm.lineBase + vm.line;
+                if (vm.profile)
+                {
+                    ChargeLine(vm);
+                    vm.profile->lines[vm.profileLine].count++;
+                }
+                if (vm.graph.nodes.size())
+                {
+                    ResetGraph(vm);
+                }
+                if (!vm.scratch->liveBlocks)
+                {
+                    vm.scratch->ResetAllocator();
+                }
+                break;
+            case OpCode::NUMBER:
+                if (!Push(vm, MakeNumber(program.numbers[ReadOperand(code, ip)])))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::STRING:
+            {
+                Value v;
+                v.type = ValueType::STRING;
+                v.string = &program.strings[ReadOperand(code, ip)];
+                if (!Push(vm, v))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::NONE:
+                if (!Push(vm, Value()))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::POP:
+                Drop(vm);
+                break;
+            case OpCode::LOAD_GLOBAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                const Variable* var = GetGlobal(vm, slot);
+                if (!var)
+                {
+                    const String name = ToCString(GetName(program.globalNames[slot]));
+                    return RuntimeError(vm, "undefined variable '%s'.", name.data());
+                }
+                Value v = var->isSparse ? MakeSparse(var->sparse, false) : LoadMatrix(var->value);
+                v.logical = var->isLogical;
+                if (!Push(vm, v))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::STORE_GLOBAL:
+            {
+                Value v = Pop(vm);
+                if (!StoreGlobal(vm, ReadOperand(code, ip), v))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::PRINT_GLOBAL:
+            {
+                // the compiler emits it after a store, a loaded cache may not.
+                const size_t slot = ReadOperand(code, ip);
+                const Variable* var = GetGlobal(vm, slot);
+                if (!var)
+                {
+                    const String name = ToCString(GetName(program.globalNames[slot]));
+                    return RuntimeError(vm, "undefined variable '%s'.", name.data());
+                }
+                PrintVariable(*var);
+                break;
+            }
+            case OpCode::STORE_ANS:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                const bool print = ReadOperand(code, ip) != 0;
+                Value v = Pop(vm);
+                if (v.type == ValueType::STRING || v.type == ValueType::NONE)
+                {
+                    if (print)
+                    {
+                        PrintValue(vm, GetName(program.globalNames[slot]), v);
+                    }
+                    break;
+                }
+                if (!StoreGlobal(vm, slot, v))
+                {
+                    return false;
+                }
+                if (print)
+                {
+                    PrintVariable(*GetGlobal(vm, slot));
+                }
+                break;
+            }
+            case OpCode::LOAD_LOCAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                const Frame& frame = vm.frames[vm.frames.size() - 1];
+                const Value& local = vm.stack[frame.base + slot];
+                Value v = local;
+                if (v.type == ValueType::NONE)
+                {
+                    const FunctionInfo& f = program.functions[frame.function];
+                    const String name = ToCString(GetName(f.localNames[slot]));
+                    return RuntimeError(vm, "variable '%s' is used before it is assigned.", name.data());
+                }
+                v.owned = false;
+                if (!Push(vm, v))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::STORE_LOCAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                const Frame& frame = vm.frames[vm.frames.size() - 1];
+                Value v = Pop(vm);
+                Own(vm, v);
+                Value& local = vm.stack[frame.base + slot];
+                FreeValue(local);
+                local = v;
+                break;
+            }
+            case OpCode::PRINT_LOCAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                const Frame& frame = vm.frames[vm.frames.size() - 1];
+                Value v = vm.stack[frame.base + slot];
+                v.owned = false;
+                PrintValue(vm, GetName(program.functions[frame.function].localNames[slot]), v);
+                break;
+            }
+            case OpCode::PRINT_POP:
+            {
+                Value v = Pop(vm);
+                PrintValue(vm, GetName(InternName("ans")), v);
+                FreeValue(v);
+                break;
+            }
+            case OpCode::ADD:           if (!ExecuteBinary(vm, ExpressionOp::ADD)) return false; break;
+            case OpCode::SUBTRACT:      if (!ExecuteBinary(vm, ExpressionOp::SUBTRACT)) return false; break;
+            case OpCode::MULTIPLY:      if (!ExecuteBinary(vm, ExpressionOp::MULTIPLY)) return false; break;
+            case OpCode::DIVIDE:        if (!ExecuteBinary(vm, ExpressionOp::DIVIDE)) return false; break;
+            case OpCode::LEFT_DIVIDE:   if (!ExecuteLeftDivide(vm)) return false; break;
+            case OpCode::LESS:          if (!ExecuteBinary(vm, ExpressionOp::LESS)) return false; break;
+            case OpCode::GREATER:       if (!ExecuteBinary(vm, ExpressionOp::GREATER)) return false; break;
+            case OpCode::LESS_EQUAL:    if (!ExecuteBinary(vm, ExpressionOp::LESS_EQUAL)) return false; break;
+            case OpCode::GREATER_EQUAL: if (!ExecuteBinary(vm, ExpressionOp::GREATER_EQUAL)) return false; break;
+            case OpCode::EQUAL:         if (!ExecuteBinary(vm, ExpressionOp::EQUAL)) return false; break;
+            case OpCode::NOT_EQUAL:     if (!ExecuteBinary(vm, ExpressionOp::NOT_EQUAL)) return false; break;
+            case OpCode::NEGATE:        if (!ExecuteUnary(vm, ExpressionOp::NEGATE)) return false; break;
+            case OpCode::NOT:           if (!ExecuteUnary(vm, ExpressionOp::NOT)) return false; break;
+            case OpCode::TRUTH:
+            {
+                Value v = Pop(vm);
+                bool truth = false;
+                if (!IsTrue(vm, v, truth))
+                {
+                    return false;
+                }
+                FreeValue(v);
+                Push(vm, MakeNumber(truth ? 1.0 : 0.0));
+                break;
+            }
+            case OpCode::JUMP:
+                ip = ReadOperand(code, ip);
+                break;
+            case OpCode::JUMP_IF_FALSE:
+            {
+                const size_t target = ReadOperand(code, ip);
+                Value v = Pop(vm);
+                bool truth = false;
+                if (!IsTrue(vm, v, truth))
+                {
+                    return false;
+                }
+                FreeValue(v);
+                if (!truth)
+                {
+                    ip = target;
+                }
+                break;
+            }
+            case OpCode::JUMP_IF_FALSE_KEEP:
+            case OpCode::JUMP_IF_TRUE_KEEP:
+            {
+                const size_t target = ReadOperand(code, ip);
+                const bool jumpOn = op == OpCode::JUMP_IF_TRUE_KEEP;
+                Value v = Pop(vm);
+                bool truth = false;
+                if (!IsTrue(vm, v, truth))
+                {
+                    return false;
+                }
+                FreeValue(v);
+                if (truth == jumpOn)
+                {
+                    Push(vm, MakeNumber(truth ? 1.0 : 0.0));
+                    ip = target;
+                }
+                break;
+            }
+            case OpCode::MATRIX_ROW:
+                if (!Concat(vm, ReadOperand(code, ip), true))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::MATRIX_STACK:
+                if (!Concat(vm, ReadOperand(code, ip), false))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::RANGE:
+                if (!ExecuteRange(vm, ReadOperand(code, ip)))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::INDEX:
+                if (!ExecuteIndex(vm, ReadOperand(code, ip)))
+                {
+                    return false;
+                }
+                break;
+            case OpCode::INDEX_END:
+            {
+                const size_t dimension = ReadOperand(code, ip);
+                ExecuteIndexEnd(vm, dimension, ReadOperand(code, ip));
+                break;
+            }
+            case OpCode::STORE_INDEX_GLOBAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                if (!StoreIndexGlobal(vm, slot, ReadOperand(code, ip)))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::STORE_INDEX_LOCAL:
+            {
+                const size_t slot = ReadOperand(code, ip);
+                if (!StoreIndexLocal(vm, slot, ReadOperand(code, ip)))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::CALL:
+            {
+                const size_t function = ReadOperand(code, ip);
+                const size_t argc = ReadOperand(code, ip);
+                if (!ExecuteCall(vm, function, argc, ip, ip))
+                {
+                    return false;
+                }
+                break;
+            }
+            case OpCode::CALL_BUILTIN:
+            {
+                const size_t index = ReadOperand(code, ip);
+                const Builtin& builtin = builtins[index];
+                const size_t argc = ReadOperand(code, ip);
+                Value* args = &vm.stack[vm.top - argc];
+                for (size_t i = 0; i < argc; ++i)
+                {
+                    if (args[i].type == ValueType::NONE)
+                    {
+                        return RuntimeError(vm, "%s got nothing as an argument.", builtin.name);
+                    }
+                }
+                Value result;
+                GEDO_PROFILE_ZONE(builtin.name);
+                const ProfileMark start = vm.profile ? MarkProfile() : ProfileMark();
+                if (!builtin.function(vm, args, argc, result))
+                {
+                    return false;
+                }
+                if (vm.profile)
+                {
+                    int64_t elements = 0;
+                    for (size_t i = 0; i < argc; ++i)
+                    {
+                        elements += CountElements(vm, args[i]);
+                    }
+                    CountWork(vm, vm.profile->builtins[index], start, Max(elements, CountElements(vm, result)));
+                }
+                for (size_t i = 0; i < argc; ++i)
+                {
+                    Drop(vm);
+                }
+                Push(vm, result);
+                break;
+            }
+            case OpCode::RETURN:
+                ExecuteReturn(vm, ip);
+                break;
+            default:
+                GEDO_ASSERT_MSG("invalid opcode.");
+                return false;
+            }
+        }
+    }
+}
+
+bool Execute(State& state, const Program& program, size_t entry, size_t lineBase)
+{
+    GEDO_PROFILE_ZONE("Execute");
+    if (!state.scratch)
+    {
+        state.scratch = CreateScratchAllocator(SCRATCH_ARENA_SIZE);
+    }
+    VM vm;
+    vm.state = &state;
+    vm.program = &program;
+    vm.scratch = state.scratch;
+    vm.lineBase = lineBase;
+    vm.stack.reserve(VM_STACK_SIZE);
+    for (size_t i = 0; i < VM_STACK_SIZE; ++i)
+    {
+        vm.stack.push_back(Value());
+    }
+    for (size_t i = 0; i < program.globalNames.size(); ++i)
+    {
+        vm.globals.push_back(-1);
+    }
+    if (state.profile.enabled)
+    {
+        vm.profile = &state.profile;
+        vm.profile->builtins.resize(ArrayCount(builtins));
+        vm.lineMark = MarkProfile();
+    }
+    const bool success = Run(vm, entry);
+    if (vm.profile)
+    {
+        ChargeLine(vm);
+    }
+    while (vm.top)
+    {
+        Drop(vm);
+    }
+    ResetGraph(vm);
+    GEDO_ASSERT(!vm.scratch->liveBlocks);
+    vm.scratch->ResetAllocator();
+    return success;
+}
+
+namespace
+{
+    struct CounterRow
+    {
+        const char* name;
+        size_t line;
+        const ExecutionCounter* counter;
+    };
+
+    void PrintCounterRows(Array<CounterRow>& rows, size_t maxRows, int64_t totalNs)
+    {
+        QuickSort(rows.data(), rows.size(), [](const CounterRow& a, const CounterRow& b)
+        {
+            return a.counter->nanoseconds > b.counter->nanoseconds;
+        });
+        for (size_t i = 0; i < rows.size() && i < maxRows; ++i)
+        {
+            const CounterRow& row = rows[i];
+            const ExecutionCounter& c = *row.counter;
+            char name[64] = {};
+            if (row.name)
+            {
+                snprintf(name, sizeof(name), "%s", row.name);
+            }
+            else
+            {
+                snprintf(name, sizeof(name), "line %zu", row.line);
+            }
+            char text[300] = {};
+            snprintf(text, sizeof(text), "%-24s %10lld %12.3f %7.1f %14lld %14zu\n", name, (long long)c.count,
+                     c.nanoseconds * 1e-6, totalNs ? 100.0 * c.nanoseconds / totalNs : 0.0,
+                     (long long)c.elements, c.bytes);
+            PrintToConsole(text);
+        }
+    }
+}
+
+void PrintExecutionProfile(const ExecutionProfile& profile)
+{
+    static const size_t MAX_LINES = 20;
+    int64_t totalNs = 0;
+    Array<CounterRow> rows;
+    // line 0 is the time before the first statement.
+    for (size_t i = 1; i < profile.lines.size(); ++i)
+    {
+        if (profile.lines[i].count)
+        {
+            totalNs += profile.lines[i].nanoseconds;
+            rows.push_back(CounterRow{NULL, i, &profile.lines[i]});
+        }
+    }
+    char text[300] = {};
+    snprintf(text, sizeof(text), "%-24s %10s %12s %7s %14s %14s\n", "line", "runs", "ms", "share", "elements", "bytes");
+    PrintToConsole(text);
+    PrintCounterRows(rows, MAX_LINES, totalNs);
+    if (rows.size() > MAX_LINES)
+    {
+        snprintf(text, sizeof(text), "(%zu more lines)\n", rows.size() - MAX_LINES);
+        PrintToConsole(text);
+    }
+
+    rows.clear();
+    for (size_t i = 0; i < profile.builtins.size(); ++i)
+    {
+        if (profile.builtins[i].count)
+        {
+            rows.push_back(CounterRow{builtins[i].name, 0, &profile.builtins[i]});
+        }
+    }
+    const CounterRow operators[] =
+    {
+        {"* (matrix product)", 0, &profile.products},
+        {"\\ (linear solve)",  0, &profile.solves},
+        {"element wise",       0, &profile.elementWise},
+        {"[] (concatenation)", 0, &profile.concats}
+    };
+    for (const CounterRow& row : operators)
+    {
+        if (row.counter->count)
+        {
+            rows.push_back(row);
+        }
+    }
+    snprintf(text, sizeof(text), "\n%-24s %10s %12s %7s %14s %14s\n", "operation", "calls", "ms", "share", "elements",
+             "bytes");
+    PrintToConsole(text);
+    PrintCounterRows(rows, rows.size(), totalNs);
+}
+//-----------------------------------------------------------
+
+//-----------------------Rendering---------------------------
+namespace
+{
+    static const Color PLOT_COLORS[] = {GREEN_BLUE, YELLOW, RED, GREEN, BLUE, WHITE};
+
+    Rect MakeRect(size_t x, size_t y, size_t width, size_t height)
+    {
+        Rect r;
+        r.x = x;
+        r.y = y;
+        r.width = width;
+        r.height = height;
+        return r;
+    }
+
+    void SetPixel(ColorBitmap& frame, size_t x, size_t y, Color c)
+    {
+        if (x < frame.width && y < frame.height)
+        {
+            frame.data[y * frame.width + x] = c;
+        }
+    }
+
+    void DrawLine(ColorBitmap& frame, double x0, double y0, double x1, double y1, Color c)
+    {
+        const size_t steps = (size_t)Max(fabs(x1 - x0), fabs(y1 - y0)) + 1;
+        for (size_t i = 0; i <= steps; ++i)
+        {
+            const double t = (double)i / steps;
+            SetPixel(frame, (size_t)(x0 + (x1 - x0) * t + 0.5), (size_t)(y0 + (y1 - y0) * t + 0.5), c);
+        }
+    }
+
+    // element k of a vector.
+    double VectorElement(const Matrix& v, size_t k)
+    {
+        return v.rows == 1 ? GetElement(v, 0, k) : GetElement(v, k, 0);
+    }
+
+    ColorBitmap ComposeImage(const RenderSnapshot& snapshot)
+    {
+        const Matrix& m = snapshot.y;
+        const size_t height = m.rows / snapshot.channels;
+        ColorBitmap frame = CreateColorBitmap(m.cols, height);
+        for (size_t i = 0; i < height; ++i)
+        {
+            for (size_t j = 0; j < m.cols; ++j)
+            {
+                uint8_t rgb[3] = {};
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    const double v = GetElement(m, (snapshot.channels == 3 ? c : 0) * height + i, j);
+                    // NaN is black like imwrite.
+                    rgb[c] = v > 0 ? (uint8_t)Min(v + 0.5, 255.0) : 0;
+                }
+                frame.data[i * frame.width + j] = CreateColor(rgb[0], rgb[1], rgb[2], 255);
+            }
+        }
+        return frame;
+    }
+
+    ColorBitmap ComposePlot(const RenderSnapshot& snapshot)
+    {
+        static const size_t MARGIN = 32;
+        const Matrix& y = snapshot.y;
+        const bool vector = y.rows == 1 || y.cols == 1;
+        const size_t points = y.rows == 1 ? y.cols : y.rows;
+        const size_t lines = vector ? 1 : y.cols;
+        auto X = [&](size_t k) { return snapshot.x.rows ? VectorElement(snapshot.x, k) : (double)(k + 1); };
+        auto Y = [&](size_t k, size_t l) { return vector ? VectorElement(y, k) : GetElement(y, k, l); };
+
+        ColorBitmap frame = CreateColorBitmap(PLOT_WIDTH, PLOT_HEIGHT);
+        FillRectangle(frame, MakeRect(0, 0, PLOT_WIDTH, PLOT_HEIGHT), DARK_GREY);
+        const Rect box = MakeRect(MARGIN, MARGIN, PLOT_WIDTH - 2 * MARGIN, PLOT_HEIGHT - 2 * MARGIN);
+        FillRectangle(frame, MakeRect(box.x, box.y, box.width, 1), WHITE);
+        FillRectangle(frame, MakeRect(box.x, box.y + box.height - 1, box.width, 1), WHITE);
+        FillRectangle(frame, MakeRect(box.x, box.y, 1, box.height), WHITE);
+        FillRectangle(frame, MakeRect(box.x + box.width - 1, box.y, 1, box.height), WHITE);
+
+        // the points that are not finite are gaps in the lines.
+        double xMin = INFINITY, xMax = -INFINITY, yMin = INFINITY, yMax = -INFINITY;
+        for (size_t k = 0; k < points; ++k)
+        {
+            const double xk = X(k);
+            for (size_t l = 0; l < lines && isfinite(xk); ++l)
+            {
+                const double yk = Y(k, l);
+                if (isfinite(yk))
+                {
+                    xMin = Min(xMin, xk);
+                    xMax = Max(xMax, xk);
+                    yMin = Min(yMin, yk);
+                    yMax = Max(yMax, yk);
+                }
+            }
+        }
+        if (xMin > xMax)
+        {
+            return frame;
+        }
+        if (xMin == xMax)
+        {
+            xMin -= 1;
+            xMax += 1;
+        }
+        if (yMin == yMax)
+        {
+            yMin -= 1;
+            yMax += 1;
+        }
+        // inside the box with a pixel of space.
+        const double left = box.x + 2.0, right = box.x + box.width - 3.0;
+        const double top = box.y + 2.0, bottom = box.y + box.height - 3.0;
+        const double sx = (right - left) / (xMax - xMin), sy = (bottom - top) / (yMax - yMin);
+        for (size_t l = 0; l < lines; ++l)
+        {
+            const Color color = PLOT_COLORS[l % ArrayCount(PLOT_COLORS)];
+            bool previous = false;
+            double px = 0, py = 0;
+            for (size_t k = 0; k < points; ++k)
+            {
+                const double xk = X(k), yk = Y(k, l);
+                if (!isfinite(xk) || !isfinite(yk))
+                {
+                    previous = false;
+                    continue;
+                }
+                const double cx = left + (xk - xMin) * sx, cy = bottom - (yk - yMin) * sy;
+                if (previous)
+                {
+                    DrawLine(frame, px, py, cx, cy, color);
+                }
+                else if (k + 1 == points || !isfinite(X(k + 1)) || !isfinite(Y(k + 1, l)))
+                {
+                    // a point on its own is still visible.
+                    FillRectangle(frame, MakeRect((size_t)cx - 1, (size_t)cy - 1, 3, 3), color);
+                }
+                previous = true;
+                px = cx;
+                py = cy;
+            }
+        }
+        return frame;
+    }
+
+    void RenderThread(void* userData)
+    {
+        Renderer& renderer = *(Renderer*)userData;
+        Array<RenderSnapshot> latest;   // one per figure.
+        for (;;)
+        {
+            WaitSemaphore(renderer.wake);
+            // read before draining so everything posted before StopRenderer is presented.
+            const bool stop = AtomicLoad(&renderer.stop) != 0;
+            RenderSnapshot snapshot;
+            while (PopQueue(renderer.queue, snapshot))
+            {
+                size_t i = 0;
+                while (i < latest.size() && latest[i].figure != snapshot.figure)
+                {
+                    i++;
+                }
+                if (i == latest.size())
+                {
+                    latest.push_back(snapshot);
+                    continue;
+                }
+                FreeMatrix(latest[i].x);
+                FreeMatrix(latest[i].y);
+                latest[i] = snapshot;
+            }
+            for (RenderSnapshot& s : latest)
+            {
+                ColorBitmap frame = ComposeFrame(s);
+                if (renderer.present)
+                {
+                    renderer.present(renderer.userData, s.figure, frame);
+                }
+                FreeColorBitmap(frame);
+                FreeMatrix(s.x);
+                FreeMatrix(s.y);
+                AtomicAdd(&renderer.presented, 1);
+            }
+            latest.clear();
+            if (stop)
+            {
+                return;
+            }
+        }
+    }
+}
+
+ColorBitmap ComposeFrame(const RenderSnapshot& snapshot)
+{
+    return snapshot.type == SnapshotType::IMAGE ? ComposeImage(snapshot) : ComposePlot(snapshot);
+}
+
+void StartRenderer(Renderer& renderer, PresentFunction present, void* userData)
+{
+    renderer.present = present;
+    renderer.userData = userData;
+    renderer.stop = 0;
+    InitSemaphore(renderer.wake, 0);
+    renderer.thread = StartThread(RenderThread, &renderer);
+}
+
+void StopRenderer(Renderer& renderer)
+{
+    AtomicStore(&renderer.stop, 1);
+    SignalSemaphore(renderer.wake);
+    JoinThread(renderer.thread);
+    DestroySemaphore(renderer.wake);
+}
+
+void PostSnapshot(Renderer& renderer, const RenderSnapshot& snapshot)
+{
+    // the render thread drains the whole queue before it composes, a full
+    // queue only waits for the frame in flight.
+    while (!PushQueue(renderer.queue, snapshot))
+    {
+        YieldThread();
+    }
+    AtomicAdd(&renderer.posted, 1);
+    SignalSemaphore(renderer.wake);
+}
+//-----------------------------------------------------------
+
+//-----------------------Program cache-----------------------
+namespace
+{
+    // bump when the bytecode or the layout of the cache changes.
+    static const uint32_t PROGRAM_CACHE_VERSION = 2;
+    static const char PROGRAM_CACHE_MAGIC[8] = {'A', 'L', 'P', 'R', 'O', 'G', 'R', 'M'};
+
+    struct ProgramCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t opCodeCount;
+        uint64_t builtinsHash;  // the code has indices in the builtin table.
+        uint64_t sourceSize;
+        uint64_t sourceHash;
+        uint64_t payloadSize;
+        uint64_t payloadHash;   // catches truncated or partially written files.
+    };
+
+    uint64_t HashData(const void* data, size_t size)
+    {
+        StringView view;
+        view.data = (const char*)data;
+        view.size = size;
+        return Hash(view);
+    }
+
+    uint64_t HashBuiltins()
+    {
+        uint64_t h = 0;
+        for (const Builtin& builtin : builtins)
+        {
+            h = Hash(h ^ Hash(CreateStringView(builtin.name)) ^ (builtin.minArgs << 8 | builtin.maxArgs));
+        }
+        return h;
+    }
+
+    // everything but the payload.
+    ProgramCacheHeader CreateProgramCacheHeader(size_t sourceSize)
+    {
+        ProgramCacheHeader header = {};
+        memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+        header.version = PROGRAM_CACHE_VERSION;
+        header.opCodeCount = (uint32_t)OpCode::RETURN + 1;
+        header.builtinsHash = HashBuiltins();
+        header.sourceSize = sourceSize;
+        return header;
+    }
+
+    void PutU64(String& out, uint64_t v)
+    {
+        Append(out, (const char*)&v, sizeof(v));
+    }
+
+    void PutBytes(String& out, const char* data, size_t size)
+    {
+        PutU64(out, size);
+        Append(out, data, size);
+    }
+
+    // names are stored as text, the ids depend on the order they were interned.
+    void PutName(String& out, NameId id)
+    {
+        const String& name = GetName(id);
+        PutBytes(out, name.data(), name.size());
+    }
+
+    struct CacheReader
+    {
+        const char* data = NULL;
+        size_t size = 0;
+        size_t offset = 0;
+    };
+
+    bool TakeBytes(CacheReader& r, size_t size, const char*& data)
+    {
+        if (size > r.size - r.offset)
+        {
+            return false;
+        }
+        data = r.data + r.offset;
+        r.offset += size;
+        return true;
+    }
+
+    bool TakeU64(CacheReader& r, uint64_t& v)
+    {
+        const char* data = NULL;
+        if (!TakeBytes(r, sizeof(v), data))
+        {
+            return false;
+        }
+        memcpy(&v, data, sizeof(v));
+        return true;
+    }
+
+    bool TakeString(CacheReader& r, String& s)
+    {
+        uint64_t size = 0;
+        const char* data = NULL;
+        if (!TakeU64(r, size) || !TakeBytes(r, size, data))
+        {
+            return false;
+        }
+        Append(s, data, size);
+        return true;
+    }
+
+    bool TakeName(CacheReader& r, NameId& id)
+    {
+        uint64_t size = 0;
+        const char* data = NULL;
+        if (!TakeU64(r, size) || !TakeBytes(r, size, data) || !size)
+        {
+            return false;
+        }
+        id = InternName(data, size);
+        return true;
+    }
+
+    // an instruction of Program::code and the values it pops and pushes.
+    struct Instruction
+    {
+        OpCode op = OpCode::HALT;
+        size_t operandCount = 0;
+        uint32_t operands[2] = {};
+        size_t pops = 0;
+        size_t pushes = 0;
+        size_t next = 0;    // ip of the following instruction.
+    };
+
+    // false for an unknown opcode or operands past the end of the code.
+    bool DecodeInstruction(const Program& program, size_t ip, Instruction& ins)
+    {
+        ins.op = (OpCode)program.code[ip];
+        switch (ins.op)
+        {
+        case OpCode::HALT:
+        case OpCode::NONE:
+        case OpCode::POP:
+        case OpCode::PRINT_POP:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::LEFT_DIVIDE:
+        case OpCode::NEGATE:
+        case OpCode::NOT:
+        case OpCode::LESS:
+        case OpCode::GREATER:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+        case OpCode::TRUTH:
+        case OpCode::RETURN:
+            ins.operandCount = 0;
+            break;
+        case OpCode::STORE_ANS:
+        case OpCode::INDEX_END:
+        case OpCode::STORE_INDEX_GLOBAL:
+        case OpCode::STORE_INDEX_LOCAL:
+        case OpCode::CALL:
+        case OpCode::CALL_BUILTIN:
+            ins.operandCount = 2;
+            break;
+        default:
+            if (ins.op > OpCode::RETURN)
+            {
+                return false;
+            }
+            ins.operandCount = 1;
+            break;
+        }
+        ins.next = ip + 1;
+        if (program.code.size() - ins.next < 4 * ins.operandCount)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < ins.operandCount; ++i)
+        {
+            ins.operands[i] = ReadOperand(program.code.data(), ins.next);
+        }
+        const size_t count = ins.operands[ins.operandCount == 2 ? 1 : 0];
+        switch (ins.op)
+        {
+        case OpCode::NUMBER:
+        case OpCode::STRING:
+        case OpCode::NONE:
+        case OpCode::LOAD_GLOBAL:
+        case OpCode::LOAD_LOCAL:
+            ins.pushes = 1;
+            break;
+        case OpCode::POP:
+        case OpCode::PRINT_POP:
+        case OpCode::STORE_GLOBAL:
+        case OpCode::STORE_LOCAL:
+        case OpCode::STORE_ANS:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP_IF_FALSE_KEEP:
+        case OpCode::JUMP_IF_TRUE_KEEP:
+        case OpCode::RETURN:
+            ins.pops = 1;
+            break;
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::LEFT_DIVIDE:
+        case OpCode::LESS:
+        case OpCode::GREATER:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+            ins.pops = 2;
+            ins.pushes = 1;
+            break;
+        case OpCode::NEGATE:
+        case OpCode::NOT:
+        case OpCode::TRUTH:
+        case OpCode::INDEX_END:
+            ins.pops = 1;
+            ins.pushes = 1;
+            break;
+        case OpCode::MATRIX_ROW:
+        case OpCode::MATRIX_STACK:
+        case OpCode::RANGE:
+        case OpCode::CALL:
+        case OpCode::CALL_BUILTIN:
+            ins.pops = count;
+            ins.pushes = 1;
+            break;
+        case OpCode::INDEX:
+            // the indexed value is under the indices.
+            ins.pops = count + 1;
+            ins.pushes = 1;
+            break;
+        case OpCode::STORE_INDEX_GLOBAL:
+        case OpCode::STORE_INDEX_LOCAL:
+            // the value and the indices under it.
+            ins.pops = count + 1;
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    // the operands of an instruction index the tables of program, locals is
+    // the number of local slots of the code (0 outside of functions).
+    bool CheckOperands(const Program& program, const Instruction& ins, size_t locals)
+    {
+        const uint32_t operand = ins.operands[0];
+        switch (ins.op)
+        {
+        case OpCode::NUMBER:                return operand < program.numbers.size();
+        case OpCode::STRING:                return operand < program.strings.size();
+        case OpCode::LOAD_GLOBAL:
+        case OpCode::STORE_GLOBAL:
+        case OpCode::PRINT_GLOBAL:
+        case OpCode::STORE_ANS:
+        case OpCode::STORE_INDEX_GLOBAL:    return operand < program.globalNames.size();
+        case OpCode::LOAD_LOCAL:
+        case OpCode::STORE_LOCAL:
+        case OpCode::PRINT_LOCAL:
+        case OpCode::STORE_INDEX_LOCAL:     return operand < locals;
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP_IF_FALSE_KEEP:
+        case OpCode::JUMP_IF_TRUE_KEEP:     return operand < program.code.size();
+        case OpCode::RANGE:                 return operand == 2 || operand == 3;
+        case OpCode::CALL:                  return operand < program.functions.size();
+        case OpCode::CALL_BUILTIN:
+            return operand < ArrayCount(builtins) && ins.operands[1] >= builtins[operand].minArgs &&
+                ins.operands[1] <= builtins[operand].maxArgs;
+        default:                            return true;
+        }
+    }
+
+    // follows every path of the code from entry with the depth of the stack
+    // (above the locals), a loaded program can't read outside of its tables or
+    // its stack. functions end with RETURN and the top level with HALT, LINE
+    // resets the expression graph so statements start with an empty stack.
+    bool VerifyCode(const Program& program, size_t entry, const FunctionInfo* function, Array<int64_t>& depths)
+    {
+        const size_t locals = function ? function->localNames.size() : 0;
+        for (int64_t& depth : depths)
+        {
+            depth = -1;
+        }
+        Array<size_t> pending;
+        depths[entry] = 0;
+        pending.push_back(entry);
+        while (pending.size())
+        {
+            const size_t ip = pending[pending.size() - 1];
+            pending.pop_back();
+            Instruction ins;
+            if (!DecodeInstruction(program, ip, ins) || !CheckOperands(program, ins, locals) ||
+                (size_t)depths[ip] < ins.pops || (ins.op == OpCode::RETURN && !function) ||
+                (ins.op == OpCode::HALT && function) || (ins.op == OpCode::LINE && depths[ip] != 0))
+            {
+                return false;
+            }
+            const int64_t depth = depths[ip] - (int64_t)ins.pops + (int64_t)ins.pushes;
+            // JUMP_IF_*_KEEP leave the condition on the stack when they jump.
+            const bool keep = ins.op == OpCode::JUMP_IF_FALSE_KEEP || ins.op == OpCode::JUMP_IF_TRUE_KEEP;
+            size_t targets[2] = {};
+            int64_t targetDepths[2] = {};
+            size_t targetCount = 0;
+            if (ins.op == OpCode::JUMP || ins.op == OpCode::JUMP_IF_FALSE || keep)
+            {
+                targets[targetCount] = ins.operands[0];
+                targetDepths[targetCount++] = keep ? depth + 1 : depth;
+            }
+            if (ins.op != OpCode::JUMP && ins.op != OpCode::HALT && ins.op != OpCode::RETURN)
+            {
+                targets[targetCount] = ins.next;
+                targetDepths[targetCount++] = depth;
+            }
+            for (size_t i = 0; i < targetCount; ++i)
+            {
+                if (targets[i] >= program.code.size())
+                {
+                    return false;
+                }
+                if (depths[targets[i]] < 0)
+                {
+                    depths[targets[i]] = targetDepths[i];
+                    pending.push_back(targets[i]);
+                }
+                else if (depths[targets[i]] != targetDepths[i])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool VerifyCode(const Program& program)
+    {
+        if (!program.code.size())
+        {
+            return false;
+        }
+        Array<int64_t> depths;
+        depths.resize(program.code.size());
+        if (!VerifyCode(program, 0, NULL, depths))
+        {
+            return false;
+        }
+        for (const FunctionInfo& f : program.functions)
+        {
+            if (!VerifyCode(program, f.entry, &f, depths))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadProgram(CacheReader& r, Program& program)
+    {
+        uint64_t count = 0;
+        const char* data = NULL;
+        if (!TakeU64(r, count) || !TakeBytes(r, count, data))
+        {
+            return false;
+        }
+        program.code.resize(count);
+        memcpy(program.code.data(), data, count);
+        if (!TakeU64(r, count) || count > (r.size - r.offset) / sizeof(double) ||
+            !TakeBytes(r, count * sizeof(double), data))
+        {
+            return false;
+        }
+        program.numbers.resize(count);
+        memcpy(program.numbers.data(), data, count * sizeof(double));
+        if (!TakeU64(r, count))
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            String s;
+            if (!TakeString(r, s))
+            {
+                return false;
+            }
+            program.strings.push_back(s);
+        }
+        if (!TakeU64(r, count))
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            NameId id = 0;
+            if (!TakeName(r, id))
+            {
+                return false;
+            }
+            program.globalNames.push_back(id);
+        }
+        if (!TakeU64(r, count))
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            FunctionInfo f;
+            uint64_t paramCount = 0, entry = 0, localCount = 0;
+            if (!TakeName(r, f.name) || !TakeU64(r, paramCount) || !TakeU64(r, entry) || !TakeU64(r, localCount) ||
+                paramCount > localCount || entry >= program.code.size())
+            {
+                return false;
+            }
+            f.paramCount = paramCount;
+            f.entry = entry;
+            for (uint64_t j = 0; j < localCount; ++j)
+            {
+                NameId id = 0;
+                if (!TakeName(r, id))
+                {
+                    return false;
+                }
+                f.localNames.push_back(id);
+            }
+            program.functions.push_back(f);
+        }
+        return r.offset == r.size && VerifyCode(program);
+    }
+}
+
+bool SaveProgramCache(const char* fileName, const Program& program, const char* source, size_t sourceSize)
+{
+    String payload;
+    PutBytes(payload, (const char*)program.code.data(), program.code.size());
+    PutU64(payload, program.numbers.size());
+    Append(payload, (const char*)program.numbers.data(), program.numbers.size() * sizeof(double));
+    PutU64(payload, program.strings.size());
+    for (const String& s : program.strings)
+    {
+        PutBytes(payload, s.data(), s.size());
+    }
+    PutU64(payload, program.globalNames.size());
+    for (NameId id : program.globalNames)
+    {
+        PutName(payload, id);
+    }
+    PutU64(payload, program.functions.size());
+    for (const FunctionInfo& f : program.functions)
+    {
+        PutName(payload, f.name);
+        PutU64(payload, f.paramCount);
+        PutU64(payload, f.entry);
+        PutU64(payload, f.localNames.size());
+        for (NameId id : f.localNames)
+        {
+            PutName(payload, id);
+        }
+    }
+
+    ProgramCacheHeader header = CreateProgramCacheHeader(sourceSize);
+    header.sourceHash = HashData(source, sourceSize);
+    header.payloadSize = payload.size();
+    header.payloadHash = HashData(payload.data(), payload.size());
+
+    // written next to it and renamed so concurrent runs never map a partial file.
+    const UUId uuid = GenerateUUID();
+    String tempName;
+    Append(tempName, fileName);
+    char suffix[40] = {};
+    snprintf(suffix, sizeof(suffix), ".%02x%02x%02x%02x%02x%02x%02x%02x.tmp", uuid.data[0], uuid.data[1],
+             uuid.data[2], uuid.data[3], uuid.data[4], uuid.data[5], uuid.data[6], uuid.data[7]);
+    Append(tempName, suffix);
+    Append(tempName, '\0');
+    FileWriter writer;
+    if (!OpenFileWriter(writer, tempName.data(), sizeof(header) + payload.size()))
+    {
+        return false;
+    }
+    WriteToFile(writer, &header, sizeof(header));
+    WriteToFile(writer, payload.data(), payload.size());
+    bool success = CloseFileWriter(writer);
+    if (success && rename(tempName.data(), fileName) != 0)
+    {
+        // rename doesn't replace an existing file on windows.
+        remove(fileName);
+        success = rename(tempName.data(), fileName) == 0;
+    }
+    if (!success)
+    {
+        remove(tempName.data());
+    }
+    return success;
+}
+
+bool LoadProgramCache(const char* fileName, const char* source, size_t sourceSize, Program& program)
+{
+    GEDO_PROFILE_ZONE("LoadProgramCache");
+    MemoryBlock file = MapFile(fileName);
+    if (!file.size)
+    {
+        return false;
+    }
+    defer(UnmapFile(file));
+    ProgramCacheHeader header = {};
+    if (file.size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    // the cheap checks first, a stale cache usually has another source size.
+    const ProgramCacheHeader expected = CreateProgramCacheHeader(sourceSize);
+    const char* payload = (const char*)file.data + sizeof(header);
+    if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+        header.opCodeCount != expected.opCodeCount || header.builtinsHash != expected.builtinsHash ||
+        header.sourceSize != expected.sourceSize || header.payloadSize != file.size - sizeof(header) ||
+        header.sourceHash != HashData(source, sourceSize) ||
+        header.payloadHash != HashData(payload, header.payloadSize))
+    {
+        return false;
+    }
+    CacheReader reader;
+    reader.data = payload;
+    reader.size = header.payloadSize;
+    program = Program();
+    if (!ReadProgram(reader, program))
+    {
+        program = Program();
+        return false;
+    }
+    return true;
+}
+//-----------------------------------------------------------
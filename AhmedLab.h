@@ -1,14 +1,103 @@
 ﻿/*
+The language:
+- every value is a matrix, scalars are 1 X 1 matrices. the elements are
+  doubles unless they are converted by single(x), int32(x) or uint8(x),
+  double(x) converts back. integers are rounded and saturated.
+- a statement ends with a new line, ',' or ';', the result of a statement is
+  printed unless it ends with ';', expressions that are not assigned are
+  stored in ans.
+    x = 2 * (3 + 4)
+    m = [1, 2; 3, 4];
+- +, -, /, <, >, <=, >=, ==, != and ! element wise, && and || short circuit,
+  * is the matrix product unless one side is a scalar. the operands of the
+  element wise operators broadcast: a dimension of 1 is repeated to match the
+  other operand, so m - r with a (1 X n) row r subtracts it from every row
+  of m and [1; 2] + [10, 20] is [11, 21; 12, 22].
+- a \ b solves a * x = b like MATLAB: triangular and symmetric positive
+  definite a are detected and the others use LU with partial pivoting, a
+  with more rows than columns gives the least squares x and with less the
+  minimum norm one. a warning is printed when a is singular. for a scalar a
+  it is b / a. a single \ is the operator, \\ starts a comment.
+- the result of an operation has the type of its operands, mixed operands
+  are promoted: integers win over floats and single over double (uint8(200) +
+  1.5 is uint8(202)), int32 over uint8. every operation is rounded to its type
+  so uint8 saturates at each step.
+- blocks:
+    if x > 1 ... elif x < 0 ... else ... end
+    while i < 10 ... end
+    func name(a, b) ... return a + b ... end
+  functions only see their arguments and their own variables.
+- builtins: zeros, ones, eye, abs, sin, cos, tan, asin, acos, atan, exp,
+  log, sqrt, pow, double, single, int32, uint8, transpose, sum, min, max,
+  sort, sortrows, unique, find, ismember, inv, det, lu, chol, qr, sparse,
+  full, nnz, issparse, imshow, plot, figure, rows, cols, numel, threads. the
+  math functions use SIMD polynomials when the CPU has AVX2, see the error
+  bounds in Gedo.h.
+- sort(m) sorts each column (a vector as a whole), sortrows(m) orders the
+  rows, unique(m) gives the distinct elements sorted and NaNs go last.
+  find(m) gives the 1 based column major indices of the elements that are
+  not 0 and ismember(a, s) is 1 where the element of a is in s.
+- inv(a) and det(a) take a square a, lu(a) gives L and U of the rows of a
+  reordered by partial pivoting in one matrix (L below the diagonal without
+  its unit diagonal), chol(a) the upper R with transpose(R) * R = a and qr(a)
+  the R of a = Q * R. they compute in double, single operands give single.
+- sparse(m) stores the elements of m that are not 0 (CSR), sparse(r, c) is an
+  empty r X c and sparse(i, j, v, r, c) puts v(k) at (i(k), j(k)) with 1
+  based indices, duplicates are added and r, c default to the largest
+  indices. full(s) gives the dense matrix, nnz(m) counts the elements that
+  are not 0 and issparse(m) is 1 for sparse matrices. *, + and - of sparse
+  operands stay sparse (a dense operand gives a dense result), so does
+  scaling and dividing by a scalar, -s and transpose(s). the other
+  operations and builtins use full(s) and fail when it has more than 64M
+  elements. sparse matrices are saved as sparse.
+- indices are 1 based, m(i) is the i-th element in column major order and
+  m(i, j) the element at row i and col j. an index can be a vector, a range
+  first:last or first:step:last, : for the whole dimension and end for its
+  size, m(2:end, :) drops the first row. the result of a comparison or ! is
+  logical and indexes as a mask with the shape of m (or a row or column as
+  long as the dimension), m(m > 0) gives the elements where it is 1 and
+  m(m < 0) = 0 clears the others. other matrices of 0 and 1 are positions,
+  v([1, 1]) repeats the first element. ranges with
+  a positive step give views of m, assigning to an index copies a shared m
+  first and grows it with zeros. a name that is a function or a builtin is
+  called, not indexed.
+- matrices share their data, b = a and transpose(a) don't copy a.
+- numbers are printed with the shortest digits that read back as the same
+  value, matrices with more than 1000 elements only print their corners.
+- save("file", "a", ...) and load("file", "a") store matrices in the binary
+  matrix file format of Gedo, without names they save/restore the workspace.
+- csvread("file") reads a matrix of comma separated numbers, one row per
+  line, csvread("file", r, c) skips r lines and c fields of every line (a
+  header or labels). dlmread("file", delimiter, r, c) does the same with
+  any delimiter, "\t" is a tab and " " runs of spaces, without it the first
+  ',', ';' or tab of the first line is used. empty and missing fields are 0.
+- imread("file") reads a PGM/PPM image as its gray or r, g, b planes stacked
+  vertically with values in [0, 255], imread("a", "b", ...) decodes images of
+  the same size in parallel, one per row. imwrite("file.ppm", m) writes them.
+- imshow(m) shows a gray image with values in [0, 255], imshow(m, 3) the r, g,
+  b planes stacked vertically. plot(y) draws the columns of y (a vector as a
+  whole) against 1, 2, ... and plot(x, y) against x. figure(n) selects the
+  figure they draw to. the frames are composed on a render thread, the lab
+  writes figure<n>.ppm until there is a GUI.
+- profile on|off|report|tree|reset|trace file as the whole input controls the
+  profiler, report prints the calls, elements, time and allocated bytes of the
+  hottest lines (numbered across the inputs of the session) and builtins
+  followed by the zones of the interpreter, tree
+  prints the zones nested and trace writes them as chrome trace json.
+
+Input goes through Tokenize -> Compile -> Execute, Compile emits bytecode for a
+stack based VM without building a tree, variables are resolved to slots at
+compile time (global slots are linked to State::vars on first use, function
+variables live in the call frame) and control flow compiles to jumps.
+"AhmedLab file" keeps the compiled program in file.cache and reuses it while
+the file doesn't change, --no-cache disables it.
+
 TODO:
-- Finish lexer.
-- Finish parser.
-- Finish code interpretor.
 - Add GUI using imgui.
 - Add builtin functions.
-- Add imread, imwrite support.
+- Add PNG and JPEG to imread, imwrite.
 - Add image rendering support.
 - Add plot support.
-- Add read, write support.
 */
 
 #pragma once
@@ -17,15 +106,75 @@ TODO:
 using namespace gedo;
 
 //-----------------------state-------------------------------
+// identifiers are interned when they are tokenized, the same name always maps
+// to the same id so lookups compare ids instead of strings.
+typedef uint32_t NameId;
+
+NameId InternName(const char* name, size_t length);
+NameId InternName(const char* name);
+// returns false when the name was never interned.
+bool LookupName(const char* name, NameId& id);
+const String& GetName(NameId id);
+
 struct Variable
 {
+    NameId id = 0;
     String name;
-    Matrix value;
+    Matrix value;           // empty when isSparse.
+    bool isSparse = false;
+    SparseMatrix sparse;    // when isSparse.
+    bool isLogical = false; // the result of a comparison or !, indexing uses it as a mask.
 };
 
+// "profile on" counters, each execution of a line or a builtin adds to one.
+struct ExecutionCounter
+{
+    int64_t count = 0;
+    int64_t elements = 0;       // elements of the values it consumed or produced.
+    int64_t nanoseconds = 0;
+    size_t bytes = 0;           // allocated, mostly temporaries.
+};
+
+struct ExecutionProfile
+{
+    bool enabled = false;
+    // index is the line number in the session, the lines of the earlier
+    // inputs come first (the line in the file for a script).
+    Array<ExecutionCounter> lines;
+    Array<ExecutionCounter> builtins;   // index in the builtin table.
+    // the element wise operators are fused and run when their result is used,
+    // their work is counted in elementWise. builtins include the evaluation of
+    // their arguments.
+    ExecutionCounter products;
+    ExecutionCounter solves;
+    ExecutionCounter elementWise;
+    ExecutionCounter concats;
+};
+
+struct Renderer;
+struct Session;
+
 struct State
 {
     Array<Variable> vars;
+    HashTable<NameId, size_t> indices;  // Variable::id -> index in vars.
+    // threads used by the matrix kernels, 0 means all the hardware threads.
+    size_t threadCount = 0;
+    // temporaries of the running program, created by the first Execute().
+    ScratchAllocator* scratch = NULL;
+    ExecutionProfile profile;
+    // imshow and plot post their frames to it, they fail without one.
+    Renderer* renderer = NULL;
+    size_t figure = 1;                  // set by figure(n).
+    // the compiled functions and global slots of the inputs, created by the
+    // first ProcessInput().
+    Session* session = NULL;
+
+    State() = default;
+    // frees the variables, the scratch arena and the session.
+    ~State();
+    State(const State&) = delete;
+    State& operator=(const State&) = delete;
 };
 
 enum class MessageLevel
@@ -34,15 +183,85 @@ enum class MessageLevel
 };
 
 void PrintMessage(MessageLevel level, const char* message);
+// the functions defined by an input can be called by the next ones.
 void ProcessInput(State& state, const char* input);
+// input doesn't need to be null terminated (e.g. a mapped file).
+void ProcessInput(State& state, const char* input, size_t size);
+// false while input opens a block or a bracket that it doesn't close, the
+// interactive mode reads more lines until it is complete. a stray closing
+// bracket makes it complete so the compiler reports it.
+bool IsInputComplete(const char* input, size_t size);
 
 const Variable* FindVariable(const State& state, const char* name);
 Variable* FindVariable(State& state, const char* name);
+const Variable* FindVariable(const State& state, NameId id);
+Variable* FindVariable(State& state, NameId id);
 void PrintVariable(const Variable& var);
+// the lines, builtins and operators that took most of the time, share is the
+// percent of the time of all the lines.
+void PrintExecutionProfile(const ExecutionProfile& profile);
 Variable* AddVariable(State& state, const char* name, Matrix data);
+Variable* AddVariable(State& state, NameId id, Matrix data);
+Variable* AddVariable(State& state, const char* name, SparseMatrix data);
+Variable* AddVariable(State& state, NameId id, SparseMatrix data);
+// evaluates node root of the expression in one pass and stores it.
+Variable* AddVariable(State& state, const char* name, const MatrixExpression& expression, size_t root);
+Variable* AddVariable(State& state, NameId id, const MatrixExpression& expression, size_t root);
 void DeleteVariable(State& state, const char* name);
 //-----------------------------------------------------------
 
+//---------------------------Rendering-----------------------
+// the interpreter posts immutable snapshots (shares of the matrices) to a
+// render thread and keeps running while the frames are composed. the render
+// thread drains the queue, keeps the last snapshot of every figure and only
+// composes those so fast updates are coalesced. composing doesn't use the
+// thread pool but the present function can (e.g. WriteImage()), threads(n)
+// then waits for it to finish.
+enum class SnapshotType
+{
+    IMAGE,  // y is the planes of the image, values in [0, 255].
+    PLOT    // the columns of y against x.
+};
+
+struct RenderSnapshot
+{
+    SnapshotType type = SnapshotType::IMAGE;
+    size_t figure = 1;
+    size_t channels = 1;    // IMAGE: 1 or 3.
+    Matrix x;               // PLOT: empty for 1, 2, ..., y.rows.
+    Matrix y;
+};
+
+// called on the render thread, frame is only valid during the call.
+typedef void (*PresentFunction)(void* userData, size_t figure, const ColorBitmap& frame);
+
+static const size_t RENDER_QUEUE_SIZE = 64;
+static const size_t PLOT_WIDTH = 640;
+static const size_t PLOT_HEIGHT = 480;
+
+struct Renderer
+{
+    SpscQueue<RenderSnapshot, RENDER_QUEUE_SIZE> queue;
+    Semaphore wake;
+    Thread thread;
+    volatile int64_t stop = 0;
+    PresentFunction present = NULL;
+    void* userData = NULL;
+    // presented <= posted, the difference was coalesced.
+    volatile int64_t posted = 0;
+    volatile int64_t presented = 0;
+};
+
+void StartRenderer(Renderer& renderer, PresentFunction present, void* userData);
+// presents the snapshots that are still queued and joins the thread.
+void StopRenderer(Renderer& renderer);
+// takes the ownership of the matrices of snapshot, they must not be written
+// after it. it only waits when RENDER_QUEUE_SIZE - 1 snapshots are queued.
+void PostSnapshot(Renderer& renderer, const RenderSnapshot& snapshot);
+// composes the frame of a snapshot, it is freed with FreeColorBitmap.
+ColorBitmap ComposeFrame(const RenderSnapshot& snapshot);
+//-----------------------------------------------------------
+
 //---------------------------Parsing-------------------------
 enum class TokenType
 {
@@ -51,6 +270,8 @@ enum class TokenType
     KEYWORD_FUNC,
     KEYWORD_ELSE,
     KEYWORD_WHILE,
+    KEYWORD_END,
+    KEYWORD_RETURN,
     IDENTIFIER,
     NUMERIC_LITERAL,
     STRING_LITERAL,
@@ -69,11 +290,13 @@ enum class TokenType
     OPERATOR_MINUS,
     OPERATOR_MULTIPLY,
     OPERATOR_DIVIDE,
+    OPERATOR_LEFT_DIVIDE,   // \ (solve)
     OPERATOR_ASSIGN,
     //
     LEFT_PARAN,
     RIGHT_PARAN,
     COMMA,
+    COLON,
     SEMICOL,
     LEFT_SQUARE_BRACKET,
     RIGHT_SQUARE_BRACKET
@@ -82,10 +305,13 @@ enum class TokenType
 struct Token
 {
     TokenType type;
-    // data.
-    String name;            // when type == IDENTIFIER.
-    double numericLiteral;  // when type == NUMERIC_LITERAL.
-    String stringLiteral;   // when type == STRING_LITERAL.
+    size_t line = 0;        // 1 based.
+    size_t offset = 0;      // offset of the first character in the input.
+    // data, the views point into the tokenized input.
+    StringView name;            // when type == IDENTIFIER.
+    NameId id = 0;              // interned name when type == IDENTIFIER.
+    double numericLiteral = 0;  // when type == NUMERIC_LITERAL.
+    StringView stringLiteral;   // when type == STRING_LITERAL.
 };
 
 struct LexerResult
@@ -95,6 +321,112 @@ struct LexerResult
     size_t errorLocation = 0;
 };
 
+// the tokens reference buffer.data so it must outlive them.
 LexerResult Tokenize(Buffer& buffer);
 
 //-----------------------------------------------------------
+
+//---------------------------Compiler------------------------
+// operands are 32 bit little endian values that follow the opcode.
+enum class OpCode : uint8_t
+{
+    HALT,
+    LINE,               // line: a new statement starts.
+    NUMBER,             // index: push Program::numbers[index].
+    STRING,             // index: push Program::strings[index].
+    NONE,               // push an empty value (functions without return).
+    POP,
+    LOAD_GLOBAL,        // slot
+    STORE_GLOBAL,       // slot: pops the value.
+    PRINT_GLOBAL,       // slot
+    STORE_ANS,          // slot, print: pops into the global slot unless it is empty.
+    LOAD_LOCAL,         // slot
+    STORE_LOCAL,        // slot
+    PRINT_LOCAL,        // slot
+    PRINT_POP,          // print the top value as ans and pop it.
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    LEFT_DIVIDE,
+    NEGATE,
+    NOT,
+    LESS,
+    GREATER,
+    LESS_EQUAL,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    TRUTH,              // replace the top value by 1 or 0.
+    JUMP,               // target
+    JUMP_IF_FALSE,      // target: pops the condition.
+    JUMP_IF_FALSE_KEEP, // target: keeps 0 on the stack when jumping, pops otherwise.
+    JUMP_IF_TRUE_KEEP,  // target: keeps 1 on the stack when jumping, pops otherwise.
+    MATRIX_ROW,         // count: concatenate the top count values horizontally.
+    MATRIX_STACK,       // count: concatenate the top count values vertically.
+    RANGE,              // count: first:last or first:step:last from the top 2 or 3 values.
+    INDEX,              // count: index the value under the top count values by them.
+    INDEX_END,          // dimension, count: replace the top value by its size, end in an index.
+    STORE_INDEX_GLOBAL, // slot, count: pops the value and the count indices under it.
+    STORE_INDEX_LOCAL,  // slot, count
+    CALL,               // function, argument count
+    CALL_BUILTIN,       // builtin, argument count
+    RETURN              // pops the return value.
+};
+
+struct FunctionInfo
+{
+    NameId name = 0;
+    size_t paramCount = 0;
+    Array<NameId> localNames;   // parameters first.
+    size_t entry = 0;           // offset in Program::code.
+    size_t lineBase = 0;        // lines of the session before its input.
+};
+
+struct Program
+{
+    Array<uint8_t> code;
+    Array<double> numbers;
+    Array<String> strings;
+    Array<NameId> globalNames;
+    Array<FunctionInfo> functions;
+};
+
+// the front end of ProcessInput, every input is compiled at the end of the
+// same program so the functions of the earlier inputs stay defined. the names
+// are interned once for the whole process.
+struct Session
+{
+    Program program;
+    HashTable<NameId, size_t> globalSlots;  // name -> index in Program::globalNames.
+    HashTable<NameId, size_t> functions;    // name -> index in Program::functions.
+    size_t lineCount = 0;                   // lines of the inputs processed so far.
+};
+
+struct CompileResult
+{
+    bool success = false;
+    size_t errorLine = 0;
+    char errorMessage[200] = {};
+};
+
+CompileResult Compile(const LexerResult& lexResult, Program& program);
+// compiles the input at the end of session.program, its code starts at entry.
+// a function of an earlier input can be defined again, the code compiled
+// before calls the new one. nothing changes when it fails.
+CompileResult Compile(const LexerResult& lexResult, Session& session, size_t& entry);
+// runs the program from entry on state, prints runtime errors and stops at
+// the first one. the profile counts its lines after lineBase lines.
+bool Execute(State& state, const Program& program, size_t entry = 0, size_t lineBase = 0);
+
+// compiled programs can be cached in a file, it is only used for a source
+// with the same size and hash compiled by the same version of the interpreter.
+bool SaveProgramCache(const char* fileName, const Program& program, const char* source, size_t sourceSize);
+// false when the file is missing, damaged or made from another source. the
+// operands, jump targets and stack use of the code are checked before it is
+// used, a program that fails the checks is compiled again.
+bool LoadProgramCache(const char* fileName, const char* source, size_t sourceSize, Program& program);
+// ProcessInput for a script, the program is cached in cacheFile (NULL to
+// always compile) and a stale cache is replaced.
+void ProcessScript(State& state, const char* input, size_t size, const char* cacheFile);
+//-----------------------------------------------------------
@@ -1,6 +1,7 @@
 ﻿#include "Gedo.h"
 
 #include <math.h>
+#include <stdlib.h> // strtod
 
 #if defined GEDO_OS_WINDOWS
 #define UNICODE
@@ -20,10 +21,38 @@
 #include <stdio.h>
 #include <uuid/uuid.h> // user will have to link against libuuid.
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
 #else
 #error "Not supported OS"
 #endif
 
+#if defined GEDO_ARCH_X86
+#include <immintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined GEDO_ARCH_ARM64
+#include <arm_neon.h>
+#endif
+
+// functions marked with these are compiled for the given instruction set and
+// must only be called after checking GetCpuFeatures().
+#if defined _MSC_VER
+#define GEDO_TARGET_SSE2
+#define GEDO_TARGET_AVX2
+#define GEDO_TARGET_AVX512
+#else
+#define GEDO_TARGET_SSE2 __attribute__((target("sse2")))
+#define GEDO_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define GEDO_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
 namespace gedo
 {
     //----------------------------Memory-------------------------//
@@ -39,9 +68,23 @@ namespace gedo
         defaultAllocator = &allocator;
     }
 
+    // bytes requested by the calling thread, the profiler charges the difference
+    // to the open zones.
+    static thread_local size_t threadAllocatedBytes = 0;
+    static thread_local size_t threadAllocationCount = 0;
+
     MemoryBlock Allocate(size_t bytes, Allocator& allocator)
     {
-        return allocator.AllocateMemoryBlock(bytes);
+        threadAllocatedBytes += bytes;
+        threadAllocationCount++;
+        return allocator.AllocateMemoryBlock(bytes, true);
+    }
+
+    MemoryBlock AllocateUninitialized(size_t bytes, Allocator& allocator)
+    {
+        threadAllocatedBytes += bytes;
+        threadAllocationCount++;
+        return allocator.AllocateMemoryBlock(bytes, false);
     }
 
     bool Deallocate(MemoryBlock& block, Allocator& allocator)
@@ -49,6 +92,23 @@ namespace gedo
         return allocator.FreeMemoryBlock(block);
     }
 
+    size_t GetAllocatedBytes()
+    {
+        return threadAllocatedBytes;
+    }
+
+    size_t GetAllocationCount()
+    {
+        return threadAllocationCount;
+    }
+
+    bool Reallocate(MemoryBlock& block, size_t bytes, Allocator& allocator)
+    {
+        threadAllocatedBytes += bytes > block.size ? bytes - block.size : 0;
+        threadAllocationCount++;
+        return allocator.ReallocateMemoryBlock(block, bytes, false);
+    }
+
     bool IsPointerInsideMemoryBlock(const uint8_t* ptr, MemoryBlock block)
     {
         const uint8_t* begin = block.data;
@@ -58,8 +118,9 @@ namespace gedo
 
     bool IsMemoryBlockInside(MemoryBlock big, MemoryBlock small)
     {
+        // small can end at the end of big.
         return IsPointerInsideMemoryBlock(small.data, big) &&
-            IsPointerInsideMemoryBlock(small.data + small.size, big);
+            small.data + small.size <= big.data + big.size;
     }
 
     void ZeroMemoryBlock(MemoryBlock block)
@@ -92,7 +153,6 @@ namespace gedo
         LinearAllocator* allocator = new LinearAllocator();
         allocator->arena.data = (uint8_t*)GEDO_MALLOC(bytes);
         allocator->arena.size = bytes;
-        ZeroMemoryBlock(allocator->arena);
         return allocator;
     }
 
@@ -111,15 +171,20 @@ namespace gedo
         offset = 0;
     }
 
-    MemoryBlock LinearAllocator::AllocateMemoryBlock(size_t bytes)
+    MemoryBlock LinearAllocator::AllocateMemoryBlock(size_t bytes, bool zeroFill)
     {
         MemoryBlock result;
-        if ((offset + bytes) <= arena.size)
+        const uintptr_t address = (uintptr_t)(arena.data + offset);
+        const size_t padding = (LINEAR_ALLOCATOR_ALIGNMENT - address % LINEAR_ALLOCATOR_ALIGNMENT) % LINEAR_ALLOCATOR_ALIGNMENT;
+        if (offset + padding <= arena.size && bytes <= arena.size - offset - padding)
         {
             result.size = bytes;
-            result.data = offset + arena.data;
-            offset += bytes;
-            ZeroMemoryBlock(result);
+            result.data = arena.data + offset + padding;
+            offset += padding + bytes;
+            if (zeroFill)
+            {
+                ZeroMemoryBlock(result);
+            }
             return result;
         }
         GEDO_ASSERT_MSG("don't have enough space.");
@@ -138,6 +203,19 @@ namespace gedo
         return false;
     }
 
+    // only the last block can change its size.
+    bool LinearAllocator::ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool)
+    {
+        if (block.data >= arena.data && block.data + block.size == arena.data + offset &&
+            bytes <= arena.size - (block.data - arena.data))
+        {
+            offset = (block.data - arena.data) + bytes;
+            block.size = bytes;
+            return true;
+        }
+        return false;
+    }
+
     MallocAllocator* CreateMallocAllocator()
     {
         MallocAllocator* allocator = new MallocAllocator();
@@ -154,7 +232,7 @@ namespace gedo
     {
     }
 
-    MemoryBlock MallocAllocator::AllocateMemoryBlock(size_t bytes)
+    MemoryBlock MallocAllocator::AllocateMemoryBlock(size_t bytes, bool zeroFill)
     {
         MemoryBlock result;
         result.data = (uint8_t*)GEDO_MALLOC(bytes);
@@ -163,7 +241,10 @@ namespace gedo
             GEDO_ASSERT_MSG("don't have enough space.");
         }
         result.size = bytes;
-        ZeroMemoryBlock(result);
+        if (zeroFill)
+        {
+            ZeroMemoryBlock(result);
+        }
         return result;
     }
 
@@ -175,1542 +256,9146 @@ namespace gedo
         block.data = NULL;
         return true;
     }
-    //-----------------------------------------------------------//
 
-    //-------------------------Bitmap manipulation---------------//
-    void FillRectangle(ColorBitmap& dest, Rect fillArea, const ColorBitmap& src)
+    bool MallocAllocator::ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace)
     {
-        uint32_t srcIdx = 0;
-        for (uint32_t y = fillArea.y; y < (fillArea.y + fillArea.height); ++y)
+        // realloc can't promise to keep the address.
+        if (inPlace || !bytes)
         {
-            for (uint32_t x = fillArea.x; x < (fillArea.x + fillArea.width); ++x)
-            {
-                const uint32_t index = y * dest.width + x;
-                dest.data[index] = src.data[srcIdx++];
-            }
+            return false;
         }
-    }
-
-    void FillRectangle(ColorBitmap& dest, Rect fillArea, const Bitmap& mask, Color c)
-    {
-        uint32_t srcIdx = 0;
-        for (uint32_t y = fillArea.y; y < (fillArea.y + fillArea.height); ++y)
+        uint8_t* data = (uint8_t*)GEDO_REALLOC(block.data, bytes);
+        if (!data)
         {
-            for (uint32_t x = fillArea.x; x < (fillArea.x + fillArea.width); ++x)
-            {
-                const uint32_t index = y * dest.width + x;
-                if (mask.data[srcIdx++])
-                {
-                    dest.data[index] = c;
-                }
-            }
+            return false;
         }
+        block.data = data;
+        block.size = bytes;
+        return true;
     }
 
-    void FillRectangle(ColorBitmap& dest, Rect fillArea, Color color)
+    ScratchAllocator* CreateScratchAllocator(size_t bytes, Allocator& fallback)
     {
-        for (uint32_t y = fillArea.y; y < (fillArea.y + fillArea.height); ++y)
-        {
-            for (uint32_t x = fillArea.x; x < (fillArea.x + fillArea.width); ++x)
-            {
-                const uint32_t index = y * dest.width + x;
-                dest.data[index] = color;
-            }
-        }
+        ScratchAllocator* allocator = new ScratchAllocator();
+        allocator->arena = CreateLinearAllocator(bytes);
+        allocator->fallback = &fallback;
+        return allocator;
     }
 
-    Color CreateColor(uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+    void FreeScratchAllocator(ScratchAllocator* allocator)
     {
-        Color c;
-        c.r = red;
-        c.g = green;
-        c.b = blue;
-        c.a = alpha;
-        return c;
+        GEDO_ASSERT(allocator);
+        GEDO_ASSERT(!allocator->liveBlocks);
+        FreeLinearAllocator(allocator->arena);
+        delete allocator;
     }
 
-    ColorBitmap CreateColorBitmap(size_t width, size_t height, Allocator& allocator)
+    void ScratchAllocator::ResetAllocator()
     {
-        ColorBitmap result;
-        result.width = width;
-        result.height = height;
-        MemoryBlock block = Allocate(sizeof(Color) * width * height, allocator);
-        GEDO_ASSERT(block.data);
-        result.data = (Color*)block.data;
-        return result;
+        GEDO_ASSERT(!liveBlocks);
+        arena->ResetAllocator();
     }
 
-    void FreeColorBitmap(ColorBitmap& bitmap, Allocator& allocator)
+    MemoryBlock ScratchAllocator::AllocateMemoryBlock(size_t bytes, bool zeroFill)
     {
-        GEDO_ASSERT(bitmap.data);
-        MemoryBlock block;
-        block.data = (uint8_t*)bitmap.data;
-        block.size = bitmap.width * bitmap.height * sizeof(Color);
-        Deallocate(block, allocator);
-        bitmap.data = NULL;
+        const size_t available = arena->arena.size - arena->offset;
+        if (available >= LINEAR_ALLOCATOR_ALIGNMENT && bytes <= available - LINEAR_ALLOCATOR_ALIGNMENT)
+        {
+            liveBlocks++;
+            return arena->AllocateMemoryBlock(bytes, zeroFill);
+        }
+        return fallback->AllocateMemoryBlock(bytes, zeroFill);
     }
 
-    Bitmap CreateBitmap(size_t width, size_t height, Allocator& allocator)
+    bool ScratchAllocator::FreeMemoryBlock(MemoryBlock& block)
     {
-        Bitmap result;
-        result.width = width;
-        result.height = height;
-        MemoryBlock block = Allocate(sizeof(uint8_t) * width * height, allocator);
-        GEDO_ASSERT(block.data);
-        result.data = (uint8_t*)block.data;
-        return result;
+        if (arena->FreeMemoryBlock(block))
+        {
+            GEDO_ASSERT(liveBlocks);
+            liveBlocks--;
+            return true;
+        }
+        return fallback->FreeMemoryBlock(block);
     }
 
-    void FreeBitmap(Bitmap& bitmap, Allocator& allocator)
+    bool ScratchAllocator::ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace)
     {
-        GEDO_ASSERT(bitmap.data);
-        MemoryBlock block;
-        block.data = (uint8_t*)bitmap.data;
-        block.size = bitmap.width * bitmap.height * sizeof(uint8_t);
-        Deallocate(block, allocator);
-        bitmap.data = NULL;
+        if (IsPointerInsideMemoryBlock(block.data, arena->arena))
+        {
+            return arena->ReallocateMemoryBlock(block, bytes, inPlace);
+        }
+        return fallback->ReallocateMemoryBlock(block, bytes, inPlace);
     }
-    //-----------------------------------------------------------//
 
-    //--------------------------------File IO---------------------//
-#if defined GEDO_OS_WINDOWS
-    struct Utf16String
+    // every pool block starts with a header, it keeps the payload 16 byte
+    // aligned and links the block while it is free.
+    struct PoolBlockHeader
     {
-        Allocator* allocator = &GetDefaultAllocator();
-        MemoryBlock memory;
-        wchar_t* text = NULL;
-        size_t size = 0;
+        uint64_t sizeClass;
+        PoolBlockHeader* next;
     };
 
-    static void FreeUtf16String(Utf16String& w)
+    // sizes of the slots including the header, about 4 classes per power of 2.
+    static const uint32_t POOL_SLOT_SIZES[] = {
+        32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096,
+        5120, 6144, 7168, 8192};
+    static const size_t POOL_CLASS_COUNT = sizeof(POOL_SLOT_SIZES) / sizeof(POOL_SLOT_SIZES[0]);
+    static const uint64_t POOL_LARGE_CLASS = ~0ULL;
+    static const size_t POOL_CHUNK_SIZE = 256 * 1024;
+    // blocks moved between a thread cache and the shared list at once, a cache
+    // keeps at most 2 batches per class.
+    static const uint32_t POOL_BATCH_SIZE = 32;
+
+    static_assert(sizeof(PoolBlockHeader) == 16, "pool blocks must stay 16 byte aligned.");
+    static_assert(POOL_MAX_BLOCK_SIZE + sizeof(PoolBlockHeader) == 8192, "POOL_MAX_BLOCK_SIZE must match the last class.");
+
+    struct PoolSizeClass
+    {
+        Mutex mutex;
+        PoolBlockHeader* freeList = NULL;
+        uint8_t* chunks = NULL;     // linked through their first 16 bytes.
+    };
+
+    // blocks left in the cache of a thread that exits without
+    // FlushPoolThreadCache() go back to the OS with the chunks in
+    // FreePoolAllocator().
+    struct PoolThreadCache
     {
-        if (w.memory.data)
-        {
-            Deallocate(w.memory, *w.allocator);
-        }
-    }
+        int64_t poolId = 0;
+        PoolAllocator* pool = NULL;
+        PoolBlockHeader* lists[POOL_CLASS_COUNT] = {};
+        uint32_t counts[POOL_CLASS_COUNT] = {};
+        PoolAllocatorStats stats;   // not added to the pool yet.
+    };
 
-    static Utf16String UTF8ToUTF16(const char* fileName, Allocator& allocator)
+    static thread_local PoolThreadCache poolThreadCache;
+    static volatile int64_t poolIdCounter = 0;
+
+    static size_t GetPoolClass(size_t slotSize)
     {
-        const size_t len = strlen(fileName);
-        const size_t wlen = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, fileName, len, NULL, 0);
-        Utf16String result;
-        result.allocator = &allocator;
-        result.memory = Allocate(sizeof(wchar_t) * (wlen + 1), allocator);
-        result.text = (wchar_t*)result.memory.data;
-        result.size = wlen;
-        ZeroMemoryBlock(result.memory);
-        MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, fileName, len, result.text, result.size);
-        return result;
+        struct ClassTable
+        {
+            uint8_t classes[8192 / 16 + 1];
+            ClassTable()
+            {
+                size_t c = 0;
+                for (size_t i = 0; i < ArrayCount(classes); ++i)
+                {
+                    while (POOL_SLOT_SIZES[c] < i * 16)
+                    {
+                        c++;
+                    }
+                    classes[i] = (uint8_t)c;
+                }
+            }
+        };
+        static const ClassTable table;
+        return table.classes[(slotSize + 15) / 16];
     }
 
-    static HANDLE GetFileHandle(const char* fileName, bool read, Allocator& allocator)
+    // called with the class locked.
+    static void AddPoolChunk(PoolAllocator& allocator, size_t sizeClass)
     {
-        if (!fileName)
-        {
-            return NULL;
-        }
-        Utf16String string = UTF8ToUTF16(fileName, allocator);
-        defer(FreeUtf16String(string));
-        HANDLE handle = NULL;
-        if (read)
+        PoolSizeClass& c = allocator.classes[sizeClass];
+        uint8_t* chunk = (uint8_t*)GEDO_MALLOC(POOL_CHUNK_SIZE);
+        if (!chunk)
         {
-            handle = CreateFile(string.text,     // file to open
-                                GENERIC_READ,    // open for reading
-                                FILE_SHARE_READ, // share for reading
-                                NULL,            // default security
-                                OPEN_EXISTING,   // existing file only
-                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, // normal file
-                                NULL);
+            GEDO_ASSERT_MSG("don't have enough space.");
+            return;
         }
-        else
+        *(uint8_t**)chunk = c.chunks;
+        c.chunks = chunk;
+        const size_t slotSize = POOL_SLOT_SIZES[sizeClass];
+        for (size_t offset = sizeof(PoolBlockHeader); offset + slotSize <= POOL_CHUNK_SIZE; offset += slotSize)
         {
-            handle = CreateFile(string.text,           // name of the write
-                                GENERIC_WRITE,         // open for writing
-                                0,                     // do not share
-                                NULL,                  // default security
-                                CREATE_NEW,            // create new file only
-                                FILE_ATTRIBUTE_NORMAL, // normal file
-                                NULL);
+            PoolBlockHeader* header = (PoolBlockHeader*)(chunk + offset);
+            header->sizeClass = sizeClass;
+            header->next = c.freeList;
+            c.freeList = header;
         }
-        return handle;
+        AtomicAdd(&allocator.stats.reservedBytes, POOL_CHUNK_SIZE);
     }
 
-    MemoryBlock ReadFile(const char* fileName, Allocator& allocator)
+    static void FlushPoolStats(PoolAllocator& allocator, PoolThreadCache& cache)
     {
-        MemoryBlock result;
-        const int64_t fileSize = GetFileSize(fileName);
-        if (fileSize < 0)
+        AtomicAdd(&allocator.stats.allocations, cache.stats.allocations);
+        AtomicAdd(&allocator.stats.cacheHits, cache.stats.cacheHits);
+        AtomicAdd(&allocator.stats.frees, cache.stats.frees);
+        cache.stats = PoolAllocatorStats{};
+    }
+
+    // moves up to count blocks from the shared list to the cache.
+    static void RefillPoolCache(PoolAllocator& allocator, PoolThreadCache& cache, size_t sizeClass, uint32_t count)
+    {
+        PoolSizeClass& c = allocator.classes[sizeClass];
+        LockMutex(c.mutex);
+        for (uint32_t i = 0; i < count; ++i)
         {
-            return result;
+            if (!c.freeList)
+            {
+                AddPoolChunk(allocator, sizeClass);
+                if (!c.freeList)
+                {
+                    break;
+                }
+            }
+            PoolBlockHeader* header = c.freeList;
+            c.freeList = header->next;
+            header->next = cache.lists[sizeClass];
+            cache.lists[sizeClass] = header;
+            cache.counts[sizeClass]++;
         }
-        result = Allocate(fileSize + 1, allocator);
-        HANDLE handle = GetFileHandle(fileName, true, allocator);
-        defer(CloseHandle(handle));
-        OVERLAPPED overlapped = {};
-        const bool success = ReadFileEx(handle,
-                                        result.data,
-                                        result.size - 1,
-                                        &overlapped,
-                                        NULL);
-        GEDO_ASSERT(success);
-        return result;
+        UnlockMutex(c.mutex);
+        FlushPoolStats(allocator, cache);
     }
 
-    bool WriteFile(const char* fileName, MemoryBlock block, Allocator& allocator)
+    // moves count blocks from the cache to the shared list.
+    static void DrainPoolCache(PoolAllocator& allocator, PoolThreadCache& cache, size_t sizeClass, uint32_t count)
     {
-        HANDLE handle = GetFileHandle(fileName, false, allocator);
-        if (handle)
+        PoolSizeClass& c = allocator.classes[sizeClass];
+        LockMutex(c.mutex);
+        for (uint32_t i = 0; i < count && cache.lists[sizeClass]; ++i)
         {
-            defer(CloseHandle(handle));
-            OVERLAPPED overlapped = {};
-            return WriteFileEx(handle, block.data, block.size - 1, &overlapped, NULL);
+            PoolBlockHeader* header = cache.lists[sizeClass];
+            cache.lists[sizeClass] = header->next;
+            cache.counts[sizeClass]--;
+            header->next = c.freeList;
+            c.freeList = header;
         }
-        return false;
+        UnlockMutex(c.mutex);
+        FlushPoolStats(allocator, cache);
     }
 
-    bool DoesFileExist(const char* fileName, Allocator& allocator)
+    // the cache of the calling thread if it belongs to allocator, threads
+    // take the cache of the first pool they use.
+    static PoolThreadCache* GetPoolCache(PoolAllocator& allocator)
     {
-        HANDLE handle = GetFileHandle(fileName, true, allocator);
-        const bool found = handle != INVALID_HANDLE_VALUE;
-        if (found)
+        PoolThreadCache& cache = poolThreadCache;
+        if (cache.poolId == allocator.id)
         {
-            CloseHandle(handle);
+            return &cache;
         }
-        return found;
+        if (!cache.poolId)
+        {
+            cache.poolId = allocator.id;
+            cache.pool = &allocator;
+            return &cache;
+        }
+        return NULL;
     }
 
-    int64_t GetFileSize(const char* fileName, Allocator& allocator)
+    PoolAllocator* CreatePoolAllocator()
     {
-        HANDLE handle = GetFileHandle(fileName, true, allocator);
-        const bool found = handle != INVALID_HANDLE_VALUE;
-        if (found)
+        PoolAllocator* allocator = new PoolAllocator();
+        allocator->id = AtomicAdd(&poolIdCounter, 1);
+        allocator->classes = new PoolSizeClass[POOL_CLASS_COUNT];
+        for (size_t i = 0; i < POOL_CLASS_COUNT; ++i)
         {
-            LARGE_INTEGER size;
-            GetFileSizeEx(handle, &size);
-            CloseHandle(handle);
-            return size.QuadPart;
+            InitMutex(allocator->classes[i].mutex);
         }
-        return -1;
+        return allocator;
     }
 
-    PathType GetPathType(const char* path, Allocator& allocator)
+    void FreePoolAllocator(PoolAllocator* allocator)
     {
-        HANDLE handle = GetFileHandle(path, true, allocator);
-        const bool found = handle != INVALID_HANDLE_VALUE;
-        if (found)
+        GEDO_ASSERT(allocator);
+        PoolThreadCache& cache = poolThreadCache;
+        if (cache.poolId == allocator->id)
         {
-            defer(CloseHandle(handle));
-            FILE_BASIC_INFO basicInfo;
-            GetFileInformationByHandleEx(handle, FileBasicInfo, &basicInfo, sizeof(basicInfo));
-            return (basicInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                ? PathType::DIRECTORY
-                : PathType::FILE;
+            cache = PoolThreadCache{};
         }
-        return PathType::FAILURE;
+        for (size_t i = 0; i < POOL_CLASS_COUNT; ++i)
+        {
+            PoolSizeClass& c = allocator->classes[i];
+            while (c.chunks)
+            {
+                uint8_t* next = *(uint8_t**)c.chunks;
+                GEDO_FREE(c.chunks);
+                c.chunks = next;
+            }
+            DestroyMutex(c.mutex);
+        }
+        delete[] allocator->classes;
+        delete allocator;
     }
-#elif defined GEDO_OS_LINUX
-    MemoryBlock ReadFile(const char* fileName, Allocator& allocator)
+
+    PoolAllocatorStats GetPoolAllocatorStats(PoolAllocator& allocator)
     {
-        FILE* fp = fopen(fileName, "r");
-        MemoryBlock result;
-        if (fp)
+        PoolThreadCache* cache = GetPoolCache(allocator);
+        if (cache)
         {
-            fseek(fp, 0, SEEK_END);
-            const int64_t size = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            result = Allocate(size + 1, allocator);
-            fread(result.data, 1, size, fp);
-            result.data[size] = 0;
-            fclose(fp);
+            FlushPoolStats(allocator, *cache);
         }
+        PoolAllocatorStats result;
+        result.allocations = AtomicLoad(&allocator.stats.allocations);
+        result.cacheHits = AtomicLoad(&allocator.stats.cacheHits);
+        result.frees = AtomicLoad(&allocator.stats.frees);
+        result.largeAllocations = AtomicLoad(&allocator.stats.largeAllocations);
+        result.reservedBytes = AtomicLoad(&allocator.stats.reservedBytes);
         return result;
     }
 
-    bool WriteFile(const char* fileName, MemoryBlock block, Allocator& allocator)
+    void FlushPoolThreadCache()
     {
-        FILE* fp = fopen(fileName, "w");
-        if (fp)
+        PoolThreadCache& cache = poolThreadCache;
+        if (!cache.pool)
         {
-            fwrite(block.data, 1, block.size, fp);
-            fclose(fp);
-            return true;
+            return;
         }
-        return false;
+        for (size_t i = 0; i < POOL_CLASS_COUNT; ++i)
+        {
+            if (cache.counts[i])
+            {
+                DrainPoolCache(*cache.pool, cache, i, cache.counts[i]);
+            }
+        }
+        FlushPoolStats(*cache.pool, cache);
+        cache = PoolThreadCache{};
     }
 
-    bool DoesFileExist(const char* fileName, Allocator& allocator)
+    void PoolAllocator::ResetAllocator()
     {
-        FILE* fp = fopen(fileName, "r");
-        if (fp)
-        {
-            fclose(fp);
-            return true;
-        }
-        return false;
     }
 
-    int64_t GetFileSize(const char* fileName, Allocator& allocator)
+    MemoryBlock PoolAllocator::AllocateMemoryBlock(size_t bytes, bool zeroFill)
     {
-        FILE* fp = fopen(fileName, "r");
-        if (fp)
+        MemoryBlock result;
+        PoolBlockHeader* header = NULL;
+        if (bytes > POOL_MAX_BLOCK_SIZE)
         {
-            fseek(fp, 0, SEEK_END);
-            fclose(fp);
-            const int64_t size = ftell(fp);
-            return size;
+            header = (PoolBlockHeader*)GEDO_MALLOC(sizeof(PoolBlockHeader) + bytes);
+            if (!header)
+            {
+                GEDO_ASSERT_MSG("don't have enough space.");
+                return result;
+            }
+            header->sizeClass = POOL_LARGE_CLASS;
+            AtomicAdd(&stats.largeAllocations, 1);
         }
-        return -1;
-    }
-
-    PathType GetPathType(const char* path, Allocator& allocator)
-    {
-        struct stat s;
-        if (stat(path, &s) == 0)
+        else
         {
-            if (s.st_mode & S_IFDIR)
+            const size_t sizeClass = GetPoolClass(sizeof(PoolBlockHeader) + bytes);
+            PoolThreadCache* cache = GetPoolCache(*this);
+            if (cache)
             {
-                return PathType::DIRECTORY;
+                if (cache->lists[sizeClass])
+                {
+                    cache->stats.cacheHits++;
+                }
+                else
+                {
+                    RefillPoolCache(*this, *cache, sizeClass, POOL_BATCH_SIZE);
+                }
+                header = cache->lists[sizeClass];
+                if (header)
+                {
+                    cache->lists[sizeClass] = header->next;
+                    cache->counts[sizeClass]--;
+                    cache->stats.allocations++;
+                }
             }
-            else if (s.st_mode & S_IFREG)
+            else
             {
-                return PathType::FILE;
+                PoolSizeClass& c = classes[sizeClass];
+                LockMutex(c.mutex);
+                if (!c.freeList)
+                {
+                    AddPoolChunk(*this, sizeClass);
+                }
+                header = c.freeList;
+                if (header)
+                {
+                    c.freeList = header->next;
+                }
+                UnlockMutex(c.mutex);
+                AtomicAdd(&stats.allocations, 1);
+            }
+            if (!header)
+            {
+                return result;
             }
         }
-        return PathType::FAILURE;
-    }
-#endif
-    //------------------------------------------------------------//
-
-    //------------------Strings----------------------------------//
-    static String CopyString(const char* string, size_t from, size_t to, Allocator& allocator)
-    {
-        String s;
-        s.allocator = &allocator;
-        s.reserve(to - from + 1);
-        for (size_t i = from; i < to; ++i)
-        {
-            Append(s, string[i]);
-        }
-        return s;
-    }
-
-    size_t StringLength(const char* string)
-    {
-        size_t result = 0;
-        while (*string++)
+        result.data = (uint8_t*)(header + 1);
+        result.size = bytes;
+        if (zeroFill)
         {
-            result++;
+            ZeroMemoryBlock(result);
         }
         return result;
     }
 
-    const char* GetFileExtension(const char* string)
+    bool PoolAllocator::FreeMemoryBlock(MemoryBlock& block)
     {
-        const size_t len = StringLength(string);
-        if (!len)
+        GEDO_ASSERT(block.data);
+        PoolBlockHeader* header = (PoolBlockHeader*)block.data - 1;
+        block.size = 0;
+        block.data = NULL;
+        const uint64_t sizeClass = header->sizeClass;
+        if (sizeClass == POOL_LARGE_CLASS)
         {
-            return NULL;
+            GEDO_FREE(header);
+            return true;
         }
-
-        for (int64_t i = len - 1; i >= 0; --i)
+        GEDO_ASSERT(sizeClass < POOL_CLASS_COUNT);
+        PoolThreadCache* cache = GetPoolCache(*this);
+        if (cache)
         {
-            if (string[i] == '.')
+            header->next = cache->lists[sizeClass];
+            cache->lists[sizeClass] = header;
+            cache->stats.frees++;
+            if (++cache->counts[sizeClass] > 2 * POOL_BATCH_SIZE)
             {
-                return string + i;
+                DrainPoolCache(*this, *cache, sizeClass, POOL_BATCH_SIZE);
             }
         }
-        return NULL;
+        else
+        {
+            PoolSizeClass& c = classes[sizeClass];
+            LockMutex(c.mutex);
+            header->next = c.freeList;
+            c.freeList = header;
+            UnlockMutex(c.mutex);
+            AtomicAdd(&stats.frees, 1);
+        }
+        return true;
     }
 
-    bool CompareStrings(const char* str1, const char* str2, size_t size0, size_t size1)
+    bool PoolAllocator::ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace)
     {
-        if (size0 != size1)
+        GEDO_ASSERT(block.data);
+        PoolBlockHeader* header = (PoolBlockHeader*)block.data - 1;
+        if (header->sizeClass != POOL_LARGE_CLASS)
         {
+            // the rest of the slot is free to use.
+            if (sizeof(PoolBlockHeader) + bytes <= POOL_SLOT_SIZES[header->sizeClass])
+            {
+                block.size = bytes;
+                return true;
+            }
             return false;
         }
-        for (size_t i = 0; i < size0; ++i)
+        if (inPlace || bytes <= POOL_MAX_BLOCK_SIZE)
         {
-            if (str1[i] != str2[i])
-            {
-                return false;
-            }
+            return false;
+        }
+        header = (PoolBlockHeader*)GEDO_REALLOC(header, sizeof(PoolBlockHeader) + bytes);
+        if (!header)
+        {
+            return false;
         }
+        block.data = (uint8_t*)(header + 1);
+        block.size = bytes;
         return true;
     }
+    //-----------------------------------------------------------//
 
-    bool CompareStrings(const char* str1, const String& str2)
+    //----------------------------Threading----------------------//
+#if defined GEDO_OS_WINDOWS
+    static_assert(sizeof(Mutex::storage) >= sizeof(SRWLOCK), "Mutex storage is too small.");
+    static_assert(sizeof(Semaphore::storage) >= sizeof(HANDLE), "Semaphore storage is too small.");
+
+    struct ThreadStart
     {
-        return CompareStrings(str2, str1);
+        ThreadFunction function = NULL;
+        void* userData = NULL;
+    };
+
+    static DWORD WINAPI ThreadEntry(LPVOID parameter)
+    {
+        ThreadStart start = *(ThreadStart*)parameter;
+        delete (ThreadStart*)parameter;
+        start.function(start.userData);
+        return 0;
     }
 
-    bool CompareStrings(const String& str1, const char* str2)
+    Thread StartThread(ThreadFunction function, void* userData)
     {
-        return CompareStrings(str1.data(), str2, str1.size(), StringLength(str2));
+        ThreadStart* start = new ThreadStart();
+        start->function = function;
+        start->userData = userData;
+        Thread result;
+        result.handle = (uint64_t)::CreateThread(NULL, 0, ThreadEntry, start, 0, NULL);
+        if (!result.handle)
+        {
+            delete start;
+        }
+        return result;
     }
 
-    bool CompareStrings(const String& str1, const String& str2)
+    void JoinThread(Thread& thread)
     {
-        return CompareStrings(str1.data(), str2.data(), str1.size(), str2.size());
+        HANDLE handle = (HANDLE)thread.handle;
+        WaitForSingleObject(handle, INFINITE);
+        CloseHandle(handle);
+        thread.handle = 0;
     }
 
-    bool CompareStrings(const StringView str1, const StringView str2)
+    void YieldThread()
     {
-        return CompareStrings(str1.data, str2.data, str1.size, str2.size);
+        SwitchToThread();
     }
 
-    bool CompareStrings(const char* str1, const char* str2)
+    size_t GetHardwareThreadCount()
     {
-        const size_t len1 = StringLength(str1);
-        const size_t len2 = StringLength(str2);
-        return CompareStrings(str1, str2, len1, len2);
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return Max<size_t>(info.dwNumberOfProcessors, 1);
     }
 
-    String ConcatStrings(const String* strings, size_t stringsCount, char seperator)
+    void InitMutex(Mutex& mutex)
     {
-        const bool addSeperator = seperator != 0;
-        size_t resultSize = 0;
-        for (size_t i = 0; i < stringsCount; ++i)
-        {
-            resultSize += strings[i].size();
-        }
-        if (addSeperator)
-        {
-            resultSize += (stringsCount - 1);
-        }
+        InitializeSRWLock((SRWLOCK*)mutex.storage);
+    }
 
-        String result;
-        result.reserve(resultSize);
-        for (size_t i = 0; i < stringsCount; ++i)
-        {
-            Append(result, strings[i]);
-            if (addSeperator && i != stringsCount - 1)
-            {
-                Append(result, seperator);
-            }
-        }
-        return result;
+    void DestroyMutex(Mutex& mutex)
+    {
     }
 
-    String CreateString(const char* string)
+    void LockMutex(Mutex& mutex)
     {
-        String result;
-        Append(result, string);
-        return result;
+        AcquireSRWLockExclusive((SRWLOCK*)mutex.storage);
     }
 
-    void Append(String& string, const char* s)
+    void UnlockMutex(Mutex& mutex)
     {
-        Append(string, s, StringLength(s));
+        ReleaseSRWLockExclusive((SRWLOCK*)mutex.storage);
     }
 
-    void Append(String& string, const char* s, size_t length)
+    void InitSemaphore(Semaphore& semaphore, uint32_t initialCount)
     {
-        string.reserve(string.size() + length);
-        for (size_t i = 0; i < length; ++i)
-        {
-            Append(string, s[i]);
-        }
+        *(HANDLE*)semaphore.storage = CreateSemaphoreW(NULL, initialCount, LONG_MAX, NULL);
     }
 
-    void Append(String& string, const String& s)
+    void DestroySemaphore(Semaphore& semaphore)
     {
-        Append(string, s.data(), s.size());
+        CloseHandle(*(HANDLE*)semaphore.storage);
     }
 
-    void Append(String& string, char c)
+    void SignalSemaphore(Semaphore& semaphore, uint32_t count)
     {
-        string.push_back(c);
+        ReleaseSemaphore(*(HANDLE*)semaphore.storage, count, NULL);
     }
 
-    StringView CreateStringView(const char* string)
+    void WaitSemaphore(Semaphore& semaphore)
     {
-        StringView result;
-        result.data = string;
-        result.size = StringLength(string);
-        return result;
+        WaitForSingleObject(*(HANDLE*)semaphore.storage, INFINITE);
     }
 
-    Array<StringView> SplitStringView(const char* string, char delim, Allocator& allocator)
+    int64_t AtomicAdd(volatile int64_t* value, int64_t addend)
     {
-        Array<StringView> result;
-        result.allocator = &allocator;
-        const size_t len = StringLength(string);
-        size_t previousOffset = 0;
-        size_t i = 0;
+        return InterlockedExchangeAdd64((volatile LONG64*)value, addend) + addend;
+    }
 
-        size_t partsCount = 0;
-        while (i < len)
-        {
-            if (string[i] == delim)
-            {
-                if (i - previousOffset)
-                {
-                    partsCount++;
-                }
-                while (string[i] == delim && i < len)
-                {
-                    i++;
-                }
-                previousOffset = i;
-            }
-            else
-            {
-                i++;
-            }
-        }
-        if (i - previousOffset)
-        {
-            partsCount++;
-        }
-        result.reserve(partsCount);
+    int64_t AtomicLoad(const volatile int64_t* value)
+    {
+        return InterlockedCompareExchange64((volatile LONG64*)value, 0, 0);
+    }
 
-        previousOffset = 0;
-        i = 0;
-        while (i < len)
+    void AtomicStore(volatile int64_t* value, int64_t newValue)
+    {
+        InterlockedExchange64((volatile LONG64*)value, newValue);
+    }
+
+    bool AtomicCompareExchange(volatile int64_t* value, int64_t expected, int64_t desired)
+    {
+        return InterlockedCompareExchange64((volatile LONG64*)value, desired, expected) == expected;
+    }
+#elif defined GEDO_OS_LINUX
+    static_assert(sizeof(Mutex::storage) >= sizeof(pthread_mutex_t), "Mutex storage is too small.");
+    static_assert(sizeof(Semaphore::storage) >= sizeof(sem_t), "Semaphore storage is too small.");
+
+    struct ThreadStart
+    {
+        ThreadFunction function = NULL;
+        void* userData = NULL;
+    };
+
+    static void* ThreadEntry(void* parameter)
+    {
+        ThreadStart start = *(ThreadStart*)parameter;
+        delete (ThreadStart*)parameter;
+        start.function(start.userData);
+        return NULL;
+    }
+
+    Thread StartThread(ThreadFunction function, void* userData)
+    {
+        ThreadStart* start = new ThreadStart();
+        start->function = function;
+        start->userData = userData;
+        pthread_t thread;
+        Thread result;
+        if (pthread_create(&thread, NULL, ThreadEntry, start) == 0)
         {
-            if (string[i] == delim)
-            {
-                const size_t slen = i - previousOffset;
-                if (slen)
-                {
-                    StringView l;
-                    l.data = string + previousOffset;
-                    l.size = slen;
-                    result.push_back(l);
-                }
-                while (string[i] == delim && i < len)
-                {
-                    i++;
-                }
-                previousOffset = i;
-            }
-            else
-            {
-                i++;
-            }
+            result.handle = (uint64_t)thread;
         }
-        const size_t slen = i - previousOffset;
-        if (slen)
+        else
         {
-            StringView l;
-            l.data = string + previousOffset;
-            l.size = slen;
-            result.push_back(l);
+            delete start;
         }
         return result;
     }
 
-    Array<String> SplitString(const char* string, char delim, Allocator& allocator)
+    void JoinThread(Thread& thread)
     {
-        Array<String> result;
-        result.allocator = &allocator;
-        const size_t len = StringLength(string);
-        size_t previousOffset = 0;
-        size_t i = 0;
-        size_t partsCount = 0;
-        while (i < len)
-        {
-            if (string[i] == delim)
-            {
-                if (i - previousOffset)
-                {
-                    partsCount++;
-                }
-                while (string[i] == delim && i < len)
-                {
-                    i++;
-                }
-                previousOffset = i;
-            }
-            else
-            {
-                i++;
-            }
-        }
-        if (i - previousOffset)
-        {
-            partsCount++;
-        }
-        result.reserve(partsCount);
+        pthread_join((pthread_t)thread.handle, NULL);
+        thread.handle = 0;
+    }
 
-        i = 0;
-        previousOffset = 0;
-        while (i < len)
-        {
-            if (string[i] == delim)
-            {
-                const size_t slen = i - previousOffset;
-                if (slen)
-                {
-                    String l = CopyString(string, previousOffset, i, allocator);
-                    result.push_back(l);
-                }
-                while (string[i] == delim && i < len)
-                {
-                    i++;
-                }
-                previousOffset = i;
-            }
-            else
-            {
-                i++;
-            }
-        }
+    void YieldThread()
+    {
+        sched_yield();
+    }
 
-        const size_t slen = i - previousOffset;
-        if (slen)
-        {
-            String l = CopyString(string, previousOffset, i, allocator);
-            result.push_back(l);
-        }
-        return result;
+    size_t GetHardwareThreadCount()
+    {
+        const long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? count : 1;
     }
 
-    Array<String> SplitStringIntoLines(const char* string, Allocator& allocator)
+    void InitMutex(Mutex& mutex)
     {
-        Array<String> result;
-        result.allocator = &allocator;
-        const size_t len = StringLength(string);
-        size_t partsCount = 0;
-        for (size_t i = 0; i < len; ++i)
-        {
-            if (string[i] == '\n')
-            {
-                partsCount++;
-            }
-        }
-        result.reserve(partsCount);
+        pthread_mutex_init((pthread_mutex_t*)mutex.storage, NULL);
+    }
 
-        size_t previousOffset = 0;
-        for (size_t i = 0; i < len; ++i)
-        {
-            if (string[i] == '\n')
-            {
-                if (i - previousOffset)
-                {
-                    String l = CopyString(string, previousOffset, i, allocator);
-                    result.push_back(l);
-                }
-                previousOffset = i;
-            }
-        }
-        if (len - previousOffset)
-        {
-            String l = CopyString(string, previousOffset, len, allocator);
-            result.push_back(l);
-        }
-        return result;
+    void DestroyMutex(Mutex& mutex)
+    {
+        pthread_mutex_destroy((pthread_mutex_t*)mutex.storage);
     }
 
-    Array<StringView> SplitStringViewIntoLines(const char* string, char delim, Allocator& allocator)
+    void LockMutex(Mutex& mutex)
     {
-        Array<StringView> result;
-        result.allocator = &allocator;
-        const size_t len = StringLength(string);
-        size_t partsCount = 0;
-        for (size_t i = 0; i < len; ++i)
-        {
-            if (string[i] == '\n')
-            {
-                partsCount++;
-            }
-        }
-        result.reserve(partsCount);
+        pthread_mutex_lock((pthread_mutex_t*)mutex.storage);
+    }
 
-        size_t previousOffset = 0;
-        for (size_t i = 0; i < len; ++i)
+    void UnlockMutex(Mutex& mutex)
+    {
+        pthread_mutex_unlock((pthread_mutex_t*)mutex.storage);
+    }
+
+    void InitSemaphore(Semaphore& semaphore, uint32_t initialCount)
+    {
+        sem_init((sem_t*)semaphore.storage, 0, initialCount);
+    }
+
+    void DestroySemaphore(Semaphore& semaphore)
+    {
+        sem_destroy((sem_t*)semaphore.storage);
+    }
+
+    void SignalSemaphore(Semaphore& semaphore, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; ++i)
         {
-            if (string[i] == '\n')
-            {
-                if (i - previousOffset)
-                {
-                    StringView l;
-                    l.data = string + previousOffset;
-                    l.size = i - previousOffset;
-                    result.push_back(l);
-                }
-                previousOffset = i;
-            }
+            sem_post((sem_t*)semaphore.storage);
         }
-        if (len - previousOffset)
+    }
+
+    void WaitSemaphore(Semaphore& semaphore)
+    {
+        while (sem_wait((sem_t*)semaphore.storage) != 0)
         {
-            StringView l;
-            l.data = string + previousOffset;
-            l.size = len - previousOffset;
-            result.push_back(l);
+            // interrupted by a signal.
         }
-        return result;
     }
-    //------------------------------------------------------------//
 
-    //------------------------Parsing-----------------------------//
+    int64_t AtomicAdd(volatile int64_t* value, int64_t addend)
+    {
+        return __atomic_add_fetch(value, addend, __ATOMIC_SEQ_CST);
+    }
 
-    char Peek(const Buffer& buffer)
+    int64_t AtomicLoad(const volatile int64_t* value)
     {
-        GEDO_ASSERT(buffer.cursor < buffer.size);
-        return buffer.data[buffer.cursor];
+        return __atomic_load_n(value, __ATOMIC_SEQ_CST);
     }
 
-    bool IsLetter(char c)
+    void AtomicStore(volatile int64_t* value, int64_t newValue)
     {
-        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        __atomic_store_n(value, newValue, __ATOMIC_SEQ_CST);
     }
 
-    bool IsDigit(char c)
+    bool AtomicCompareExchange(volatile int64_t* value, int64_t expected, int64_t desired)
     {
-        return (c >= '0' && c <= '9');
+        return __atomic_compare_exchange_n(value, &expected, desired, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
     }
+#endif
 
-    bool IsWhiteSpace(char c)
+    // Each pool thread owns a deque of range tasks, a thread running a task
+    // keeps splitting it in halves, pushes the upper half to the back of its
+    // own deque and works on the lower half. Idle threads take from the back
+    // of their own deque first and otherwise steal from the front of the other
+    // deques which holds the biggest ranges. Threads that are not part of the
+    // pool (main thread, etc.) share deque 0.
+    struct ParallelJob
     {
-        switch (c)
+        volatile int64_t pending = 0; // elements not processed yet.
+    };
+
+    struct ParallelTask
+    {
+        TaskFunction function = NULL;
+        void* userData = NULL;
+        size_t begin = 0;
+        size_t end = 0;
+        size_t grain = 0;
+        ParallelJob* job = NULL;
+    };
+
+    static const size_t TASK_DEQUE_CAPACITY = 256;
+    static const size_t MAX_THREAD_COUNT = 256;
+
+    struct TaskDeque
+    {
+        Mutex mutex;
+        ParallelTask tasks[TASK_DEQUE_CAPACITY];
+        size_t head = 0;
+        size_t count = 0;
+    };
+
+    struct ThreadPool
+    {
+        size_t threadCount = 1;
+        TaskDeque* deques = NULL;
+        Thread* threads = NULL;
+        Semaphore wake;
+        volatile int64_t sleeping = 0;
+        volatile int64_t stop = 0;
+        volatile int64_t users = 0;     // threads outside the pool inside ParallelFor.
+    };
+
+    struct WorkerStart
+    {
+        ThreadPool* pool = NULL;
+        size_t index = 0;
+    };
+
+    // threadPool is created and replaced with the mutex locked, a thread that
+    // isn't a worker counts itself as a user of the pool while it is inside
+    // ParallelFor so SetThreadCount() waits for it (e.g. the render thread).
+    static ThreadPool* threadPool = NULL;
+    static thread_local size_t currentThreadIndex = 0;
+    // the pool the thread works for, NULL outside of ParallelFor.
+    static thread_local ThreadPool* currentPool = NULL;
+
+    static Mutex& GetThreadPoolMutex()
+    {
+        struct PoolMutex
         {
-        case ' ':
-        case '\n':
-        case '\t':
-        case '\v':
-        case '\f':
-        case '\r':
-            return true;
-        }
-        return false;
+            Mutex mutex;
+            PoolMutex()
+            {
+                InitMutex(mutex);
+            }
+        };
+        static PoolMutex poolMutex;
+        return poolMutex.mutex;
     }
 
-    bool IsLetterOrDigit(char c)
+    static bool PushTask(TaskDeque& deque, const ParallelTask& task)
     {
-        return IsLetter(c) || IsDigit(c);
+        LockMutex(deque.mutex);
+        const bool pushed = deque.count < TASK_DEQUE_CAPACITY;
+        if (pushed)
+        {
+            deque.tasks[(deque.head + deque.count) % TASK_DEQUE_CAPACITY] = task;
+            deque.count++;
+        }
+        UnlockMutex(deque.mutex);
+        return pushed;
     }
 
-    Buffer CreateBufferFromString(const char* text)
+    static bool PopTask(TaskDeque& deque, ParallelTask& task)
     {
-        Buffer result;
-        result.data = text;
-        result.size = StringLength(text);
-        result.cursor = 0;
-        return result;
+        LockMutex(deque.mutex);
+        const bool popped = deque.count > 0;
+        if (popped)
+        {
+            deque.count--;
+            task = deque.tasks[(deque.head + deque.count) % TASK_DEQUE_CAPACITY];
+        }
+        UnlockMutex(deque.mutex);
+        return popped;
     }
 
-    void SkipToNextLine(Buffer& buffer)
+    static bool StealTask(TaskDeque& deque, ParallelTask& task)
     {
-        while (buffer.cursor < buffer.size && Peek(buffer) != '\n')
+        LockMutex(deque.mutex);
+        const bool stolen = deque.count > 0;
+        if (stolen)
         {
-            buffer.cursor++;
+            task = deque.tasks[deque.head];
+            deque.head = (deque.head + 1) % TASK_DEQUE_CAPACITY;
+            deque.count--;
         }
+        UnlockMutex(deque.mutex);
+        return stolen;
     }
 
-    void SkipWhiteSpaces(Buffer& buffer)
+    static bool FindTask(ThreadPool& pool, size_t index, ParallelTask& task)
     {
-        while (buffer.cursor < buffer.size && IsWhiteSpace(Peek(buffer)))
+        if (PopTask(pool.deques[index], task))
         {
-            buffer.cursor++;
+            return true;
         }
+        for (size_t i = 1; i < pool.threadCount; ++i)
+        {
+            if (StealTask(pool.deques[(index + i) % pool.threadCount], task))
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    void SkipSingleLineComment(Buffer& buffer)
+    static void RunTask(ThreadPool& pool, size_t index, ParallelTask task)
     {
-        if (buffer.data[buffer.cursor + 0] == '\\' &&
-            buffer.data[buffer.cursor + 1] == '\\')
+        while (task.end - task.begin > task.grain)
         {
-            buffer.cursor += 2;
-            SkipToNextLine(buffer);
+            ParallelTask upper = task;
+            upper.begin = task.begin + (task.end - task.begin) / 2;
+            if (!PushTask(pool.deques[index], upper))
+            {
+                break;
+            }
+            if (AtomicLoad(&pool.sleeping) > 0)
+            {
+                SignalSemaphore(pool.wake);
+            }
+            task.end = upper.begin;
         }
+        task.function(task.userData, task.begin, task.end);
+        AtomicAdd(&task.job->pending, -(int64_t)(task.end - task.begin));
     }
 
-    bool ParseFloat(Buffer& buffer, double& result)
+    static void WorkerMain(void* userData)
     {
-        if (IsDigit(Peek(buffer)))
+        WorkerStart start = *(WorkerStart*)userData;
+        delete (WorkerStart*)userData;
+        ThreadPool& pool = *start.pool;
+        currentThreadIndex = start.index;
+        currentPool = start.pool;
+
+        const size_t spinCount = 64;
+        while (!AtomicLoad(&pool.stop))
         {
-            String data;
-            bool dotAdded = false;
-            while (buffer.cursor < buffer.size &&
-                   (IsDigit(Peek(buffer)) || Peek(buffer) == '.'))
+            ParallelTask task;
+            bool found = false;
+            for (size_t i = 0; i < spinCount && !found; ++i)
             {
-                if (Peek(buffer) == '.')
+                found = FindTask(pool, start.index, task);
+                if (!found)
                 {
-                    if (dotAdded)
-                    {
-                        return false;
-                    }
-                    dotAdded = true;
+                    YieldThread();
                 }
-                Append(data, Peek(buffer));
-                buffer.cursor++;
             }
-            Append(data, (char)0); // since String is not null terminated.
-            return StringToFloat(data.data(), result);
+            if (!found)
+            {
+                // announce that we are going to sleep before the last check,
+                // so a push that happens after the check will signal us.
+                AtomicAdd(&pool.sleeping, 1);
+                found = FindTask(pool, start.index, task);
+                if (!found && !AtomicLoad(&pool.stop))
+                {
+                    WaitSemaphore(pool.wake);
+                }
+                AtomicAdd(&pool.sleeping, -1);
+            }
+            if (found)
+            {
+                RunTask(pool, start.index, task);
+            }
         }
-        return false;
+        // the next pool gets new workers, their caches would be lost.
+        FlushPoolThreadCache();
     }
 
-    bool ParseIdentifier(Buffer& buffer, String& result)
+    static void FreeThreadPool(ThreadPool* pool)
     {
-        if (IsLetter(Peek(buffer)))
+        AtomicStore(&pool->stop, 1);
+        SignalSemaphore(pool->wake, (uint32_t)pool->threadCount);
+        for (size_t i = 1; i < pool->threadCount; ++i)
         {
-            result.clear();
-            while (buffer.cursor < buffer.size &&
-                   (IsLetterOrDigit(Peek(buffer)) || Peek(buffer) == '_'))
+            if (pool->threads[i].handle)
             {
-                Append(result, Peek(buffer));
-                buffer.cursor++;
+                JoinThread(pool->threads[i]);
             }
-            return true;
         }
-        return false;
+        for (size_t i = 0; i < pool->threadCount; ++i)
+        {
+            DestroyMutex(pool->deques[i].mutex);
+        }
+        DestroySemaphore(pool->wake);
+        delete[] pool->threads;
+        delete[] pool->deques;
+        delete pool;
     }
 
-    bool ParseStringLiteral(Buffer& buffer, String& result)
+    static ThreadPool* CreateThreadPool(size_t threadCount)
     {
-        if (Peek(buffer) == '"')
+        ThreadPool* pool = new ThreadPool();
+        pool->threadCount = threadCount;
+        pool->deques = new TaskDeque[threadCount];
+        for (size_t i = 0; i < threadCount; ++i)
         {
-            result.clear();
-            buffer.cursor++;
-            while (buffer.cursor < buffer.size && Peek(buffer) != '"')
+            InitMutex(pool->deques[i].mutex);
+        }
+        InitSemaphore(pool->wake, 0);
+        pool->threads = new Thread[threadCount];
+        // thread 0 is the calling thread.
+        for (size_t i = 1; i < threadCount; ++i)
+        {
+            WorkerStart* start = new WorkerStart();
+            start->pool = pool;
+            start->index = i;
+            pool->threads[i] = StartThread(WorkerMain, start);
+            if (!pool->threads[i].handle)
             {
-                Append(result, Peek(buffer));
-                buffer.cursor++;
+                // the system is out of threads, run with the workers that started.
+                delete start;
+                FreeThreadPool(pool);
+                return CreateThreadPool(i);
             }
-            buffer.cursor++;
-            return true;
         }
-        return false;
+        return pool;
     }
 
-    bool CompareWordAndSkip(Buffer& buffer, const char* word)
+    // called with the mutex locked.
+    static ThreadPool& GetThreadPool()
     {
-        const size_t length = StringLength(word);
-        if (buffer.cursor + length < buffer.size)
+        if (!threadPool)
         {
-            for (size_t i = 0; i < length; ++i)
+            threadPool = CreateThreadPool(Min(GetHardwareThreadCount(), MAX_THREAD_COUNT));
+        }
+        return *threadPool;
+    }
+
+    void SetThreadCount(size_t count)
+    {
+        GEDO_ASSERT(!currentPool);
+        count = count ? count : GetHardwareThreadCount();
+        count = Clamp<size_t>(count, 1, MAX_THREAD_COUNT);
+        Mutex& mutex = GetThreadPoolMutex();
+        LockMutex(mutex);
+        if (!threadPool || threadPool->threadCount != count)
+        {
+            if (threadPool)
             {
-                if (buffer.data[buffer.cursor + i] != word[i])
+                // no new user can come in while the mutex is locked.
+                while (AtomicLoad(&threadPool->users) > 0)
                 {
-                    return false;
+                    YieldThread();
                 }
+                FreeThreadPool(threadPool);
             }
-            buffer.cursor += length;
-            return true;
+            threadPool = CreateThreadPool(count);
         }
-        return false;
+        UnlockMutex(mutex);
     }
 
-    bool StringToFloat(const char* string, double& result)
+    size_t GetThreadCount()
     {
-        const size_t length = StringLength(string);
-        if (!length)
+        if (currentPool)
         {
-            return false;
+            return currentPool->threadCount;
         }
+        Mutex& mutex = GetThreadPoolMutex();
+        LockMutex(mutex);
+        const size_t count = GetThreadPool().threadCount;
+        UnlockMutex(mutex);
+        return count;
+    }
 
-        size_t dot = length;
-        for (size_t i = 0; i < length; ++i)
+    static void ParallelForOnPool(ThreadPool& pool, size_t count, size_t minBatch, void* userData, TaskFunction function)
+    {
+        minBatch = Max<size_t>(minBatch, 1);
+        if (pool.threadCount <= 1 || count <= minBatch)
         {
-            if (string[i] == '.')
-            {
-                if (dot != length)
-                {
-                    return false;
-                }
-                dot = i;
-            }
+            function(userData, 0, count);
+            return;
         }
 
-        result = 0.0;
-        size_t power = dot - 1;
-        for (size_t i = 0; i < length; ++i)
+        const size_t index = currentThreadIndex;
+        ParallelJob job;
+        job.pending = count;
+        ParallelTask task;
+        task.function = function;
+        task.userData = userData;
+        task.begin = 0;
+        task.end = count;
+        // a few batches per thread is enough to balance the load.
+        task.grain = Max(minBatch, count / (pool.threadCount * 8));
+        task.job = &job;
+        RunTask(pool, index, task);
+
+        // help with whatever is pending until our job is done.
+        while (AtomicLoad(&job.pending) > 0)
         {
-            if (string[i] != '.')
+            ParallelTask other;
+            if (FindTask(pool, index, other))
             {
-                if (string[i] != '0')
-                {
-                    double basePower = 1.0;
-                    if (power >= 0)
-                    {
-                        for (int k = 0; k < power; k++)
-                        {
-                            basePower *= 10.0;
-                        }
-                    }
-                    else if (power < 0)
-                    {
-                        for (int k = 0; k < -power; k++)
-                        {
-                            basePower *= 0.1;
-                        }
-                    }
-                    result += (string[i] - '0') * basePower;
-                }
-                power--;
+                RunTask(pool, index, other);
             }
             else
             {
-                power = -1;
+                YieldThread();
             }
         }
-        return true;
     }
 
-    bool StringToInt(const char* string, int64_t& result)
+    void ParallelFor(size_t count, size_t minBatch, void* userData, TaskFunction function)
     {
-        const size_t length = StringLength(string);
-        if (!length)
+        if (!count)
         {
-            return false;
+            return;
         }
-
-        bool isNegative = false;
-
-        for (size_t i = 0; i < length; ++i)
+        if (currentPool)
         {
-            if (string[i] == '-')
-            {
-                if (isNegative)
-                {
-                    return false;
-                }
-                isNegative = true;
-            }
+            // nested, the outer call keeps the pool alive.
+            ParallelForOnPool(*currentPool, count, minBatch, userData, function);
+            return;
         }
+        Mutex& mutex = GetThreadPoolMutex();
+        LockMutex(mutex);
+        ThreadPool& pool = GetThreadPool();
+        AtomicAdd(&pool.users, 1);
+        UnlockMutex(mutex);
 
-        result = 0.0;
-        size_t power = length - 1;
-        for (size_t i = 0; i < length; ++i)
-        {
-            if (string[i] != '0')
-            {
-                int64_t basePower = 1.0;
-                for (int k = 0; k < power; k++)
-                {
-                    basePower *= 10.0;
-                }
-                result += (string[i] - '0') * basePower;
-            }
-            power--;
-        }
-        if (isNegative)
-        {
-            result *= -1;
-        }
-        return true;
+        currentPool = &pool;
+        ParallelForOnPool(pool, count, minBatch, userData, function);
+        currentPool = NULL;
+        AtomicAdd(&pool.users, -1);
     }
+    //-----------------------------------------------------------//
 
-    //------------------------------------------------------------//
+    //---------------------------Containers----------------------//
+    uint64_t Hash(uint64_t v)
+    {
+        // splitmix64 finalizer, neighbouring ids end up in different slots.
+        v ^= v >> 30;
+        v *= 0xbf58476d1ce4e5b9ull;
+        v ^= v >> 27;
+        v *= 0x94d049bb133111ebull;
+        v ^= v >> 31;
+        return v;
+    }
 
-    //--------------------UUID------------------------------------//
-#if defined (GEDO_OS_WINDOWS)
-    UUId GenerateUUID()
+    uint64_t Hash(int64_t v)
     {
-        GUID uuid;
-        UuidCreate(&uuid);
+        return Hash((uint64_t)v);
+    }
 
-        UUId result
-        {
-            (uint8_t)((uuid.Data1 >> 24) & 0xFF),
-            (uint8_t)((uuid.Data1 >> 16) & 0xFF),
-            (uint8_t)((uuid.Data1 >> 8) & 0xFF),
-            (uint8_t)((uuid.Data1) & 0xff),
+    uint64_t Hash(uint32_t v)
+    {
+        return Hash((uint64_t)v);
+    }
 
-            (uint8_t)((uuid.Data2 >> 8) & 0xFF),
-            (uint8_t)((uuid.Data2) & 0xff),
+    uint64_t Hash(int32_t v)
+    {
+        return Hash((uint64_t)(int64_t)v);
+    }
+    //-----------------------------------------------------------//
 
-            (uint8_t)((uuid.Data3 >> 8) & 0xFF),
-            (uint8_t)((uuid.Data3) & 0xFF),
+    //-------------------------Bitmap manipulation---------------//
+    // the rectangles are drawn row by row with these, count pixels at a time.
+    typedef void (*FillRowKernel)(Color* dest, size_t count, Color color);
+    typedef void (*MaskRowKernel)(Color* dest, const uint8_t* mask, size_t count, Color color);
+    typedef void (*BlendRowKernel)(Color* dest, const Color* src, size_t count);
 
-            (uint8_t)uuid.Data4[0],
-            (uint8_t)uuid.Data4[1],
-            (uint8_t)uuid.Data4[2],
-            (uint8_t)uuid.Data4[3],
-            (uint8_t)uuid.Data4[4],
-            (uint8_t)uuid.Data4[5],
-            (uint8_t)uuid.Data4[6],
-            (uint8_t)uuid.Data4[7]
-        };
+    struct BitmapKernels
+    {
+        FillRowKernel fill = NULL;
+        MaskRowKernel mask = NULL;
+        BlendRowKernel blend = NULL;
+    };
+
+    static uint32_t ColorToU32(Color c)
+    {
+        uint32_t result = 0;
+        memcpy(&result, &c, sizeof(result));
         return result;
     }
 
-#elif defined (GEDO_OS_LINUX)
-    UUId GenerateUUID()
+    // x / 255 rounded to nearest for x <= 255 * 255, the SIMD kernels use the
+    // same formula so all of them give the same pixels.
+    static uint32_t DivideBy255(uint32_t x)
     {
-        UUId result;
-        uuid_generate(result.data);
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    // src over dest with straight alpha.
+    static Color BlendPixel(Color dest, Color src)
+    {
+        const uint32_t a = src.a;
+        const uint32_t ia = 255 - a;
+        Color result;
+        result.r = uint8_t(DivideBy255(src.r * a + dest.r * ia));
+        result.g = uint8_t(DivideBy255(src.g * a + dest.g * ia));
+        result.b = uint8_t(DivideBy255(src.b * a + dest.b * ia));
+        result.a = uint8_t(DivideBy255(255 * a + dest.a * ia));
         return result;
     }
-#endif
-    bool CompareUUID(const UUId& a, const UUId& b)
+
+    static void FillRowScalar(Color* dest, size_t count, Color color)
     {
-        for (size_t i = 0; i < 16; ++i)
+        for (size_t i = 0; i < count; ++i)
         {
-            if (a.data[i] != b.data[i])
+            dest[i] = color;
+        }
+    }
+
+    static void MaskRowScalar(Color* dest, const uint8_t* mask, size_t count, Color color)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (mask[i])
             {
-                return false;
+                dest[i] = color;
             }
         }
-        return true;
     }
-    //------------------------------------------------------------//
 
-    //--------------------Math-----------------------------------//
-    Vec2d operator+(const Vec2d a, const Vec2d& b)
+    static void BlendRowScalar(Color* dest, const Color* src, size_t count)
     {
-        return Vec2d{ a.x + b.x, a.y + b.y };
+        for (size_t i = 0; i < count; ++i)
+        {
+            dest[i] = BlendPixel(dest[i], src[i]);
+        }
     }
 
-    Vec2d operator-(const Vec2d a, const Vec2d& b)
+#if defined GEDO_ARCH_X86
+    GEDO_TARGET_SSE2 static void FillRowSse2(Color* dest, size_t count, Color color)
     {
-        return Vec2d{ a.x - b.x, a.y - b.y };
+        const __m128i c = _mm_set1_epi32(int(ColorToU32(color)));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm_storeu_si128((__m128i*)(dest + i), c);
+        }
+        FillRowScalar(dest + i, count - i, color);
     }
 
-    Vec2d operator*(const Vec2d a, const Vec2d& b)
+    GEDO_TARGET_SSE2 static void MaskRowSse2(Color* dest, const uint8_t* mask, size_t count, Color color)
     {
-        return Vec2d{ a.x * b.x, a.y * b.y };
+        const __m128i c = _mm_set1_epi32(int(ColorToU32(color)));
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            // 0xFF.. for the pixels that are kept, widened from 8 to 32 bits.
+            const __m128i keep8 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(mask + i)), zero);
+            const __m128i keep16[2] = {_mm_unpacklo_epi8(keep8, keep8), _mm_unpackhi_epi8(keep8, keep8)};
+            for (size_t j = 0; j < 4; ++j)
+            {
+                const __m128i keep = (j & 1) ? _mm_unpackhi_epi16(keep16[j / 2], keep16[j / 2])
+                                             : _mm_unpacklo_epi16(keep16[j / 2], keep16[j / 2]);
+                __m128i* p = (__m128i*)(dest + i + 4 * j);
+                const __m128i d = _mm_loadu_si128(p);
+                _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, c)));
+            }
+        }
+        MaskRowScalar(dest + i, mask + i, count - i, color);
     }
 
-    Vec2d operator*(const Vec2d a, double x)
+    // 2 pixels of 4 16 bit channels, alpha is the first channel.
+    GEDO_TARGET_SSE2 static __m128i BlendSse2(__m128i s, __m128i d)
     {
-        return Vec2d{ a.x * x, a.y * x };
+        const __m128i one = _mm_set1_epi16(255);
+        const __m128i alphaLanes = _mm_set_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+        const __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0), 0);
+        const __m128i ia = _mm_sub_epi16(one, a);
+        // the alpha of src counts as 255 so the result alpha is a + da * (1 - a).
+        const __m128i x = _mm_add_epi16(_mm_mullo_epi16(_mm_or_si128(s, alphaLanes), a), _mm_mullo_epi16(d, ia));
+        const __m128i t = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
     }
 
-    Vec2d operator*(double x, const Vec2d a)
+    GEDO_TARGET_SSE2 static void BlendRowSse2(Color* dest, const Color* src, size_t count)
     {
-        return Vec2d{ a.x * x, a.y * x };
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+            const __m128i d = _mm_loadu_si128((const __m128i*)(dest + i));
+            const __m128i lo = BlendSse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+            const __m128i hi = BlendSse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+            _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+        }
+        BlendRowScalar(dest + i, src + i, count - i);
     }
 
-    Vec3d operator+(const Vec3d a, const Vec3d& b)
+    GEDO_TARGET_AVX2 static void MaskRowAvx2(Color* dest, const uint8_t* mask, size_t count, Color color)
     {
-        return Vec3d{ a.x + b.x, a.y + b.y, a.z + b.z };
+        const __m256i c = _mm256_set1_epi32(int(ColorToU32(color)));
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(mask + i)));
+            __m256i* p = (__m256i*)(dest + i);
+            const __m256i d = _mm256_loadu_si256(p);
+            _mm256_storeu_si256(p, _mm256_blendv_epi8(c, d, _mm256_cmpeq_epi32(m, zero)));
+        }
+        MaskRowScalar(dest + i, mask + i, count - i, color);
     }
 
-    Vec3d operator-(const Vec3d a, const Vec3d& b)
+    GEDO_TARGET_AVX2 static __m256i BlendAvx2(__m256i s, __m256i d)
     {
-        return Vec3d{ a.x - b.x, a.y - b.y, a.z - b.z };
+        const __m256i one = _mm256_set1_epi16(255);
+        const __m256i alphaLanes = _mm256_set_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+        const __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0), 0);
+        const __m256i ia = _mm256_sub_epi16(one, a);
+        const __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_or_si256(s, alphaLanes), a),
+                                           _mm256_mullo_epi16(d, ia));
+        const __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
     }
 
-    Vec3d operator*(const Vec3d a, const Vec3d& b)
+    GEDO_TARGET_AVX2 static void BlendRowAvx2(Color* dest, const Color* src, size_t count)
     {
-        return Vec3d{ a.x * b.x, a.y * b.y, a.z * b.z };
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            // unpack and pack work per 128 bit lane so the pixel order is kept.
+            const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+            const __m256i d = _mm256_loadu_si256((const __m256i*)(dest + i));
+            const __m256i lo = BlendAvx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+            const __m256i hi = BlendAvx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+            _mm256_storeu_si256((__m256i*)(dest + i), _mm256_packus_epi16(lo, hi));
+        }
+        BlendRowSse2(dest + i, src + i, count - i);
+    }
+#elif defined GEDO_ARCH_ARM64
+    static void FillRowNeon(Color* dest, size_t count, Color color)
+    {
+        const uint32x4_t c = vdupq_n_u32(ColorToU32(color));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            vst1q_u32((uint32_t*)(dest + i), c);
+        }
+        FillRowScalar(dest + i, count - i, color);
     }
 
-    Vec3d operator*(const Vec3d a, double x)
+    static void MaskRowNeon(Color* dest, const uint8_t* mask, size_t count, Color color)
     {
-        return Vec3d{ a.x * x, a.y * x, a.z * x };
+        const uint32x4_t c = vdupq_n_u32(ColorToU32(color));
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            // all ones for the pixels that are kept, widened from 8 to 32 bits.
+            const int8x16_t keep8 = vreinterpretq_s8_u8(vceqq_u8(vld1q_u8(mask + i), vdupq_n_u8(0)));
+            const int16x8_t keep16[2] = {vmovl_s8(vget_low_s8(keep8)), vmovl_s8(vget_high_s8(keep8))};
+            for (size_t j = 0; j < 4; ++j)
+            {
+                const int16x8_t k = keep16[j / 2];
+                const uint32x4_t keep = vreinterpretq_u32_s32(vmovl_s16((j & 1) ? vget_high_s16(k) : vget_low_s16(k)));
+                uint32_t* p = (uint32_t*)(dest + i + 4 * j);
+                vst1q_u32(p, vbslq_u32(keep, vld1q_u32(p), c));
+            }
+        }
+        MaskRowScalar(dest + i, mask + i, count - i, color);
     }
 
-    Vec3d operator*(double x, const Vec3d a)
+    static void BlendRowNeon(Color* dest, const Color* src, size_t count)
     {
-        return Vec3d{ a.x * x, a.y * x, a.z * x };
+        static const uint8_t alphaIndices[16] = {0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12};
+        static const uint8_t alphaBytes[16] = {255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0};
+        const uint8x16_t indices = vld1q_u8(alphaIndices);
+        const uint8x16_t alphaLanes = vld1q_u8(alphaBytes);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const uint8x16_t s = vld1q_u8((const uint8_t*)(src + i));
+            const uint8x16_t d = vld1q_u8((const uint8_t*)(dest + i));
+            const uint8x16_t a = vqtbl1q_u8(s, indices);
+            const uint8x16_t ia = vmvnq_u8(a);
+            const uint8x16_t s1 = vorrq_u8(s, alphaLanes);
+            uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(s1), vget_low_u8(a)), vget_low_u8(d), vget_low_u8(ia));
+            uint16x8_t hi = vmlal_high_u8(vmull_high_u8(s1, a), d, ia);
+            // (x + 128 + ((x + 128) >> 8)) >> 8 as in DivideBy255.
+            lo = vrsraq_n_u16(lo, lo, 8);
+            hi = vrsraq_n_u16(hi, hi, 8);
+            vst1q_u8((uint8_t*)(dest + i), vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+        }
+        BlendRowScalar(dest + i, src + i, count - i);
     }
+#endif
 
-    double DotProduct(const Vec3d a, const Vec3d& b)
+    static BitmapKernels SelectBitmapKernels()
     {
-        return a.x * b.x + a.y * b.y + a.z * b.z;
+        BitmapKernels result;
+        result.fill = FillRowScalar;
+        result.mask = MaskRowScalar;
+        result.blend = BlendRowScalar;
+        const CpuFeatures& cpu = GetCpuFeatures();
+#if defined GEDO_ARCH_X86
+        if (cpu.sse2)
+        {
+            result.fill = FillRowSse2;
+            result.mask = MaskRowSse2;
+            result.blend = BlendRowSse2;
+        }
+        if (cpu.avx2)
+        {
+            result.mask = MaskRowAvx2;
+            result.blend = BlendRowAvx2;
+        }
+#elif defined GEDO_ARCH_ARM64
+        if (cpu.neon)
+        {
+            result.fill = FillRowNeon;
+            result.mask = MaskRowNeon;
+            result.blend = BlendRowNeon;
+        }
+#else
+        (void)cpu;
+#endif
+        return result;
     }
 
-    double DotProduct(const Vec2d a, const Vec2d& b)
+    static const BitmapKernels& GetBitmapKernels()
     {
-        return a.x * b.x + a.y * b.y;
+        static const BitmapKernels kernels = SelectBitmapKernels();
+        return kernels;
     }
 
-    Mat4 operator*(const Mat4& left, const Mat4& right)
+    // clips area to dest and to a (width X height) source, false when nothing
+    // is left.
+    static bool ClipRect(const ColorBitmap& dest, Rect& area, size_t width, size_t height)
     {
-        Mat4 result;
-        for (int columns = 0; columns < 4; ++columns)
+        if (area.x >= dest.width || area.y >= dest.height)
         {
-            for (int rows = 0; rows < 4; ++rows)
-            {
-                double sum = 0;
-                for (int currentMatrice = 0; currentMatrice < 4; ++currentMatrice)
-                {
-                    sum += left.elements[currentMatrice][rows] * right.elements[columns][currentMatrice];
-                }
-                result.elements[columns][rows] = sum;
-            }
+            return false;
         }
-        return result;
+        area.width = Min(Min(area.width, dest.width - area.x), width);
+        area.height = Min(Min(area.height, dest.height - area.y), height);
+        return area.width && area.height;
     }
 
-    Mat4 operator*(Mat4 left, double x)
+    void FillRectangle(ColorBitmap& dest, Rect fillArea, const ColorBitmap& src)
     {
-        for (int columns = 0; columns < 4; ++columns)
+        if (!ClipRect(dest, fillArea, src.width, src.height))
         {
-            for (int rows = 0; rows < 4; ++rows)
-            {
-                left.elements[columns][rows] *= x;
-            }
+            return;
+        }
+        for (size_t y = 0; y < fillArea.height; ++y)
+        {
+            memcpy(dest.data + (fillArea.y + y) * dest.width + fillArea.x, src.data + y * src.width,
+                   fillArea.width * sizeof(Color));
         }
-        return left;
     }
 
-    Vec3d operator*(const Mat3 a, const Vec3d& v)
+    void FillRectangle(ColorBitmap& dest, Rect fillArea, const Bitmap& mask, Color c)
     {
-        Vec3d r;
-        for (int rows = 0; rows < 3; ++rows)
+        if (!ClipRect(dest, fillArea, mask.width, mask.height))
         {
-            double sum = 0;
-            for (int columns = 0; columns < 3; ++columns)
-            {
-                sum += a.elements[columns][rows] * v.data[columns];
-            }
-            r.data[rows] = sum;
+            return;
+        }
+        const MaskRowKernel kernel = GetBitmapKernels().mask;
+        for (size_t y = 0; y < fillArea.height; ++y)
+        {
+            kernel(dest.data + (fillArea.y + y) * dest.width + fillArea.x, mask.data + y * mask.width,
+                   fillArea.width, c);
         }
-        return r;
     }
 
-    Vec3d CrossProduct(const Vec3d a, const Vec3d& b)
+    void FillRectangle(ColorBitmap& dest, Rect fillArea, Color color)
     {
-        return Vec3d{ a.y * b.z - a.z * b.y,
-                      a.z * b.x - a.x * b.z,
-                      a.x * b.y - a.y * b.x };
+        if (!ClipRect(dest, fillArea, fillArea.width, fillArea.height))
+        {
+            return;
+        }
+        Color* first = dest.data + fillArea.y * dest.width + fillArea.x;
+        GetBitmapKernels().fill(first, fillArea.width, color);
+        // the other rows are copies of the first one.
+        for (size_t y = 1; y < fillArea.height; ++y)
+        {
+            memcpy(first + y * dest.width, first, fillArea.width * sizeof(Color));
+        }
     }
 
-    double Length(const Vec2d& v)
+    void BlendRectangle(ColorBitmap& dest, Rect blendArea, const ColorBitmap& src)
     {
-        return sqrtf(v.x * v.x + v.y * v.y);
+        if (!ClipRect(dest, blendArea, src.width, src.height))
+        {
+            return;
+        }
+        const BlendRowKernel kernel = GetBitmapKernels().blend;
+        for (size_t y = 0; y < blendArea.height; ++y)
+        {
+            kernel(dest.data + (blendArea.y + y) * dest.width + blendArea.x, src.data + y * src.width,
+                   blendArea.width);
+        }
     }
 
-    double Length(const Vec3d& v)
+    Color CreateColor(uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
     {
-        return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+        Color c;
+        c.r = red;
+        c.g = green;
+        c.b = blue;
+        c.a = alpha;
+        return c;
     }
 
-    void Normalise(Vec2d& v)
+    ColorBitmap CreateColorBitmap(size_t width, size_t height, Allocator& allocator)
     {
-        const double length = Length(v);
-        v.x /= length;
-        v.y /= length;
+        ColorBitmap result;
+        result.width = width;
+        result.height = height;
+        MemoryBlock block = Allocate(sizeof(Color) * width * height, allocator);
+        GEDO_ASSERT(block.data);
+        result.data = (Color*)block.data;
+        return result;
+    }
+
+    void FreeColorBitmap(ColorBitmap& bitmap, Allocator& allocator)
+    {
+        GEDO_ASSERT(bitmap.data);
+        MemoryBlock block;
+        block.data = (uint8_t*)bitmap.data;
+        block.size = bitmap.width * bitmap.height * sizeof(Color);
+        Deallocate(block, allocator);
+        bitmap.data = NULL;
+    }
+
+    Bitmap CreateBitmap(size_t width, size_t height, Allocator& allocator)
+    {
+        Bitmap result;
+        result.width = width;
+        result.height = height;
+        MemoryBlock block = Allocate(sizeof(uint8_t) * width * height, allocator);
+        GEDO_ASSERT(block.data);
+        result.data = (uint8_t*)block.data;
+        return result;
+    }
+
+    void FreeBitmap(Bitmap& bitmap, Allocator& allocator)
+    {
+        GEDO_ASSERT(bitmap.data);
+        MemoryBlock block;
+        block.data = (uint8_t*)bitmap.data;
+        block.size = bitmap.width * bitmap.height * sizeof(uint8_t);
+        Deallocate(block, allocator);
+        bitmap.data = NULL;
+    }
+    //-----------------------------------------------------------//
+
+    //--------------------------------File IO---------------------//
+#if defined GEDO_OS_WINDOWS
+    struct Utf16String
+    {
+        Allocator* allocator = &GetDefaultAllocator();
+        MemoryBlock memory;
+        wchar_t* text = NULL;
+        size_t size = 0;
+    };
+
+    static void FreeUtf16String(Utf16String& w)
+    {
+        if (w.memory.data)
+        {
+            Deallocate(w.memory, *w.allocator);
+        }
+    }
+
+    static Utf16String UTF8ToUTF16(const char* fileName, Allocator& allocator)
+    {
+        const size_t len = strlen(fileName);
+        const size_t wlen = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, fileName, len, NULL, 0);
+        Utf16String result;
+        result.allocator = &allocator;
+        result.memory = Allocate(sizeof(wchar_t) * (wlen + 1), allocator);
+        result.text = (wchar_t*)result.memory.data;
+        result.size = wlen;
+        ZeroMemoryBlock(result.memory);
+        MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, fileName, len, result.text, result.size);
+        return result;
+    }
+
+    static HANDLE GetFileHandle(const char* fileName, bool read, Allocator& allocator)
+    {
+        if (!fileName)
+        {
+            return NULL;
+        }
+        Utf16String string = UTF8ToUTF16(fileName, allocator);
+        defer(FreeUtf16String(string));
+        HANDLE handle = NULL;
+        if (read)
+        {
+            handle = CreateFile(string.text,     // file to open
+                                GENERIC_READ,    // open for reading
+                                FILE_SHARE_READ, // share for reading
+                                NULL,            // default security
+                                OPEN_EXISTING,   // existing file only
+                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, // normal file
+                                NULL);
+        }
+        else
+        {
+            handle = CreateFile(string.text,           // name of the write
+                                GENERIC_WRITE,         // open for writing
+                                0,                     // do not share
+                                NULL,                  // default security
+                                CREATE_NEW,            // create new file only
+                                FILE_ATTRIBUTE_NORMAL, // normal file
+                                NULL);
+        }
+        return handle;
+    }
+
+    MemoryBlock ReadFile(const char* fileName, Allocator& allocator)
+    {
+        MemoryBlock result;
+        const int64_t fileSize = GetFileSize(fileName);
+        if (fileSize < 0)
+        {
+            return result;
+        }
+        result = Allocate(fileSize + 1, allocator);
+        HANDLE handle = GetFileHandle(fileName, true, allocator);
+        defer(CloseHandle(handle));
+        OVERLAPPED overlapped = {};
+        const bool success = ReadFileEx(handle,
+                                        result.data,
+                                        result.size - 1,
+                                        &overlapped,
+                                        NULL);
+        GEDO_ASSERT(success);
+        return result;
+    }
+
+    bool WriteFile(const char* fileName, MemoryBlock block, Allocator& allocator)
+    {
+        HANDLE handle = GetFileHandle(fileName, false, allocator);
+        if (handle)
+        {
+            defer(CloseHandle(handle));
+            OVERLAPPED overlapped = {};
+            return WriteFileEx(handle, block.data, block.size - 1, &overlapped, NULL);
+        }
+        return false;
+    }
+
+    bool DoesFileExist(const char* fileName, Allocator& allocator)
+    {
+        HANDLE handle = GetFileHandle(fileName, true, allocator);
+        const bool found = handle != INVALID_HANDLE_VALUE;
+        if (found)
+        {
+            CloseHandle(handle);
+        }
+        return found;
+    }
+
+    int64_t GetFileSize(const char* fileName, Allocator& allocator)
+    {
+        HANDLE handle = GetFileHandle(fileName, true, allocator);
+        const bool found = handle != INVALID_HANDLE_VALUE;
+        if (found)
+        {
+            LARGE_INTEGER size;
+            GetFileSizeEx(handle, &size);
+            CloseHandle(handle);
+            return size.QuadPart;
+        }
+        return -1;
+    }
+
+    PathType GetPathType(const char* path, Allocator& allocator)
+    {
+        HANDLE handle = GetFileHandle(path, true, allocator);
+        const bool found = handle != INVALID_HANDLE_VALUE;
+        if (found)
+        {
+            defer(CloseHandle(handle));
+            FILE_BASIC_INFO basicInfo;
+            GetFileInformationByHandleEx(handle, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+            return (basicInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                ? PathType::DIRECTORY
+                : PathType::FILE;
+        }
+        return PathType::FAILURE;
+    }
+
+    MemoryBlock MapFile(const char* fileName, Allocator& allocator)
+    {
+        MemoryBlock result;
+        if (!fileName)
+        {
+            return result;
+        }
+        Utf16String string = UTF8ToUTF16(fileName, allocator);
+        defer(FreeUtf16String(string));
+        HANDLE file = CreateFile(string.text, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return result;
+        }
+        defer(CloseHandle(file));
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            return result;
+        }
+        // the view keeps the mapping alive after the handles are closed.
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping)
+        {
+            return result;
+        }
+        defer(CloseHandle(mapping));
+        void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (view)
+        {
+            result.data = (uint8_t*)view;
+            result.size = size.QuadPart;
+        }
+        return result;
+    }
+
+    void UnmapFile(MemoryBlock& block)
+    {
+        if (block.data)
+        {
+            UnmapViewOfFile(block.data);
+        }
+        block = MemoryBlock{};
+    }
+
+    static bool OpenFileHandle(const char* fileName, uint64_t& handle, Allocator& allocator)
+    {
+        Utf16String string = UTF8ToUTF16(fileName, allocator);
+        defer(FreeUtf16String(string));
+        HANDLE h = CreateFile(string.text, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        handle = (uint64_t)h;
+        return h != INVALID_HANDLE_VALUE;
+    }
+
+    static bool WriteToHandle(uint64_t handle, const uint8_t* data, size_t size)
+    {
+        while (size)
+        {
+            const DWORD chunk = (DWORD)Min(size, (size_t)1 << 30);
+            DWORD written = 0;
+            if (!::WriteFile((HANDLE)handle, data, chunk, &written, NULL) || !written)
+            {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static void CloseFileHandle(uint64_t handle)
+    {
+        CloseHandle((HANDLE)handle);
+    }
+#elif defined GEDO_OS_LINUX
+    MemoryBlock ReadFile(const char* fileName, Allocator& allocator)
+    {
+        FILE* fp = fopen(fileName, "r");
+        MemoryBlock result;
+        if (fp)
+        {
+            fseek(fp, 0, SEEK_END);
+            const int64_t size = ftell(fp);
+            fseek(fp, 0, SEEK_SET);
+            result = Allocate(size + 1, allocator);
+            fread(result.data, 1, size, fp);
+            result.data[size] = 0;
+            fclose(fp);
+        }
+        return result;
+    }
+
+    bool WriteFile(const char* fileName, MemoryBlock block, Allocator& allocator)
+    {
+        FILE* fp = fopen(fileName, "w");
+        if (fp)
+        {
+            fwrite(block.data, 1, block.size, fp);
+            fclose(fp);
+            return true;
+        }
+        return false;
+    }
+
+    bool DoesFileExist(const char* fileName, Allocator& allocator)
+    {
+        FILE* fp = fopen(fileName, "r");
+        if (fp)
+        {
+            fclose(fp);
+            return true;
+        }
+        return false;
+    }
+
+    int64_t GetFileSize(const char* fileName, Allocator& allocator)
+    {
+        FILE* fp = fopen(fileName, "r");
+        if (fp)
+        {
+            fseek(fp, 0, SEEK_END);
+            const int64_t size = ftell(fp);
+            fclose(fp);
+            return size;
+        }
+        return -1;
+    }
+
+    PathType GetPathType(const char* path, Allocator& allocator)
+    {
+        struct stat s;
+        if (stat(path, &s) == 0)
+        {
+            if (s.st_mode & S_IFDIR)
+            {
+                return PathType::DIRECTORY;
+            }
+            else if (s.st_mode & S_IFREG)
+            {
+                return PathType::FILE;
+            }
+        }
+        return PathType::FAILURE;
+    }
+
+    MemoryBlock MapFile(const char* fileName, Allocator& allocator)
+    {
+        MemoryBlock result;
+        const int fd = fileName ? open(fileName, O_RDONLY) : -1;
+        if (fd < 0)
+        {
+            return result;
+        }
+        defer(close(fd));
+        struct stat s;
+        if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size == 0)
+        {
+            return result;
+        }
+        // the mapping stays valid after the file is closed.
+        void* data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            result.data = (uint8_t*)data;
+            result.size = s.st_size;
+        }
+        return result;
+    }
+
+    void UnmapFile(MemoryBlock& block)
+    {
+        if (block.data)
+        {
+            munmap(block.data, block.size);
+        }
+        block = MemoryBlock{};
+    }
+
+    static bool OpenFileHandle(const char* fileName, uint64_t& handle, Allocator&)
+    {
+        const int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        handle = (uint64_t)(int64_t)fd;
+        return fd >= 0;
+    }
+
+    static bool WriteToHandle(uint64_t handle, const uint8_t* data, size_t size)
+    {
+        while (size)
+        {
+            const ssize_t written = write((int)handle, data, size);
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static void CloseFileHandle(uint64_t handle)
+    {
+        close((int)handle);
+    }
+#endif
+
+    bool OpenFileWriter(FileWriter& writer, const char* fileName, size_t bufferSize, Allocator& allocator)
+    {
+        writer = FileWriter{};
+        if (!fileName || !OpenFileHandle(fileName, writer.handle, allocator))
+        {
+            return false;
+        }
+        writer.allocator = &allocator;
+        writer.buffer = Allocate(Max(bufferSize, (size_t)1), allocator);
+        return true;
+    }
+
+    static void FlushFileWriter(FileWriter& writer)
+    {
+        if (writer.used)
+        {
+            writer.failed = writer.failed || !WriteToHandle(writer.handle, writer.buffer.data, writer.used);
+            writer.used = 0;
+        }
+    }
+
+    void WriteToFile(FileWriter& writer, const void* data, size_t size)
+    {
+        if (writer.failed || !writer.buffer.data)
+        {
+            writer.failed = true;
+            return;
+        }
+        if (writer.used + size > writer.buffer.size)
+        {
+            FlushFileWriter(writer);
+            if (size >= writer.buffer.size)
+            {
+                writer.failed = writer.failed || !WriteToHandle(writer.handle, (const uint8_t*)data, size);
+                return;
+            }
+        }
+        GEDO_MEMCPY(writer.buffer.data + writer.used, data, size);
+        writer.used += size;
+    }
+
+    bool CloseFileWriter(FileWriter& writer)
+    {
+        if (!writer.buffer.data)
+        {
+            return false;
+        }
+        FlushFileWriter(writer);
+        CloseFileHandle(writer.handle);
+        Deallocate(writer.buffer, *writer.allocator);
+        const bool success = !writer.failed;
+        writer = FileWriter{};
+        return success;
+    }
+    //------------------------------------------------------------//
+
+    //----------------------Matrix files--------------------------//
+    static const char MATRIX_FILE_MAGIC[8] = {'G', 'E', 'D', 'O', 'M', 'A', 'T', 'X'};
+    static const uint32_t MATRIX_FILE_VERSION = 1;
+    static const size_t MATRIX_FILE_ALIGNMENT = 64;
+
+    struct MatrixFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint8_t padding[48];
+    };
+
+    struct MatrixRecordHeader
+    {
+        uint64_t rows;
+        uint64_t cols;
+        uint32_t type;
+        uint32_t nameLength;
+        uint64_t payloadSize;
+        uint32_t layout;
+        uint32_t reserved;
+        uint64_t nonZeros;
+        uint8_t padding[16];
+    };
+
+    enum MatrixRecordLayout : uint32_t
+    {
+        MATRIX_LAYOUT_DENSE = 0,
+        MATRIX_LAYOUT_CSR = 1,
+        MATRIX_LAYOUT_CSC = 2,
+    };
+
+    static_assert(sizeof(MatrixFileHeader) == MATRIX_FILE_ALIGNMENT, "header must be 64 bytes");
+    static_assert(sizeof(MatrixRecordHeader) == MATRIX_FILE_ALIGNMENT, "header must be 64 bytes");
+    static_assert(sizeof(size_t) == sizeof(uint64_t), "sparse offsets are stored as u64");
+
+    static size_t AlignToMatrixFile(size_t size)
+    {
+        return (size + MATRIX_FILE_ALIGNMENT - 1) & ~(MATRIX_FILE_ALIGNMENT - 1);
+    }
+
+    // the SparseMatrix arrays of a sparse record, they point into the mapping.
+    static SparseMatrix GetSparseRecordView(const MatrixRecord& record)
+    {
+        SparseMatrix m;
+        m.rows = record.rows;
+        m.cols = record.cols;
+        m.nonZeros = record.nonZeros;
+        m.format = record.format;
+        const size_t major = record.format == SparseFormat::CSR ? record.rows : record.cols;
+        m.offsets = (size_t*)record.data;
+        m.values = (double*)(m.offsets + major + 1);
+        m.indices = (uint32_t*)(m.values + m.nonZeros);
+        return m;
+    }
+
+    static size_t GetSparsePayloadSize(size_t major, size_t nonZeros)
+    {
+        return (major + 1) * sizeof(uint64_t) + nonZeros * (sizeof(double) + sizeof(uint32_t));
+    }
+
+    // the offsets and indices are used to address memory so all of them are
+    // checked once when the file is opened.
+    static bool IsValidSparseRecord(const MatrixRecord& record)
+    {
+        const SparseMatrix m = GetSparseRecordView(record);
+        const size_t major = m.format == SparseFormat::CSR ? m.rows : m.cols;
+        const size_t minor = m.format == SparseFormat::CSR ? m.cols : m.rows;
+        if (m.offsets[0] != 0 || m.offsets[major] != m.nonZeros)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < major; ++i)
+        {
+            if (m.offsets[i] > m.offsets[i + 1] || m.offsets[i + 1] > m.nonZeros)
+            {
+                return false;
+            }
+        }
+        for (size_t k = 0; k < m.nonZeros; ++k)
+        {
+            if (m.indices[k] >= minor)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool OpenMatrixFile(const char* fileName, MatrixFile& file, Allocator& allocator)
+    {
+        file.records.clear();
+        file.mapping = MapFile(fileName, allocator);
+        const uint8_t* data = file.mapping.data;
+        const size_t size = file.mapping.size;
+        MatrixFileHeader header;
+        if (size < sizeof(header))
+        {
+            CloseMatrixFile(file);
+            return false;
+        }
+        GEDO_MEMCPY(&header, data, sizeof(header));
+        if (GEDO_MEMCMP(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != MATRIX_FILE_VERSION)
+        {
+            CloseMatrixFile(file);
+            return false;
+        }
+        file.records.reserve(header.count);
+        size_t offset = sizeof(header);
+        for (uint32_t i = 0; i < header.count; ++i)
+        {
+            MatrixRecordHeader recordHeader;
+            if (size - offset < sizeof(recordHeader))
+            {
+                CloseMatrixFile(file);
+                return false;
+            }
+            GEDO_MEMCPY(&recordHeader, data + offset, sizeof(recordHeader));
+            offset += sizeof(recordHeader);
+            MatrixRecord record;
+            record.rows = recordHeader.rows;
+            record.cols = recordHeader.cols;
+            record.type = (MatrixDataType)recordHeader.type;
+            record.sparse = recordHeader.layout != MATRIX_LAYOUT_DENSE;
+            record.format = recordHeader.layout == MATRIX_LAYOUT_CSC ? SparseFormat::CSC : SparseFormat::CSR;
+            record.nonZeros = record.sparse ? recordHeader.nonZeros : 0;
+            const size_t elementSize = GetElementSize(record.type);
+            const size_t nameSize = AlignToMatrixFile(recordHeader.nameLength);
+            // the sizes come from the file so the products are checked before
+            // they are used, a payloadSize near SIZE_MAX aligns to 0 so it is
+            // checked against the remaining bytes before and after the alignment.
+            const bool nameFits = nameSize <= size - offset;
+            const bool payloadFits = nameFits && recordHeader.payloadSize <= size - offset - nameSize;
+            const size_t payloadSize = payloadFits ? AlignToMatrixFile(recordHeader.payloadSize) : 0;
+            bool validPayload = false;
+            if (!record.sparse)
+            {
+                validPayload = elementSize &&
+                    (!record.cols || record.rows <= SIZE_MAX / elementSize / record.cols) &&
+                    recordHeader.payloadSize == record.rows * record.cols * elementSize;
+            }
+            else
+            {
+                const size_t major = record.format == SparseFormat::CSR ? record.rows : record.cols;
+                validPayload = recordHeader.layout <= MATRIX_LAYOUT_CSC && record.type == MatrixDataType::FLOAT64 &&
+                    record.rows <= UINT32_MAX && record.cols <= UINT32_MAX && record.nonZeros <= SIZE_MAX / 16 &&
+                    (!record.cols || record.nonZeros / record.cols <= record.rows) &&
+                    recordHeader.payloadSize == GetSparsePayloadSize(major, record.nonZeros);
+            }
+            const bool valid = validPayload && payloadFits && payloadSize >= recordHeader.payloadSize &&
+                payloadSize <= size - offset - nameSize;
+            if (!valid)
+            {
+                CloseMatrixFile(file);
+                return false;
+            }
+            record.name.data = (const char*)data + offset;
+            record.name.size = recordHeader.nameLength;
+            offset += nameSize;
+            record.data = data + offset;
+            offset += payloadSize;
+            if (record.sparse && !IsValidSparseRecord(record))
+            {
+                CloseMatrixFile(file);
+                return false;
+            }
+            file.records.push_back(record);
+        }
+        return true;
+    }
+
+    void CloseMatrixFile(MatrixFile& file)
+    {
+        UnmapFile(file.mapping);
+        file.records.clear();
+    }
+
+    const MatrixRecord* FindMatrixRecord(const MatrixFile& file, const StringView name)
+    {
+        for (const MatrixRecord& record : file.records)
+        {
+            if (CompareStrings(record.name, name))
+            {
+                return &record;
+            }
+        }
+        return NULL;
+    }
+
+    Matrix CreateMatrixFromRecord(const MatrixRecord& record)
+    {
+        if (record.sparse)
+        {
+            return SparseToDense(GetSparseRecordView(record));
+        }
+        Matrix result = CreateMatrix(record.rows, record.cols, record.type);
+        GEDO_MEMCPY(result.data, record.data, record.rows * record.cols * GetElementSize(record.type));
+        return result;
+    }
+
+    SparseMatrix CreateSparseMatrixFromRecord(const MatrixRecord& record)
+    {
+        GEDO_ASSERT(record.sparse);
+        return CopySparseMatrix(GetSparseRecordView(record));
+    }
+
+    static void WritePadding(FileWriter& writer, size_t size)
+    {
+        static const uint8_t zeros[MATRIX_FILE_ALIGNMENT] = {};
+        const size_t padding = AlignToMatrixFile(size) - size;
+        if (padding)
+        {
+            WriteToFile(writer, zeros, padding);
+        }
+    }
+
+    void WriteMatrixFileHeader(FileWriter& writer, size_t count)
+    {
+        GEDO_ASSERT(count <= UINT32_MAX);
+        MatrixFileHeader header = {};
+        GEDO_MEMCPY(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+        header.version = MATRIX_FILE_VERSION;
+        header.count = (uint32_t)count;
+        WriteToFile(writer, &header, sizeof(header));
+    }
+
+    void WriteMatrixRecord(FileWriter& writer, const StringView name, const Matrix& m)
+    {
+        MatrixRecordHeader header = {};
+        header.rows = m.rows;
+        header.cols = m.cols;
+        header.type = (uint32_t)m.type;
+        header.nameLength = (uint32_t)name.size;
+        const size_t elementSize = GetElementSize(m.type);
+        header.payloadSize = m.rows * m.cols * elementSize;
+        WriteToFile(writer, &header, sizeof(header));
+        WriteToFile(writer, name.data, name.size);
+        WritePadding(writer, name.size);
+        if (IsContiguous(m))
+        {
+            WriteToFile(writer, m.data, header.payloadSize);
+        }
+        else
+        {
+            for (size_t i = 0; i < m.rows; ++i)
+            {
+                for (size_t j = 0; j < m.cols; ++j)
+                {
+                    const size_t index = i * m.rowStride + j * m.colStride;
+                    WriteToFile(writer, (const uint8_t*)m.data + index * elementSize, elementSize);
+                }
+            }
+        }
+        WritePadding(writer, header.payloadSize);
+    }
+
+    void WriteMatrixRecord(FileWriter& writer, const StringView name, const SparseMatrix& m)
+    {
+        MatrixRecordHeader header = {};
+        header.rows = m.rows;
+        header.cols = m.cols;
+        header.type = (uint32_t)MatrixDataType::FLOAT64;
+        header.nameLength = (uint32_t)name.size;
+        header.layout = m.format == SparseFormat::CSR ? MATRIX_LAYOUT_CSR : MATRIX_LAYOUT_CSC;
+        header.nonZeros = m.nonZeros;
+        const size_t major = m.format == SparseFormat::CSR ? m.rows : m.cols;
+        header.payloadSize = GetSparsePayloadSize(major, m.nonZeros);
+        WriteToFile(writer, &header, sizeof(header));
+        WriteToFile(writer, name.data, name.size);
+        WritePadding(writer, name.size);
+        WriteToFile(writer, m.offsets, (major + 1) * sizeof(size_t));
+        WriteToFile(writer, m.values, m.nonZeros * sizeof(double));
+        WriteToFile(writer, m.indices, m.nonZeros * sizeof(uint32_t));
+        WritePadding(writer, header.payloadSize);
+    }
+    //------------------------------------------------------------//
+
+    //------------------------Text matrices-----------------------//
+    // bit i is for byte i of a 64 bytes block.
+    struct TextMasks
+    {
+        uint64_t newlines = 0;
+        uint64_t delimiters = 0;
+        uint64_t content = 0;   // not a space, CR, LF or blank (tab unless it is the delimiter).
+    };
+
+    typedef TextMasks (*ScanTextFunction)(const char* text, char delimiter, char blank);
+
+    static size_t PopCount(uint64_t v)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return (size_t)__builtin_popcountll(v);
+#else
+        size_t n = 0;
+        for (; v; v &= v - 1)
+        {
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    static TextMasks ScanTextScalar(const char* text, char delimiter, char blank)
+    {
+        TextMasks result;
+        for (size_t i = 0; i < 64; ++i)
+        {
+            const char c = text[i];
+            const uint64_t bit = uint64_t(1) << i;
+            result.newlines |= c == '\n' ? bit : 0;
+            result.delimiters |= c == delimiter ? bit : 0;
+            result.content |= (c != ' ' && c != blank && c != '\r' && c != '\n') ? bit : 0;
+        }
+        return result;
+    }
+
+#if defined GEDO_ARCH_X86
+    GEDO_TARGET_SSE2 static TextMasks ScanTextSse2(const char* text, char delimiter, char blank)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i delimiters = _mm_set1_epi8(delimiter);
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i blanks = _mm_set1_epi8(blank);
+        const __m128i cr = _mm_set1_epi8('\r');
+        TextMasks result;
+        for (size_t i = 0; i < 64; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(text + i));
+            const __m128i n = _mm_cmpeq_epi8(v, newline);
+            const __m128i empty = _mm_or_si128(_mm_or_si128(n, _mm_cmpeq_epi8(v, space)),
+                                               _mm_or_si128(_mm_cmpeq_epi8(v, blanks), _mm_cmpeq_epi8(v, cr)));
+            result.newlines |= uint64_t((uint32_t)_mm_movemask_epi8(n)) << i;
+            result.delimiters |= uint64_t((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, delimiters))) << i;
+            result.content |= uint64_t(~(uint32_t)_mm_movemask_epi8(empty) & 0xffff) << i;
+        }
+        return result;
+    }
+
+    GEDO_TARGET_AVX2 static TextMasks ScanTextAvx2(const char* text, char delimiter, char blank)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const __m256i delimiters = _mm256_set1_epi8(delimiter);
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i blanks = _mm256_set1_epi8(blank);
+        const __m256i cr = _mm256_set1_epi8('\r');
+        TextMasks result;
+        for (size_t i = 0; i < 64; i += 32)
+        {
+            const __m256i v = _mm256_loadu_si256((const __m256i*)(text + i));
+            const __m256i n = _mm256_cmpeq_epi8(v, newline);
+            const __m256i empty = _mm256_or_si256(_mm256_or_si256(n, _mm256_cmpeq_epi8(v, space)),
+                                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, blanks), _mm256_cmpeq_epi8(v, cr)));
+            result.newlines |= uint64_t((uint32_t)_mm256_movemask_epi8(n)) << i;
+            result.delimiters |= uint64_t((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, delimiters))) << i;
+            result.content |= uint64_t(~(uint32_t)_mm256_movemask_epi8(empty)) << i;
+        }
+        return result;
+    }
+#elif defined GEDO_ARCH_ARM64
+    // one bit per byte of the 4 masks like movemask, each byte keeps its bit
+    // of a weight and the pairwise adds pack them.
+    static uint64_t MoveMaskNeon(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3)
+    {
+        static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        const uint8x16_t w = vld1q_u8(weights);
+        uint8x16_t sum0 = vpaddq_u8(vandq_u8(m0, w), vandq_u8(m1, w));
+        const uint8x16_t sum1 = vpaddq_u8(vandq_u8(m2, w), vandq_u8(m3, w));
+        sum0 = vpaddq_u8(sum0, sum1);
+        sum0 = vpaddq_u8(sum0, sum0);
+        return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+    }
+
+    static TextMasks ScanTextNeon(const char* text, char delimiter, char blank)
+    {
+        uint8x16_t newlines[4];
+        uint8x16_t delimiters[4];
+        uint8x16_t content[4];
+        for (size_t i = 0; i < 4; ++i)
+        {
+            const uint8x16_t v = vld1q_u8((const uint8_t*)text + 16 * i);
+            newlines[i] = vceqq_u8(v, vdupq_n_u8('\n'));
+            delimiters[i] = vceqq_u8(v, vdupq_n_u8((uint8_t)delimiter));
+            const uint8x16_t empty = vorrq_u8(vorrq_u8(newlines[i], vceqq_u8(v, vdupq_n_u8(' '))),
+                                              vorrq_u8(vceqq_u8(v, vdupq_n_u8((uint8_t)blank)), vceqq_u8(v, vdupq_n_u8('\r'))));
+            content[i] = vmvnq_u8(empty);
+        }
+        TextMasks result;
+        result.newlines = MoveMaskNeon(newlines[0], newlines[1], newlines[2], newlines[3]);
+        result.delimiters = MoveMaskNeon(delimiters[0], delimiters[1], delimiters[2], delimiters[3]);
+        result.content = MoveMaskNeon(content[0], content[1], content[2], content[3]);
+        return result;
+    }
+#endif
+
+    static ScanTextFunction SelectScanText()
+    {
+        const CpuFeatures& cpu = GetCpuFeatures();
+#if defined GEDO_ARCH_X86
+        if (cpu.avx2)
+        {
+            return ScanTextAvx2;
+        }
+        if (cpu.sse2)
+        {
+            return ScanTextSse2;
+        }
+#elif defined GEDO_ARCH_ARM64
+        if (cpu.neon)
+        {
+            return ScanTextNeon;
+        }
+#else
+        (void)cpu;
+#endif
+        return ScanTextScalar;
+    }
+
+    static ScanTextFunction GetScanText()
+    {
+        static const ScanTextFunction scan = SelectScanText();
+        return scan;
+    }
+
+    // [begin, end) are whole lines, only the last chunk can end without LF.
+    struct TextChunk
+    {
+        size_t begin = 0;
+        size_t end = 0;
+        size_t lines = 0;       // lines that have content, one row each.
+        size_t rawLines = 0;
+        size_t maxFields = 0;
+        size_t firstRow = 0;
+        size_t firstLine = 0;   // lines before the chunk, for the errors.
+        size_t errorLine = 0;   // 1 based in the chunk, 0 when it parsed.
+    };
+
+    // whitespace is set when the fields are split by runs of blanks, a field
+    // then starts at every byte of content that follows a blank.
+    static void CountTextChunk(const char* text, char delimiter, bool whitespace, ScanTextFunction scan,
+                               TextChunk& chunk)
+    {
+        const char blank = delimiter == '\t' ? ' ' : '\t';
+        size_t fields = 0;
+        bool content = false;
+        char padded[64];
+        for (size_t i = chunk.begin; i < chunk.end; i += 64)
+        {
+            const char* block = text + i;
+            if (chunk.end - i < 64)
+            {
+                // spaces don't change the masks.
+                GEDO_MEMSET(padded, ' ', sizeof(padded));
+                GEDO_MEMCPY(padded, block, chunk.end - i);
+                block = padded;
+            }
+            TextMasks masks = scan(block, delimiter, blank);
+            // the byte before a block is content only inside a line.
+            const uint64_t before = (i > chunk.begin && content && text[i - 1] != ' ' && text[i - 1] != blank &&
+                                     text[i - 1] != '\r') ? 1 : 0;
+            uint64_t separators = whitespace ? masks.content & ~((masks.content << 1) | before) : masks.delimiters;
+            uint64_t newlines = masks.newlines;
+            while (newlines)
+            {
+                // the bytes up to the first newline.
+                const uint64_t line = newlines ^ (newlines - 1);
+                fields += PopCount(separators & line);
+                content = content || (masks.content & line);
+                chunk.rawLines++;
+                if (content)
+                {
+                    chunk.lines++;
+                    chunk.maxFields = Max(chunk.maxFields, whitespace ? fields : fields + 1);
+                }
+                fields = 0;
+                content = false;
+                separators &= ~line;
+                masks.content &= ~line;
+                newlines &= newlines - 1;
+            }
+            fields += PopCount(separators);
+            content = content || masks.content;
+        }
+        if (content)
+        {
+            chunk.rawLines++;
+            chunk.lines++;
+            chunk.maxFields = Max(chunk.maxFields, whitespace ? fields : fields + 1);
+        }
+    }
+
+    static bool IsTextBlank(char c, char delimiter)
+    {
+        return c == ' ' || c == '\r' || (c == '\t' && delimiter != '\t');
+    }
+
+    // writes the rows of chunk to out, fields of the skipped columns are not
+    // parsed so they can be text.
+    static void ParseTextChunk(const char* text, char delimiter, bool whitespace, size_t skipCols, size_t cols,
+                               TextChunk& chunk, double* out)
+    {
+        const size_t end = chunk.end;
+        double* row = out + chunk.firstRow * cols;
+        size_t i = chunk.begin;
+        for (size_t line = 1; i < end; ++line)
+        {
+            size_t field = 0;
+            bool content = false;
+            for (;;)
+            {
+                while (i < end && IsTextBlank(text[i], delimiter))
+                {
+                    i++;
+                }
+                if (i == end || text[i] == '\n')
+                {
+                    break;
+                }
+                content = true;
+                const bool empty = !whitespace && text[i] == delimiter;
+                if (field < skipCols)
+                {
+                    while (i < end && text[i] != '\n' && text[i] != delimiter && !(whitespace && IsTextBlank(text[i], delimiter)))
+                    {
+                        i++;
+                    }
+                }
+                else
+                {
+                    double value = 0;
+                    if (!empty)
+                    {
+                        const size_t length = ScanFloat(text + i, end - i, value);
+                        i += length;
+                        while (i < end && IsTextBlank(text[i], delimiter))
+                        {
+                            i++;
+                        }
+                        if (!length || (i < end && text[i] != '\n' && !whitespace && text[i] != delimiter) ||
+                            (whitespace && i < end && text[i] != '\n' && !IsTextBlank(text[i - 1], delimiter)))
+                        {
+                            chunk.errorLine = line;
+                            return;
+                        }
+                    }
+                    if (field - skipCols < cols)
+                    {
+                        row[field - skipCols] = value;
+                    }
+                }
+                field++;
+                if (!whitespace && i < end && text[i] == delimiter)
+                {
+                    i++;
+                }
+            }
+            i += i < end;
+            if (content)
+            {
+                for (size_t j = Max(field, skipCols) - skipCols; j < cols; ++j)
+                {
+                    row[j] = 0;
+                }
+                row += cols;
+            }
+        }
+    }
+
+    // the first ',', ';' or tab before the end of the line at text.
+    static char DetectDelimiter(const char* text, size_t size)
+    {
+        for (size_t i = 0; i < size && text[i] != '\n'; ++i)
+        {
+            if (text[i] == ',' || text[i] == ';' || text[i] == '\t')
+            {
+                return text[i];
+            }
+        }
+        return ' ';
+    }
+
+    TextMatrixResult ParseTextMatrix(const char* text, size_t size, const TextMatrixOptions& options,
+                                     Allocator& allocator)
+    {
+        TextMatrixResult result;
+        size_t start = 0;
+        for (size_t r = 0; r < options.skipRows && start < size; ++r)
+        {
+            const char* next = (const char*)memchr(text + start, '\n', size - start);
+            start = next ? next - text + 1 : size;
+        }
+        const char delimiter = options.delimiter ? options.delimiter : DetectDelimiter(text + start, size - start);
+        const bool whitespace = delimiter == ' ';
+
+        // chunks start after the first LF from their nominal offset.
+        const size_t count = Max<size_t>((size - start + TEXT_MATRIX_CHUNK_SIZE - 1) / TEXT_MATRIX_CHUNK_SIZE, 1);
+        Array<TextChunk> chunks;
+        chunks.resize(count);
+        chunks[0].begin = start;
+        for (size_t c = 1; c < count; ++c)
+        {
+            const size_t nominal = Max(start + c * TEXT_MATRIX_CHUNK_SIZE - 1, chunks[c - 1].begin);
+            const char* next = (const char*)memchr(text + nominal, '\n', size - nominal);
+            chunks[c].begin = next ? next - text + 1 : size;
+            chunks[c - 1].end = chunks[c].begin;
+        }
+        chunks[count - 1].end = size;
+
+        const ScanTextFunction scan = GetScanText();
+        ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c)
+            {
+                CountTextChunk(text, delimiter, whitespace, scan, chunks[c]);
+            }
+        });
+        size_t rows = 0;
+        size_t maxFields = 0;
+        size_t lines = options.skipRows;
+        for (TextChunk& chunk : chunks)
+        {
+            chunk.firstRow = rows;
+            chunk.firstLine = lines;
+            rows += chunk.lines;
+            lines += chunk.rawLines;
+            maxFields = Max(maxFields, chunk.maxFields);
+        }
+        const size_t cols = maxFields > options.skipCols ? maxFields - options.skipCols : 0;
+        if (!rows || !cols)
+        {
+            result.matrix = CreateMatrix(0, 0, allocator);
+            result.success = true;
+            return result;
+        }
+
+        result.matrix = CreateMatrix(rows, cols, allocator);
+        double* out = result.matrix.data;
+        ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c)
+            {
+                ParseTextChunk(text, delimiter, whitespace, options.skipCols, cols, chunks[c], out);
+            }
+        });
+        for (const TextChunk& chunk : chunks)
+        {
+            if (chunk.errorLine)
+            {
+                result.errorLine = chunk.firstLine + chunk.errorLine;
+                FreeMatrix(result.matrix);
+                return result;
+            }
+        }
+        result.success = true;
+        return result;
+    }
+
+    TextMatrixResult ReadTextMatrix(const char* fileName, const TextMatrixOptions& options, Allocator& allocator)
+    {
+        MemoryBlock file = MapFile(fileName);
+        if (!file.size)
+        {
+            // an empty file can't be mapped.
+            TextMatrixResult result;
+            if (GetPathType(fileName) == PathType::FILE && GetFileSize(fileName) == 0)
+            {
+                result.matrix = CreateMatrix(0, 0, allocator);
+                result.success = true;
+            }
+            return result;
+        }
+        defer(UnmapFile(file));
+        return ParseTextMatrix((const char*)file.data, file.size, options, allocator);
+    }
+    //------------------------------------------------------------//
+
+    //---------------------------Images---------------------------//
+    struct ImageHeader
+    {
+        ImageInfo info;
+        size_t maxValue = 0;
+        size_t dataOffset = 0;
+    };
+
+    static bool IsImageSpace(uint8_t c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static bool ParseImageNumber(const MemoryBlock& file, size_t& offset, size_t& value)
+    {
+        while (offset < file.size)
+        {
+            if (file.data[offset] == '#')
+            {
+                while (offset < file.size && file.data[offset] != '\n')
+                {
+                    ++offset;
+                }
+            }
+            else if (IsImageSpace(file.data[offset]))
+            {
+                ++offset;
+            }
+            else
+            {
+                break;
+            }
+        }
+        const size_t start = offset;
+        value = 0;
+        while (offset < file.size && file.data[offset] >= '0' && file.data[offset] <= '9')
+        {
+            value = value * 10 + (file.data[offset++] - '0');
+            if (value > (1 << 30))
+            {
+                return false;
+            }
+        }
+        return offset != start;
+    }
+
+    static bool ParseImageHeader(const MemoryBlock& file, ImageHeader& header)
+    {
+        if (file.size < 2 || file.data[0] != 'P' || (file.data[1] != '5' && file.data[1] != '6'))
+        {
+            return false;
+        }
+        header.info.channels = file.data[1] == '5' ? 1 : 3;
+        size_t offset = 2;
+        if (!ParseImageNumber(file, offset, header.info.width) ||
+            !ParseImageNumber(file, offset, header.info.height) ||
+            !ParseImageNumber(file, offset, header.maxValue))
+        {
+            return false;
+        }
+        if (!header.info.width || !header.info.height || !header.maxValue || header.maxValue > 65535)
+        {
+            return false;
+        }
+        // a single white space separates the header from the samples.
+        if (offset >= file.size || !IsImageSpace(file.data[offset]))
+        {
+            return false;
+        }
+        ++offset;
+        const size_t sampleSize = header.maxValue > 255 ? 2 : 1;
+        // a row that doesn't fit in the file could overflow rowSize.
+        if (header.info.width > (file.size - offset) / (sampleSize * header.info.channels))
+        {
+            return false;
+        }
+        const size_t rowSize = sampleSize * header.info.channels * header.info.width;
+        if ((file.size - offset) / rowSize < header.info.height)
+        {
+            return false;
+        }
+        header.dataOffset = offset;
+        return true;
+    }
+
+    // dest[c][i] = src[i * stride + offsets[c]] for i in [begin, end).
+    static void BytesToPlanesScalar(const uint8_t* src, size_t begin, size_t end, size_t stride,
+                                    const size_t* offsets, size_t planes, double* const* dest)
+    {
+        for (size_t c = 0; c < planes; ++c)
+        {
+            const uint8_t* s = src + offsets[c];
+            double* d = dest[c];
+            for (size_t i = begin; i < end; ++i)
+            {
+                d[i] = s[i * stride];
+            }
+        }
+    }
+
+    // the inverse of BytesToPlanes, a NULL plane is 255. the values are
+    // clamped to [0, 255] (NaN is 0) and rounded to nearest even.
+    static void PlanesToBytesScalar(const double* const* src, size_t planes, size_t begin, size_t end,
+                                    uint8_t* dest, size_t stride, const size_t* offsets)
+    {
+        for (size_t c = 0; c < planes; ++c)
+        {
+            const double* s = src[c];
+            uint8_t* d = dest + offsets[c];
+            for (size_t i = begin; i < end; ++i)
+            {
+                double v = s ? s[i] : 255.0;
+                v = v > 0 ? (v < 255 ? v : 255) : 0;
+                d[i * stride] = (uint8_t)lrint(v);
+            }
+        }
+    }
+
+#if defined GEDO_ARCH_X86
+    // 4 pixels per step, for each plane a shuffle gathers its 4 bytes from the
+    // 16 loaded ones (stride <= 4) and they are widened to doubles.
+    GEDO_TARGET_AVX2 static void BytesToPlanesAvx2(const uint8_t* src, size_t count, size_t stride,
+                                                   const size_t* offsets, size_t planes, double* const* dest)
+    {
+        GEDO_ASSERT(stride <= 4 && planes <= 4);
+        __m128i masks[4];
+        for (size_t c = 0; c < planes; ++c)
+        {
+            alignas(16) int8_t mask[16];
+            GEDO_MEMSET(mask, -1, sizeof(mask));
+            for (size_t j = 0; j < 4; ++j)
+            {
+                mask[j] = (int8_t)(j * stride + offsets[c]);
+            }
+            masks[c] = _mm_load_si128((const __m128i*)mask);
+        }
+        size_t i = 0;
+        for (; i * stride + 16 <= count * stride; i += 4)
+        {
+            const __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * stride));
+            for (size_t c = 0; c < planes; ++c)
+            {
+                const __m128i bytes = _mm_shuffle_epi8(pixels, masks[c]);
+                _mm256_storeu_pd(dest[c] + i, _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(bytes)));
+            }
+        }
+        BytesToPlanesScalar(src, i, count, stride, offsets, planes, dest);
+    }
+
+    // each plane gives 4 rounded int32s, they are packed to the bytes of plane
+    // c pixel j at c * 4 + j and a shuffle puts them at j * stride + offsets[c].
+    GEDO_TARGET_AVX2 static void PlanesToBytesAvx2(const double* const* src, size_t planes, size_t count,
+                                                   uint8_t* dest, size_t stride, const size_t* offsets)
+    {
+        GEDO_ASSERT(stride <= 4 && planes <= 4);
+        alignas(16) int8_t mask[16];
+        GEDO_MEMSET(mask, -1, sizeof(mask));
+        for (size_t c = 0; c < planes; ++c)
+        {
+            for (size_t j = 0; j < 4; ++j)
+            {
+                mask[j * stride + offsets[c]] = (int8_t)(c * 4 + j);
+            }
+        }
+        const __m128i interleave = _mm_load_si128((const __m128i*)mask);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d maxValue = _mm256_set1_pd(255);
+        const size_t size = 4 * stride;
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i values[4] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(),
+                                 _mm_setzero_si128()};
+            for (size_t c = 0; c < planes; ++c)
+            {
+                __m256d x = src[c] ? _mm256_loadu_pd(src[c] + i) : maxValue;
+                // max returns its second operand for NaN.
+                x = _mm256_min_pd(_mm256_max_pd(x, zero), maxValue);
+                values[c] = _mm256_cvtpd_epi32(x);
+            }
+            const __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(values[0], values[1]),
+                                                   _mm_packs_epi32(values[2], values[3]));
+            const __m128i pixels = _mm_shuffle_epi8(bytes, interleave);
+            if (size == 16)
+            {
+                _mm_storeu_si128((__m128i*)(dest + i * stride), pixels);
+            }
+            else
+            {
+                alignas(16) uint8_t temp[16];
+                _mm_store_si128((__m128i*)temp, pixels);
+                GEDO_MEMCPY(dest + i * stride, temp, size);
+            }
+        }
+        PlanesToBytesScalar(src, planes, i, count, dest, stride, offsets);
+    }
+#endif
+
+    static void BytesToPlanes(const uint8_t* src, size_t count, size_t stride, const size_t* offsets,
+                              size_t planes, double* const* dest)
+    {
+#if defined GEDO_ARCH_X86
+        if (GetCpuFeatures().avx2)
+        {
+            BytesToPlanesAvx2(src, count, stride, offsets, planes, dest);
+            return;
+        }
+#endif
+        BytesToPlanesScalar(src, 0, count, stride, offsets, planes, dest);
+    }
+
+    static void PlanesToBytes(const double* const* src, size_t planes, size_t count, uint8_t* dest,
+                              size_t stride, const size_t* offsets)
+    {
+#if defined GEDO_ARCH_X86
+        if (GetCpuFeatures().avx2)
+        {
+            PlanesToBytesAvx2(src, planes, count, dest, stride, offsets);
+            return;
+        }
+#endif
+        PlanesToBytesScalar(src, planes, 0, count, dest, stride, offsets);
+    }
+
+    static const size_t PNM_OFFSETS[3] = {0, 1, 2};
+    // Color is stored as a, b, g, r.
+    static const size_t COLOR_OFFSETS[4] = {3, 2, 1, 0};
+
+    static size_t ImageRowsPerBatch(size_t width)
+    {
+        return width < PARALLEL_MIN_BATCH ? PARALLEL_MIN_BATCH / width : 1;
+    }
+
+    static uint32_t ReadImageSample(const uint8_t* p, size_t sampleSize)
+    {
+        // 16 bit samples are big endian.
+        return sampleSize == 1 ? p[0] : ((uint32_t)p[0] << 8) | p[1];
+    }
+
+    // plane c row y goes to dest + (c * height + y) * rowStride.
+    static void DecodeImagePlanes(const MemoryBlock& file, const ImageHeader& header, double* dest,
+                                  size_t rowStride)
+    {
+        const ImageInfo& info = header.info;
+        const size_t sampleSize = header.maxValue > 255 ? 2 : 1;
+        const size_t rowSize = sampleSize * info.channels * info.width;
+        const double scale = 255.0 / header.maxValue;
+        ParallelFor(info.height, ImageRowsPerBatch(info.width), [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                const uint8_t* src = file.data + header.dataOffset + y * rowSize;
+                double* planes[3];
+                for (size_t c = 0; c < info.channels; ++c)
+                {
+                    planes[c] = dest + (c * info.height + y) * rowStride;
+                }
+                if (sampleSize == 1)
+                {
+                    BytesToPlanes(src, info.width, info.channels, PNM_OFFSETS, info.channels, planes);
+                    if (header.maxValue != 255)
+                    {
+                        for (size_t c = 0; c < info.channels; ++c)
+                        {
+                            for (size_t x = 0; x < info.width; ++x)
+                            {
+                                planes[c][x] *= scale;
+                            }
+                        }
+                    }
+                    continue;
+                }
+                for (size_t x = 0; x < info.width; ++x)
+                {
+                    for (size_t c = 0; c < info.channels; ++c)
+                    {
+                        planes[c][x] = ReadImageSample(src + (x * info.channels + c) * 2, 2) * scale;
+                    }
+                }
+            }
+        });
+    }
+
+    static void DecodeImageColors(const MemoryBlock& file, const ImageHeader& header, Color* dest)
+    {
+        const ImageInfo& info = header.info;
+        const size_t sampleSize = header.maxValue > 255 ? 2 : 1;
+        const size_t rowSize = sampleSize * info.channels * info.width;
+        const uint32_t maxValue = (uint32_t)header.maxValue;
+        ParallelFor(info.height, ImageRowsPerBatch(info.width), [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                const uint8_t* src = file.data + header.dataOffset + y * rowSize;
+                Color* d = dest + y * info.width;
+                for (size_t x = 0; x < info.width; ++x)
+                {
+                    uint8_t rgb[3] = {};
+                    for (size_t c = 0; c < info.channels; ++c)
+                    {
+                        uint32_t v = ReadImageSample(src + (x * info.channels + c) * sampleSize, sampleSize);
+                        if (maxValue != 255)
+                        {
+                            v = (v * 255 + maxValue / 2) / maxValue;
+                        }
+                        rgb[c] = (uint8_t)(v < 255 ? v : 255);
+                    }
+                    d[x].r = rgb[0];
+                    d[x].g = rgb[info.channels == 3 ? 1 : 0];
+                    d[x].b = rgb[info.channels == 3 ? 2 : 0];
+                    d[x].a = 255;
+                }
+            }
+        });
+    }
+
+    bool ReadImageInfo(const char* fileName, ImageInfo& info)
+    {
+        MemoryBlock file = MapFile(fileName);
+        defer(UnmapFile(file));
+        ImageHeader header;
+        if (!ParseImageHeader(file, header))
+        {
+            return false;
+        }
+        info = header.info;
+        return true;
+    }
+
+    bool ReadImage(const char* fileName, ColorBitmap& result, Allocator& allocator)
+    {
+        MemoryBlock file = MapFile(fileName);
+        defer(UnmapFile(file));
+        ImageHeader header;
+        if (!ParseImageHeader(file, header))
+        {
+            return false;
+        }
+        result = CreateColorBitmap(header.info.width, header.info.height, allocator);
+        DecodeImageColors(file, header, result.data);
+        return true;
+    }
+
+    bool ReadImage(const char* fileName, Matrix& result, Allocator& allocator)
+    {
+        MemoryBlock file = MapFile(fileName);
+        defer(UnmapFile(file));
+        ImageHeader header;
+        if (!ParseImageHeader(file, header))
+        {
+            return false;
+        }
+        result = CreateMatrix(header.info.channels * header.info.height, header.info.width, allocator);
+        DecodeImagePlanes(file, header, result.data, result.rowStride);
+        return true;
+    }
+
+    bool ReadImages(const char* const* fileNames, size_t count, Matrix& result, Allocator& allocator)
+    {
+        if (!count)
+        {
+            return false;
+        }
+        // the files are mapped and parsed in parallel, the result is allocated
+        // here so allocator doesn't have to be thread safe.
+        Array<MemoryBlock> files;
+        files.resize(count);
+        Array<ImageHeader> headers;
+        headers.resize(count);
+        volatile int64_t failed = 0;
+        ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                files[i] = MapFile(fileNames[i]);
+                if (!ParseImageHeader(files[i], headers[i]))
+                {
+                    AtomicAdd(&failed, 1);
+                }
+            }
+        });
+        defer({
+            for (MemoryBlock& file : files)
+            {
+                UnmapFile(file);
+            }
+        });
+        if (failed)
+        {
+            return false;
+        }
+        const ImageInfo& info = headers[0].info;
+        for (const ImageHeader& header : headers)
+        {
+            if (header.info.width != info.width || header.info.height != info.height ||
+                header.info.channels != info.channels)
+            {
+                return false;
+            }
+        }
+        result = CreateMatrix(count, info.channels * info.height * info.width, allocator);
+        ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                DecodeImagePlanes(files[i], headers[i], result.data + i * result.rowStride, info.width);
+            }
+        });
+        return true;
+    }
+
+    static bool WriteImageFile(const char* fileName, const ImageInfo& info, const MemoryBlock& pixels)
+    {
+        char header[64];
+        const int size = snprintf(header, sizeof(header), "P%c\n%zu %zu\n255\n", info.channels == 1 ? '5' : '6',
+                                  info.width, info.height);
+        FileWriter writer;
+        if (!OpenFileWriter(writer, fileName))
+        {
+            return false;
+        }
+        WriteToFile(writer, header, size);
+        WriteToFile(writer, pixels.data, pixels.size);
+        return CloseFileWriter(writer);
+    }
+
+    bool WriteImage(const char* fileName, const ColorBitmap& image)
+    {
+        if (!image.width || !image.height)
+        {
+            return false;
+        }
+        ImageInfo info;
+        info.width = image.width;
+        info.height = image.height;
+        info.channels = 3;
+        MemoryBlock pixels = AllocateUninitialized(image.width * image.height * 3);
+        defer(Deallocate(pixels));
+        ParallelFor(image.height, ImageRowsPerBatch(image.width), [&](size_t begin, size_t end) {
+            for (size_t i = begin * image.width; i < end * image.width; ++i)
+            {
+                pixels.data[i * 3 + 0] = image.data[i].r;
+                pixels.data[i * 3 + 1] = image.data[i].g;
+                pixels.data[i * 3 + 2] = image.data[i].b;
+            }
+        });
+        return WriteImageFile(fileName, info, pixels);
+    }
+
+    bool WriteImage(const char* fileName, const Matrix& image, size_t channels)
+    {
+        if ((channels != 1 && channels != 3) || !image.rows || !image.cols || image.rows % channels)
+        {
+            return false;
+        }
+        ImageInfo info;
+        info.width = image.cols;
+        info.height = image.rows / channels;
+        info.channels = channels;
+        // the rows of a plane are read as arrays of doubles.
+        const bool direct = image.colStride == 1 && image.type == MatrixDataType::FLOAT64;
+        Matrix copy;
+        if (!direct)
+        {
+            copy = ConvertMatrix(image, MatrixDataType::FLOAT64);
+        }
+        defer(FreeMatrix(copy));
+        const Matrix& m = direct ? image : copy;
+        MemoryBlock pixels = AllocateUninitialized(info.width * info.height * channels);
+        defer(Deallocate(pixels));
+        ParallelFor(info.height, ImageRowsPerBatch(info.width), [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                const double* planes[3];
+                for (size_t c = 0; c < channels; ++c)
+                {
+                    planes[c] = m.data + (c * info.height + y) * m.rowStride;
+                }
+                PlanesToBytes(planes, channels, info.width, pixels.data + y * info.width * channels, channels,
+                              PNM_OFFSETS);
+            }
+        });
+        return WriteImageFile(fileName, info, pixels);
+    }
+
+    Matrix ColorBitmapToMatrix(const ColorBitmap& image, size_t channels, Allocator& allocator)
+    {
+        GEDO_ASSERT(channels == 3 || channels == 4);
+        Matrix result = CreateMatrix(channels * image.height, image.width, allocator);
+        ParallelFor(image.height, ImageRowsPerBatch(image.width), [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                double* planes[4];
+                for (size_t c = 0; c < channels; ++c)
+                {
+                    planes[c] = result.data + (c * image.height + y) * result.rowStride;
+                }
+                BytesToPlanes((const uint8_t*)(image.data + y * image.width), image.width, sizeof(Color),
+                              COLOR_OFFSETS, channels, planes);
+            }
+        });
+        return result;
+    }
+
+    ColorBitmap MatrixToColorBitmap(const Matrix& image, size_t channels, Allocator& allocator)
+    {
+        GEDO_ASSERT(channels == 1 || channels == 3 || channels == 4);
+        GEDO_ASSERT(image.rows % channels == 0);
+        const size_t height = image.rows / channels;
+        // the rows of a plane are read as arrays of doubles.
+        const bool direct = image.colStride == 1 && image.type == MatrixDataType::FLOAT64;
+        Matrix copy;
+        if (!direct)
+        {
+            copy = ConvertMatrix(image, MatrixDataType::FLOAT64);
+        }
+        defer(FreeMatrix(copy));
+        const Matrix& m = direct ? image : copy;
+        ColorBitmap result = CreateColorBitmap(image.cols, height, allocator);
+        ParallelFor(height, ImageRowsPerBatch(image.cols), [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                const double* planes[4] = {};
+                for (size_t c = 0; c < 4; ++c)
+                {
+                    // gray is copied to r, g and b.
+                    const size_t plane = channels == 1 ? 0 : c;
+                    if (c < 3 || channels == 4)
+                    {
+                        planes[c] = m.data + (plane * height + y) * m.rowStride;
+                    }
+                }
+                PlanesToBytes(planes, 4, image.cols, (uint8_t*)(result.data + y * image.cols), sizeof(Color),
+                              COLOR_OFFSETS);
+            }
+        });
+        return result;
+    }
+    //------------------------------------------------------------//
+
+    //------------------Strings----------------------------------//
+    static String CopyString(const char* string, size_t from, size_t to, Allocator& allocator)
+    {
+        String s;
+        s.allocator = &allocator;
+        s.reserve(to - from + 1);
+        for (size_t i = from; i < to; ++i)
+        {
+            Append(s, string[i]);
+        }
+        return s;
+    }
+
+    size_t StringLength(const char* string)
+    {
+        size_t result = 0;
+        while (*string++)
+        {
+            result++;
+        }
+        return result;
+    }
+
+    const char* GetFileExtension(const char* string)
+    {
+        const size_t len = StringLength(string);
+        if (!len)
+        {
+            return NULL;
+        }
+
+        for (int64_t i = len - 1; i >= 0; --i)
+        {
+            if (string[i] == '.')
+            {
+                return string + i;
+            }
+        }
+        return NULL;
+    }
+
+    bool CompareStrings(const char* str1, const char* str2, size_t size0, size_t size1)
+    {
+        if (size0 != size1)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < size0; ++i)
+        {
+            if (str1[i] != str2[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool CompareStrings(const char* str1, const String& str2)
+    {
+        return CompareStrings(str2, str1);
+    }
+
+    bool CompareStrings(const String& str1, const char* str2)
+    {
+        return CompareStrings(str1.data(), str2, str1.size(), StringLength(str2));
+    }
+
+    bool CompareStrings(const String& str1, const String& str2)
+    {
+        return CompareStrings(str1.data(), str2.data(), str1.size(), str2.size());
+    }
+
+    bool CompareStrings(const StringView str1, const StringView str2)
+    {
+        return CompareStrings(str1.data, str2.data, str1.size, str2.size);
+    }
+
+    // FNV-1a.
+    static uint64_t HashBytes(const char* data, size_t size)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i)
+        {
+            h ^= (uint8_t)data[i];
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    uint64_t Hash(const String& s)
+    {
+        return HashBytes(s.data(), s.size());
+    }
+
+    uint64_t Hash(const StringView s)
+    {
+        return HashBytes(s.data, s.size);
+    }
+
+    bool KeysEqual(const String& s0, const String& s1)
+    {
+        return CompareStrings(s0, s1);
+    }
+
+    bool KeysEqual(const String& s0, const StringView s1)
+    {
+        return CompareStrings(s0.data(), s1.data, s0.size(), s1.size);
+    }
+
+    bool CompareStrings(const char* str1, const char* str2)
+    {
+        const size_t len1 = StringLength(str1);
+        const size_t len2 = StringLength(str2);
+        return CompareStrings(str1, str2, len1, len2);
+    }
+
+    String ConcatStrings(const String* strings, size_t stringsCount, char seperator)
+    {
+        const bool addSeperator = seperator != 0;
+        size_t resultSize = 0;
+        for (size_t i = 0; i < stringsCount; ++i)
+        {
+            resultSize += strings[i].size();
+        }
+        if (addSeperator)
+        {
+            resultSize += (stringsCount - 1);
+        }
+
+        String result;
+        result.reserve(resultSize);
+        for (size_t i = 0; i < stringsCount; ++i)
+        {
+            Append(result, strings[i]);
+            if (addSeperator && i != stringsCount - 1)
+            {
+                Append(result, seperator);
+            }
+        }
+        return result;
+    }
+
+    String CreateString(const char* string)
+    {
+        String result;
+        Append(result, string);
+        return result;
+    }
+
+    void Append(String& string, const char* s)
+    {
+        Append(string, s, StringLength(s));
+    }
+
+    void Append(String& string, const char* s, size_t length)
+    {
+        string.reserve(string.size() + length);
+        for (size_t i = 0; i < length; ++i)
+        {
+            Append(string, s[i]);
+        }
+    }
+
+    void Append(String& string, const String& s)
+    {
+        Append(string, s.data(), s.size());
+    }
+
+    void Append(String& string, char c)
+    {
+        string.push_back(c);
+    }
+
+    StringView CreateStringView(const char* string)
+    {
+        StringView result;
+        result.data = string;
+        result.size = StringLength(string);
+        return result;
+    }
+
+    Array<StringView> SplitStringView(const char* string, char delim, Allocator& allocator)
+    {
+        Array<StringView> result;
+        result.allocator = &allocator;
+        const size_t len = StringLength(string);
+        size_t previousOffset = 0;
+        size_t i = 0;
+
+        size_t partsCount = 0;
+        while (i < len)
+        {
+            if (string[i] == delim)
+            {
+                if (i - previousOffset)
+                {
+                    partsCount++;
+                }
+                while (string[i] == delim && i < len)
+                {
+                    i++;
+                }
+                previousOffset = i;
+            }
+            else
+            {
+                i++;
+            }
+        }
+        if (i - previousOffset)
+        {
+            partsCount++;
+        }
+        result.reserve(partsCount);
+
+        previousOffset = 0;
+        i = 0;
+        while (i < len)
+        {
+            if (string[i] == delim)
+            {
+                const size_t slen = i - previousOffset;
+                if (slen)
+                {
+                    StringView l;
+                    l.data = string + previousOffset;
+                    l.size = slen;
+                    result.push_back(l);
+                }
+                while (string[i] == delim && i < len)
+                {
+                    i++;
+                }
+                previousOffset = i;
+            }
+            else
+            {
+                i++;
+            }
+        }
+        const size_t slen = i - previousOffset;
+        if (slen)
+        {
+            StringView l;
+            l.data = string + previousOffset;
+            l.size = slen;
+            result.push_back(l);
+        }
+        return result;
+    }
+
+    Array<String> SplitString(const char* string, char delim, Allocator& allocator)
+    {
+        Array<String> result;
+        result.allocator = &allocator;
+        const size_t len = StringLength(string);
+        size_t previousOffset = 0;
+        size_t i = 0;
+        size_t partsCount = 0;
+        while (i < len)
+        {
+            if (string[i] == delim)
+            {
+                if (i - previousOffset)
+                {
+                    partsCount++;
+                }
+                while (string[i] == delim && i < len)
+                {
+                    i++;
+                }
+                previousOffset = i;
+            }
+            else
+            {
+                i++;
+            }
+        }
+        if (i - previousOffset)
+        {
+            partsCount++;
+        }
+        result.reserve(partsCount);
+
+        i = 0;
+        previousOffset = 0;
+        while (i < len)
+        {
+            if (string[i] == delim)
+            {
+                const size_t slen = i - previousOffset;
+                if (slen)
+                {
+                    String l = CopyString(string, previousOffset, i, allocator);
+                    result.push_back(l);
+                }
+                while (string[i] == delim && i < len)
+                {
+                    i++;
+                }
+                previousOffset = i;
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        const size_t slen = i - previousOffset;
+        if (slen)
+        {
+            String l = CopyString(string, previousOffset, i, allocator);
+            result.push_back(l);
+        }
+        return result;
+    }
+
+    Array<String> SplitStringIntoLines(const char* string, Allocator& allocator)
+    {
+        Array<String> result;
+        result.allocator = &allocator;
+        const size_t len = StringLength(string);
+        size_t partsCount = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (string[i] == '\n')
+            {
+                partsCount++;
+            }
+        }
+        result.reserve(partsCount);
+
+        size_t previousOffset = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (string[i] == '\n')
+            {
+                if (i - previousOffset)
+                {
+                    String l = CopyString(string, previousOffset, i, allocator);
+                    result.push_back(l);
+                }
+                previousOffset = i;
+            }
+        }
+        if (len - previousOffset)
+        {
+            String l = CopyString(string, previousOffset, len, allocator);
+            result.push_back(l);
+        }
+        return result;
+    }
+
+    Array<StringView> SplitStringViewIntoLines(const char* string, char delim, Allocator& allocator)
+    {
+        Array<StringView> result;
+        result.allocator = &allocator;
+        const size_t len = StringLength(string);
+        size_t partsCount = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (string[i] == '\n')
+            {
+                partsCount++;
+            }
+        }
+        result.reserve(partsCount);
+
+        size_t previousOffset = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (string[i] == '\n')
+            {
+                if (i - previousOffset)
+                {
+                    StringView l;
+                    l.data = string + previousOffset;
+                    l.size = i - previousOffset;
+                    result.push_back(l);
+                }
+                previousOffset = i;
+            }
+        }
+        if (len - previousOffset)
+        {
+            StringView l;
+            l.data = string + previousOffset;
+            l.size = len - previousOffset;
+            result.push_back(l);
+        }
+        return result;
+    }
+    //------------------------------------------------------------//
+
+    //------------------------Parsing-----------------------------//
+
+    char Peek(const Buffer& buffer)
+    {
+        GEDO_ASSERT(buffer.cursor < buffer.size);
+        return buffer.data[buffer.cursor];
+    }
+
+    bool IsLetter(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    bool IsDigit(char c)
+    {
+        return (c >= '0' && c <= '9');
+    }
+
+    bool IsWhiteSpace(char c)
+    {
+        switch (c)
+        {
+        case ' ':
+        case '\n':
+        case '\t':
+        case '\v':
+        case '\f':
+        case '\r':
+            return true;
+        }
+        return false;
+    }
+
+    bool IsLetterOrDigit(char c)
+    {
+        return IsLetter(c) || IsDigit(c);
+    }
+
+    Buffer CreateBufferFromString(const char* text)
+    {
+        Buffer result;
+        result.data = text;
+        result.size = StringLength(text);
+        result.cursor = 0;
+        return result;
+    }
+
+    void SkipToNextLine(Buffer& buffer)
+    {
+        while (buffer.cursor < buffer.size && Peek(buffer) != '\n')
+        {
+            buffer.cursor++;
+        }
+    }
+
+    void SkipWhiteSpaces(Buffer& buffer)
+    {
+        while (buffer.cursor < buffer.size && IsWhiteSpace(Peek(buffer)))
+        {
+            buffer.cursor++;
+        }
+    }
+
+    void SkipSingleLineComment(Buffer& buffer)
+    {
+        if (buffer.data[buffer.cursor + 0] == '\\' &&
+            buffer.data[buffer.cursor + 1] == '\\')
+        {
+            buffer.cursor += 2;
+            SkipToNextLine(buffer);
+        }
+    }
+
+    // the powers of 10 that are exact doubles.
+    static const double EXACT_POWERS_OF_10[] =
+    {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // the first size characters of text converted by strtod.
+    static double StringToDoubleSlow(const char* text, size_t size)
+    {
+        char copy[64];
+        if (size < sizeof(copy))
+        {
+            GEDO_MEMCPY(copy, text, size);
+            copy[size] = 0;
+            return strtod(copy, NULL);
+        }
+        String s;
+        Append(s, text, size);
+        Append(s, (char)0);
+        return strtod(s.data(), NULL);
+    }
+
+    // parses digits with at most one '.' directly from text, returns the
+    // number of characters used or 0 when text doesn't start with a digit.
+    static size_t ScanDecimal(const char* text, size_t size, double& result)
+    {
+        const double* powersOf10 = EXACT_POWERS_OF_10;
+        if (!size || !IsDigit(text[0]))
+        {
+            return 0;
+        }
+        uint64_t mantissa = 0;
+        int64_t exponent = 0;
+        bool dot = false;
+        bool exact = true;
+        size_t i = 0;
+        for (; i < size; ++i)
+        {
+            const char c = text[i];
+            if (c == '.')
+            {
+                if (dot)
+                {
+                    break;
+                }
+                dot = true;
+                continue;
+            }
+            if (!IsDigit(c))
+            {
+                break;
+            }
+            if (mantissa < 100000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (c - '0');
+                exponent -= dot;
+            }
+            else
+            {
+                // digits that don't fit in the mantissa.
+                exponent += !dot;
+                exact = exact && c == '0';
+            }
+        }
+        // both values are exact doubles so a single multiply or divide gives
+        // the correctly rounded result, other numbers go through strtod.
+        if (exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+        {
+            result = exponent < 0 ? (double)mantissa / powersOf10[-exponent]
+                                  : (double)mantissa * powersOf10[exponent];
+            return i;
+        }
+        result = StringToDoubleSlow(text, i);
+        return i;
+    }
+
+    // case insensitive, word is lower case.
+    static bool StartsWithWord(const char* text, size_t size, const char* word, size_t length)
+    {
+        if (size < length)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < length; ++i)
+        {
+            if ((text[i] | 0x20) != word[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t ScanFloat(const char* text, size_t size, double& result)
+    {
+        size_t i = 0;
+        const bool negative = size && text[0] == '-';
+        i += size && (text[0] == '-' || text[0] == '+');
+        if (i < size && ((text[i] | 0x20) == 'i' || (text[i] | 0x20) == 'n'))
+        {
+            if (StartsWithWord(text + i, size - i, "nan", 3))
+            {
+                result = negative ? -NAN : NAN;
+                return i + 3;
+            }
+            if (StartsWithWord(text + i, size - i, "inf", 3))
+            {
+                result = negative ? -HUGE_VAL : HUGE_VAL;
+                return i + (StartsWithWord(text + i, size - i, "infinity", 8) ? 8 : 3);
+            }
+            return 0;
+        }
+
+        // the first 19 significant digits are kept in mantissa.
+        uint64_t mantissa = 0;
+        int64_t exponent = 0;
+        bool exact = true;
+        bool digits = false;
+        bool dot = false;
+        for (; i < size; ++i)
+        {
+            const char c = text[i];
+            if (c == '.' && !dot)
+            {
+                dot = true;
+                continue;
+            }
+            if (!IsDigit(c))
+            {
+                break;
+            }
+            digits = true;
+            if (mantissa < 1000000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (c - '0');
+                exponent -= dot;
+            }
+            else
+            {
+                exponent += !dot;
+                exact = exact && c == '0';
+            }
+        }
+        if (!digits)
+        {
+            return 0;
+        }
+        // an exponent without digits is not part of the number, like strtod.
+        if (i < size && (text[i] | 0x20) == 'e')
+        {
+            size_t j = i + 1;
+            const bool negativeExponent = j < size && text[j] == '-';
+            j += j < size && (text[j] == '-' || text[j] == '+');
+            if (j < size && IsDigit(text[j]))
+            {
+                int64_t e = 0;
+                for (; j < size && IsDigit(text[j]); ++j)
+                {
+                    e = e < 100000 ? e * 10 + (text[j] - '0') : e;
+                }
+                exponent += negativeExponent ? -e : e;
+                i = j;
+            }
+        }
+        // Clinger's fast path: both values are exact so one multiply or divide
+        // is correctly rounded.
+        if (exact && (mantissa == 0 || (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)))
+        {
+            const double value = mantissa == 0 ? 0.0
+                                 : exponent < 0 ? (double)mantissa / EXACT_POWERS_OF_10[-exponent]
+                                                : (double)mantissa * EXACT_POWERS_OF_10[exponent];
+            result = negative ? -value : value;
+            return i;
+        }
+        result = StringToDoubleSlow(text, i);
+        return i;
+    }
+
+    bool ParseFloat(Buffer& buffer, double& result)
+    {
+        const size_t length = ScanDecimal(buffer.data + buffer.cursor, buffer.size - buffer.cursor, result);
+        if (!length)
+        {
+            return false;
+        }
+        buffer.cursor += length;
+        // a second '.' isn't a number.
+        return buffer.cursor >= buffer.size || Peek(buffer) != '.';
+    }
+
+    bool ParseIdentifier(Buffer& buffer, StringView& result)
+    {
+        if (buffer.cursor < buffer.size && IsLetter(Peek(buffer)))
+        {
+            const size_t start = buffer.cursor;
+            while (buffer.cursor < buffer.size &&
+                   (IsLetterOrDigit(Peek(buffer)) || Peek(buffer) == '_'))
+            {
+                buffer.cursor++;
+            }
+            result.data = buffer.data + start;
+            result.size = buffer.cursor - start;
+            return true;
+        }
+        return false;
+    }
+
+    bool ParseIdentifier(Buffer& buffer, String& result)
+    {
+        StringView view;
+        if (ParseIdentifier(buffer, view))
+        {
+            result.clear();
+            Append(result, view.data, view.size);
+            return true;
+        }
+        return false;
+    }
+
+    bool ParseStringLiteral(Buffer& buffer, StringView& result)
+    {
+        if (buffer.cursor < buffer.size && Peek(buffer) == '"')
+        {
+            const size_t start = ++buffer.cursor;
+            while (buffer.cursor < buffer.size && Peek(buffer) != '"')
+            {
+                buffer.cursor++;
+            }
+            result.data = buffer.data + start;
+            result.size = buffer.cursor - start;
+            buffer.cursor++;
+            return true;
+        }
+        return false;
+    }
+
+    bool ParseStringLiteral(Buffer& buffer, String& result)
+    {
+        StringView view;
+        if (ParseStringLiteral(buffer, view))
+        {
+            result.clear();
+            Append(result, view.data, view.size);
+            return true;
+        }
+        return false;
+    }
+
+    bool CompareWordAndSkip(Buffer& buffer, const char* word)
+    {
+        const size_t length = StringLength(word);
+        if (buffer.cursor + length <= buffer.size)
+        {
+            for (size_t i = 0; i < length; ++i)
+            {
+                if (buffer.data[buffer.cursor + i] != word[i])
+                {
+                    return false;
+                }
+            }
+            buffer.cursor += length;
+            return true;
+        }
+        return false;
+    }
+
+    bool StringToFloat(const char* string, double& result)
+    {
+        const size_t length = StringLength(string);
+        return length && ScanDecimal(string, length, result) == length;
+    }
+
+    bool StringToFloat(const StringView string, double& result)
+    {
+        return string.size && ScanFloat(string.data, string.size, result) == string.size;
+    }
+
+    bool StringToInt(const char* string, int64_t& result)
+    {
+        const size_t length = StringLength(string);
+        if (!length)
+        {
+            return false;
+        }
+
+        bool isNegative = false;
+
+        for (size_t i = 0; i < length; ++i)
+        {
+            if (string[i] == '-')
+            {
+                if (isNegative)
+                {
+                    return false;
+                }
+                isNegative = true;
+            }
+        }
+
+        result = 0.0;
+        size_t power = length - 1;
+        for (size_t i = 0; i < length; ++i)
+        {
+            if (string[i] != '0')
+            {
+                int64_t basePower = 1.0;
+                for (int k = 0; k < power; k++)
+                {
+                    basePower *= 10.0;
+                }
+                result += (string[i] - '0') * basePower;
+            }
+            power--;
+        }
+        if (isNegative)
+        {
+            result *= -1;
+        }
+        return true;
+    }
+
+    // grisu2 (Loitsch, "Printing floating-point numbers quickly and accurately
+    // with integers"): the boundaries of the double are scaled by a cached power
+    // of ten so the digits can be generated with 64 bit integers.
+    struct DiyFp
+    {
+        uint64_t f;
+        int e;
+    };
+
+    static DiyFp MultiplyDiyFp(DiyFp x, DiyFp y)
+    {
+        const uint64_t M32 = 0xFFFFFFFFULL;
+        const uint64_t a = x.f >> 32;
+        const uint64_t b = x.f & M32;
+        const uint64_t c = y.f >> 32;
+        const uint64_t d = y.f & M32;
+        const uint64_t ac = a * c;
+        const uint64_t bc = b * c;
+        const uint64_t ad = a * d;
+        const uint64_t bd = b * d;
+        uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+        tmp += 1ULL << 31; // round.
+        return DiyFp{ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+    }
+
+    static DiyFp NormalizeDiyFp(DiyFp x)
+    {
+        while (!(x.f & (1ULL << 63)))
+        {
+            x.f <<= 1;
+            x.e--;
+        }
+        return x;
+    }
+
+    // 10^k for k = -348 + 8 * i normalized to 64 bits.
+    static const uint64_t cachedPowersF[] =
+    {
+        0xFA8FD5A0081C0288ULL, 0xBAAEE17FA23EBF76ULL, 0x8B16FB203055AC76ULL,
+        0xCF42894A5DCE35EAULL, 0x9A6BB0AA55653B2DULL, 0xE61ACF033D1A45DFULL,
+        0xAB70FE17C79AC6CAULL, 0xFF77B1FCBEBCDC4FULL, 0xBE5691EF416BD60CULL,
+        0x8DD01FAD907FFC3CULL, 0xD3515C2831559A83ULL, 0x9D71AC8FADA6C9B5ULL,
+        0xEA9C227723EE8BCBULL, 0xAECC49914078536DULL, 0x823C12795DB6CE57ULL,
+        0xC21094364DFB5637ULL, 0x9096EA6F3848984FULL, 0xD77485CB25823AC7ULL,
+        0xA086CFCD97BF97F4ULL, 0xEF340A98172AACE5ULL, 0xB23867FB2A35B28EULL,
+        0x84C8D4DFD2C63F3BULL, 0xC5DD44271AD3CDBAULL, 0x936B9FCEBB25C996ULL,
+        0xDBAC6C247D62A584ULL, 0xA3AB66580D5FDAF6ULL, 0xF3E2F893DEC3F126ULL,
+        0xB5B5ADA8AAFF80B8ULL, 0x87625F056C7C4A8BULL, 0xC9BCFF6034C13053ULL,
+        0x964E858C91BA2655ULL, 0xDFF9772470297EBDULL, 0xA6DFBD9FB8E5B88FULL,
+        0xF8A95FCF88747D94ULL, 0xB94470938FA89BCFULL, 0x8A08F0F8BF0F156BULL,
+        0xCDB02555653131B6ULL, 0x993FE2C6D07B7FACULL, 0xE45C10C42A2B3B06ULL,
+        0xAA242499697392D3ULL, 0xFD87B5F28300CA0EULL, 0xBCE5086492111AEBULL,
+        0x8CBCCC096F5088CCULL, 0xD1B71758E219652CULL, 0x9C40000000000000ULL,
+        0xE8D4A51000000000ULL, 0xAD78EBC5AC620000ULL, 0x813F3978F8940984ULL,
+        0xC097CE7BC90715B3ULL, 0x8F7E32CE7BEA5C70ULL, 0xD5D238A4ABE98068ULL,
+        0x9F4F2726179A2245ULL, 0xED63A231D4C4FB27ULL, 0xB0DE65388CC8ADA8ULL,
+        0x83C7088E1AAB65DBULL, 0xC45D1DF942711D9AULL, 0x924D692CA61BE758ULL,
+        0xDA01EE641A708DEAULL, 0xA26DA3999AEF774AULL, 0xF209787BB47D6B85ULL,
+        0xB454E4A179DD1877ULL, 0x865B86925B9BC5C2ULL, 0xC83553C5C8965D3DULL,
+        0x952AB45CFA97A0B3ULL, 0xDE469FBD99A05FE3ULL, 0xA59BC234DB398C25ULL,
+        0xF6C69A72A3989F5CULL, 0xB7DCBF5354E9BECEULL, 0x88FCF317F22241E2ULL,
+        0xCC20CE9BD35C78A5ULL, 0x98165AF37B2153DFULL, 0xE2A0B5DC971F303AULL,
+        0xA8D9D1535CE3B396ULL, 0xFB9B7CD9A4A7443CULL, 0xBB764C4CA7A44410ULL,
+        0x8BAB8EEFB6409C1AULL, 0xD01FEF10A657842CULL, 0x9B10A4E5E9913129ULL,
+        0xE7109BFBA19C0C9DULL, 0xAC2820D9623BF429ULL, 0x80444B5E7AA7CF85ULL,
+        0xBF21E44003ACDD2DULL, 0x8E679C2F5E44FF8FULL, 0xD433179D9C8CB841ULL,
+        0x9E19DB92B4E31BA9ULL, 0xEB96BF6EBADF77D9ULL, 0xAF87023B9BF0EE6BULL,
+    };
+    static const int16_t cachedPowersE[] =
+    {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+        -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+        -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+        -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+        -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+        109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+        375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+        641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+        907, 933, 960, 986, 1013, 1039, 1066,
+    };
+
+    static const uint32_t powersOf10[] =
+    {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+
+    static void GrisuRound(char* buffer, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t wpw)
+    {
+        while (rest < wpw && delta - rest >= tenKappa &&
+               (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw))
+        {
+            buffer[length - 1]--;
+            rest += tenKappa;
+        }
+    }
+
+    static int CountDecimalDigits(uint32_t n)
+    {
+        int count = 1;
+        while (count < 10 && n >= powersOf10[count])
+        {
+            count++;
+        }
+        return count;
+    }
+
+    // digits of w in buffer, w * 10^k is the value.
+    static int Grisu2(double value, char* buffer, int& k)
+    {
+        uint64_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        const uint64_t HIDDEN_BIT = 1ULL << 52;
+        const int biasedExponent = int((bits >> 52) & 0x7FF);
+        const uint64_t significand = bits & (HIDDEN_BIT - 1);
+        DiyFp v = biasedExponent ? DiyFp{significand + HIDDEN_BIT, biasedExponent - 1075}
+                                 : DiyFp{significand, -1074};
+
+        // the boundaries are half way to the neighbouring doubles.
+        DiyFp plus = NormalizeDiyFp(DiyFp{(v.f << 1) + 1, v.e - 1});
+        DiyFp minus = v.f == HIDDEN_BIT ? DiyFp{(v.f << 2) - 1, v.e - 2} : DiyFp{(v.f << 1) - 1, v.e - 1};
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+
+        // a power that brings the exponent of plus into [-60, -32].
+        const double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+        int ik = int(dk);
+        if (dk - ik > 0.0)
+        {
+            ik++;
+        }
+        const size_t index = size_t((ik >> 3) + 1);
+        k = -(-348 + int(index) * 8);
+        const DiyFp power = DiyFp{cachedPowersF[index], cachedPowersE[index]};
+
+        const DiyFp w = MultiplyDiyFp(NormalizeDiyFp(v), power);
+        DiyFp wp = MultiplyDiyFp(plus, power);
+        DiyFp wm = MultiplyDiyFp(minus, power);
+        wm.f++;
+        wp.f--;
+
+        uint64_t delta = wp.f - wm.f;
+        const DiyFp one = DiyFp{1ULL << -wp.e, wp.e};
+        const uint64_t wpw = wp.f - w.f;
+        uint32_t p1 = uint32_t(wp.f >> -one.e);
+        uint64_t p2 = wp.f & (one.f - 1);
+        int kappa = CountDecimalDigits(p1);
+        int length = 0;
+        while (kappa > 0)
+        {
+            // constant divisors become multiplications.
+            uint32_t d = 0;
+            switch (kappa)
+            {
+            case 10: d = p1 / 1000000000; p1 %= 1000000000; break;
+            case 9:  d = p1 / 100000000;  p1 %= 100000000;  break;
+            case 8:  d = p1 / 10000000;   p1 %= 10000000;   break;
+            case 7:  d = p1 / 1000000;    p1 %= 1000000;    break;
+            case 6:  d = p1 / 100000;     p1 %= 100000;     break;
+            case 5:  d = p1 / 10000;      p1 %= 10000;      break;
+            case 4:  d = p1 / 1000;       p1 %= 1000;       break;
+            case 3:  d = p1 / 100;        p1 %= 100;        break;
+            case 2:  d = p1 / 10;         p1 %= 10;         break;
+            case 1:  d = p1;              p1 = 0;           break;
+            }
+            if (d || length)
+            {
+                buffer[length++] = char('0' + d);
+            }
+            kappa--;
+            const uint64_t rest = (uint64_t(p1) << -one.e) + p2;
+            if (rest <= delta)
+            {
+                k += kappa;
+                GrisuRound(buffer, length, delta, rest, uint64_t(powersOf10[kappa]) << -one.e, wpw);
+                return length;
+            }
+        }
+        for (;;)
+        {
+            p2 *= 10;
+            delta *= 10;
+            const char d = char(p2 >> -one.e);
+            if (d || length)
+            {
+                buffer[length++] = char('0' + d);
+            }
+            p2 &= one.f - 1;
+            kappa--;
+            if (p2 < delta)
+            {
+                k += kappa;
+                GrisuRound(buffer, length, delta, p2, one.f, -kappa < 10 ? wpw * powersOf10[-kappa] : 0);
+                return length;
+            }
+        }
+    }
+
+    static char* WriteExponent(char* p, int e)
+    {
+        *p++ = 'e';
+        if (e < 0)
+        {
+            *p++ = '-';
+            e = -e;
+        }
+        if (e >= 100)
+        {
+            *p++ = char('0' + e / 100);
+            e %= 100;
+            *p++ = char('0' + e / 10);
+        }
+        else if (e >= 10)
+        {
+            *p++ = char('0' + e / 10);
+        }
+        *p++ = char('0' + e % 10);
+        return p;
+    }
+
+    size_t FloatToString(double value, char* buffer)
+    {
+        char* p = buffer;
+        if (value != value)
+        {
+            memcpy(p, "nan", 4);
+            return 3;
+        }
+        if (signbit(value))
+        {
+            *p++ = '-';
+            value = -value;
+        }
+        if (value == 0.0)
+        {
+            memcpy(p, "0", 2);
+            return size_t(p - buffer) + 1;
+        }
+        if (isinf(value))
+        {
+            memcpy(p, "inf", 4);
+            return size_t(p - buffer) + 3;
+        }
+
+        char digits[20];
+        int k = 0;
+        const int length = Grisu2(value, digits, k);
+        // value = 0.digits * 10^point.
+        const int point = length + k;
+        if (k >= 0 && point <= 17)
+        {
+            // integer.
+            memcpy(p, digits, length);
+            memset(p + length, '0', k);
+            p += point;
+        }
+        else if (point > 0 && point <= 17)
+        {
+            memcpy(p, digits, point);
+            p[point] = '.';
+            memcpy(p + point + 1, digits + point, length - point);
+            p += length + 1;
+        }
+        else if (point > -6 && point <= 0)
+        {
+            *p++ = '0';
+            *p++ = '.';
+            memset(p, '0', -point);
+            memcpy(p - point, digits, length);
+            p += length - point;
+        }
+        else
+        {
+            *p++ = digits[0];
+            if (length > 1)
+            {
+                *p++ = '.';
+                memcpy(p, digits + 1, length - 1);
+                p += length - 1;
+            }
+            p = WriteExponent(p, point - 1);
+        }
+        *p = 0;
+        return size_t(p - buffer);
+    }
+
+    size_t FloatToString(float value, char* buffer)
+    {
+        // the double with the fewest digits that rounds to value, 9 digits
+        // always do.
+        if (value == value && !isinf(value) && value != 0.0f)
+        {
+            for (int digits = 1; digits <= 9; ++digits)
+            {
+                char text[32];
+                snprintf(text, sizeof(text), "%.*e", digits - 1, (double)value);
+                const double candidate = strtod(text, NULL);
+                if ((float)candidate == value)
+                {
+                    return FloatToString(candidate, buffer);
+                }
+            }
+        }
+        return FloatToString((double)value, buffer);
+    }
+
+    //------------------------------------------------------------//
+
+    //--------------------UUID------------------------------------//
+#if defined (GEDO_OS_WINDOWS)
+    UUId GenerateUUID()
+    {
+        GUID uuid;
+        UuidCreate(&uuid);
+
+        UUId result
+        {
+            (uint8_t)((uuid.Data1 >> 24) & 0xFF),
+            (uint8_t)((uuid.Data1 >> 16) & 0xFF),
+            (uint8_t)((uuid.Data1 >> 8) & 0xFF),
+            (uint8_t)((uuid.Data1) & 0xff),
+
+            (uint8_t)((uuid.Data2 >> 8) & 0xFF),
+            (uint8_t)((uuid.Data2) & 0xff),
+
+            (uint8_t)((uuid.Data3 >> 8) & 0xFF),
+            (uint8_t)((uuid.Data3) & 0xFF),
+
+            (uint8_t)uuid.Data4[0],
+            (uint8_t)uuid.Data4[1],
+            (uint8_t)uuid.Data4[2],
+            (uint8_t)uuid.Data4[3],
+            (uint8_t)uuid.Data4[4],
+            (uint8_t)uuid.Data4[5],
+            (uint8_t)uuid.Data4[6],
+            (uint8_t)uuid.Data4[7]
+        };
+        return result;
+    }
+
+#elif defined (GEDO_OS_LINUX)
+    UUId GenerateUUID()
+    {
+        UUId result;
+        uuid_generate(result.data);
+        return result;
+    }
+#endif
+    bool CompareUUID(const UUId& a, const UUId& b)
+    {
+        for (size_t i = 0; i < 16; ++i)
+        {
+            if (a.data[i] != b.data[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    //------------------------------------------------------------//
+
+    //--------------------CPU-------------------------------------//
+    static CpuFeatures QueryCpuFeatures()
+    {
+        CpuFeatures result;
+#if defined GEDO_ARCH_X86
+#if defined _MSC_VER
+        int info[4] = {};
+        __cpuid(info, 0);
+        const int maxLeaf = info[0];
+        __cpuid(info, 1);
+        result.sse2 = (info[3] & (1 << 26)) != 0;
+        result.sse41 = (info[2] & (1 << 19)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        // the OS has to save the ymm/zmm registers on context switch.
+        const uint64_t xcr0 = osxsave ? _xgetbv(0) : 0;
+        const bool ymmEnabled = (xcr0 & 0x6) == 0x6;
+        const bool zmmEnabled = (xcr0 & 0xE6) == 0xE6;
+        result.avx = avx && ymmEnabled;
+        result.fma = fma && ymmEnabled;
+        if (maxLeaf >= 7)
+        {
+            __cpuidex(info, 7, 0);
+            result.avx2 = result.avx && (info[1] & (1 << 5)) != 0;
+            result.avx512f = zmmEnabled && (info[1] & (1 << 16)) != 0;
+        }
+#else
+        __builtin_cpu_init();
+        result.sse2 = __builtin_cpu_supports("sse2");
+        result.sse41 = __builtin_cpu_supports("sse4.1");
+        result.avx = __builtin_cpu_supports("avx");
+        result.avx2 = __builtin_cpu_supports("avx2");
+        result.fma = __builtin_cpu_supports("fma");
+        result.avx512f = __builtin_cpu_supports("avx512f");
+#endif
+#elif defined GEDO_ARCH_ARM64
+        result.neon = true;
+#endif
+        return result;
+    }
+
+    const CpuFeatures& GetCpuFeatures()
+    {
+        static const CpuFeatures features = QueryCpuFeatures();
+        return features;
+    }
+    //------------------------------------------------------------//
+
+    //--------------------Math-----------------------------------//
+    Vec2d operator+(const Vec2d a, const Vec2d& b)
+    {
+        return Vec2d{ a.x + b.x, a.y + b.y };
+    }
+
+    Vec2d operator-(const Vec2d a, const Vec2d& b)
+    {
+        return Vec2d{ a.x - b.x, a.y - b.y };
+    }
+
+    Vec2d operator*(const Vec2d a, const Vec2d& b)
+    {
+        return Vec2d{ a.x * b.x, a.y * b.y };
+    }
+
+    Vec2d operator*(const Vec2d a, double x)
+    {
+        return Vec2d{ a.x * x, a.y * x };
+    }
+
+    Vec2d operator*(double x, const Vec2d a)
+    {
+        return Vec2d{ a.x * x, a.y * x };
+    }
+
+    Vec3d operator+(const Vec3d a, const Vec3d& b)
+    {
+        return Vec3d{ a.x + b.x, a.y + b.y, a.z + b.z };
+    }
+
+    Vec3d operator-(const Vec3d a, const Vec3d& b)
+    {
+        return Vec3d{ a.x - b.x, a.y - b.y, a.z - b.z };
+    }
+
+    Vec3d operator*(const Vec3d a, const Vec3d& b)
+    {
+        return Vec3d{ a.x * b.x, a.y * b.y, a.z * b.z };
+    }
+
+    Vec3d operator*(const Vec3d a, double x)
+    {
+        return Vec3d{ a.x * x, a.y * x, a.z * x };
+    }
+
+    Vec3d operator*(double x, const Vec3d a)
+    {
+        return Vec3d{ a.x * x, a.y * x, a.z * x };
+    }
+
+    double DotProduct(const Vec3d a, const Vec3d& b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    double DotProduct(const Vec2d a, const Vec2d& b)
+    {
+        return a.x * b.x + a.y * b.y;
+    }
+
+    Mat4 operator*(const Mat4& left, const Mat4& right)
+    {
+        Mat4 result;
+        for (int columns = 0; columns < 4; ++columns)
+        {
+            for (int rows = 0; rows < 4; ++rows)
+            {
+                double sum = 0;
+                for (int currentMatrice = 0; currentMatrice < 4; ++currentMatrice)
+                {
+                    sum += left.elements[currentMatrice][rows] * right.elements[columns][currentMatrice];
+                }
+                result.elements[columns][rows] = sum;
+            }
+        }
+        return result;
+    }
+
+    Mat4 operator*(Mat4 left, double x)
+    {
+        for (int columns = 0; columns < 4; ++columns)
+        {
+            for (int rows = 0; rows < 4; ++rows)
+            {
+                left.elements[columns][rows] *= x;
+            }
+        }
+        return left;
+    }
+
+    Vec3d operator*(const Mat3 a, const Vec3d& v)
+    {
+        Vec3d r;
+        for (int rows = 0; rows < 3; ++rows)
+        {
+            double sum = 0;
+            for (int columns = 0; columns < 3; ++columns)
+            {
+                sum += a.elements[columns][rows] * v.data[columns];
+            }
+            r.data[rows] = sum;
+        }
+        return r;
+    }
+
+    Vec3d CrossProduct(const Vec3d a, const Vec3d& b)
+    {
+        return Vec3d{ a.y * b.z - a.z * b.y,
+                      a.z * b.x - a.x * b.z,
+                      a.x * b.y - a.y * b.x };
+    }
+
+    double Length(const Vec2d& v)
+    {
+        return sqrtf(v.x * v.x + v.y * v.y);
+    }
+
+    double Length(const Vec3d& v)
+    {
+        return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    }
+
+    void Normalise(Vec2d& v)
+    {
+        const double length = Length(v);
+        v.x /= length;
+        v.y /= length;
+    }
+
+    Vec2d Normalised(const Vec2d& v)
+    {
+        const double length = Length(v);
+        return Vec2d{ v.x / length, v.y / length };
+    }
+
+    void Normalise(Vec3d& v)
+    {
+        const double length = Length(v);
+        v.x /= length;
+        v.y /= length;
+        v.z /= length;
+    }
+
+    Vec3d Normalised(const Vec3d& v)
+    {
+        const double length = Length(v);
+        return Vec3d{ v.x / length, v.y / length, v.z / length };
+    }
+
+    Mat4 Transpose(Mat4 m)
+    {
+        Swap(m.elements[0][1], m.elements[1][0]);
+        Swap(m.elements[0][2], m.elements[2][0]);
+        Swap(m.elements[0][3], m.elements[3][0]);
+        Swap(m.elements[1][2], m.elements[2][1]);
+        Swap(m.elements[1][3], m.elements[3][1]);
+        Swap(m.elements[2][3], m.elements[3][2]);
+        return m;
+    }
+
+    Mat3 Transpose(Mat3 m)
+    {
+        Swap(m.elements[0][1], m.elements[1][0]);
+        Swap(m.elements[0][2], m.elements[2][0]);
+        Swap(m.elements[1][2], m.elements[2][1]);
+        return m;
+    }
+
+    Mat4 Translate(const Mat4& m, Vec3d translation)
+    {
+        Mat4 translate = Identity();
+        translate.elements[3][0] = translation.x;
+        translate.elements[3][1] = translation.y;
+        translate.elements[3][2] = translation.z;
+        return m * translate;
+    }
+
+    Mat4 Rotate(const Mat4& m, double angle, Vec3d axis)
+    {
+        const double sinTheta = sinf(angle);
+        const double cosTheta = cosf(angle);
+        const double cosValue = 1.0f - cosTheta;
+
+        Normalise(axis);
+        Mat4 rotate = Identity();
+
+        rotate.elements[0][0] = (axis.x * axis.x * cosValue) + cosTheta;
+        rotate.elements[0][1] = (axis.x * axis.y * cosValue) + (axis.z * sinTheta);
+        rotate.elements[0][2] = (axis.x * axis.z * cosValue) - (axis.y * sinTheta);
+
+        rotate.elements[1][0] = (axis.y * axis.x * cosValue) - (axis.z * sinTheta);
+        rotate.elements[1][1] = (axis.y * axis.y * cosValue) + cosTheta;
+        rotate.elements[1][2] = (axis.y * axis.z * cosValue) + (axis.x * sinTheta);
+
+        rotate.elements[2][0] = (axis.z * axis.x * cosValue) + (axis.y * sinTheta);
+        rotate.elements[2][1] = (axis.z * axis.y * cosValue) - (axis.x * sinTheta);
+        rotate.elements[2][2] = (axis.z * axis.z * cosValue) + cosTheta;
+
+        return m * rotate;
+    }
+
+    Mat4 Identity()
+    {
+        Mat4 m = { 0 };
+        m.elements[0][0] = m.elements[1][1] = m.elements[2][2] = m.elements[3][3] = 1.0f;
+        return m;
+    }
+
+    Mat4 LookAt(const Vec3d& eye, const Vec3d& center, const Vec3d& up)
+    {
+        const Vec3d f = Normalised(center - eye);
+        const Vec3d s = Normalised(CrossProduct(f, up));
+        const Vec3d u = CrossProduct(s, f);
+
+        Mat4 dest;
+        dest.elements[0][0] = s.x;
+        dest.elements[0][1] = u.x;
+        dest.elements[0][2] = -f.x;
+        dest.elements[0][3] = 0;
+
+        dest.elements[1][0] = s.y;
+        dest.elements[1][1] = u.y;
+        dest.elements[1][2] = -f.y;
+        dest.elements[1][3] = 0;
+
+        dest.elements[2][0] = s.z;
+        dest.elements[2][1] = u.z;
+        dest.elements[2][2] = -f.z;
+        dest.elements[2][3] = 0;
+
+        dest.elements[3][0] = -DotProduct(s, eye);
+        dest.elements[3][1] = -DotProduct(u, eye);
+        dest.elements[3][2] = DotProduct(f, eye);
+        dest.elements[3][3] = 1.0f;
+        return dest;
+    }
+
+    Mat4 Perspective(double fovy, double aspect, double zNear, double zFar)
+    {
+        const double f = 1.0f / tanf(fovy * 0.5f);
+        const double fn = 1.0f / (zNear - zFar);
+        Mat4 dest = { 0 };
+        dest.elements[0][0] = f / aspect;
+        dest.elements[1][1] = f;
+        dest.elements[2][2] = (zNear + zFar) * fn;
+        dest.elements[2][3] = -1.0f;
+        dest.elements[3][2] = 2.0f * zNear * zFar * fn;
+        return dest;
+    }
+
+    Vec3d TransformPoint(const Mat4& m, const Vec3d& p)
+    {
+        const double* e = m.data;
+        return Vec3d{ e[0] * p.x + e[4] * p.y + e[8] * p.z + e[12],
+                      e[1] * p.x + e[5] * p.y + e[9] * p.z + e[13],
+                      e[2] * p.x + e[6] * p.y + e[10] * p.z + e[14] };
+    }
+
+    Points3d ToPoints(const Matrix& m)
+    {
+        GEDO_ASSERT(m.rows == 3 && m.type == MatrixDataType::FLOAT64 && (m.colStride == 1 || m.cols <= 1));
+        Points3d result;
+        result.x = m.data;
+        result.y = m.data + m.rowStride;
+        result.z = m.data + 2 * m.rowStride;
+        result.count = m.cols;
+        return result;
+    }
+
+    // (x, y, z) of count points are replaced by m * (p, 1), divided by its w
+    // when divide is set. the m.data of column major matrices is the columns
+    // so output row r uses data[r], data[4 + r], data[8 + r] and data[12 + r].
+    typedef void (*TransformPointsFunction)(const Mat4& m, const double* x, const double* y, const double* z,
+                                            double* ox, double* oy, double* oz, size_t count, bool divide);
+
+    static void TransformPointsScalar(const Mat4& m, const double* x, const double* y, const double* z,
+                                      double* ox, double* oy, double* oz, size_t count, bool divide)
+    {
+        const double* e = m.data;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const double px = x[i];
+            const double py = y[i];
+            const double pz = z[i];
+            double rx = e[0] * px + e[4] * py + e[8] * pz + e[12];
+            double ry = e[1] * px + e[5] * py + e[9] * pz + e[13];
+            double rz = e[2] * px + e[6] * py + e[10] * pz + e[14];
+            if (divide)
+            {
+                const double w = 1.0 / (e[3] * px + e[7] * py + e[11] * pz + e[15]);
+                rx *= w;
+                ry *= w;
+                rz *= w;
+            }
+            ox[i] = rx;
+            oy[i] = ry;
+            oz[i] = rz;
+        }
+    }
+
+#if defined GEDO_ARCH_X86
+    GEDO_TARGET_SSE2 static void TransformPointsSse2(const Mat4& m, const double* x, const double* y, const double* z,
+                                                     double* ox, double* oy, double* oz, size_t count, bool divide)
+    {
+        __m128d e[16];
+        for (size_t k = 0; k < 16; ++k)
+        {
+            e[k] = _mm_set1_pd(m.data[k]);
+        }
+        const __m128d one = _mm_set1_pd(1.0);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            const __m128d px = _mm_loadu_pd(x + i);
+            const __m128d py = _mm_loadu_pd(y + i);
+            const __m128d pz = _mm_loadu_pd(z + i);
+            __m128d r[4];
+            for (size_t row = 0; row < (divide ? 4u : 3u); ++row)
+            {
+                r[row] = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e[row], px), _mm_mul_pd(e[4 + row], py)),
+                                    _mm_add_pd(_mm_mul_pd(e[8 + row], pz), e[12 + row]));
+            }
+            if (divide)
+            {
+                const __m128d w = _mm_div_pd(one, r[3]);
+                r[0] = _mm_mul_pd(r[0], w);
+                r[1] = _mm_mul_pd(r[1], w);
+                r[2] = _mm_mul_pd(r[2], w);
+            }
+            _mm_storeu_pd(ox + i, r[0]);
+            _mm_storeu_pd(oy + i, r[1]);
+            _mm_storeu_pd(oz + i, r[2]);
+        }
+        TransformPointsScalar(m, x + i, y + i, z + i, ox + i, oy + i, oz + i, count - i, divide);
+    }
+
+    GEDO_TARGET_AVX2 static void TransformPointsAvx2(const Mat4& m, const double* x, const double* y, const double* z,
+                                                     double* ox, double* oy, double* oz, size_t count, bool divide)
+    {
+        __m256d e[16];
+        for (size_t k = 0; k < 16; ++k)
+        {
+            e[k] = _mm256_set1_pd(m.data[k]);
+        }
+        const __m256d one = _mm256_set1_pd(1.0);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m256d px = _mm256_loadu_pd(x + i);
+            const __m256d py = _mm256_loadu_pd(y + i);
+            const __m256d pz = _mm256_loadu_pd(z + i);
+            __m256d r[4];
+            for (size_t row = 0; row < (divide ? 4u : 3u); ++row)
+            {
+                r[row] = _mm256_fmadd_pd(e[row], px, _mm256_fmadd_pd(e[4 + row], py, _mm256_fmadd_pd(e[8 + row], pz, e[12 + row])));
+            }
+            if (divide)
+            {
+                const __m256d w = _mm256_div_pd(one, r[3]);
+                r[0] = _mm256_mul_pd(r[0], w);
+                r[1] = _mm256_mul_pd(r[1], w);
+                r[2] = _mm256_mul_pd(r[2], w);
+            }
+            _mm256_storeu_pd(ox + i, r[0]);
+            _mm256_storeu_pd(oy + i, r[1]);
+            _mm256_storeu_pd(oz + i, r[2]);
+        }
+        TransformPointsScalar(m, x + i, y + i, z + i, ox + i, oy + i, oz + i, count - i, divide);
+    }
+#elif defined GEDO_ARCH_ARM64
+    static void TransformPointsNeon(const Mat4& m, const double* x, const double* y, const double* z,
+                                    double* ox, double* oy, double* oz, size_t count, bool divide)
+    {
+        float64x2_t e[16];
+        for (size_t k = 0; k < 16; ++k)
+        {
+            e[k] = vdupq_n_f64(m.data[k]);
+        }
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            const float64x2_t px = vld1q_f64(x + i);
+            const float64x2_t py = vld1q_f64(y + i);
+            const float64x2_t pz = vld1q_f64(z + i);
+            float64x2_t r[4];
+            for (size_t row = 0; row < (divide ? 4u : 3u); ++row)
+            {
+                r[row] = vfmaq_f64(vfmaq_f64(vfmaq_f64(e[12 + row], e[8 + row], pz), e[4 + row], py), e[row], px);
+            }
+            if (divide)
+            {
+                const float64x2_t w = vdivq_f64(vdupq_n_f64(1.0), r[3]);
+                r[0] = vmulq_f64(r[0], w);
+                r[1] = vmulq_f64(r[1], w);
+                r[2] = vmulq_f64(r[2], w);
+            }
+            vst1q_f64(ox + i, r[0]);
+            vst1q_f64(oy + i, r[1]);
+            vst1q_f64(oz + i, r[2]);
+        }
+        TransformPointsScalar(m, x + i, y + i, z + i, ox + i, oy + i, oz + i, count - i, divide);
+    }
+#endif
+
+    static TransformPointsFunction SelectTransformPoints()
+    {
+        const CpuFeatures& cpu = GetCpuFeatures();
+#if defined GEDO_ARCH_X86
+        if (cpu.avx2 && cpu.fma)
+        {
+            return TransformPointsAvx2;
+        }
+        if (cpu.sse2)
+        {
+            return TransformPointsSse2;
+        }
+#elif defined GEDO_ARCH_ARM64
+        if (cpu.neon)
+        {
+            return TransformPointsNeon;
+        }
+#endif
+        (void)cpu;
+        return TransformPointsScalar;
+    }
+
+    static void TransformPoints(const Mat4& m, const Points3d& points, Points3d& result, bool divide)
+    {
+        GEDO_ASSERT(points.count == result.count);
+        static const TransformPointsFunction transform = SelectTransformPoints();
+        // a point is 6 loads and stores so the batches are smaller than the
+        // element wise ones.
+        ParallelFor(points.count, PARALLEL_MIN_BATCH / 4, [&](size_t begin, size_t end) {
+            transform(m, points.x + begin, points.y + begin, points.z + begin,
+                      result.x + begin, result.y + begin, result.z + begin, end - begin, divide);
+        });
+    }
+
+    void TransformPoints(const Mat4& m, const Points3d& points, Points3d& result)
+    {
+        TransformPoints(m, points, result, false);
+    }
+
+    void ProjectPoints(const Mat4& m, const Points3d& points, Points3d& result)
+    {
+        TransformPoints(m, points, result, true);
+    }
+
+    void TransformVectors(const Mat4& m, const Points3d& vectors, Points3d& result)
+    {
+        Mat4 linear = m;
+        linear.elements[3][0] = 0;
+        linear.elements[3][1] = 0;
+        linear.elements[3][2] = 0;
+        TransformPoints(linear, vectors, result, false);
+    }
+
+    double Deg2Rad(double v)
+    {
+        return (PI / 180.0) * v;
+    }
+
+    double Rad2Deg(double v)
+    {
+        return (180.0 / PI) * v;
+    }
+
+    size_t GetElementSize(MatrixDataType type)
+    {
+        switch (type)
+        {
+        case MatrixDataType::FLOAT64: return sizeof(double);
+        case MatrixDataType::FLOAT32: return sizeof(float);
+        case MatrixDataType::INT32:   return sizeof(int32_t);
+        case MatrixDataType::UINT8:   return sizeof(uint8_t);
+        }
+        return 0;
+    }
+
+    const char* GetTypeName(MatrixDataType type)
+    {
+        switch (type)
+        {
+        case MatrixDataType::FLOAT64: return "double";
+        case MatrixDataType::FLOAT32: return "single";
+        case MatrixDataType::INT32:   return "int32";
+        case MatrixDataType::UINT8:   return "uint8";
+        }
+        return "unknown";
+    }
+
+    static bool IsIntegerType(MatrixDataType type)
+    {
+        return type == MatrixDataType::INT32 || type == MatrixDataType::UINT8;
+    }
+
+    MatrixDataType PromoteTypes(MatrixDataType a, MatrixDataType b)
+    {
+        if (a == b)
+        {
+            return a;
+        }
+        if (IsIntegerType(a) != IsIntegerType(b))
+        {
+            return IsIntegerType(a) ? a : b;
+        }
+        return IsIntegerType(a) ? MatrixDataType::INT32 : MatrixDataType::FLOAT32;
+    }
+
+// expands to a switch over type that runs "call<T>(arguments)" with the C++
+// type of the elements, call can start with return.
+#define DISPATCH_MATRIX_TYPE(type, call, ...)                                  \
+  switch (type)                                                                \
+  {                                                                            \
+  case MatrixDataType::FLOAT64: call<double>(__VA_ARGS__); break;              \
+  case MatrixDataType::FLOAT32: call<float>(__VA_ARGS__); break;               \
+  case MatrixDataType::INT32: call<int32_t>(__VA_ARGS__); break;               \
+  case MatrixDataType::UINT8: call<uint8_t>(__VA_ARGS__); break;               \
+  }
+
+    // v converted to T, integers are rounded half away from zero and
+    // saturated, NaN becomes 0.
+    template <typename T>
+    static T NarrowElement(double v)
+    {
+        switch (MatrixElement<T>::type)
+        {
+        case MatrixDataType::INT32:
+            return (T)(v != v ? 0 : v <= INT32_MIN ? INT32_MIN : v >= INT32_MAX ? INT32_MAX : (int32_t)round(v));
+        case MatrixDataType::UINT8:
+            return (T)(v != v || v <= 0 ? 0 : v >= 255 ? 255 : (uint8_t)round(v));
+        default:
+            return (T)v;
+        }
+    }
+
+    // dst[i] = src[i * srcStride] converted to D.
+    template <typename S, typename D>
+    static void ConvertElements(const S* src, size_t srcStride, D* dst, size_t n)
+    {
+        if (MatrixElement<S>::type == MatrixElement<D>::type && srcStride == 1)
+        {
+            GEDO_MEMCPY(dst, src, n * sizeof(D));
+            return;
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = NarrowElement<D>((double)src[i * srcStride]);
+        }
+    }
+
+    template <typename D>
+    static void ConvertElementsFrom(MatrixDataType srcType, const void* src, size_t srcStride, D* dst, size_t n)
+    {
+        switch (srcType)
+        {
+        case MatrixDataType::FLOAT64: ConvertElements((const double*)src, srcStride, dst, n); break;
+        case MatrixDataType::FLOAT32: ConvertElements((const float*)src, srcStride, dst, n); break;
+        case MatrixDataType::INT32:   ConvertElements((const int32_t*)src, srcStride, dst, n); break;
+        case MatrixDataType::UINT8:   ConvertElements((const uint8_t*)src, srcStride, dst, n); break;
+        }
+    }
+
+    template <typename S>
+    static void ConvertElementsTo(const S* src, size_t srcStride, MatrixDataType dstType, void* dst, size_t n)
+    {
+        switch (dstType)
+        {
+        case MatrixDataType::FLOAT64: ConvertElements(src, srcStride, (double*)dst, n); break;
+        case MatrixDataType::FLOAT32: ConvertElements(src, srcStride, (float*)dst, n); break;
+        case MatrixDataType::INT32:   ConvertElements(src, srcStride, (int32_t*)dst, n); break;
+        case MatrixDataType::UINT8:   ConvertElements(src, srcStride, (uint8_t*)dst, n); break;
+        }
+    }
+
+    static uint8_t* GetElementAddress(const Matrix& m, size_t i, size_t j)
+    {
+        return (uint8_t*)m.data + (i * m.rowStride + j * m.colStride) * GetElementSize(m.type);
+    }
+
+    double& At(Matrix& m, size_t i, size_t j)
+    {
+        GEDO_ASSERT(m.type == MatrixDataType::FLOAT64);
+        return m.data[i * m.rowStride + j * m.colStride];
+    }
+
+    const double& At(const Matrix& m, size_t i, size_t j)
+    {
+        GEDO_ASSERT(m.type == MatrixDataType::FLOAT64);
+        return m.data[i * m.rowStride + j * m.colStride];
+    }
+
+    double GetElement(const Matrix& m, size_t i, size_t j)
+    {
+        double result = 0;
+        ConvertElementsFrom(m.type, GetElementAddress(m, i, j), 1, &result, 1);
+        return result;
+    }
+
+    void GetRow(const Matrix& m, size_t row, double* result)
+    {
+        for (size_t i = 0; i < m.cols; ++i)
+        {
+            result[i] = At(m, row, i);
+        }
+    }
+
+    double DotProduct(const double* v0, const double* v1, size_t size)
+    {
+        double result = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            result += v0[i] * v1[i];
+        }
+        return result;
+    }
+
+    void GetCol(const Matrix& m, size_t col, double* result)
+    {
+        for (size_t i = 0; i < m.rows; ++i)
+        {
+            result[i] = At(m, i, col);
+        }
+    }
+
+    Matrix CreateHeapMatrix(size_t rows, size_t cols, Allocator& allocator)
+    {
+        return CreateHeapMatrix(rows, cols, MatrixDataType::FLOAT64, allocator);
+    }
+
+    Matrix CreateHeapMatrix(size_t rows, size_t cols, MatrixDataType type, Allocator& allocator)
+    {
+        Matrix result;
+        result.rows = rows;
+        result.cols = cols;
+        result.rowStride = cols;
+        result.type = type;
+        // every caller writes all the elements.
+        MemoryBlock block =
+            AllocateUninitialized(sizeof(MatrixStorage) + rows * cols * GetElementSize(type), allocator);
+        MatrixStorage* storage = (MatrixStorage*)block.data;
+        storage->refCount = 1;
+        storage->allocator = &allocator;
+        storage->size = block.size;
+        result.storage = storage;
+        result.data = (double*)(storage + 1);
+        return result;
+    }
+
+    Matrix CreateMatrix(size_t rows, size_t cols, Allocator& allocator)
+    {
+        return CreateMatrix(rows, cols, MatrixDataType::FLOAT64, allocator);
+    }
+
+    Matrix CreateMatrix(size_t rows, size_t cols, MatrixDataType type, Allocator& allocator)
+    {
+        if (rows * cols > Matrix::stackBufferSize)
+        {
+            return CreateHeapMatrix(rows, cols, type, allocator);
+        }
+        Matrix result;
+        result.rows = rows;
+        result.cols = cols;
+        result.rowStride = cols;
+        result.type = type;
+        result.data = result.stackBuffer;
+        return result;
+    }
+
+    Matrix Zeros(size_t rows, size_t cols, Allocator& allocator)
+    {
+        Matrix result = CreateMatrix(rows, cols, allocator);
+        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        {
+            result.data[i] = 0;
+        }
+        return result;
+    }
+
+    Matrix Ones(size_t rows, size_t cols, Allocator& allocator)
+    {
+        Matrix result = CreateMatrix(rows, cols, allocator);
+        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        {
+            result.data[i] = 1;
+        }
+        return result;
+    }
+
+    Matrix Eye(size_t rows, size_t cols, Allocator& allocator)
+    {
+        Matrix result = CreateMatrix(rows, cols, allocator);
+        for (size_t i = 0; i < result.rows; ++i)
+        {
+            for (size_t j = 0; j < result.cols; ++j)
+            {
+                At(result, i, j) = (i == j) ? 1 : 0;
+            }
+        }
+        return result;
+    }
+
+    void FreeMatrix(Matrix& m)
+    {
+        if (m.storage && AtomicAdd(&m.storage->refCount, -1) == 0)
+        {
+            MemoryBlock block;
+            block.data = (uint8_t*)m.storage;
+            block.size = m.storage->size;
+            Deallocate(block, *m.storage->allocator);
+        }
+        m.storage = NULL;
+        if (m.data != m.stackBuffer)
+        {
+            m.data = NULL;
+        }
+    }
+
+    Matrix ShareMatrix(const Matrix& m)
+    {
+        if (m.storage)
+        {
+            AtomicAdd(&m.storage->refCount, 1);
+        }
+        return m;
+    }
+
+    static bool IsScalar(const Matrix& m)
+    {
+        return m.rows == 1 && m.cols == 1;
+    }
+
+    bool IsContiguous(const Matrix& m)
+    {
+        return (m.colStride == 1 || m.cols <= 1) && (m.rowStride == m.cols || m.rows <= 1);
+    }
+
+    // dst gets the m.cols elements of the row, it has the type of m.
+    static void CopyRow(const Matrix& m, size_t row, void* dst)
+    {
+        const uint8_t* src = GetElementAddress(m, row, 0);
+        switch (m.type)
+        {
+        case MatrixDataType::FLOAT64: ConvertElements((const double*)src, m.colStride, (double*)dst, m.cols); break;
+        case MatrixDataType::FLOAT32: ConvertElements((const float*)src, m.colStride, (float*)dst, m.cols); break;
+        case MatrixDataType::INT32:   ConvertElements((const int32_t*)src, m.colStride, (int32_t*)dst, m.cols); break;
+        case MatrixDataType::UINT8:   ConvertElements((const uint8_t*)src, m.colStride, (uint8_t*)dst, m.cols); break;
+        }
+    }
+
+    // (COPY_TILE X COPY_TILE) tiles at a time so the strided reads of a
+    // transposed source and the writes both stay in the cache.
+    static const size_t COPY_TILE = 32;
+
+    template <typename T>
+    static void CopyElementsTiled(const Matrix& src, Matrix& dest)
+    {
+        const T* s = (const T*)src.data;
+        T* d = (T*)dest.data;
+        const size_t tileRows = (src.rows + COPY_TILE - 1) / COPY_TILE;
+        ParallelFor(tileRows, Max<size_t>(PARALLEL_MIN_BATCH / (COPY_TILE * src.cols), 1), [&](size_t begin, size_t end) {
+            for (size_t ib = begin * COPY_TILE; ib < Min(end * COPY_TILE, src.rows); ib += COPY_TILE)
+            {
+                const size_t rows = Min(COPY_TILE, src.rows - ib);
+                for (size_t jb = 0; jb < src.cols; jb += COPY_TILE)
+                {
+                    const size_t cols = Min(COPY_TILE, src.cols - jb);
+                    for (size_t i = ib; i < ib + rows; ++i)
+                    {
+                        for (size_t j = jb; j < jb + cols; ++j)
+                        {
+                            d[i * dest.rowStride + j * dest.colStride] = s[i * src.rowStride + j * src.colStride];
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    void CopyElements(const Matrix& src, Matrix& dest)
+    {
+        GEDO_ASSERT(src.rows == dest.rows && src.cols == dest.cols && src.type == dest.type);
+        if (IsContiguous(src) && IsContiguous(dest))
+        {
+            GEDO_MEMCPY(dest.data, src.data, src.rows * src.cols * GetElementSize(src.type));
+            return;
+        }
+        if (src.colStride != 1 && src.rows > 1 && src.cols > 1)
+        {
+            DISPATCH_MATRIX_TYPE(src.type, CopyElementsTiled, src, dest);
+            return;
+        }
+        if (dest.colStride == 1)
+        {
+            for (size_t i = 0; i < src.rows; ++i)
+            {
+                CopyRow(src, i, GetElementAddress(dest, i, 0));
+            }
+            return;
+        }
+        const size_t elementSize = GetElementSize(src.type);
+        for (size_t i = 0; i < src.rows; ++i)
+        {
+            for (size_t j = 0; j < src.cols; ++j)
+            {
+                GEDO_MEMCPY(GetElementAddress(dest, i, j), GetElementAddress(src, i, j), elementSize);
+            }
+        }
+    }
+
+    Matrix CopyMatrix(const Matrix& m, Allocator& allocator)
+    {
+        Matrix result = CreateMatrix(m.rows, m.cols, m.type, allocator);
+        CopyElements(m, result);
+        return result;
+    }
+
+    Matrix ConvertMatrix(const Matrix& m, MatrixDataType type, Allocator& allocator)
+    {
+        if (m.type == type)
+        {
+            return CopyMatrix(m, allocator);
+        }
+        Matrix result = CreateMatrix(m.rows, m.cols, type, allocator);
+        const size_t elementSize = GetElementSize(type);
+        ParallelFor(m.rows, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(m.cols, 1), 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                uint8_t* dst = (uint8_t*)result.data + i * m.cols * elementSize;
+                const uint8_t* src = GetElementAddress(m, i, 0);
+                switch (type)
+                {
+                case MatrixDataType::FLOAT64: ConvertElementsFrom(m.type, src, m.colStride, (double*)dst, m.cols); break;
+                case MatrixDataType::FLOAT32: ConvertElementsFrom(m.type, src, m.colStride, (float*)dst, m.cols); break;
+                case MatrixDataType::INT32:   ConvertElementsFrom(m.type, src, m.colStride, (int32_t*)dst, m.cols); break;
+                case MatrixDataType::UINT8:   ConvertElementsFrom(m.type, src, m.colStride, (uint8_t*)dst, m.cols); break;
+                }
+            }
+        });
+        return result;
+    }
+
+    // m when it is contiguous, otherwise a copy stored in copy which the
+    // caller frees.
+    static const Matrix& Contiguous(const Matrix& m, Matrix& copy)
+    {
+        if (IsContiguous(m))
+        {
+            return m;
+        }
+        copy = CopyMatrix(m);
+        return copy;
+    }
+
+    void MakeMatrixUnique(Matrix& m)
+    {
+        if (m.storage && (AtomicLoad(&m.storage->refCount) > 1 || !IsContiguous(m)))
+        {
+            Matrix copy = CopyMatrix(m, *m.storage->allocator);
+            FreeMatrix(m);
+            m = copy;
+        }
+    }
+
+    // views of matrices in stackBuffer are copied since stackBuffer moves
+    // with the Matrix.
+    static Matrix MakeView(const Matrix& m, double* data, size_t rows, size_t cols, size_t rowStride, size_t colStride)
+    {
+        Matrix view;
+        view.rows = rows;
+        view.cols = cols;
+        view.rowStride = rowStride;
+        view.colStride = colStride;
+        view.data = data;
+        view.type = m.type;
+        if (m.data == m.stackBuffer)
+        {
+            return CopyMatrix(view);
+        }
+        view.storage = m.storage;
+        return ShareMatrix(view);
+    }
+
+    Matrix RowsView(const Matrix& m, size_t first, size_t count)
+    {
+        GEDO_ASSERT(first + count <= m.rows);
+        return MakeView(m, (double*)GetElementAddress(m, first, 0), count, m.cols, m.rowStride, m.colStride);
+    }
+
+    Matrix ColsView(const Matrix& m, size_t first, size_t count)
+    {
+        GEDO_ASSERT(first + count <= m.cols);
+        return MakeView(m, (double*)GetElementAddress(m, 0, first), m.rows, count, m.rowStride, m.colStride);
+    }
+
+    Matrix TransposedView(const Matrix& m)
+    {
+        return MakeView(m, m.data, m.cols, m.rows, m.colStride, m.rowStride);
+    }
+
+    Matrix SliceView(const Matrix& m, size_t firstRow, size_t rowCount, size_t rowStep,
+                     size_t firstCol, size_t colCount, size_t colStep)
+    {
+        GEDO_ASSERT(rowStep && colStep);
+        GEDO_ASSERT(!rowCount || firstRow + (rowCount - 1) * rowStep < m.rows);
+        GEDO_ASSERT(!colCount || firstCol + (colCount - 1) * colStep < m.cols);
+        double* data = rowCount && colCount ? (double*)GetElementAddress(m, firstRow, firstCol) : m.data;
+        return MakeView(m, data, rowCount, colCount, m.rowStride * rowStep, m.colStride * colStep);
+    }
+
+    //---------------------------Indexing------------------------//
+    // the copies only move bits so T is an unsigned integer of the element size.
+    template<typename T>
+    static void GatherElementsT(const Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols,
+                                size_t colCount, Matrix& result)
+    {
+        const T* src = (const T*)m.data;
+        T* dst = (T*)result.data;
+        ParallelFor(rowCount, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(colCount, 1), 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const T* row = src + (rows ? rows[i] : i) * m.rowStride;
+                T* out = dst + i * colCount;
+                if (!cols && m.colStride == 1)
+                {
+                    memcpy(out, row, colCount * sizeof(T));
+                    continue;
+                }
+                for (size_t j = 0; j < colCount; ++j)
+                {
+                    out[j] = row[(cols ? cols[j] : j) * m.colStride];
+                }
+            }
+        });
+    }
+
+    template<typename T>
+    static void ScatterElementsT(Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols, size_t colCount,
+                                 const Matrix& values)
+    {
+        T* dst = (T*)m.data;
+        const T* src = (const T*)values.data;
+        // a single value is repeated.
+        const size_t valueRowStride = values.rows * values.cols == 1 ? 0 : values.rowStride;
+        const size_t valueColStride = values.rows * values.cols == 1 ? 0 : values.colStride;
+        auto scatter = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                T* row = dst + (rows ? rows[i] : i) * m.rowStride;
+                const T* in = src + i * valueRowStride;
+                for (size_t j = 0; j < colCount; ++j)
+                {
+                    row[(cols ? cols[j] : j) * m.colStride] = in[j * valueColStride];
+                }
+            }
+        };
+        // repeated rows must be written in order, the last value wins.
+        if (rows)
+        {
+            scatter(0, rowCount);
+        }
+        else
+        {
+            ParallelFor(rowCount, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(colCount, 1), 1), scatter);
+        }
+    }
+
+    template<typename T>
+    static void GatherLinearT(const Matrix& m, const size_t* indices, size_t count, Matrix& result)
+    {
+        const T* src = (const T*)m.data;
+        T* dst = (T*)result.data;
+        ParallelFor(count, PARALLEL_MIN_BATCH, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k)
+            {
+                const size_t p = indices[k];
+                dst[(k % result.rows) * result.cols + k / result.rows] =
+                    src[(p % m.rows) * m.rowStride + (p / m.rows) * m.colStride];
+            }
+        });
+    }
+
+    template<typename T>
+    static void ScatterLinearT(Matrix& m, const size_t* indices, size_t count, const Matrix& values)
+    {
+        T* dst = (T*)m.data;
+        const T* src = (const T*)values.data;
+        const bool repeat = values.rows * values.cols == 1;
+        for (size_t k = 0; k < count; ++k)
+        {
+            const size_t p = indices[k];
+            const T v = repeat ? src[0] : src[(k % values.rows) * values.rowStride + (k / values.rows) * values.colStride];
+            dst[(p % m.rows) * m.rowStride + (p / m.rows) * m.colStride] = v;
+        }
+    }
+
+    template<typename T>
+    static void GatherMaskT(const Matrix& m, const Matrix& mask, Matrix& result)
+    {
+        const T* src = (const T*)m.data;
+        T* dst = (T*)result.data;
+        size_t n = 0;
+        for (size_t j = 0; j < m.cols; ++j)
+        {
+            for (size_t i = 0; i < m.rows; ++i)
+            {
+                if (GetElement(mask, i, j) != 0.0)
+                {
+                    dst[n++] = src[i * m.rowStride + j * m.colStride];
+                }
+            }
+        }
+    }
+
+    template<typename T>
+    static void FillMaskT(Matrix& m, const Matrix& mask, T value)
+    {
+        T* dst = (T*)m.data;
+        ParallelFor(m.rows, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(m.cols, 1), 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                for (size_t j = 0; j < m.cols; ++j)
+                {
+                    if (GetElement(mask, i, j) != 0.0)
+                    {
+                        dst[i * m.rowStride + j * m.colStride] = value;
+                    }
+                }
+            }
+        });
+    }
+
+    // the FLOAT64 rows, NaN in the mask selects like any value that is not 0.
+    typedef void (*FillMaskRowFunction)(double* dest, const double* mask, size_t count, double value);
+
+    static void FillMaskRowScalar(double* dest, const double* mask, size_t count, double value)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (mask[i] != 0.0)
+            {
+                dest[i] = value;
+            }
+        }
+    }
+
+#if defined GEDO_ARCH_X86
+    GEDO_TARGET_SSE2 static void FillMaskRowSse2(double* dest, const double* mask, size_t count, double value)
+    {
+        const __m128d v = _mm_set1_pd(value);
+        const __m128d zero = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            const __m128d selected = _mm_cmpneq_pd(_mm_loadu_pd(mask + i), zero);
+            const __m128d d = _mm_loadu_pd(dest + i);
+            _mm_storeu_pd(dest + i, _mm_or_pd(_mm_and_pd(selected, v), _mm_andnot_pd(selected, d)));
+        }
+        FillMaskRowScalar(dest + i, mask + i, count - i, value);
+    }
+
+    GEDO_TARGET_AVX2 static void FillMaskRowAvx2(double* dest, const double* mask, size_t count, double value)
+    {
+        const __m256d v = _mm256_set1_pd(value);
+        const __m256d zero = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m256d selected = _mm256_cmp_pd(_mm256_loadu_pd(mask + i), zero, _CMP_NEQ_UQ);
+            _mm256_storeu_pd(dest + i, _mm256_blendv_pd(_mm256_loadu_pd(dest + i), v, selected));
+        }
+        FillMaskRowSse2(dest + i, mask + i, count - i, value);
+    }
+#elif defined GEDO_ARCH_ARM64
+    static void FillMaskRowNeon(double* dest, const double* mask, size_t count, double value)
+    {
+        const float64x2_t v = vdupq_n_f64(value);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            // NaN is not equal to 0 so it is replaced as well.
+            const uint64x2_t keep = vceqq_f64(vld1q_f64(mask + i), vdupq_n_f64(0.0));
+            vst1q_f64(dest + i, vbslq_f64(keep, vld1q_f64(dest + i), v));
+        }
+        FillMaskRowScalar(dest + i, mask + i, count - i, value);
+    }
+#endif
+
+    static FillMaskRowFunction SelectFillMaskRow()
+    {
+        const CpuFeatures& cpu = GetCpuFeatures();
+#if defined GEDO_ARCH_X86
+        if (cpu.avx2)
+        {
+            return FillMaskRowAvx2;
+        }
+        if (cpu.sse2)
+        {
+            return FillMaskRowSse2;
+        }
+#elif defined GEDO_ARCH_ARM64
+        if (cpu.neon)
+        {
+            return FillMaskRowNeon;
+        }
+#endif
+        (void)cpu;
+        return FillMaskRowScalar;
+    }
+
+    Matrix GatherElements(const Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols, size_t colCount,
+                          Allocator& allocator)
+    {
+        Matrix result = CreateMatrix(rowCount, colCount, m.type, allocator);
+        switch (GetElementSize(m.type))
+        {
+        case 8:  GatherElementsT<uint64_t>(m, rows, rowCount, cols, colCount, result); break;
+        case 4:  GatherElementsT<uint32_t>(m, rows, rowCount, cols, colCount, result); break;
+        default: GatherElementsT<uint8_t>(m, rows, rowCount, cols, colCount, result); break;
+        }
+        return result;
+    }
+
+    void ScatterElements(Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols, size_t colCount,
+                         const Matrix& values)
+    {
+        GEDO_ASSERT(values.type == m.type);
+        GEDO_ASSERT(values.rows * values.cols == 1 || (values.rows == rowCount && values.cols == colCount));
+        switch (GetElementSize(m.type))
+        {
+        case 8:  ScatterElementsT<uint64_t>(m, rows, rowCount, cols, colCount, values); break;
+        case 4:  ScatterElementsT<uint32_t>(m, rows, rowCount, cols, colCount, values); break;
+        default: ScatterElementsT<uint8_t>(m, rows, rowCount, cols, colCount, values); break;
+        }
+    }
+
+    Matrix GatherLinear(const Matrix& m, const size_t* indices, size_t count, size_t rows, size_t cols,
+                        Allocator& allocator)
+    {
+        GEDO_ASSERT(rows * cols == count);
+        Matrix result = CreateMatrix(rows, cols, m.type, allocator);
+        switch (GetElementSize(m.type))
+        {
+        case 8:  GatherLinearT<uint64_t>(m, indices, count, result); break;
+        case 4:  GatherLinearT<uint32_t>(m, indices, count, result); break;
+        default: GatherLinearT<uint8_t>(m, indices, count, result); break;
+        }
+        return result;
+    }
+
+    void ScatterLinear(Matrix& m, const size_t* indices, size_t count, const Matrix& values)
+    {
+        GEDO_ASSERT(values.type == m.type);
+        GEDO_ASSERT(values.rows * values.cols == 1 || values.rows * values.cols == count);
+        switch (GetElementSize(m.type))
+        {
+        case 8:  ScatterLinearT<uint64_t>(m, indices, count, values); break;
+        case 4:  ScatterLinearT<uint32_t>(m, indices, count, values); break;
+        default: ScatterLinearT<uint8_t>(m, indices, count, values); break;
+        }
+    }
+
+    size_t CountMask(const Matrix& mask)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < mask.rows; ++i)
+        {
+            if (mask.type == MatrixDataType::FLOAT64 && mask.colStride == 1)
+            {
+                const double* row = mask.data + i * mask.rowStride;
+                for (size_t j = 0; j < mask.cols; ++j)
+                {
+                    count += row[j] != 0.0;
+                }
+                continue;
+            }
+            for (size_t j = 0; j < mask.cols; ++j)
+            {
+                count += GetElement(mask, i, j) != 0.0;
+            }
+        }
+        return count;
+    }
+
+    Matrix GatherMask(const Matrix& m, const Matrix& mask, Allocator& allocator)
+    {
+        GEDO_ASSERT(m.rows == mask.rows && m.cols == mask.cols);
+        Matrix result = CreateMatrix(CountMask(mask), 1, m.type, allocator);
+        switch (GetElementSize(m.type))
+        {
+        case 8:  GatherMaskT<uint64_t>(m, mask, result); break;
+        case 4:  GatherMaskT<uint32_t>(m, mask, result); break;
+        default: GatherMaskT<uint8_t>(m, mask, result); break;
+        }
+        return result;
+    }
+
+    void FillMask(Matrix& m, const Matrix& mask, double value)
+    {
+        GEDO_ASSERT(m.rows == mask.rows && m.cols == mask.cols);
+        if (m.type == MatrixDataType::FLOAT64 && mask.type == MatrixDataType::FLOAT64 && m.colStride == 1 &&
+            mask.colStride == 1)
+        {
+            static const FillMaskRowFunction fill = SelectFillMaskRow();
+            ParallelFor(m.rows, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(m.cols, 1), 1), [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    fill(m.data + i * m.rowStride, mask.data + i * mask.rowStride, m.cols, value);
+                }
+            });
+            return;
+        }
+        uint64_t converted = 0;
+        ConvertElementsTo(&value, 1, m.type, &converted, 1);
+        uint32_t converted32 = 0;
+        GEDO_MEMCPY(&converted32, &converted, sizeof(converted32));
+        uint8_t converted8 = 0;
+        GEDO_MEMCPY(&converted8, &converted, sizeof(converted8));
+        switch (GetElementSize(m.type))
+        {
+        case 8:  FillMaskT<uint64_t>(m, mask, converted); break;
+        case 4:  FillMaskT<uint32_t>(m, mask, converted32); break;
+        default: FillMaskT<uint8_t>(m, mask, converted8); break;
+        }
+    }
+    //-----------------------------------------------------------//
+
+    // the type of the first non empty matrix, CanConcat* checks the rest match it.
+    static MatrixDataType GetConcatType(const Matrix* matrices, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (matrices[i].rows * matrices[i].cols != 0)
+            {
+                return matrices[i].type;
+            }
+        }
+        return MatrixDataType::FLOAT64;
+    }
+
+    bool CanConcatHorizontal(const Matrix* matrices, size_t count)
+    {
+        const MatrixDataType type = GetConcatType(matrices, count);
+        size_t rows = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Matrix& m = matrices[i];
+            if (m.rows * m.cols != 0)
+            {
+                if ((rows && rows != m.rows) || m.type != type)
+                {
+                    return false;
+                }
+                rows = m.rows;
+            }
+        }
+        return true;
+    }
+
+    bool CanConcatVertical(const Matrix* matrices, size_t count)
+    {
+        const MatrixDataType type = GetConcatType(matrices, count);
+        size_t cols = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Matrix& m = matrices[i];
+            if (m.rows * m.cols != 0)
+            {
+                if ((cols && cols != m.cols) || m.type != type)
+                {
+                    return false;
+                }
+                cols = m.cols;
+            }
+        }
+        return true;
+    }
+
+
+    Matrix ConcatHorizontal(const Matrix* matrices, size_t count, Allocator& allocator)
+    {
+        GEDO_ASSERT(CanConcatHorizontal(matrices, count));
+        size_t rows = 0;
+        size_t cols = 0;
+        const MatrixDataType type = GetConcatType(matrices, count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (matrices[i].rows * matrices[i].cols != 0)
+            {
+                rows = matrices[i].rows;
+                cols += matrices[i].cols;
+            }
+        }
+        Matrix result = CreateMatrix(rows, cols, type, allocator);
+        size_t offset = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Matrix& m = matrices[i];
+            if (m.rows * m.cols != 0)
+            {
+                for (size_t r = 0; r < rows; ++r)
+                {
+                    CopyRow(m, r, GetElementAddress(result, r, offset));
+                }
+                offset += m.cols;
+            }
+        }
+        return result;
+    }
+
+    Matrix ConcatVertical(const Matrix* matrices, size_t count, Allocator& allocator)
+    {
+        GEDO_ASSERT(CanConcatVertical(matrices, count));
+        size_t rows = 0;
+        size_t cols = 0;
+        const MatrixDataType type = GetConcatType(matrices, count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (matrices[i].rows * matrices[i].cols != 0)
+            {
+                cols = matrices[i].cols;
+                rows += matrices[i].rows;
+            }
+        }
+        Matrix result = CreateMatrix(rows, cols, type, allocator);
+        size_t row = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Matrix& m = matrices[i];
+            for (size_t r = 0; r < m.rows && m.cols; ++r)
+            {
+                CopyRow(m, r, GetElementAddress(result, row + r, 0));
+            }
+            row += m.cols ? m.rows : 0;
+        }
+        return result;
+    }
+
+    bool CanMultiply(const Matrix& m0, const Matrix& m1)
+    {
+        return (IsScalar(m0) || IsScalar(m1) || (m0.cols == m1.rows));
+    }
+
+    bool CanBroadcast(size_t rows0, size_t cols0, size_t rows1, size_t cols1)
+    {
+        return (rows0 == rows1 || rows0 == 1 || rows1 == 1) &&
+               (cols0 == cols1 || cols0 == 1 || cols1 == 1);
+    }
+
+    size_t BroadcastSize(size_t size0, size_t size1)
+    {
+        return (size0 == 1) ? size1 : size0;
+    }
+
+    bool CanAdd(const Matrix& m0, const Matrix& m1)
+    {
+        return CanBroadcast(m0.rows, m0.cols, m1.rows, m1.cols);
+    }
+
+    bool CanSubtract(const Matrix& m0, const Matrix& m1)
+    {
+        return CanAdd(m0, m1);
+    }
+
+    //--------------------Vector math----------------------------//
+    // the argument reductions and the polynomials are the ones of fdlibm. the
+    // last block of an array is padded to 4 elements so every value goes
+    // through the same code and gets the same result wherever it is.
+    typedef void (*VectorMathFunction)(const double* values, double* result, size_t count);
+
+    struct VectorMathKernels
+    {
+        VectorMathFunction sin = NULL;
+        VectorMathFunction cos = NULL;
+        VectorMathFunction tan = NULL;
+        VectorMathFunction asin = NULL;
+        VectorMathFunction acos = NULL;
+        VectorMathFunction atan = NULL;
+        VectorMathFunction exp = NULL;
+        VectorMathFunction log = NULL;
+        VectorMathFunction sqrt = NULL;
+    };
+
+    template <double (*F)(double)>
+    static void VectorMathScalar(const double* values, double* result, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            result[i] = F(values[i]);
+        }
+    }
+
+#if defined GEDO_ARCH_X86
+    // 1 / k! for k = 0..13, enough for |r| <= ln(2) / 2.
+    static const double EXP_POLY[] =
+    {
+        1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040, 1.0 / 40320,
+        1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800.0
+    };
+    static const double LOG2E = 1.44269504088896338700e+00;
+    // ln(2) = LN2_HI + LN2_LO, n * LN2_HI is exact for |n| < 2^21.
+    static const double LN2_HI = 6.93147180369123816490e-01;
+    static const double LN2_LO = 1.90821492927058770002e-10;
+    static const double LOG_POLY[] =
+    {
+        6.666666666666735130e-01, 3.999999999940941908e-01, 2.857142874366239149e-01,
+        2.222219843214978396e-01, 1.818357216161805012e-01, 1.531383769920937332e-01,
+        1.479819860511658591e-01
+    };
+    static const double TWO_OVER_PI = 6.36619772367581382433e-01;
+    // pi / 2 split in pieces of 33 bits, j * PIO2_1..3 is exact for j < 2^20.
+    static const double PIO2_1 = 1.57079632673412561417e+00;
+    static const double PIO2_2 = 6.07710050630396597660e-11;
+    static const double PIO2_3 = 2.02226624871116645580e-21;
+    static const double PIO2_3T = 8.47842766036889956997e-32;
+    // (2^20 - 1) * pi / 2, larger arguments are given to libm.
+    static const double TRIG_MAX_ARGUMENT = 1.6e6;
+    static const double SIN_S1 = -1.66666666666666324348e-01;
+    static const double SIN_POLY[] =
+    {
+        8.33333333332248946124e-03, -1.98412698298579493134e-04, 2.75573137070700676789e-06,
+        -2.50507602534068634195e-08, 1.58969099521155010221e-10
+    };
+    static const double COS_POLY[] =
+    {
+        4.16666666666666019037e-02, -1.38888888888741095749e-03, 2.48015872894767294178e-05,
+        -2.75573143513906633035e-07, 2.08757232129817482790e-09, -1.13596475577881948265e-11
+    };
+    // atan(x) = ATAN_HI[i] + ATAN_LO[i] + atan(t) with t = (x * c0 - c1) / (c2 + x * c3)
+    // for the ranges [0, 7/16), [7/16, 11/16), [11/16, 19/16), [19/16, 39/16), [39/16, inf].
+    static const double ATAN_BOUNDS[] = {7.0 / 16, 11.0 / 16, 19.0 / 16, 39.0 / 16};
+    static const double ATAN_HI[] =
+    {
+        0.0, 4.63647609000806093515e-01, 7.85398163397448278999e-01,
+        9.82793723247329054082e-01, 1.57079632679489655800e+00
+    };
+    static const double ATAN_LO[] =
+    {
+        0.0, 2.26987774529616870924e-17, 3.06161699786838301793e-17,
+        1.39033110312309984516e-17, 6.12323399573676603587e-17
+    };
+    static const double ATAN_REDUCE[][4] =
+    {
+        {1.0, 0.0, 1.0, 0.0}, {2.0, 1.0, 2.0, 1.0}, {1.0, 1.0, 1.0, 1.0},
+        {1.0, 1.5, 1.0, 1.5}, {0.0, 1.0, 0.0, 1.0}
+    };
+    static const double ATAN_POLY_EVEN[] =
+    {
+        3.33333333333329318027e-01, 1.42857142725034663711e-01, 9.09088713343650656196e-02,
+        6.66107313738753120669e-02, 4.97687799461593236017e-02, 1.62858201153657823623e-02
+    };
+    static const double ATAN_POLY_ODD[] =
+    {
+        -1.99999999998764832476e-01, -1.11111104054623557880e-01, -7.69187620504482999495e-02,
+        -5.83357013379057348645e-02, -3.65315727442169155270e-02
+    };
+
+    // c[0] + x * (c[1] + x * (... + x * c[N - 1])).
+    template <size_t N>
+    GEDO_TARGET_AVX2 static inline __m256d HornerAvx2(__m256d x, const double (&c)[N])
+    {
+        __m256d result = _mm256_set1_pd(c[N - 1]);
+        for (size_t i = N - 1; i-- > 0;)
+        {
+            result = _mm256_fmadd_pd(result, x, _mm256_set1_pd(c[i]));
+        }
+        return result;
+    }
+
+    // 2^k for k in [-1022, 1023].
+    GEDO_TARGET_AVX2 static inline __m256d Pow2Avx2(__m128i k)
+    {
+        const __m256i biased = _mm256_add_epi64(_mm256_cvtepi32_epi64(k), _mm256_set1_epi64x(1023));
+        return _mm256_castsi256_pd(_mm256_slli_epi64(biased, 52));
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d ExpAvx2(__m256d x)
+    {
+        // the operand order keeps NaN, exp(710) is inf and exp(-746) is 0.
+        x = _mm256_min_pd(_mm256_set1_pd(710.0), _mm256_max_pd(_mm256_set1_pd(-746.0), x));
+        const __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)),
+                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), x);
+        r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+        const __m256d p = HornerAvx2(r, EXP_POLY);
+        // 2^n is applied in two halves so results that overflow or are
+        // subnormal are rounded once.
+        const __m128i k = _mm256_cvtpd_epi32(n);
+        const __m128i k0 = _mm_srai_epi32(k, 1);
+        const __m128i k1 = _mm_sub_epi32(k, k0);
+        return _mm256_mul_pd(_mm256_mul_pd(p, Pow2Avx2(k0)), Pow2Avx2(k1));
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d LogAvx2(__m256d x)
+    {
+        const __m256d one = _mm256_set1_pd(1.0);
+        // subnormals are scaled by 2^54 first.
+        const __m256d subnormal = _mm256_cmp_pd(x, _mm256_set1_pd(2.2250738585072014e-308), _CMP_LT_OQ);
+        const __m256d v = _mm256_blendv_pd(x, _mm256_mul_pd(x, _mm256_set1_pd(18014398509481984.0)), subnormal);
+        // x = 2^e * m with m in [sqrt(2) / 2, sqrt(2)), the biased exponent is
+        // turned to a double by placing it in the mantissa of 2^52.
+        const __m256d twoPow52 = _mm256_set1_pd(4503599627370496.0);
+        const __m256i biased = _mm256_srli_epi64(_mm256_castpd_si256(v), 52);
+        __m256d e = _mm256_sub_pd(_mm256_or_pd(_mm256_castsi256_pd(biased), twoPow52),
+                                  _mm256_set1_pd(4503599627370496.0 + 1023.0));
+        e = _mm256_sub_pd(e, _mm256_and_pd(subnormal, _mm256_set1_pd(54.0)));
+        const __m256d mantissaMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x000FFFFFFFFFFFFFll));
+        __m256d m = _mm256_or_pd(_mm256_and_pd(v, mantissaMask), one);
+        const __m256d upper = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), upper);
+        e = _mm256_add_pd(e, _mm256_and_pd(upper, one));
+
+        // log(m) = log(1 + f) = f - hfsq + s * (hfsq + R) with s = f / (2 + f).
+        const __m256d f = _mm256_sub_pd(m, one);
+        const __m256d s = _mm256_div_pd(f, _mm256_add_pd(_mm256_set1_pd(2.0), f));
+        const __m256d z = _mm256_mul_pd(s, s);
+        const __m256d R = _mm256_mul_pd(z, HornerAvx2(z, LOG_POLY));
+        const __m256d hfsq = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(f, f));
+        const __m256d t = _mm256_fmadd_pd(s, _mm256_add_pd(hfsq, R), _mm256_mul_pd(e, _mm256_set1_pd(LN2_LO)));
+        __m256d result = _mm256_fmsub_pd(e, _mm256_set1_pd(LN2_HI), _mm256_sub_pd(_mm256_sub_pd(hfsq, t), f));
+
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d inf = _mm256_set1_pd(INFINITY);
+        result = _mm256_blendv_pd(result, _mm256_set1_pd(-INFINITY), _mm256_cmp_pd(x, zero, _CMP_EQ_OQ));
+        result = _mm256_blendv_pd(result, _mm256_set1_pd(NAN), _mm256_cmp_pd(x, zero, _CMP_NGE_UQ));
+        return _mm256_blendv_pd(result, inf, _mm256_cmp_pd(x, inf, _CMP_EQ_OQ));
+    }
+
+    // x = j * pi / 2 + r + y with |r| <= pi / 4 for |x| < TRIG_MAX_ARGUMENT,
+    // y holds the rounding error of r. x - j * PIO2_1 and j * PIO2_2 are exact.
+    GEDO_TARGET_AVX2 static inline __m256d ReducePiOver2Avx2(__m256d x, __m256d& j, __m256d& y)
+    {
+        j = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(TWO_OVER_PI)),
+                            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        const __m256d a = _mm256_fnmadd_pd(j, _mm256_set1_pd(PIO2_1), x);
+        const __m256d b = _mm256_mul_pd(j, _mm256_set1_pd(PIO2_2));
+        // r + e = a - b exactly.
+        __m256d r = _mm256_sub_pd(a, b);
+        const __m256d rb = _mm256_sub_pd(a, r);
+        __m256d e = _mm256_sub_pd(_mm256_sub_pd(a, _mm256_add_pd(r, rb)), _mm256_sub_pd(b, rb));
+        e = _mm256_fnmadd_pd(j, _mm256_set1_pd(PIO2_3), e);
+        e = _mm256_fnmadd_pd(j, _mm256_set1_pd(PIO2_3T), e);
+        const __m256d sum = _mm256_add_pd(r, e);
+        y = _mm256_sub_pd(e, _mm256_sub_pd(sum, r));
+        return sum;
+    }
+
+    // sin and cos of r + y with |r| <= pi / 4 and y a correction of r.
+    GEDO_TARGET_AVX2 static inline __m256d SinKernelAvx2(__m256d r, __m256d y)
+    {
+        const __m256d z = _mm256_mul_pd(r, r);
+        const __m256d v = _mm256_mul_pd(z, r);
+        const __m256d p = HornerAvx2(z, SIN_POLY);
+        // r - ((z * (y / 2 - v * p) - y) - v * S1)
+        const __m256d t = _mm256_fnmadd_pd(v, p, _mm256_mul_pd(_mm256_set1_pd(0.5), y));
+        const __m256d u = _mm256_fmsub_pd(z, t, y);
+        return _mm256_sub_pd(r, _mm256_fnmadd_pd(v, _mm256_set1_pd(SIN_S1), u));
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d CosKernelAvx2(__m256d r, __m256d y)
+    {
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d z = _mm256_mul_pd(r, r);
+        const __m256d hz = _mm256_mul_pd(_mm256_set1_pd(0.5), z);
+        const __m256d w = _mm256_sub_pd(one, hz);
+        const __m256d tail = _mm256_fmsub_pd(_mm256_mul_pd(z, z), HornerAvx2(z, COS_POLY), _mm256_mul_pd(r, y));
+        return _mm256_add_pd(w, _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(one, w), hz), tail));
+    }
+
+    // quadrant j of the reduction as 64 bit integers.
+    GEDO_TARGET_AVX2 static inline __m256i QuadrantAvx2(__m256d j)
+    {
+        return _mm256_and_si256(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(j)), _mm256_set1_epi64x(3));
+    }
+
+    // the lanes of mask are recomputed with libm.
+    GEDO_TARGET_AVX2 static inline __m256d FixLanesAvx2(__m256d x, __m256d result, __m256d mask, double (*f)(double))
+    {
+        const int lanes = _mm256_movemask_pd(mask);
+        if (!lanes)
+        {
+            return result;
+        }
+        alignas(32) double xs[4];
+        alignas(32) double rs[4];
+        _mm256_store_pd(xs, x);
+        _mm256_store_pd(rs, result);
+        for (int i = 0; i < 4; ++i)
+        {
+            if (lanes & (1 << i))
+            {
+                rs[i] = f(xs[i]);
+            }
+        }
+        return _mm256_load_pd(rs);
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d LargeTrigArgumentsAvx2(__m256d x)
+    {
+        const __m256d abs = _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+        return _mm256_cmp_pd(abs, _mm256_set1_pd(TRIG_MAX_ARGUMENT), _CMP_NLT_UQ);
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d SinAvx2(__m256d x)
+    {
+        __m256d j;
+        __m256d y;
+        const __m256d r = ReducePiOver2Avx2(x, j, y);
+        // quadrant 0: sin(r), 1: cos(r), 2: -sin(r), 3: -cos(r).
+        const __m256i q = QuadrantAvx2(j);
+        const __m256d useCos = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)),
+                                                                      _mm256_set1_epi64x(1)));
+        const __m256d sign = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(2)), 62));
+        __m256d result = _mm256_blendv_pd(SinKernelAvx2(r, y), CosKernelAvx2(r, y), useCos);
+        result = _mm256_xor_pd(result, sign);
+        // keeps the sign of -0.
+        result = _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_EQ_OQ));
+        return FixLanesAvx2(x, result, LargeTrigArgumentsAvx2(x), sin);
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d CosAvx2(__m256d x)
+    {
+        __m256d j;
+        __m256d y;
+        const __m256d r = ReducePiOver2Avx2(x, j, y);
+        // quadrant 0: cos(r), 1: -sin(r), 2: -cos(r), 3: sin(r).
+        const __m256i q = QuadrantAvx2(j);
+        const __m256d useSin = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)),
+                                                                      _mm256_set1_epi64x(1)));
+        const __m256i q1 = _mm256_add_epi64(q, _mm256_set1_epi64x(1));
+        const __m256d sign = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(q1, _mm256_set1_epi64x(2)), 62));
+        __m256d result = _mm256_blendv_pd(CosKernelAvx2(r, y), SinKernelAvx2(r, y), useSin);
+        result = _mm256_xor_pd(result, sign);
+        return FixLanesAvx2(x, result, LargeTrigArgumentsAvx2(x), cos);
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d TanAvx2(__m256d x)
+    {
+        __m256d j;
+        __m256d y;
+        const __m256d r = ReducePiOver2Avx2(x, j, y);
+        // even quadrants: sin(r) / cos(r), odd ones: -cos(r) / sin(r).
+        const __m256i q = QuadrantAvx2(j);
+        const __m256d odd = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)),
+                                                                   _mm256_set1_epi64x(1)));
+        const __m256d s = SinKernelAvx2(r, y);
+        const __m256d c = CosKernelAvx2(r, y);
+        const __m256d numerator = _mm256_blendv_pd(s, _mm256_xor_pd(c, _mm256_set1_pd(-0.0)), odd);
+        const __m256d denominator = _mm256_blendv_pd(c, s, odd);
+        __m256d result = _mm256_div_pd(numerator, denominator);
+        result = _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_EQ_OQ));
+        return FixLanesAvx2(x, result, LargeTrigArgumentsAvx2(x), tan);
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d ATanAvx2(__m256d x)
+    {
+        const __m256d signMask = _mm256_set1_pd(-0.0);
+        const __m256d a = _mm256_andnot_pd(signMask, x);
+        // the range of every lane picks its reduction, NaN stays in the first.
+        __m256d c0 = _mm256_set1_pd(ATAN_REDUCE[0][0]);
+        __m256d c1 = _mm256_set1_pd(ATAN_REDUCE[0][1]);
+        __m256d c2 = _mm256_set1_pd(ATAN_REDUCE[0][2]);
+        __m256d c3 = _mm256_set1_pd(ATAN_REDUCE[0][3]);
+        __m256d hi = _mm256_set1_pd(ATAN_HI[0]);
+        __m256d lo = _mm256_set1_pd(ATAN_LO[0]);
+        for (size_t i = 0; i < ArrayCount(ATAN_BOUNDS); ++i)
+        {
+            const __m256d inRange = _mm256_cmp_pd(a, _mm256_set1_pd(ATAN_BOUNDS[i]), _CMP_GE_OQ);
+            c0 = _mm256_blendv_pd(c0, _mm256_set1_pd(ATAN_REDUCE[i + 1][0]), inRange);
+            c1 = _mm256_blendv_pd(c1, _mm256_set1_pd(ATAN_REDUCE[i + 1][1]), inRange);
+            c2 = _mm256_blendv_pd(c2, _mm256_set1_pd(ATAN_REDUCE[i + 1][2]), inRange);
+            c3 = _mm256_blendv_pd(c3, _mm256_set1_pd(ATAN_REDUCE[i + 1][3]), inRange);
+            hi = _mm256_blendv_pd(hi, _mm256_set1_pd(ATAN_HI[i + 1]), inRange);
+            lo = _mm256_blendv_pd(lo, _mm256_set1_pd(ATAN_LO[i + 1]), inRange);
+        }
+        // the numerator of the last range is -1 and not a * 0 - 1 for a = inf.
+        const __m256d finite = _mm256_min_pd(_mm256_set1_pd(1e300), a);
+        const __m256d t = _mm256_div_pd(_mm256_fmsub_pd(finite, c0, c1), _mm256_fmadd_pd(finite, c3, c2));
+        const __m256d z = _mm256_mul_pd(t, t);
+        const __m256d w = _mm256_mul_pd(z, z);
+        const __m256d sum = _mm256_add_pd(_mm256_mul_pd(z, HornerAvx2(w, ATAN_POLY_EVEN)),
+                                          _mm256_mul_pd(w, HornerAvx2(w, ATAN_POLY_ODD)));
+        const __m256d result = _mm256_sub_pd(hi, _mm256_sub_pd(_mm256_fmsub_pd(t, sum, lo), t));
+        return _mm256_or_pd(result, _mm256_and_pd(x, signMask));
+    }
+
+    // asin(x) = atan(x / sqrt(1 - x^2)), 1 - x^2 is rounded once by the fma.
+    GEDO_TARGET_AVX2 static inline __m256d ASinAvx2(__m256d x)
+    {
+        const __m256d d = _mm256_sqrt_pd(_mm256_fnmadd_pd(x, x, _mm256_set1_pd(1.0)));
+        return ATanAvx2(_mm256_div_pd(x, d));
+    }
+
+    // acos(x) = 2 * atan(sqrt((1 - x) / (1 + x))).
+    GEDO_TARGET_AVX2 static inline __m256d ACosAvx2(__m256d x)
+    {
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d q = _mm256_div_pd(_mm256_sub_pd(one, x), _mm256_add_pd(one, x));
+        return _mm256_mul_pd(_mm256_set1_pd(2.0), ATanAvx2(_mm256_sqrt_pd(q)));
+    }
+
+    GEDO_TARGET_AVX2 static inline __m256d SqrtAvx2(__m256d x)
+    {
+        return _mm256_sqrt_pd(x);
+    }
+
+    template <__m256d (*F)(__m256d)>
+    GEDO_TARGET_AVX2 static void VectorMathAvx2(const double* values, double* result, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm256_storeu_pd(result + i, F(_mm256_loadu_pd(values + i)));
+        }
+        if (i < count)
+        {
+            double tail[4] = {};
+            GEDO_MEMCPY(tail, values + i, (count - i) * sizeof(double));
+            _mm256_storeu_pd(tail, F(_mm256_loadu_pd(tail)));
+            GEDO_MEMCPY(result + i, tail, (count - i) * sizeof(double));
+        }
+    }
+#endif
+
+    static VectorMathKernels SelectVectorMathKernels()
+    {
+        VectorMathKernels result;
+        result.sin = VectorMathScalar<sin>;
+        result.cos = VectorMathScalar<cos>;
+        result.tan = VectorMathScalar<tan>;
+        result.asin = VectorMathScalar<asin>;
+        result.acos = VectorMathScalar<acos>;
+        result.atan = VectorMathScalar<atan>;
+        result.exp = VectorMathScalar<exp>;
+        result.log = VectorMathScalar<log>;
+        result.sqrt = VectorMathScalar<sqrt>;
+#if defined GEDO_ARCH_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.avx2 && cpu.fma)
+        {
+            result.sin = VectorMathAvx2<SinAvx2>;
+            result.cos = VectorMathAvx2<CosAvx2>;
+            result.tan = VectorMathAvx2<TanAvx2>;
+            result.asin = VectorMathAvx2<ASinAvx2>;
+            result.acos = VectorMathAvx2<ACosAvx2>;
+            result.atan = VectorMathAvx2<ATanAvx2>;
+            result.exp = VectorMathAvx2<ExpAvx2>;
+            result.log = VectorMathAvx2<LogAvx2>;
+            result.sqrt = VectorMathAvx2<SqrtAvx2>;
+        }
+#endif
+        return result;
+    }
+
+    static const VectorMathKernels& GetVectorMathKernels()
+    {
+        static const VectorMathKernels kernels = SelectVectorMathKernels();
+        return kernels;
+    }
+
+    void Sin(const double* values, double* result, size_t count)  { GetVectorMathKernels().sin(values, result, count); }
+    void Cos(const double* values, double* result, size_t count)  { GetVectorMathKernels().cos(values, result, count); }
+    void Tan(const double* values, double* result, size_t count)  { GetVectorMathKernels().tan(values, result, count); }
+    void ASin(const double* values, double* result, size_t count) { GetVectorMathKernels().asin(values, result, count); }
+    void ACos(const double* values, double* result, size_t count) { GetVectorMathKernels().acos(values, result, count); }
+    void ATan(const double* values, double* result, size_t count) { GetVectorMathKernels().atan(values, result, count); }
+    void Exp(const double* values, double* result, size_t count)  { GetVectorMathKernels().exp(values, result, count); }
+    void Log(const double* values, double* result, size_t count)  { GetVectorMathKernels().log(values, result, count); }
+    void Sqrt(const double* values, double* result, size_t count) { GetVectorMathKernels().sqrt(values, result, count); }
+    //------------------------------------------------------------//
+
+    // cost of a libm call compared to an add, used to lower the batch size.
+    static const size_t TRANSCENDENTAL_COST = 16;
+
+    // result[i] = f(m[i]), split over the thread pool.
+    template <typename F>
+    static Matrix MapElements(const Matrix& m, size_t minBatch, F f, Allocator& allocator = GetDefaultAllocator())
+    {
+        GEDO_ASSERT(m.type == MatrixDataType::FLOAT64);
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const double* src = Contiguous(m, copy).data;
+        Matrix result = CreateMatrix(m.rows, m.cols, allocator);
+        double* dst = result.data;
+        ParallelFor(m.rows * m.cols, minBatch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                dst[i] = f(src[i]);
+            }
+        });
+        return result;
+    }
+
+    // same as MapElements for a function of arrays, each task gets a range.
+    static Matrix MapArray(const Matrix& m, size_t minBatch, VectorMathFunction f)
+    {
+        GEDO_ASSERT(m.type == MatrixDataType::FLOAT64);
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const double* src = Contiguous(m, copy).data;
+        Matrix result = CreateMatrix(m.rows, m.cols);
+        double* dst = result.data;
+        ParallelFor(m.rows * m.cols, minBatch, [&](size_t begin, size_t end) {
+            f(src + begin, dst + begin, end - begin);
+        });
+        return result;
+    }
+
+    // strides that read m broadcast to a bigger matrix, a dimension of 1
+    // doesn't move.
+    static void GetBroadcastStrides(const Matrix& m, size_t& rowStride, size_t& colStride)
+    {
+        rowStride = (m.rows == 1) ? 0 : m.rowStride;
+        colStride = (m.cols == 1) ? 0 : m.colStride;
+    }
+
+    // result(i, j) = f(m0(i, j), m1(i, j)) with m0 and m1 broadcast, the rows
+    // are split over the thread pool.
+    template <typename F>
+    static Matrix MapElements(const Matrix& m0, const Matrix& m1, size_t minBatch, F f)
+    {
+        GEDO_ASSERT(CanBroadcast(m0.rows, m0.cols, m1.rows, m1.cols));
+        GEDO_ASSERT(m0.type == MatrixDataType::FLOAT64 && m1.type == MatrixDataType::FLOAT64);
+        const size_t rows = BroadcastSize(m0.rows, m1.rows);
+        const size_t cols = BroadcastSize(m0.cols, m1.cols);
+        size_t rowStride0 = 0, colStride0 = 0, rowStride1 = 0, colStride1 = 0;
+        GetBroadcastStrides(m0, rowStride0, colStride0);
+        GetBroadcastStrides(m1, rowStride1, colStride1);
+        Matrix result = CreateMatrix(rows, cols);
+        ParallelFor(rows, Max<size_t>(minBatch / Max<size_t>(cols, 1), 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double* a = m0.data + i * rowStride0;
+                const double* b = m1.data + i * rowStride1;
+                double* dst = result.data + i * cols;
+                if (colStride0 == 1 && colStride1 == 1)
+                {
+                    for (size_t j = 0; j < cols; ++j)
+                    {
+                        dst[j] = f(a[j], b[j]);
+                    }
+                }
+                else if (colStride0 == 1 && colStride1 == 0)
+                {
+                    const double bv = *b;
+                    for (size_t j = 0; j < cols; ++j)
+                    {
+                        dst[j] = f(a[j], bv);
+                    }
+                }
+                else if (colStride0 == 0 && colStride1 == 1)
+                {
+                    const double av = *a;
+                    for (size_t j = 0; j < cols; ++j)
+                    {
+                        dst[j] = f(av, b[j]);
+                    }
+                }
+                else
+                {
+                    for (size_t j = 0; j < cols; ++j)
+                    {
+                        dst[j] = f(a[j * colStride0], b[j * colStride1]);
+                    }
+                }
+            }
+        });
+        return result;
+    }
+
+    // the elements are split in fixed chunks so the result doesn't depend on
+    // the number of threads, they are combined as doubles.
+    template <typename T, typename F>
+    static double ReduceElements(const Matrix& view, double initial, F combine)
+    {
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const Matrix& m = Contiguous(view, copy);
+        const size_t count = m.rows * m.cols;
+        const size_t chunkSize = PARALLEL_MIN_BATCH;
+        const size_t chunks = (count + chunkSize - 1) / chunkSize;
+        const T* src = GetData<T>(m);
+        if (chunks <= 1)
+        {
+            double result = initial;
+            for (size_t i = 0; i < count; ++i)
+            {
+                result = combine(result, (double)src[i]);
+            }
+            return result;
+        }
+
+        MemoryBlock partialsBlock = AllocateUninitialized(chunks * sizeof(double));
+        defer(Deallocate(partialsBlock));
+        double* partials = (double*)partialsBlock.data;
+        ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c)
+            {
+                const size_t last = Min(count, (c + 1) * chunkSize);
+                double partial = initial;
+                for (size_t i = c * chunkSize; i < last; ++i)
+                {
+                    partial = combine(partial, (double)src[i]);
+                }
+                partials[c] = partial;
+            }
+        });
+        double result = initial;
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            result = combine(result, partials[c]);
+        }
+        return result;
+    }
+
+    Matrix Multiply(const Matrix& m0, double scalar, Allocator& allocator)
+    {
+        return MapElements(m0, PARALLEL_MIN_BATCH, [scalar](double v) { return v * scalar; }, allocator);
+    }
+
+    Matrix Add(const Matrix& m0, double scalar)
+    {
+        return MapElements(m0, PARALLEL_MIN_BATCH, [scalar](double v) { return v + scalar; });
+    }
+
+    Matrix Subtract(const Matrix& m0, double scalar)
+    {
+        return MapElements(m0, PARALLEL_MIN_BATCH, [scalar](double v) { return v - scalar; });
+    }
+
+    //--------------------Gemm----------------------------------//
+    // The blocked multiplication follows the usual Goto/BLIS layout:
+    // B is packed into (kc X nc) panels that live in L2/L3 and A into (mc X kc)
+    // blocks that live in L2, both stored as slivers of MR rows/NR columns so
+    // the micro kernel reads them linearly, the micro kernel keeps a (MR X NR)
+    // tile of C in registers for the whole kc loop.
+    static const size_t GEMM_KC = 256;
+    static const size_t GEMM_MC = 128;
+    static const size_t GEMM_NC = 4096;
+    // columns of C given to one thread pool task.
+    static const size_t GEMM_NR_CHUNK = 512;
+
+    // computes the (mr X nr) tile ab = packedA * packedB over kc and stores
+    // c = alpha * ab + beta * c, c is only read when beta != 0.
+    template<typename T>
+    struct GemmKernel
+    {
+        typedef void (*MicroKernel)(size_t kc, const T* a, const T* b,
+                                    T* c, size_t ldc, T alpha, T beta);
+        size_t mr = 0;
+        size_t nr = 0;
+        MicroKernel kernel = NULL;
+    };
+
+    template<typename T>
+    static void GemmMicroKernelScalar(size_t kc, const T* a, const T* b,
+                                      T* c, size_t ldc, T alpha, T beta)
+    {
+        const size_t MR = 4;
+        const size_t NR = 4;
+        T ab[MR * NR] = {};
+        for (size_t p = 0; p < kc; ++p)
+        {
+            for (size_t i = 0; i < MR; ++i)
+            {
+                const T ai = a[p * MR + i];
+                for (size_t j = 0; j < NR; ++j)
+                {
+                    ab[i * NR + j] += ai * b[p * NR + j];
+                }
+            }
+        }
+        for (size_t i = 0; i < MR; ++i)
+        {
+            for (size_t j = 0; j < NR; ++j)
+            {
+                T& r = c[i * ldc + j];
+                r = (beta == 0) ? alpha * ab[i * NR + j] : alpha * ab[i * NR + j] + beta * r;
+            }
+        }
+    }
+
+#if defined GEDO_ARCH_X86
+    GEDO_TARGET_AVX2 static void GemmMicroKernelAvx2(size_t kc, const double* a, const double* b,
+                                                     double* c, size_t ldc, double alpha, double beta)
+    {
+        // 6 X 8 tile, 12 accumulators + 2 B registers + 1 broadcast.
+        __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+        __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+        __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+        __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+        __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+        __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+        for (size_t p = 0; p < kc; ++p)
+        {
+            const __m256d b0 = _mm256_loadu_pd(b);
+            const __m256d b1 = _mm256_loadu_pd(b + 4);
+            __m256d ai;
+            ai = _mm256_broadcast_sd(a + 0); c00 = _mm256_fmadd_pd(ai, b0, c00); c01 = _mm256_fmadd_pd(ai, b1, c01);
+            ai = _mm256_broadcast_sd(a + 1); c10 = _mm256_fmadd_pd(ai, b0, c10); c11 = _mm256_fmadd_pd(ai, b1, c11);
+            ai = _mm256_broadcast_sd(a + 2); c20 = _mm256_fmadd_pd(ai, b0, c20); c21 = _mm256_fmadd_pd(ai, b1, c21);
+            ai = _mm256_broadcast_sd(a + 3); c30 = _mm256_fmadd_pd(ai, b0, c30); c31 = _mm256_fmadd_pd(ai, b1, c31);
+            ai = _mm256_broadcast_sd(a + 4); c40 = _mm256_fmadd_pd(ai, b0, c40); c41 = _mm256_fmadd_pd(ai, b1, c41);
+            ai = _mm256_broadcast_sd(a + 5); c50 = _mm256_fmadd_pd(ai, b0, c50); c51 = _mm256_fmadd_pd(ai, b1, c51);
+            a += 6;
+            b += 8;
+        }
+        const __m256d va = _mm256_set1_pd(alpha);
+        __m256d* rows[6][2] = { {&c00, &c01}, {&c10, &c11}, {&c20, &c21},
+                                {&c30, &c31}, {&c40, &c41}, {&c50, &c51} };
+        if (beta == 0.0)
+        {
+            for (size_t i = 0; i < 6; ++i)
+            {
+                _mm256_storeu_pd(c + i * ldc + 0, _mm256_mul_pd(va, *rows[i][0]));
+                _mm256_storeu_pd(c + i * ldc + 4, _mm256_mul_pd(va, *rows[i][1]));
+            }
+        }
+        else
+        {
+            const __m256d vb = _mm256_set1_pd(beta);
+            for (size_t i = 0; i < 6; ++i)
+            {
+                double* r = c + i * ldc;
+                _mm256_storeu_pd(r + 0, _mm256_fmadd_pd(va, *rows[i][0], _mm256_mul_pd(vb, _mm256_loadu_pd(r + 0))));
+                _mm256_storeu_pd(r + 4, _mm256_fmadd_pd(va, *rows[i][1], _mm256_mul_pd(vb, _mm256_loadu_pd(r + 4))));
+            }
+        }
+    }
+
+    GEDO_TARGET_AVX512 static void GemmMicroKernelAvx512(size_t kc, const double* a, const double* b,
+                                                         double* c, size_t ldc, double alpha, double beta)
+    {
+        // 8 X 16 tile, 16 accumulators.
+        __m512d acc[8][2];
+        for (size_t i = 0; i < 8; ++i)
+        {
+            acc[i][0] = _mm512_setzero_pd();
+            acc[i][1] = _mm512_setzero_pd();
+        }
+        for (size_t p = 0; p < kc; ++p)
+        {
+            const __m512d b0 = _mm512_loadu_pd(b);
+            const __m512d b1 = _mm512_loadu_pd(b + 8);
+            for (size_t i = 0; i < 8; ++i)
+            {
+                const __m512d ai = _mm512_set1_pd(a[i]);
+                acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+                acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+            }
+            a += 8;
+            b += 16;
+        }
+        const __m512d va = _mm512_set1_pd(alpha);
+        if (beta == 0.0)
+        {
+            for (size_t i = 0; i < 8; ++i)
+            {
+                _mm512_storeu_pd(c + i * ldc + 0, _mm512_mul_pd(va, acc[i][0]));
+                _mm512_storeu_pd(c + i * ldc + 8, _mm512_mul_pd(va, acc[i][1]));
+            }
+        }
+        else
+        {
+            const __m512d vb = _mm512_set1_pd(beta);
+            for (size_t i = 0; i < 8; ++i)
+            {
+                double* r = c + i * ldc;
+                _mm512_storeu_pd(r + 0, _mm512_fmadd_pd(va, acc[i][0], _mm512_mul_pd(vb, _mm512_loadu_pd(r + 0))));
+                _mm512_storeu_pd(r + 8, _mm512_fmadd_pd(va, acc[i][1], _mm512_mul_pd(vb, _mm512_loadu_pd(r + 8))));
+            }
+        }
+    }
+
+    GEDO_TARGET_AVX2 static void GemmMicroKernelAvx2(size_t kc, const float* a, const float* b,
+                                                     float* c, size_t ldc, float alpha, float beta)
+    {
+        // 6 X 16 tile, same register budget as the double kernel with twice
+        // the lanes per register.
+        __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+        __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+        __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+        __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+        __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+        __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+        for (size_t p = 0; p < kc; ++p)
+        {
+            const __m256 b0 = _mm256_loadu_ps(b);
+            const __m256 b1 = _mm256_loadu_ps(b + 8);
+            __m256 ai;
+            ai = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+            ai = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+            ai = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+            ai = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+            ai = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+            ai = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+            a += 6;
+            b += 16;
+        }
+        const __m256 va = _mm256_set1_ps(alpha);
+        __m256* rows[6][2] = { {&c00, &c01}, {&c10, &c11}, {&c20, &c21},
+                               {&c30, &c31}, {&c40, &c41}, {&c50, &c51} };
+        if (beta == 0.0f)
+        {
+            for (size_t i = 0; i < 6; ++i)
+            {
+                _mm256_storeu_ps(c + i * ldc + 0, _mm256_mul_ps(va, *rows[i][0]));
+                _mm256_storeu_ps(c + i * ldc + 8, _mm256_mul_ps(va, *rows[i][1]));
+            }
+        }
+        else
+        {
+            const __m256 vb = _mm256_set1_ps(beta);
+            for (size_t i = 0; i < 6; ++i)
+            {
+                float* r = c + i * ldc;
+                _mm256_storeu_ps(r + 0, _mm256_fmadd_ps(va, *rows[i][0], _mm256_mul_ps(vb, _mm256_loadu_ps(r + 0))));
+                _mm256_storeu_ps(r + 8, _mm256_fmadd_ps(va, *rows[i][1], _mm256_mul_ps(vb, _mm256_loadu_ps(r + 8))));
+            }
+        }
+    }
+
+    GEDO_TARGET_AVX512 static void GemmMicroKernelAvx512(size_t kc, const float* a, const float* b,
+                                                         float* c, size_t ldc, float alpha, float beta)
+    {
+        // 8 X 32 tile, 16 accumulators.
+        __m512 acc[8][2];
+        for (size_t i = 0; i < 8; ++i)
+        {
+            acc[i][0] = _mm512_setzero_ps();
+            acc[i][1] = _mm512_setzero_ps();
+        }
+        for (size_t p = 0; p < kc; ++p)
+        {
+            const __m512 b0 = _mm512_loadu_ps(b);
+            const __m512 b1 = _mm512_loadu_ps(b + 16);
+            for (size_t i = 0; i < 8; ++i)
+            {
+                const __m512 ai = _mm512_set1_ps(a[i]);
+                acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+                acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+            }
+            a += 8;
+            b += 32;
+        }
+        const __m512 va = _mm512_set1_ps(alpha);
+        if (beta == 0.0f)
+        {
+            for (size_t i = 0; i < 8; ++i)
+            {
+                _mm512_storeu_ps(c + i * ldc + 0, _mm512_mul_ps(va, acc[i][0]));
+                _mm512_storeu_ps(c + i * ldc + 16, _mm512_mul_ps(va, acc[i][1]));
+            }
+        }
+        else
+        {
+            const __m512 vb = _mm512_set1_ps(beta);
+            for (size_t i = 0; i < 8; ++i)
+            {
+                float* r = c + i * ldc;
+                _mm512_storeu_ps(r + 0, _mm512_fmadd_ps(va, acc[i][0], _mm512_mul_ps(vb, _mm512_loadu_ps(r + 0))));
+                _mm512_storeu_ps(r + 16, _mm512_fmadd_ps(va, acc[i][1], _mm512_mul_ps(vb, _mm512_loadu_ps(r + 16))));
+            }
+        }
+    }
+#endif
+
+    // the double and float kernels share the tile shape in registers, the
+    // float ones cover twice the columns.
+    static GemmKernel<double> SelectGemmKernel(double)
+    {
+        GemmKernel<double> result;
+        result.mr = 4;
+        result.nr = 4;
+        result.kernel = GemmMicroKernelScalar<double>;
+#if defined GEDO_ARCH_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.avx512f)
+        {
+            result.mr = 8;
+            result.nr = 16;
+            result.kernel = GemmMicroKernelAvx512;
+        }
+        else if (cpu.avx2 && cpu.fma)
+        {
+            result.mr = 6;
+            result.nr = 8;
+            result.kernel = GemmMicroKernelAvx2;
+        }
+#endif
+        return result;
+    }
+
+    static GemmKernel<float> SelectGemmKernel(float)
+    {
+        GemmKernel<float> result;
+        result.mr = 4;
+        result.nr = 4;
+        result.kernel = GemmMicroKernelScalar<float>;
+#if defined GEDO_ARCH_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.avx512f)
+        {
+            result.mr = 8;
+            result.nr = 32;
+            result.kernel = GemmMicroKernelAvx512;
+        }
+        else if (cpu.avx2 && cpu.fma)
+        {
+            result.mr = 6;
+            result.nr = 16;
+            result.kernel = GemmMicroKernelAvx2;
+        }
+#endif
+        return result;
+    }
+
+    template<typename T>
+    static const GemmKernel<T>& GetGemmKernel()
+    {
+        static const GemmKernel<T> kernel = SelectGemmKernel(T());
+        return kernel;
+    }
+
+    // packs the (mc X kc) block of A into slivers of mr rows, each sliver is
+    // stored column by column, rows past mc are zero padded.
+    template<typename T>
+    static void PackA(size_t mc, size_t kc, const T* a, size_t lda, size_t mr, T* result)
+    {
+        for (size_t i = 0; i < mc; i += mr)
+        {
+            const size_t rows = Min(mr, mc - i);
+            for (size_t p = 0; p < kc; ++p)
+            {
+                size_t r = 0;
+                for (; r < rows; ++r)
+                {
+                    result[r] = a[(i + r) * lda + p];
+                }
+                for (; r < mr; ++r)
+                {
+                    result[r] = 0;
+                }
+                result += mr;
+            }
+        }
+    }
+
+    // packs the (kc X nc) panel of B into slivers of nr columns, each sliver is
+    // stored row by row, columns past nc are zero padded.
+    template<typename T>
+    static void PackB(size_t kc, size_t nc, const T* b, size_t ldb, size_t nr, T* result)
+    {
+        for (size_t j = 0; j < nc; j += nr)
+        {
+            const size_t cols = Min(nr, nc - j);
+            for (size_t p = 0; p < kc; ++p)
+            {
+                const T* row = b + p * ldb + j;
+                size_t c = 0;
+                for (; c < cols; ++c)
+                {
+                    result[c] = row[c];
+                }
+                for (; c < nr; ++c)
+                {
+                    result[c] = 0;
+                }
+                result += nr;
+            }
+        }
+    }
+
+    template<typename T>
+    static void GemmMacroKernel(const GemmKernel<T>& kernel, size_t mc, size_t nc, size_t kc,
+                                T alpha, const T* packedA, const T* packedB,
+                                T beta, T* c, size_t ldc)
+    {
+        const size_t mr = kernel.mr;
+        const size_t nr = kernel.nr;
+        // edge tiles are computed into tile and then merged into c.
+        T tile[16 * 16];
+        GEDO_ASSERT(mr * nr <= ArrayCount(tile));
+        for (size_t j = 0; j < nc; j += nr)
+        {
+            const size_t cols = Min(nr, nc - j);
+            const T* b = packedB + j * kc;
+            for (size_t i = 0; i < mc; i += mr)
+            {
+                const size_t rows = Min(mr, mc - i);
+                const T* a = packedA + i * kc;
+                T* cij = c + i * ldc + j;
+                if (rows == mr && cols == nr)
+                {
+                    kernel.kernel(kc, a, b, cij, ldc, alpha, beta);
+                }
+                else
+                {
+                    kernel.kernel(kc, a, b, tile, nr, alpha, T(0));
+                    for (size_t r = 0; r < rows; ++r)
+                    {
+                        for (size_t q = 0; q < cols; ++q)
+                        {
+                            T& v = cij[r * ldc + q];
+                            v = (beta == 0) ? tile[r * nr + q] : tile[r * nr + q] + beta * v;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    template<typename T>
+    static void GemmBlocked(size_t m, size_t n, size_t k,
+                            T alpha, const T* a, size_t lda,
+                            const T* b, size_t ldb,
+                            T beta, T* c, size_t ldc)
+    {
+        if (!m || !n)
+        {
+            return;
+        }
+        if (!k || alpha == 0)
+        {
+            for (size_t i = 0; i < m; ++i)
+            {
+                for (size_t j = 0; j < n; ++j)
+                {
+                    T& v = c[i * ldc + j];
+                    v = (beta == 0) ? T(0) : beta * v;
+                }
+            }
+            return;
+        }
+
+        const GemmKernel<T>& kernel = GetGemmKernel<T>();
+        const size_t mr = kernel.mr;
+        const size_t nr = kernel.nr;
+        const size_t mcMax = Max<size_t>(GEMM_MC / mr, 1) * mr;
+        const size_t ncMax = ((Min(n, GEMM_NC) + nr - 1) / nr) * nr;
+        const size_t kcMax = Min(k, GEMM_KC);
+
+        MemoryBlock packedBBlock = AllocateUninitialized(ncMax * kcMax * sizeof(T));
+        defer(Deallocate(packedBBlock));
+        T* packedB = (T*)packedBBlock.data;
+
+        // the C block of every (jc, pc) iteration is split into a grid of
+        // (mc X GEMM_NR_CHUNK) tiles that run on the thread pool, all the
+        // tiles share the packed B panel and pack their own A block.
+        const size_t ncChunkMax = Max<size_t>(GEMM_NR_CHUNK / nr, 1) * nr;
+        for (size_t jc = 0; jc < n; jc += GEMM_NC)
+        {
+            const size_t nc = Min(GEMM_NC, n - jc);
+            for (size_t pc = 0; pc < k; pc += GEMM_KC)
+            {
+                const size_t kc = Min(GEMM_KC, k - pc);
+                // the first kc block applies beta, the rest accumulate.
+                const T blockBeta = (pc == 0) ? beta : T(1);
+                PackB(kc, nc, b + pc * ldb + jc, ldb, nr, packedB);
+
+                const size_t icBlocks = (m + mcMax - 1) / mcMax;
+                const size_t jrBlocks = (nc + ncChunkMax - 1) / ncChunkMax;
+                ParallelFor(icBlocks * jrBlocks, 1, [&](size_t begin, size_t end) {
+                    T* packedA = (T*)GEDO_MALLOC(mcMax * kcMax * sizeof(T));
+                    GEDO_ASSERT(packedA);
+                    size_t packedIc = (size_t)-1;
+                    for (size_t t = begin; t < end; ++t)
+                    {
+                        const size_t ic = (t / jrBlocks) * mcMax;
+                        const size_t jr = (t % jrBlocks) * ncChunkMax;
+                        const size_t mc = Min(mcMax, m - ic);
+                        const size_t ncChunk = Min(ncChunkMax, nc - jr);
+                        if (ic != packedIc)
+                        {
+                            PackA(mc, kc, a + ic * lda + pc, lda, mr, packedA);
+                            packedIc = ic;
+                        }
+                        GemmMacroKernel(kernel, mc, ncChunk, kc, alpha, packedA, packedB + jr * kc,
+                                        blockBeta, c + ic * ldc + jc + jr, ldc);
+                    }
+                    GEDO_FREE(packedA);
+                });
+            }
+        }
+    }
+
+    void Gemm(size_t m, size_t n, size_t k,
+              double alpha, const double* a, size_t lda,
+              const double* b, size_t ldb,
+              double beta, double* c, size_t ldc)
+    {
+        GEDO_PROFILE_ZONE("Gemm");
+        GemmBlocked(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    }
+
+    void Gemm(size_t m, size_t n, size_t k,
+              float alpha, const float* a, size_t lda,
+              const float* b, size_t ldb,
+              float beta, float* c, size_t ldc)
+    {
+        GEDO_PROFILE_ZONE("Gemm");
+        GemmBlocked(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    }
+    //------------------------------------------------------------//
+
+    Matrix MultiplyReference(const Matrix& m0, const Matrix& m1)
+    {
+        GEDO_ASSERT(m0.cols == m1.rows);
+        Matrix result = CreateMatrix(m0.rows, m1.cols);
+        MemoryBlock rowBlock = Allocate(m0.cols * sizeof(double));
+        MemoryBlock colBlock = Allocate(m0.cols * sizeof(double));
+        defer(Deallocate(colBlock));
+        defer(Deallocate(rowBlock));
+
+        double* col = (double*)colBlock.data;
+        double* row = (double*)rowBlock.data;
+        for (size_t i = 0; i < result.rows; ++i)
+        {
+            for (size_t j = 0; j < result.cols; ++j)
+            {
+                GetRow(m0, i, row);
+                GetCol(m1, j, col);
+                At(result, i, j) = DotProduct(row, col, m0.cols);
+            }
+        }
+        return result;
+    }
+
+    static Matrix MultiplySingle(const Matrix& m0, const Matrix& m1, Allocator& allocator)
+    {
+        Matrix copy0;
+        Matrix copy1;
+        defer(FreeMatrix(copy0));
+        defer(FreeMatrix(copy1));
+        const Matrix& a = (m0.type == MatrixDataType::FLOAT32 && m0.colStride == 1)
+            ? m0 : (copy0 = ConvertMatrix(m0, MatrixDataType::FLOAT32));
+        const Matrix& b = (m1.type == MatrixDataType::FLOAT32 && m1.colStride == 1)
+            ? m1 : (copy1 = ConvertMatrix(m1, MatrixDataType::FLOAT32));
+        const float* aData = GetData<float>(a);
+        const float* bData = GetData<float>(b);
+        if (IsScalar(a) || IsScalar(b))
+        {
+            const Matrix& m = IsScalar(a) ? b : a;
+            const float scalar = IsScalar(a) ? aData[0] : bData[0];
+            Matrix result = ConvertMatrix(m, MatrixDataType::FLOAT32, allocator);
+            float* data = GetData<float>(result);
+            for (size_t i = 0; i < result.rows * result.cols; ++i)
+            {
+                data[i] *= scalar;
+            }
+            return result;
+        }
+        Matrix result = CreateMatrix(a.rows, b.cols, MatrixDataType::FLOAT32, allocator);
+        Gemm(a.rows, b.cols, a.cols,
+             1.0f, aData, a.rowStride,
+             bData, b.rowStride,
+             0.0f, GetData<float>(result), result.cols);
+        return result;
+    }
+
+    Matrix Multiply(const Matrix& m0, const Matrix& m1, Allocator& allocator)
+    {
+        assert(CanMultiply(m0, m1));
+        const MatrixDataType type = PromoteTypes(m0.type, m1.type);
+        if (type == MatrixDataType::FLOAT32)
+        {
+            return MultiplySingle(m0, m1, allocator);
+        }
+        if (type != MatrixDataType::FLOAT64)
+        {
+            // integers are multiplied as doubles.
+            Matrix a = ConvertMatrix(m0, MatrixDataType::FLOAT64);
+            Matrix b = ConvertMatrix(m1, MatrixDataType::FLOAT64);
+            Matrix product = Multiply(a, b);
+            Matrix result = ConvertMatrix(product, type, allocator);
+            FreeMatrix(a);
+            FreeMatrix(b);
+            FreeMatrix(product);
+            return result;
+        }
+        if (IsScalar(m0))
+        {
+            return Multiply(m1, m0.data[0], allocator);
+        }
+        else if (IsScalar(m1))
+        {
+            return Multiply(m0, m1.data[0], allocator);
+        }
+        else
+        {
+            // Gemm takes any row stride but the elements of a row must be
+            // next to each other.
+            Matrix copy0;
+            Matrix copy1;
+            defer(FreeMatrix(copy0));
+            defer(FreeMatrix(copy1));
+            const Matrix& a = (m0.colStride == 1) ? m0 : (copy0 = CopyMatrix(m0));
+            const Matrix& b = (m1.colStride == 1) ? m1 : (copy1 = CopyMatrix(m1));
+            Matrix result = CreateMatrix(m0.rows, m1.cols, allocator);
+            Gemm(a.rows, b.cols, a.cols,
+                 1.0, a.data, a.rowStride,
+                 b.data, b.rowStride,
+                 0.0, result.data, result.cols);
+            return result;
+        }
+    }
+
+    Matrix Add(const Matrix& m0, const Matrix& m1)
+    {
+        assert(CanAdd(m0, m1));
+        return MapElements(m0, m1, PARALLEL_MIN_BATCH, [](double a, double b) { return a + b; });
+    }
+
+    Matrix Subtract(const Matrix& m0, const Matrix& m1)
+    {
+        assert(CanSubtract(m0, m1));
+        return MapElements(m0, m1, PARALLEL_MIN_BATCH, [](double a, double b) { return a - b; });
+    }
+
+    Matrix Abs(const Matrix& m)
+    {
+        return MapElements(m, PARALLEL_MIN_BATCH, [](double v) { return fabs(v); });
+    }
+
+    Matrix Sin(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().sin);
+    }
+
+    Matrix Cos(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().cos);
+    }
+
+    Matrix Tan(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().tan);
+    }
+
+    Matrix ASin(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().asin);
+    }
+
+    Matrix ACos(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().acos);
+    }
+
+    Matrix ATan(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().atan);
+    }
+
+    Matrix Exp(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().exp);
+    }
+
+    Matrix Log(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().log);
+    }
+
+    Matrix Sqrt(const Matrix& m)
+    {
+        return MapArray(m, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, GetVectorMathKernels().sqrt);
+    }
+
+    Matrix Pow(const Matrix& m0, const Matrix& m1)
+    {
+        GEDO_ASSERT(CanBroadcast(m0.rows, m0.cols, m1.rows, m1.cols));
+        return MapElements(m0, m1, PARALLEL_MIN_BATCH / TRANSCENDENTAL_COST, [](double a, double b) { return pow(a, b); });
+    }
+
+    static double AddElements(double a, double b)
+    {
+        return a + b;
+    }
+
+    static double MinOfElements(double a, double b)
+    {
+        return Min(a, b);
+    }
+
+    static double MaxOfElements(double a, double b)
+    {
+        return Max(a, b);
+    }
+
+    double Sum(const Matrix& m)
+    {
+        DISPATCH_MATRIX_TYPE(m.type, return ReduceElements, m, 0.0, AddElements);
+        return 0;
+    }
+
+    double MinElement(const Matrix& m)
+    {
+        DISPATCH_MATRIX_TYPE(m.type, return ReduceElements, m, HUGE_VAL, MinOfElements);
+        return HUGE_VAL;
+    }
+
+    double MaxElement(const Matrix& m)
+    {
+        DISPATCH_MATRIX_TYPE(m.type, return ReduceElements, m, -HUGE_VAL, MaxOfElements);
+        return -HUGE_VAL;
+    }
+
+    //--------------------Sorting-------------------------------//
+    // the radix sort works on unsigned keys that order like the numbers: the
+    // sign bit of positive floats is set and negative ones are inverted. every
+    // NaN maps to the largest key so they go after +inf (and come back as the
+    // default quiet NaN).
+    template <typename T>
+    struct RadixKey;
+
+    template <>
+    struct RadixKey<double>
+    {
+        typedef uint64_t Type;
+        static Type From(double v)
+        {
+            uint64_t u = 0;
+            GEDO_MEMCPY(&u, &v, sizeof(u));
+            return v != v ? UINT64_MAX : (u >> 63) ? ~u : u | (uint64_t(1) << 63);
+        }
+        static double To(Type u)
+        {
+            u = (u >> 63) ? u & ~(uint64_t(1) << 63) : ~u;
+            double v = 0;
+            GEDO_MEMCPY(&v, &u, sizeof(v));
+            return v;
+        }
+    };
+
+    template <>
+    struct RadixKey<float>
+    {
+        typedef uint32_t Type;
+        static Type From(float v)
+        {
+            uint32_t u = 0;
+            GEDO_MEMCPY(&u, &v, sizeof(u));
+            return v != v ? UINT32_MAX : (u >> 31) ? ~u : u | (uint32_t(1) << 31);
+        }
+        static float To(Type u)
+        {
+            u = (u >> 31) ? u & ~(uint32_t(1) << 31) : ~u;
+            float v = 0;
+            GEDO_MEMCPY(&v, &u, sizeof(v));
+            return v;
+        }
+    };
+
+    template <>
+    struct RadixKey<int32_t>
+    {
+        typedef uint32_t Type;
+        static Type From(int32_t v) { return uint32_t(v) ^ (uint32_t(1) << 31); }
+        static int32_t To(Type u) { return int32_t(u ^ (uint32_t(1) << 31)); }
+    };
+
+    template <>
+    struct RadixKey<uint8_t>
+    {
+        typedef uint8_t Type;
+        static Type From(uint8_t v) { return v; }
+        static uint8_t To(Type u) { return u; }
+    };
+
+    // same order as the radix keys for the small sorts (except -0 == 0).
+    template <typename T>
+    static bool SortLess(T a, T b)
+    {
+        return a < b || (a == a && b != b);
+    }
+
+    // elements below which the sorts use QuickSort.
+    static const size_t RADIX_SORT_MIN_SIZE = 256;
+
+    // LSD radix sort of the keys one byte at a time, temp holds count keys and
+    // the sorted keys end in one of the two. every chunk of PARALLEL_MIN_BATCH
+    // keys counts its bytes and scatters them in parallel, the offsets are
+    // byte major then chunk so it is stable. a byte that is the same in all
+    // the keys (e.g. the high bytes of small integers) skips its pass.
+    template <typename K>
+    static K* RadixSortKeys(K* keys, K* temp, size_t count, bool parallel)
+    {
+        const size_t chunks = parallel ? Max<size_t>((count + PARALLEL_MIN_BATCH - 1) / PARALLEL_MIN_BATCH, 1) : 1;
+        const size_t chunkSize = (count + chunks - 1) / chunks;
+        MemoryBlock countsBlock = AllocateUninitialized(chunks * 256 * sizeof(size_t));
+        defer(Deallocate(countsBlock));
+        size_t* counts = (size_t*)countsBlock.data;
+        K* src = keys;
+        K* dest = temp;
+        for (size_t shift = 0; shift < sizeof(K) * 8; shift += 8)
+        {
+            ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+                for (size_t c = begin; c < end; ++c)
+                {
+                    size_t* histogram = counts + c * 256;
+                    memset(histogram, 0, 256 * sizeof(size_t));
+                    const size_t last = Min(count, (c + 1) * chunkSize);
+                    for (size_t i = c * chunkSize; i < last; ++i)
+                    {
+                        histogram[(src[i] >> shift) & 255]++;
+                    }
+                }
+            });
+            bool skip = false;
+            for (size_t d = 0; d < 256 && !skip; ++d)
+            {
+                size_t total = 0;
+                for (size_t c = 0; c < chunks; ++c)
+                {
+                    total += counts[c * 256 + d];
+                }
+                skip = total == count;
+            }
+            if (skip)
+            {
+                continue;
+            }
+            size_t offset = 0;
+            for (size_t d = 0; d < 256; ++d)
+            {
+                for (size_t c = 0; c < chunks; ++c)
+                {
+                    const size_t n = counts[c * 256 + d];
+                    counts[c * 256 + d] = offset;
+                    offset += n;
+                }
+            }
+            ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+                for (size_t c = begin; c < end; ++c)
+                {
+                    size_t* offsets = counts + c * 256;
+                    const size_t last = Min(count, (c + 1) * chunkSize);
+                    for (size_t i = c * chunkSize; i < last; ++i)
+                    {
+                        const K key = src[i];
+                        dest[offsets[(key >> shift) & 255]++] = key;
+                    }
+                }
+            });
+            Swap(src, dest);
+        }
+        return src;
+    }
+
+    // parallel is false when the caller already runs on the thread pool for
+    // many small arrays.
+    template <typename T>
+    static void SortElements(T* values, size_t count, bool parallel)
+    {
+        typedef typename RadixKey<T>::Type K;
+        if (count < RADIX_SORT_MIN_SIZE)
+        {
+            QuickSort(values, count, [](T a, T b) { return SortLess(a, b); });
+            return;
+        }
+        MemoryBlock block = AllocateUninitialized(2 * count * sizeof(K));
+        defer(Deallocate(block));
+        K* keys = (K*)block.data;
+        const size_t minBatch = parallel ? PARALLEL_MIN_BATCH : count;
+        ParallelFor(count, minBatch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                keys[i] = RadixKey<T>::From(values[i]);
+            }
+        });
+        const K* sorted = RadixSortKeys(keys, keys + count, count, parallel);
+        ParallelFor(count, minBatch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                values[i] = RadixKey<T>::To(sorted[i]);
+            }
+        });
+    }
+
+    void SortValues(double* values, size_t count)
+    {
+        SortElements(values, count, true);
+    }
+
+    void SortValues(float* values, size_t count)
+    {
+        SortElements(values, count, true);
+    }
+
+    void SortValues(int32_t* values, size_t count)
+    {
+        SortElements(values, count, true);
+    }
+
+    void SortValues(uint8_t* values, size_t count)
+    {
+        SortElements(values, count, true);
+    }
+
+    // m is a contiguous copy sorted in place, vectors as a whole and matrices
+    // column by column with one column per task.
+    template <typename T>
+    static void SortColumns(Matrix& m)
+    {
+        T* data = GetData<T>(m);
+        if (m.rows == 1 || m.cols == 1)
+        {
+            SortElements(data, m.rows * m.cols, true);
+            return;
+        }
+        ParallelFor(m.cols, 1, [&](size_t begin, size_t end) {
+            MemoryBlock block = AllocateUninitialized(m.rows * sizeof(T));
+            defer(Deallocate(block));
+            T* column = (T*)block.data;
+            for (size_t j = begin; j < end; ++j)
+            {
+                for (size_t i = 0; i < m.rows; ++i)
+                {
+                    column[i] = data[i * m.cols + j];
+                }
+                SortElements(column, m.rows, false);
+                for (size_t i = 0; i < m.rows; ++i)
+                {
+                    data[i * m.cols + j] = column[i];
+                }
+            }
+        });
+    }
+
+    Matrix Sort(const Matrix& m, Allocator& allocator)
+    {
+        Matrix result = CopyMatrix(m, allocator);
+        DISPATCH_MATRIX_TYPE(m.type, SortColumns, result);
+        return result;
+    }
+
+    // sorts the row indices and gathers the rows, ties are broken by the index
+    // so equal rows keep their order.
+    template <typename T>
+    static void SortRowsOf(const Matrix& m, Matrix& result)
+    {
+        const size_t cols = m.cols;
+        const T* src = GetData<T>(m);
+        Array<size_t> order;
+        order.resize(m.rows);
+        for (size_t i = 0; i < m.rows; ++i)
+        {
+            order[i] = i;
+        }
+        ParallelSort(order.data(), m.rows, [src, cols](size_t a, size_t b) {
+            const T* rowA = src + a * cols;
+            const T* rowB = src + b * cols;
+            for (size_t j = 0; j < cols; ++j)
+            {
+                if (SortLess(rowA[j], rowB[j]))
+                {
+                    return true;
+                }
+                if (SortLess(rowB[j], rowA[j]))
+                {
+                    return false;
+                }
+            }
+            return a < b;
+        });
+        T* dest = GetData<T>(result);
+        ParallelFor(m.rows, Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(cols, 1), 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                GEDO_MEMCPY(dest + i * cols, src + order[i] * cols, cols * sizeof(T));
+            }
+        });
+    }
+
+    Matrix SortRows(const Matrix& m, Allocator& allocator)
+    {
+        // equal rows of one element can't be told apart.
+        if (m.cols == 1)
+        {
+            return Sort(m, allocator);
+        }
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const Matrix& src = Contiguous(m, copy);
+        Matrix result = CreateMatrix(m.rows, m.cols, m.type, allocator);
+        DISPATCH_MATRIX_TYPE(m.type, SortRowsOf, src, result);
+        return result;
+    }
+
+    // sorts m (contiguous) and moves the distinct values to its start, NaNs
+    // are never equal so each one is kept.
+    template <typename T>
+    static size_t UniqueElements(Matrix& m)
+    {
+        T* data = GetData<T>(m);
+        const size_t count = m.rows * m.cols;
+        SortElements(data, count, true);
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!n || data[i] != data[n - 1])
+            {
+                data[n++] = data[i];
+            }
+        }
+        return n;
+    }
+
+    Matrix Unique(const Matrix& m, Allocator& allocator)
+    {
+        Matrix sorted = CopyMatrix(m);
+        defer(FreeMatrix(sorted));
+        size_t n = 0;
+        DISPATCH_MATRIX_TYPE(m.type, n = UniqueElements, sorted);
+        const bool row = m.rows == 1;
+        Matrix result = CreateMatrix(row ? 1 : n, row ? n : 1, m.type, allocator);
+        GEDO_MEMCPY(result.data, sorted.data, n * GetElementSize(m.type));
+        return result;
+    }
+
+    // linear index k is element (k % rows, k / rows).
+    template <typename T>
+    static size_t CountNonZeros(const Matrix& m, size_t first, size_t last)
+    {
+        const T* data = GetData<T>(m);
+        size_t i = first % m.rows;
+        size_t j = first / m.rows;
+        size_t n = 0;
+        for (size_t k = first; k < last; ++k)
+        {
+            n += data[i * m.rowStride + j * m.colStride] != 0;
+            if (++i == m.rows)
+            {
+                i = 0;
+                ++j;
+            }
+        }
+        return n;
+    }
+
+    template <typename T>
+    static void FindNonZeros(const Matrix& m, size_t first, size_t last, double* out)
+    {
+        const T* data = GetData<T>(m);
+        size_t i = first % m.rows;
+        size_t j = first / m.rows;
+        for (size_t k = first; k < last; ++k)
+        {
+            if (data[i * m.rowStride + j * m.colStride] != 0)
+            {
+                *out++ = double(k + 1);
+            }
+            if (++i == m.rows)
+            {
+                i = 0;
+                ++j;
+            }
+        }
+    }
+
+    // every chunk of the linear indices counts its elements, then writes them
+    // after the ones of the chunks before it.
+    Matrix Find(const Matrix& m, Allocator& allocator)
+    {
+        const size_t count = m.rows * m.cols;
+        const bool row = m.rows == 1;
+        if (!count)
+        {
+            return CreateMatrix(row ? 1 : 0, row ? 0 : 1, allocator);
+        }
+        const size_t chunkSize = PARALLEL_MIN_BATCH;
+        const size_t chunks = (count + chunkSize - 1) / chunkSize;
+        Array<size_t> offsets;
+        offsets.resize(chunks + 1);
+        ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c)
+            {
+                const size_t last = Min(count, (c + 1) * chunkSize);
+                DISPATCH_MATRIX_TYPE(m.type, offsets[c + 1] = CountNonZeros, m, c * chunkSize, last);
+            }
+        });
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            offsets[c + 1] += offsets[c];
+        }
+        const size_t total = offsets[chunks];
+        Matrix result = CreateMatrix(row ? 1 : total, row ? total : 1, allocator);
+        ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c)
+            {
+                const size_t last = Min(count, (c + 1) * chunkSize);
+                DISPATCH_MATRIX_TYPE(m.type, FindNonZeros, m, c * chunkSize, last, result.data + offsets[c]);
+            }
+        });
+        return result;
+    }
+
+    // the distinct values of set in Eytzinger order, each element of values is
+    // looked up in parallel.
+    Matrix IsMember(const Matrix& values, const Matrix& set, Allocator& allocator)
+    {
+        Matrix sorted = ConvertMatrix(set, MatrixDataType::FLOAT64);
+        defer(FreeMatrix(sorted));
+        size_t n = UniqueElements<double>(sorted);
+        // NaNs are sorted last and never members, without them the search
+        // can use a plain comparison.
+        while (n && sorted.data[n - 1] != sorted.data[n - 1])
+        {
+            n--;
+        }
+        Array<double> tree;
+        tree.resize(n + 1);
+        BuildEytzinger(sorted.data, n, tree.data());
+
+        Matrix v = ConvertMatrix(values, MatrixDataType::FLOAT64);
+        defer(FreeMatrix(v));
+        Matrix result = CreateMatrix(values.rows, values.cols, allocator);
+        const double* keys = tree.data();
+        ParallelFor(values.rows * values.cols, PARALLEL_MIN_BATCH, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double x = v.data[i];
+                const size_t k = EytzingerLowerBound(keys, n, x, [](double a, double b) { return a < b; });
+                result.data[i] = k && keys[k] == x;
+            }
+        });
+        return result;
+    }
+    //----------------------------------------------------------//
+
+    //--------------------Linear algebra------------------------//
+    // The factorizations are blocked like LAPACK: a panel of LINALG_BLOCK
+    // columns is factored by the unblocked algorithm, then the rest of the
+    // matrix is updated by one Gemm call so most of the flops run in the
+    // packed micro kernel on the thread pool.
+    static const size_t LINALG_BLOCK = 64;
+    // columns of the lower triangle updated by one Gemm call in Cholesky, the
+    // part of the band above the diagonal is computed for nothing.
+    static const size_t CHOLESKY_BAND = 256;
+
+    // b = inverse(a) * b for the (n X n) triangle of a and its (n X nrhs) b,
+    // unit means the diagonal is 1 and is not read. n <= LINALG_BLOCK, the
+    // columns of b are split between the threads.
+    static void TriangularSolveBlock(bool lower, bool unit, size_t n, size_t nrhs,
+                                     const double* a, size_t lda, double* b, size_t ldb)
+    {
+        ParallelFor(nrhs, Max<size_t>(PARALLEL_MIN_BATCH / (n * n), 1), [&](size_t begin, size_t end) {
+            for (size_t ii = 0; ii < n; ++ii)
+            {
+                const size_t i = lower ? ii : n - 1 - ii;
+                const double* ai = a + i * lda;
+                double* bi = b + i * ldb;
+                const size_t first = lower ? 0 : i + 1;
+                const size_t last = lower ? i : n;
+                for (size_t p = first; p < last; ++p)
+                {
+                    const double f = ai[p];
+                    const double* bp = b + p * ldb;
+                    for (size_t j = begin; j < end; ++j)
+                    {
+                        bi[j] -= f * bp[j];
+                    }
+                }
+                if (!unit)
+                {
+                    const double d = ai[i];
+                    for (size_t j = begin; j < end; ++j)
+                    {
+                        bi[j] /= d;
+                    }
+                }
+            }
+        });
+    }
+
+    // the blocks of rows are solved in order, down for lower and up for
+    // upper, and the remaining rows of b are updated by Gemm after each one.
+    static void TriangularSolve(bool lower, bool unit, size_t n, size_t nrhs,
+                                const double* a, size_t lda, double* b, size_t ldb)
+    {
+        for (size_t done = 0; done < n; done += LINALG_BLOCK)
+        {
+            const size_t kb = Min(LINALG_BLOCK, n - done);
+            const size_t k = lower ? done : n - done - kb;
+            TriangularSolveBlock(lower, unit, kb, nrhs, a + k * lda + k, lda, b + k * ldb, ldb);
+            if (lower)
+            {
+                Gemm(n - k - kb, nrhs, kb, -1.0, a + (k + kb) * lda + k, lda, b + k * ldb, ldb,
+                     1.0, b + (k + kb) * ldb, ldb);
+            }
+            else
+            {
+                Gemm(k, nrhs, kb, -1.0, a + k, lda, b + k * ldb, ldb, 1.0, b, ldb);
+            }
+        }
+    }
+
+    bool FactorLU(double* a, size_t n, size_t lda, size_t* pivots)
+    {
+        GEDO_PROFILE_ZONE("FactorLU");
+        bool nonsingular = true;
+        for (size_t k = 0; k < n; k += LINALG_BLOCK)
+        {
+            const size_t kb = Min(LINALG_BLOCK, n - k);
+            // the panel is the columns [k, k + kb) of the rows [k, n), the
+            // rows are swapped over the whole width since they are contiguous.
+            for (size_t j = k; j < k + kb; ++j)
+            {
+                size_t pivot = j;
+                double largest = fabs(a[j * lda + j]);
+                for (size_t i = j + 1; i < n; ++i)
+                {
+                    const double v = fabs(a[i * lda + j]);
+                    if (v > largest)
+                    {
+                        largest = v;
+                        pivot = i;
+                    }
+                }
+                pivots[j] = pivot;
+                if (pivot != j)
+                {
+                    for (size_t q = 0; q < n; ++q)
+                    {
+                        Swap(a[j * lda + q], a[pivot * lda + q]);
+                    }
+                }
+                const double d = a[j * lda + j];
+                if (d == 0)
+                {
+                    nonsingular = false;
+                    continue;
+                }
+                const double* rowJ = a + j * lda;
+                ParallelFor(n - j - 1, Max<size_t>(PARALLEL_MIN_BATCH / kb, 1), [&](size_t begin, size_t end) {
+                    for (size_t i = j + 1 + begin; i < j + 1 + end; ++i)
+                    {
+                        double* row = a + i * lda;
+                        const double l = row[j] / d;
+                        row[j] = l;
+                        for (size_t q = j + 1; q < k + kb; ++q)
+                        {
+                            row[q] -= l * rowJ[q];
+                        }
+                    }
+                });
+            }
+            // U12 = inverse(L11) * A12 and A22 -= L21 * U12.
+            const size_t rest = n - k - kb;
+            TriangularSolveBlock(true, true, kb, rest, a + k * lda + k, lda, a + k * lda + k + kb, lda);
+            Gemm(rest, rest, kb, -1.0, a + (k + kb) * lda + k, lda, a + k * lda + k + kb, lda,
+                 1.0, a + (k + kb) * lda + k + kb, lda);
+        }
+        return nonsingular;
+    }
+
+    bool FactorCholesky(double* a, size_t n, size_t lda)
+    {
+        GEDO_PROFILE_ZONE("FactorCholesky");
+        MemoryBlock transposedBlock = AllocateUninitialized(LINALG_BLOCK * n * sizeof(double));
+        defer(Deallocate(transposedBlock));
+        double* transposed = (double*)transposedBlock.data;
+        for (size_t k = 0; k < n; k += LINALG_BLOCK)
+        {
+            const size_t kb = Min(LINALG_BLOCK, n - k);
+            // L11 row by row, the previous panels were already subtracted.
+            for (size_t i = k; i < k + kb; ++i)
+            {
+                double* rowI = a + i * lda;
+                for (size_t j = k; j <= i; ++j)
+                {
+                    const double* rowJ = a + j * lda;
+                    double s = rowI[j];
+                    for (size_t p = k; p < j; ++p)
+                    {
+                        s -= rowI[p] * rowJ[p];
+                    }
+                    if (i == j)
+                    {
+                        if (!(s > 0))
+                        {
+                            return false;
+                        }
+                        rowI[i] = sqrt(s);
+                    }
+                    else
+                    {
+                        rowI[j] = s / rowJ[j];
+                    }
+                }
+            }
+            // L21 = A21 * inverse(L11'), the rows are independent.
+            const size_t rest = n - k - kb;
+            ParallelFor(rest, Max<size_t>(PARALLEL_MIN_BATCH / (kb * kb), 1), [&](size_t begin, size_t end) {
+                for (size_t r = k + kb + begin; r < k + kb + end; ++r)
+                {
+                    double* row = a + r * lda;
+                    for (size_t j = k; j < k + kb; ++j)
+                    {
+                        const double* rowJ = a + j * lda;
+                        double s = row[j];
+                        for (size_t p = k; p < j; ++p)
+                        {
+                            s -= row[p] * rowJ[p];
+                        }
+                        row[j] = s / rowJ[j];
+                    }
+                }
+            });
+            // A22 -= L21 * L21' on the lower triangle, one band of columns at
+            // a time with a transposed copy of L21 as the right operand.
+            const double* l21 = a + (k + kb) * lda + k;
+            for (size_t r = 0; r < rest; ++r)
+            {
+                for (size_t p = 0; p < kb; ++p)
+                {
+                    transposed[p * rest + r] = l21[r * lda + p];
+                }
+            }
+            for (size_t jb = 0; jb < rest; jb += CHOLESKY_BAND)
+            {
+                const size_t band = Min(CHOLESKY_BAND, rest - jb);
+                Gemm(rest - jb, band, kb, -1.0, l21 + jb * lda, lda, transposed + jb, rest,
+                     1.0, a + (k + kb + jb) * lda + k + kb + jb, lda);
+            }
+        }
+        return true;
+    }
+
+    // the reflection H = I - tau * v * v' with v[0] = 1 that maps the count
+    // elements of x (at stride) to (beta, 0, ... 0), x[0] becomes beta and
+    // v[1...] replaces the rest. returns tau, 0 when x is already reduced.
+    static double MakeReflector(double* x, size_t count, size_t stride)
+    {
+        double norm = 0;
+        for (size_t i = 1; i < count; ++i)
+        {
+            norm += x[i * stride] * x[i * stride];
+        }
+        if (norm == 0)
+        {
+            return 0;
+        }
+        const double alpha = x[0];
+        const double beta = -copysign(sqrt(alpha * alpha + norm), alpha);
+        const double scale = 1.0 / (alpha - beta);
+        for (size_t i = 1; i < count; ++i)
+        {
+            x[i * stride] *= scale;
+        }
+        x[0] = beta;
+        return (beta - alpha) / beta;
+    }
+
+    /*
+     * c = H' * c (transpose) or H * c for the (rows X cols) c and the block
+     * reflection H = H(0) * ... H(count - 1) = I - V * T * V' of the vectors
+     * stored below the diagonal of v (rows X count). T is the upper triangular
+     * (count X count) matrix of LAPACK's dlarft, the two products with V are
+     * Gemm calls on an explicit copy of V and of V'.
+     */
+    static void ApplyReflectors(bool transpose, const double* v, size_t ldv, const double* tau, size_t rows,
+                                size_t count, double* c, size_t ldc, size_t cols)
+    {
+        if (!rows || !count || !cols)
+        {
+            return;
+        }
+        MemoryBlock block = AllocateUninitialized((2 * rows * count + 2 * count * count + count * cols) * sizeof(double));
+        defer(Deallocate(block));
+        double* vFull = (double*)block.data;
+        double* vTransposed = vFull + rows * count;
+        double* gram = vTransposed + rows * count;
+        double* t = gram + count * count;
+        double* w = t + count * count;
+        for (size_t r = 0; r < rows; ++r)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const double value = r > i ? v[r * ldv + i] : r == i ? 1.0 : 0.0;
+                vFull[r * count + i] = value;
+                vTransposed[i * rows + r] = value;
+            }
+        }
+        // T(j, j) = tau(j), T(0:j, j) = -tau(j) * T(0:j, 0:j) * V(:, 0:j)' * v(j).
+        Gemm(count, count, rows, 1.0, vTransposed, rows, vFull, count, 0.0, gram, count);
+        for (size_t j = 0; j < count; ++j)
+        {
+            for (size_t i = 0; i < j; ++i)
+            {
+                double s = 0;
+                for (size_t p = i; p < j; ++p)
+                {
+                    s += t[i * count + p] * gram[p * count + j];
+                }
+                t[i * count + j] = -tau[j] * s;
+            }
+            t[j * count + j] = tau[j];
+            for (size_t i = j + 1; i < count; ++i)
+            {
+                t[i * count + j] = 0;
+            }
+        }
+        // W = V' * c, W = T' * W or T * W in place, c -= V * W.
+        Gemm(count, cols, rows, 1.0, vTransposed, rows, c, ldc, 0.0, w, cols);
+        for (size_t ii = 0; ii < count; ++ii)
+        {
+            // T' * W needs the rows before i and T * W the rows after it, so
+            // they are updated in the order that keeps those unchanged.
+            const size_t i = transpose ? count - 1 - ii : ii;
+            double* wi = w + i * cols;
+            const double d = t[i * count + i];
+            for (size_t q = 0; q < cols; ++q)
+            {
+                wi[q] *= d;
+            }
+            const size_t first = transpose ? 0 : i + 1;
+            const size_t last = transpose ? i : count;
+            for (size_t p = first; p < last; ++p)
+            {
+                const double f = transpose ? t[p * count + i] : t[i * count + p];
+                const double* wp = w + p * cols;
+                for (size_t q = 0; q < cols; ++q)
+                {
+                    wi[q] += f * wp[q];
+                }
+            }
+        }
+        Gemm(rows, cols, count, -1.0, vFull, count, w, cols, 1.0, c, ldc);
+    }
+
+    void FactorQR(double* a, size_t m, size_t n, size_t lda, double* tau)
+    {
+        GEDO_PROFILE_ZONE("FactorQR");
+        const size_t steps = Min(m, n);
+        double w[LINALG_BLOCK];
+        for (size_t k = 0; k < steps; k += LINALG_BLOCK)
+        {
+            const size_t kb = Min(LINALG_BLOCK, steps - k);
+            // the panel is the columns [k, k + kb) of the rows [k, m).
+            for (size_t j = k; j < k + kb; ++j)
+            {
+                double* v = a + j * lda + j;
+                tau[j] = MakeReflector(v, m - j, lda);
+                const size_t cols = k + kb - j - 1;
+                if (tau[j] == 0 || !cols)
+                {
+                    continue;
+                }
+                // w = v' * A, A -= tau * v * w on the columns after j.
+                for (size_t q = 0; q < cols; ++q)
+                {
+                    w[q] = v[q + 1];
+                }
+                for (size_t i = 1; i < m - j; ++i)
+                {
+                    const double vi = v[i * lda];
+                    const double* row = v + i * lda + 1;
+                    for (size_t q = 0; q < cols; ++q)
+                    {
+                        w[q] += vi * row[q];
+                    }
+                }
+                for (size_t q = 0; q < cols; ++q)
+                {
+                    w[q] *= tau[j];
+                    v[q + 1] -= w[q];
+                }
+                for (size_t i = 1; i < m - j; ++i)
+                {
+                    const double vi = v[i * lda];
+                    double* row = v + i * lda + 1;
+                    for (size_t q = 0; q < cols; ++q)
+                    {
+                        row[q] -= vi * w[q];
+                    }
+                }
+            }
+            ApplyReflectors(true, a + k * lda + k, lda, tau + k, m - k, kb,
+                            a + k * lda + k + kb, lda, n - k - kb);
+        }
+    }
+
+    // the element type of the results of the linear algebra kernels.
+    static MatrixDataType LinearAlgebraType(const Matrix& a, const Matrix& b)
+    {
+        return (a.type == MatrixDataType::FLOAT32 || b.type == MatrixDataType::FLOAT32)
+            ? MatrixDataType::FLOAT32 : MatrixDataType::FLOAT64;
+    }
+
+    // x is FLOAT64, it is converted to type in allocator.
+    static Matrix LinearAlgebraResult(Matrix& x, MatrixDataType type, Allocator& allocator)
+    {
+        if (type == MatrixDataType::FLOAT64)
+        {
+            return x;
+        }
+        Matrix result = ConvertMatrix(x, type, allocator);
+        FreeMatrix(x);
+        return result;
+    }
+
+    // a contiguous FLOAT64 copy of m or of its transpose to factor in place.
+    static Matrix FactorCopy(const Matrix& m, bool transpose)
+    {
+        if (!transpose)
+        {
+            return ConvertMatrix(m, MatrixDataType::FLOAT64);
+        }
+        Matrix view = TransposedView(m);
+        Matrix copy = ConvertMatrix(view, MatrixDataType::FLOAT64);
+        FreeMatrix(view);
+        return copy;
+    }
+
+    static bool IsTriangular(const Matrix& a, bool lower)
+    {
+        for (size_t i = 0; i < a.rows; ++i)
+        {
+            const double* row = a.data + i * a.cols;
+            const size_t first = lower ? i + 1 : 0;
+            const size_t last = lower ? a.cols : i;
+            for (size_t j = first; j < last; ++j)
+            {
+                if (row[j] != 0)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // symmetric with a positive diagonal, the matrices worth trying Cholesky on.
+    static bool IsCholeskyCandidate(const Matrix& a)
+    {
+        for (size_t i = 0; i < a.rows; ++i)
+        {
+            if (!(a.data[i * a.cols + i] > 0))
+            {
+                return false;
+            }
+            for (size_t j = 0; j < i; ++j)
+            {
+                if (a.data[i * a.cols + j] != a.data[j * a.cols + i])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static bool HasZeroDiagonal(const double* a, size_t n, size_t lda)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (a[i * lda + i] == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // x = f \ x for the square f, f is overwritten by its factors.
+    static bool SolveSquare(Matrix& f, Matrix& x)
+    {
+        const size_t n = f.rows;
+        const size_t nrhs = x.cols;
+        const bool lower = IsTriangular(f, true);
+        if (lower || IsTriangular(f, false))
+        {
+            TriangularSolve(lower, false, n, nrhs, f.data, n, x.data, nrhs);
+            return !HasZeroDiagonal(f.data, n, n);
+        }
+        if (IsCholeskyCandidate(f))
+        {
+            Matrix copy = CopyMatrix(f);
+            defer(FreeMatrix(copy));
+            if (FactorCholesky(copy.data, n, n))
+            {
+                // L' is mirrored into the upper triangle for the second solve.
+                for (size_t i = 0; i < n; ++i)
+                {
+                    for (size_t j = i + 1; j < n; ++j)
+                    {
+                        copy.data[i * n + j] = copy.data[j * n + i];
+                    }
+                }
+                TriangularSolve(true, false, n, nrhs, copy.data, n, x.data, nrhs);
+                TriangularSolve(false, false, n, nrhs, copy.data, n, x.data, nrhs);
+                return true;
+            }
+        }
+        Array<size_t> pivots;
+        pivots.resize(n);
+        const bool nonsingular = FactorLU(f.data, n, n, pivots.data());
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (pivots[i] != i)
+            {
+                for (size_t q = 0; q < nrhs; ++q)
+                {
+                    Swap(x.data[i * nrhs + q], x.data[pivots[i] * nrhs + q]);
+                }
+            }
+        }
+        TriangularSolve(true, true, n, nrhs, f.data, n, x.data, nrhs);
+        TriangularSolve(false, false, n, nrhs, f.data, n, x.data, nrhs);
+        return nonsingular;
+    }
+
+    bool CanSolve(const Matrix& a, const Matrix& b)
+    {
+        return a.rows == b.rows;
+    }
+
+    Matrix Solve(const Matrix& a, const Matrix& b, Allocator& allocator, bool* singular)
+    {
+        GEDO_ASSERT(CanSolve(a, b));
+        GEDO_PROFILE_ZONE("Solve");
+        const MatrixDataType type = LinearAlgebraType(a, b);
+        const size_t m = a.rows;
+        const size_t n = a.cols;
+        const size_t nrhs = b.cols;
+        bool exact = true;
+        Matrix x;
+        if (m == n)
+        {
+            Matrix f = FactorCopy(a, false);
+            defer(FreeMatrix(f));
+            x = ConvertMatrix(b, MatrixDataType::FLOAT64, allocator);
+            exact = SolveSquare(f, x);
+        }
+        else if (m > n)
+        {
+            // least squares: R * x = (Q' * b)(0:n).
+            Matrix f = FactorCopy(a, false);
+            defer(FreeMatrix(f));
+            Array<double> tau;
+            tau.resize(n);
+            FactorQR(f.data, m, n, n, tau.data());
+            Matrix qb = ConvertMatrix(b, MatrixDataType::FLOAT64);
+            defer(FreeMatrix(qb));
+            for (size_t k = 0; k < n; k += LINALG_BLOCK)
+            {
+                ApplyReflectors(true, f.data + k * n + k, n, tau.data() + k, m - k, Min(LINALG_BLOCK, n - k),
+                                qb.data + k * nrhs, nrhs, nrhs);
+            }
+            TriangularSolve(false, false, n, nrhs, f.data, n, qb.data, nrhs);
+            x = CreateMatrix(n, nrhs, allocator);
+            GEDO_MEMCPY(x.data, qb.data, n * nrhs * sizeof(double));
+            exact = !HasZeroDiagonal(f.data, n, n);
+        }
+        else
+        {
+            // minimum norm: a' = Q * R so a = R' * Q' and x = Q * [inverse(R') * b; 0].
+            Matrix f = FactorCopy(a, true);
+            defer(FreeMatrix(f));
+            Array<double> tau;
+            tau.resize(m);
+            FactorQR(f.data, n, m, m, tau.data());
+            Matrix rt = Zeros(m, m);
+            defer(FreeMatrix(rt));
+            for (size_t i = 0; i < m; ++i)
+            {
+                for (size_t j = 0; j <= i; ++j)
+                {
+                    rt.data[i * m + j] = f.data[j * m + i];
+                }
+            }
+            x = Zeros(n, nrhs, allocator);
+            Matrix top = ConvertMatrix(b, MatrixDataType::FLOAT64);
+            GEDO_MEMCPY(x.data, top.data, m * nrhs * sizeof(double));
+            FreeMatrix(top);
+            TriangularSolve(true, false, m, nrhs, rt.data, m, x.data, nrhs);
+            const size_t blocks = (m + LINALG_BLOCK - 1) / LINALG_BLOCK;
+            for (size_t block = blocks; block-- > 0;)
+            {
+                const size_t k = block * LINALG_BLOCK;
+                ApplyReflectors(false, f.data + k * m + k, m, tau.data() + k, n - k, Min(LINALG_BLOCK, m - k),
+                                x.data + k * nrhs, nrhs, nrhs);
+            }
+            exact = !HasZeroDiagonal(f.data, m, m);
+        }
+        if (singular)
+        {
+            *singular = !exact;
+        }
+        return LinearAlgebraResult(x, type, allocator);
+    }
+
+    Matrix Inverse(const Matrix& m, Allocator& allocator, bool* singular)
+    {
+        GEDO_ASSERT(m.rows == m.cols);
+        Matrix identity = Eye(m.rows, m.cols);
+        defer(FreeMatrix(identity));
+        return Solve(m, identity, allocator, singular);
+    }
+
+    double Determinant(const Matrix& m)
+    {
+        GEDO_ASSERT(m.rows == m.cols);
+        const size_t n = m.rows;
+        Matrix f = FactorCopy(m, false);
+        defer(FreeMatrix(f));
+        Array<size_t> pivots;
+        pivots.resize(n);
+        FactorLU(f.data, n, n, pivots.data());
+        double result = 1;
+        for (size_t i = 0; i < n; ++i)
+        {
+            result *= (pivots[i] == i) ? f.data[i * n + i] : -f.data[i * n + i];
+        }
+        return result;
+    }
+
+    Matrix LU(const Matrix& m, Allocator& allocator, bool* singular)
+    {
+        GEDO_ASSERT(m.rows == m.cols);
+        Matrix f = ConvertMatrix(m, MatrixDataType::FLOAT64, allocator);
+        Array<size_t> pivots;
+        pivots.resize(f.rows);
+        const bool nonsingular = FactorLU(f.data, f.rows, f.cols, pivots.data());
+        if (singular)
+        {
+            *singular = !nonsingular;
+        }
+        return LinearAlgebraResult(f, LinearAlgebraType(m, m), allocator);
+    }
+
+    Matrix Cholesky(const Matrix& m, Allocator& allocator, bool* positiveDefinite)
+    {
+        GEDO_ASSERT(m.rows == m.cols);
+        const size_t n = m.rows;
+        Matrix f = FactorCopy(m, false);
+        defer(FreeMatrix(f));
+        const bool success = FactorCholesky(f.data, n, n);
+        if (positiveDefinite)
+        {
+            *positiveDefinite = success;
+        }
+        // R = L'.
+        Matrix r = CreateMatrix(n, n, allocator);
+        for (size_t i = 0; i < n; ++i)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                r.data[i * n + j] = (j >= i) ? f.data[j * n + i] : 0.0;
+            }
+        }
+        return LinearAlgebraResult(r, LinearAlgebraType(m, m), allocator);
+    }
+
+    Matrix QR(const Matrix& m, Allocator& allocator)
+    {
+        Matrix f = ConvertMatrix(m, MatrixDataType::FLOAT64, allocator);
+        Array<double> tau;
+        tau.resize(Min(f.rows, f.cols));
+        FactorQR(f.data, f.rows, f.cols, f.cols, tau.data());
+        for (size_t i = 1; i < f.rows; ++i)
+        {
+            for (size_t j = 0; j < Min(i, f.cols); ++j)
+            {
+                f.data[i * f.cols + j] = 0;
+            }
+        }
+        return LinearAlgebraResult(f, LinearAlgebraType(m, m), allocator);
+    }
+
+    Matrix Transpose(const Matrix& m, Allocator& allocator)
+    {
+        return CopyMatrix(TransposedView(m), allocator);
+    }
+    //----------------------------------------------------------//
+
+    //--------------------Sparse matrices-----------------------//
+    static size_t GetMajorCount(size_t rows, size_t cols, SparseFormat format)
+    {
+        return format == SparseFormat::CSR ? rows : cols;
+    }
+
+    static size_t GetMajorCount(const SparseMatrix& m)
+    {
+        return GetMajorCount(m.rows, m.cols, m.format);
+    }
+
+    // ParallelFor batch of major lines with about PARALLEL_MIN_BATCH elements
+    // of work, cost is the work of an element.
+    static size_t SparseBatch(const SparseMatrix& m, size_t cost)
+    {
+        const size_t lines = Max<size_t>(GetMajorCount(m), 1);
+        const size_t perLine = (m.nonZeros / lines + 1) * cost;
+        return Max<size_t>(PARALLEL_MIN_BATCH / perLine, 1);
+    }
+
+    SparseMatrix CreateSparseMatrix(size_t rows, size_t cols, size_t nonZeros, SparseFormat format,
+                                    Allocator& allocator)
+    {
+        GEDO_ASSERT(rows <= UINT32_MAX && cols <= UINT32_MAX);
+        SparseMatrix result;
+        result.rows = rows;
+        result.cols = cols;
+        result.nonZeros = nonZeros;
+        result.format = format;
+        const size_t major = GetMajorCount(rows, cols, format);
+        // the elements are in the order of the matrix file payload.
+        MemoryBlock block = AllocateUninitialized(sizeof(MatrixStorage) + (major + 1) * sizeof(size_t) +
+                                                  nonZeros * (sizeof(double) + sizeof(uint32_t)), allocator);
+        MatrixStorage* storage = (MatrixStorage*)block.data;
+        storage->refCount = 1;
+        storage->allocator = &allocator;
+        storage->size = block.size;
+        result.storage = storage;
+        result.offsets = (size_t*)(storage + 1);
+        result.values = (double*)(result.offsets + major + 1);
+        result.indices = (uint32_t*)(result.values + nonZeros);
+        result.offsets[0] = 0;
+        return result;
+    }
+
+    void FreeSparseMatrix(SparseMatrix& m)
+    {
+        if (m.storage && AtomicAdd(&m.storage->refCount, -1) == 0)
+        {
+            MemoryBlock block;
+            block.data = (uint8_t*)m.storage;
+            block.size = m.storage->size;
+            Deallocate(block, *m.storage->allocator);
+        }
+        m = SparseMatrix();
+    }
+
+    SparseMatrix ShareSparseMatrix(const SparseMatrix& m)
+    {
+        if (m.storage)
+        {
+            AtomicAdd(&m.storage->refCount, 1);
+        }
+        return m;
+    }
+
+    SparseMatrix CopySparseMatrix(const SparseMatrix& m, Allocator& allocator)
+    {
+        SparseMatrix result = CreateSparseMatrix(m.rows, m.cols, m.nonZeros, m.format, allocator);
+        GEDO_MEMCPY(result.offsets, m.offsets, (GetMajorCount(m) + 1) * sizeof(size_t));
+        GEDO_MEMCPY(result.values, m.values, m.nonZeros * sizeof(double));
+        GEDO_MEMCPY(result.indices, m.indices, m.nonZeros * sizeof(uint32_t));
+        return result;
+    }
+
+    SparseMatrix ConvertSparseMatrix(const SparseMatrix& m, SparseFormat format, Allocator& allocator)
+    {
+        if (m.format == format)
+        {
+            return ShareSparseMatrix(m);
+        }
+        // a counting sort of the elements by their index, walking the major
+        // lines in order keeps the new indices ascending.
+        SparseMatrix result = CreateSparseMatrix(m.rows, m.cols, m.nonZeros, format, allocator);
+        const size_t major = GetMajorCount(m);
+        const size_t minor = GetMajorCount(result);
+        size_t* offsets = result.offsets;
+        GEDO_MEMSET(offsets, 0, (minor + 1) * sizeof(size_t));
+        for (size_t k = 0; k < m.nonZeros; ++k)
+        {
+            offsets[m.indices[k] + 1]++;
+        }
+        for (size_t i = 0; i < minor; ++i)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        for (size_t i = 0; i < major; ++i)
+        {
+            for (size_t k = m.offsets[i]; k < m.offsets[i + 1]; ++k)
+            {
+                const size_t position = offsets[m.indices[k]]++;
+                result.indices[position] = (uint32_t)i;
+                result.values[position] = m.values[k];
+            }
+        }
+        // every offset moved to the start of the next line.
+        for (size_t i = minor; i > 0; --i)
+        {
+            offsets[i] = offsets[i - 1];
+        }
+        offsets[0] = 0;
+        return result;
+    }
+
+    struct SparseEntry
+    {
+        uint32_t index;
+        double value;
+    };
+
+    SparseMatrix CreateSparseFromTriplets(size_t rows, size_t cols, const size_t* rowIndices,
+                                          const size_t* colIndices, const double* values, size_t count,
+                                          SparseFormat format, Allocator& allocator)
+    {
+        GEDO_PROFILE_ZONE("CreateSparseFromTriplets");
+        const size_t major = GetMajorCount(rows, cols, format);
+        const size_t* majorIndices = format == SparseFormat::CSR ? rowIndices : colIndices;
+        const size_t* minorIndices = format == SparseFormat::CSR ? colIndices : rowIndices;
+        // the triplets are bucketed by their major line, then every line is
+        // sorted and its duplicates summed on the thread pool.
+        Array<size_t> offsets;
+        offsets.resize(major + 1);
+        GEDO_MEMSET(offsets.data(), 0, (major + 1) * sizeof(size_t));
+        for (size_t k = 0; k < count; ++k)
+        {
+            GEDO_ASSERT(rowIndices[k] < rows && colIndices[k] < cols);
+            offsets[majorIndices[k] + 1]++;
+        }
+        for (size_t i = 0; i < major; ++i)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        Array<SparseEntry> entries;
+        entries.resize(count);
+        {
+            Array<size_t> cursors = offsets;
+            for (size_t k = 0; k < count; ++k)
+            {
+                SparseEntry& entry = entries[cursors[majorIndices[k]]++];
+                entry.index = (uint32_t)minorIndices[k];
+                entry.value = values[k];
+            }
+        }
+        Array<size_t> kept;
+        kept.resize(major + 1);
+        kept[0] = 0;
+        const size_t batch = Max<size_t>(PARALLEL_MIN_BATCH / (count / Max<size_t>(major, 1) + 1), 1);
+        ParallelFor(major, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                SparseEntry* line = entries.data() + offsets[i];
+                const size_t size = offsets[i + 1] - offsets[i];
+                QuickSort(line, size, [](const SparseEntry& a, const SparseEntry& b) { return a.index < b.index; });
+                size_t n = 0;
+                for (size_t k = 0; k < size; ++k)
+                {
+                    if (n && line[n - 1].index == line[k].index)
+                    {
+                        line[n - 1].value += line[k].value;
+                    }
+                    else
+                    {
+                        line[n++] = line[k];
+                    }
+                }
+                // the sums can be 0 as well.
+                size_t nonZeros = 0;
+                for (size_t k = 0; k < n; ++k)
+                {
+                    if (line[k].value != 0)
+                    {
+                        line[nonZeros++] = line[k];
+                    }
+                }
+                kept[i + 1] = nonZeros;
+            }
+        });
+        for (size_t i = 0; i < major; ++i)
+        {
+            kept[i + 1] += kept[i];
+        }
+        SparseMatrix result = CreateSparseMatrix(rows, cols, kept[major], format, allocator);
+        GEDO_MEMCPY(result.offsets, kept.data(), (major + 1) * sizeof(size_t));
+        ParallelFor(major, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const SparseEntry* line = entries.data() + offsets[i];
+                for (size_t k = 0; k < kept[i + 1] - kept[i]; ++k)
+                {
+                    result.indices[kept[i] + k] = line[k].index;
+                    result.values[kept[i] + k] = line[k].value;
+                }
+            }
+        });
+        return result;
+    }
+
+    SparseMatrix SparseFromDense(const Matrix& m, SparseFormat format, Allocator& allocator)
+    {
+        if (format == SparseFormat::CSC)
+        {
+            SparseMatrix csr = SparseFromDense(m, SparseFormat::CSR);
+            SparseMatrix result = ConvertSparseMatrix(csr, SparseFormat::CSC, allocator);
+            FreeSparseMatrix(csr);
+            return result;
+        }
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const Matrix& a = (m.type == MatrixDataType::FLOAT64 && m.colStride == 1)
+            ? m : (copy = ConvertMatrix(m, MatrixDataType::FLOAT64));
+        // the non zeros of every row are counted, then copied at their offset.
+        Array<size_t> offsets;
+        offsets.resize(a.rows + 1);
+        offsets[0] = 0;
+        const size_t batch = Max<size_t>(PARALLEL_MIN_BATCH / Max<size_t>(a.cols, 1), 1);
+        ParallelFor(a.rows, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double* row = a.data + i * a.rowStride;
+                size_t n = 0;
+                for (size_t j = 0; j < a.cols; ++j)
+                {
+                    n += row[j] != 0;
+                }
+                offsets[i + 1] = n;
+            }
+        });
+        for (size_t i = 0; i < a.rows; ++i)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        SparseMatrix result = CreateSparseMatrix(a.rows, a.cols, offsets[a.rows], SparseFormat::CSR, allocator);
+        GEDO_MEMCPY(result.offsets, offsets.data(), (a.rows + 1) * sizeof(size_t));
+        ParallelFor(a.rows, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double* row = a.data + i * a.rowStride;
+                size_t k = offsets[i];
+                for (size_t j = 0; j < a.cols; ++j)
+                {
+                    if (row[j] != 0)
+                    {
+                        result.indices[k] = (uint32_t)j;
+                        result.values[k] = row[j];
+                        k++;
+                    }
+                }
+            }
+        });
+        return result;
+    }
+
+    Matrix SparseToDense(const SparseMatrix& m, Allocator& allocator)
+    {
+        Matrix result = Zeros(m.rows, m.cols, allocator);
+        // the lines of both formats write different elements.
+        const bool csr = m.format == SparseFormat::CSR;
+        ParallelFor(GetMajorCount(m), SparseBatch(m, 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                for (size_t k = m.offsets[i]; k < m.offsets[i + 1]; ++k)
+                {
+                    const size_t index = csr ? i * m.cols + m.indices[k] : m.indices[k] * m.cols + i;
+                    result.data[index] = m.values[k];
+                }
+            }
+        });
+        return result;
+    }
+
+    double GetElement(const SparseMatrix& m, size_t i, size_t j)
+    {
+        GEDO_ASSERT(i < m.rows && j < m.cols);
+        const size_t line = m.format == SparseFormat::CSR ? i : j;
+        const uint32_t index = (uint32_t)(m.format == SparseFormat::CSR ? j : i);
+        const uint32_t* indices = m.indices + m.offsets[line];
+        const size_t size = m.offsets[line + 1] - m.offsets[line];
+        const size_t k = LowerBound(indices, size, index);
+        return (k < size && indices[k] == index) ? m.values[m.offsets[line] + k] : 0.0;
+    }
+
+    SparseMatrix Transpose(const SparseMatrix& m)
+    {
+        // the CSR arrays of m are the CSC arrays of its transpose.
+        SparseMatrix result = ShareSparseMatrix(m);
+        result.rows = m.cols;
+        result.cols = m.rows;
+        result.format = m.format == SparseFormat::CSR ? SparseFormat::CSC : SparseFormat::CSR;
+        return result;
+    }
+
+    // a FLOAT64 matrix whose rows are contiguous, m itself when it is one.
+    static const Matrix& DoubleRows(const Matrix& m, Matrix& copy)
+    {
+        if (m.type == MatrixDataType::FLOAT64 && m.colStride == 1)
+        {
+            return m;
+        }
+        copy = ConvertMatrix(m, MatrixDataType::FLOAT64);
+        return copy;
+    }
+
+    Matrix Multiply(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator)
+    {
+        GEDO_ASSERT(m0.cols == m1.rows);
+        GEDO_PROFILE_ZONE("SparseDenseMultiply");
+        SparseMatrix a = ConvertSparseMatrix(m0, SparseFormat::CSR);
+        defer(FreeSparseMatrix(a));
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const Matrix& b = DoubleRows(m1, copy);
+        const size_t n = b.cols;
+        Matrix result = CreateMatrix(a.rows, n, allocator);
+        ParallelFor(a.rows, SparseBatch(a, Max<size_t>(n, 1)), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                double* y = result.data + i * n;
+                const size_t first = a.offsets[i];
+                const size_t last = a.offsets[i + 1];
+                if (n == 1)
+                {
+                    // SpMV, the independent sums hide the latency of the gathers.
+                    double s0 = 0;
+                    double s1 = 0;
+                    size_t k = first;
+                    for (; k + 2 <= last; k += 2)
+                    {
+                        s0 += a.values[k] * b.data[a.indices[k] * b.rowStride];
+                        s1 += a.values[k + 1] * b.data[a.indices[k + 1] * b.rowStride];
+                    }
+                    if (k < last)
+                    {
+                        s0 += a.values[k] * b.data[a.indices[k] * b.rowStride];
+                    }
+                    y[0] = s0 + s1;
+                    continue;
+                }
+                for (size_t j = 0; j < n; ++j)
+                {
+                    y[j] = 0;
+                }
+                for (size_t k = first; k < last; ++k)
+                {
+                    const double v = a.values[k];
+                    const double* x = b.data + a.indices[k] * b.rowStride;
+                    for (size_t j = 0; j < n; ++j)
+                    {
+                        y[j] += v * x[j];
+                    }
+                }
+            }
+        });
+        return result;
+    }
+
+    Matrix Multiply(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator)
+    {
+        GEDO_ASSERT(m0.cols == m1.rows);
+        GEDO_PROFILE_ZONE("DenseSparseMultiply");
+        Matrix copy;
+        defer(FreeMatrix(copy));
+        const Matrix& a = DoubleRows(m0, copy);
+        SparseMatrix b = ConvertSparseMatrix(m1, SparseFormat::CSR);
+        defer(FreeSparseMatrix(b));
+        const size_t n = b.cols;
+        Matrix result = CreateMatrix(a.rows, n, allocator);
+        const size_t batch = Max<size_t>(PARALLEL_MIN_BATCH / (b.nonZeros + n + 1), 1);
+        ParallelFor(a.rows, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double* x = a.data + i * a.rowStride;
+                double* y = result.data + i * n;
+                for (size_t j = 0; j < n; ++j)
+                {
+                    y[j] = 0;
+                }
+                // row i of the result is the sum of the rows k of m1 scaled by x[k].
+                for (size_t k = 0; k < b.rows; ++k)
+                {
+                    const double f = x[k];
+                    for (size_t e = b.offsets[k]; e < b.offsets[k + 1]; ++e)
+                    {
+                        y[b.indices[e]] += f * b.values[e];
+                    }
+                }
+            }
+        });
+        return result;
+    }
+
+    // the columns of a row of a * b are found with marks[c] == row and their
+    // sums are kept in accumulator, both have b.cols elements.
+    struct SparseRowWorkspace
+    {
+        size_t* marks = NULL;
+        double* accumulator = NULL;
+        uint32_t* columns = NULL;
+    };
+
+    SparseMatrix Multiply(const SparseMatrix& m0, const SparseMatrix& m1, Allocator& allocator)
+    {
+        GEDO_ASSERT(m0.cols == m1.rows);
+        GEDO_PROFILE_ZONE("SparseSparseMultiply");
+        SparseMatrix a = ConvertSparseMatrix(m0, SparseFormat::CSR);
+        SparseMatrix b = ConvertSparseMatrix(m1, SparseFormat::CSR);
+        defer(FreeSparseMatrix(a));
+        defer(FreeSparseMatrix(b));
+        const size_t n = b.cols;
+        auto createWorkspace = [n]() {
+            SparseRowWorkspace w;
+            w.marks = (size_t*)GEDO_MALLOC(n * (sizeof(size_t) + sizeof(double) + sizeof(uint32_t)) + 1);
+            GEDO_ASSERT(w.marks);
+            w.accumulator = (double*)(w.marks + n);
+            w.columns = (uint32_t*)(w.accumulator + n);
+            for (size_t c = 0; c < n; ++c)
+            {
+                w.marks[c] = SIZE_MAX;
+            }
+            return w;
+        };
+        // the first pass counts the columns of every row, the second one sums
+        // them and writes the row sorted.
+        Array<size_t> offsets;
+        offsets.resize(a.rows + 1);
+        offsets[0] = 0;
+        const size_t batch = SparseBatch(a, b.nonZeros / Max<size_t>(b.rows, 1) + 1);
+        ParallelFor(a.rows, batch, [&](size_t begin, size_t end) {
+            SparseRowWorkspace w = createWorkspace();
+            for (size_t i = begin; i < end; ++i)
+            {
+                size_t count = 0;
+                for (size_t k = a.offsets[i]; k < a.offsets[i + 1]; ++k)
+                {
+                    const size_t row = a.indices[k];
+                    for (size_t e = b.offsets[row]; e < b.offsets[row + 1]; ++e)
+                    {
+                        if (w.marks[b.indices[e]] != i)
+                        {
+                            w.marks[b.indices[e]] = i;
+                            count++;
+                        }
+                    }
+                }
+                offsets[i + 1] = count;
+            }
+            GEDO_FREE(w.marks);
+        });
+        for (size_t i = 0; i < a.rows; ++i)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        SparseMatrix result = CreateSparseMatrix(a.rows, n, offsets[a.rows], SparseFormat::CSR, allocator);
+        GEDO_MEMCPY(result.offsets, offsets.data(), (a.rows + 1) * sizeof(size_t));
+        ParallelFor(a.rows, batch, [&](size_t begin, size_t end) {
+            SparseRowWorkspace w = createWorkspace();
+            for (size_t i = begin; i < end; ++i)
+            {
+                size_t count = 0;
+                for (size_t k = a.offsets[i]; k < a.offsets[i + 1]; ++k)
+                {
+                    const size_t row = a.indices[k];
+                    const double f = a.values[k];
+                    for (size_t e = b.offsets[row]; e < b.offsets[row + 1]; ++e)
+                    {
+                        const uint32_t c = b.indices[e];
+                        if (w.marks[c] != i)
+                        {
+                            w.marks[c] = i;
+                            w.accumulator[c] = f * b.values[e];
+                            w.columns[count++] = c;
+                        }
+                        else
+                        {
+                            w.accumulator[c] += f * b.values[e];
+                        }
+                    }
+                }
+                QuickSort(w.columns, count);
+                uint32_t* indices = result.indices + result.offsets[i];
+                double* values = result.values + result.offsets[i];
+                for (size_t k = 0; k < count; ++k)
+                {
+                    indices[k] = w.columns[k];
+                    values[k] = w.accumulator[w.columns[k]];
+                }
+            }
+            GEDO_FREE(w.marks);
+        });
+        return result;
+    }
+
+    SparseMatrix Multiply(const SparseMatrix& m, double scalar, Allocator& allocator)
+    {
+        SparseMatrix result = CopySparseMatrix(m, allocator);
+        ParallelFor(result.nonZeros, PARALLEL_MIN_BATCH, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k)
+            {
+                result.values[k] *= scalar;
+            }
+        });
+        return result;
+    }
+
+    // m0 + sign * m1, every line is the merge of the two lines.
+    static SparseMatrix AddSparse(const SparseMatrix& m0, const SparseMatrix& m1, double sign, Allocator& allocator)
+    {
+        GEDO_ASSERT(m0.rows == m1.rows && m0.cols == m1.cols);
+        const SparseMatrix& a = m0;
+        SparseMatrix b = ConvertSparseMatrix(m1, m0.format);
+        defer(FreeSparseMatrix(b));
+        const size_t major = GetMajorCount(a);
+        Array<size_t> offsets;
+        offsets.resize(major + 1);
+        offsets[0] = 0;
+        const size_t batch = SparseBatch(a, 2);
+        ParallelFor(major, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                size_t p = a.offsets[i];
+                size_t q = b.offsets[i];
+                size_t count = 0;
+                while (p < a.offsets[i + 1] && q < b.offsets[i + 1])
+                {
+                    const uint32_t pi = a.indices[p];
+                    const uint32_t qi = b.indices[q];
+                    p += pi <= qi;
+                    q += qi <= pi;
+                    count++;
+                }
+                offsets[i + 1] = count + (a.offsets[i + 1] - p) + (b.offsets[i + 1] - q);
+            }
+        });
+        for (size_t i = 0; i < major; ++i)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+        SparseMatrix result = CreateSparseMatrix(a.rows, a.cols, offsets[major], a.format, allocator);
+        GEDO_MEMCPY(result.offsets, offsets.data(), (major + 1) * sizeof(size_t));
+        ParallelFor(major, batch, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                size_t p = a.offsets[i];
+                size_t q = b.offsets[i];
+                size_t k = result.offsets[i];
+                while (p < a.offsets[i + 1] || q < b.offsets[i + 1])
+                {
+                    const uint32_t pi = p < a.offsets[i + 1] ? a.indices[p] : UINT32_MAX;
+                    const uint32_t qi = q < b.offsets[i + 1] ? b.indices[q] : UINT32_MAX;
+                    double v = 0;
+                    if (pi <= qi)
+                    {
+                        v = a.values[p++];
+                    }
+                    if (qi <= pi)
+                    {
+                        v += sign * b.values[q++];
+                    }
+                    result.indices[k] = Min(pi, qi);
+                    result.values[k] = v;
+                    k++;
+                }
+            }
+        });
+        return result;
     }
 
-    Vec2d Normalised(const Vec2d& v)
+    SparseMatrix Add(const SparseMatrix& m0, const SparseMatrix& m1, Allocator& allocator)
     {
-        const double length = Length(v);
-        return Vec2d{ v.x / length, v.y / length };
+        return AddSparse(m0, m1, 1.0, allocator);
     }
 
-    void Normalise(Vec3d& v)
+    SparseMatrix Subtract(const SparseMatrix& m0, const SparseMatrix& m1, Allocator& allocator)
     {
-        const double length = Length(v);
-        v.x /= length;
-        v.y /= length;
-        v.z /= length;
+        return AddSparse(m0, m1, -1.0, allocator);
     }
 
-    Vec3d Normalised(const Vec3d& v)
+    // denseSign * dense + sparseSign * sparse.
+    static Matrix AddSparseToDense(const Matrix& dense, double denseSign, const SparseMatrix& sparse,
+                                   double sparseSign, Allocator& allocator)
     {
-        const double length = Length(v);
-        return Vec3d{ v.x / length, v.y / length, v.z / length };
+        GEDO_ASSERT(dense.rows == sparse.rows && dense.cols == sparse.cols);
+        Matrix result = ConvertMatrix(dense, MatrixDataType::FLOAT64, allocator);
+        if (denseSign != 1)
+        {
+            ParallelFor(result.rows * result.cols, PARALLEL_MIN_BATCH, [&](size_t begin, size_t end) {
+                for (size_t k = begin; k < end; ++k)
+                {
+                    result.data[k] = -result.data[k];
+                }
+            });
+        }
+        const bool csr = sparse.format == SparseFormat::CSR;
+        ParallelFor(GetMajorCount(sparse), SparseBatch(sparse, 1), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                for (size_t k = sparse.offsets[i]; k < sparse.offsets[i + 1]; ++k)
+                {
+                    const size_t index = csr ? i * result.cols + sparse.indices[k] : sparse.indices[k] * result.cols + i;
+                    result.data[index] += sparseSign * sparse.values[k];
+                }
+            }
+        });
+        return result;
     }
 
-    Mat4 Transpose(Mat4 m)
+    Matrix Add(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator)
     {
-        Swap(m.elements[0][1], m.elements[1][0]);
-        Swap(m.elements[0][2], m.elements[2][0]);
-        Swap(m.elements[0][3], m.elements[3][0]);
-        Swap(m.elements[1][2], m.elements[2][1]);
-        Swap(m.elements[1][3], m.elements[3][1]);
-        Swap(m.elements[2][3], m.elements[3][2]);
-        return m;
+        return AddSparseToDense(m1, 1.0, m0, 1.0, allocator);
     }
 
-    Mat3 Transpose(Mat3 m)
+    Matrix Add(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator)
     {
-        Swap(m.elements[0][1], m.elements[1][0]);
-        Swap(m.elements[0][2], m.elements[2][0]);
-        Swap(m.elements[1][2], m.elements[2][1]);
-        return m;
+        return AddSparseToDense(m0, 1.0, m1, 1.0, allocator);
     }
 
-    Mat4 Translate(const Mat4& m, Vec3d translation)
+    Matrix Subtract(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator)
     {
-        Mat4 translate = Identity();
-        translate.elements[3][0] = translation.x;
-        translate.elements[3][1] = translation.y;
-        translate.elements[3][2] = translation.z;
-        return m * translate;
+        return AddSparseToDense(m1, -1.0, m0, 1.0, allocator);
     }
 
-    Mat4 Rotate(const Mat4& m, double angle, Vec3d axis)
+    Matrix Subtract(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator)
     {
-        const double sinTheta = sinf(angle);
-        const double cosTheta = cosf(angle);
-        const double cosValue = 1.0f - cosTheta;
-
-        Normalise(axis);
-        Mat4 rotate = Identity();
-
-        rotate.elements[0][0] = (axis.x * axis.x * cosValue) + cosTheta;
-        rotate.elements[0][1] = (axis.x * axis.y * cosValue) + (axis.z * sinTheta);
-        rotate.elements[0][2] = (axis.x * axis.z * cosValue) - (axis.y * sinTheta);
-
-        rotate.elements[1][0] = (axis.y * axis.x * cosValue) - (axis.z * sinTheta);
-        rotate.elements[1][1] = (axis.y * axis.y * cosValue) + cosTheta;
-        rotate.elements[1][2] = (axis.y * axis.z * cosValue) + (axis.x * sinTheta);
+        return AddSparseToDense(m0, 1.0, m1, -1.0, allocator);
+    }
+    //----------------------------------------------------------//
 
-        rotate.elements[2][0] = (axis.z * axis.x * cosValue) + (axis.y * sinTheta);
-        rotate.elements[2][1] = (axis.z * axis.y * cosValue) - (axis.x * sinTheta);
-        rotate.elements[2][2] = (axis.z * axis.z * cosValue) + cosTheta;
+    //--------------------Expressions---------------------------//
+    // Evaluate() folds the nodes that only depend on scalars, then walks the
+    // output in tiles of EXPRESSION_TILE elements. Every inner node gets a
+    // tile sized buffer that stays in L1 and the root writes straight to the
+    // result, so each input is read once and nothing else touches memory.
+    static const size_t EXPRESSION_TILE = 256;
+    // graphs up to this size are evaluated without allocating the bookkeeping.
+    static const size_t EXPRESSION_INLINE_NODES = 32;
 
-        return m * rotate;
+    void ClearExpression(MatrixExpression& e)
+    {
+        e.nodes.clear();
     }
 
-    Mat4 Identity()
+    size_t PushMatrix(MatrixExpression& e, const Matrix& m)
     {
-        Mat4 m = { 0 };
-        m.elements[0][0] = m.elements[1][1] = m.elements[2][2] = m.elements[3][3] = 1.0f;
-        return m;
+        GEDO_ASSERT(IsContiguous(m));
+        if (IsScalar(m) && m.type == MatrixDataType::FLOAT64)
+        {
+            return PushScalar(e, m.data[0]);
+        }
+        ExpressionNode node;
+        node.op = ExpressionOp::MATRIX;
+        node.data = m.data;
+        node.rows = m.rows;
+        node.cols = m.cols;
+        node.type = m.type;
+        e.nodes.push_back(node);
+        return e.nodes.size() - 1;
     }
 
-    Mat4 LookAt(const Vec3d& eye, const Vec3d& center, const Vec3d& up)
+    size_t PushScalar(MatrixExpression& e, double scalar)
     {
-        const Vec3d f = Normalised(center - eye);
-        const Vec3d s = Normalised(CrossProduct(f, up));
-        const Vec3d u = CrossProduct(s, f);
-
-        Mat4 dest;
-        dest.elements[0][0] = s.x;
-        dest.elements[0][1] = u.x;
-        dest.elements[0][2] = -f.x;
-        dest.elements[0][3] = 0;
-
-        dest.elements[1][0] = s.y;
-        dest.elements[1][1] = u.y;
-        dest.elements[1][2] = -f.y;
-        dest.elements[1][3] = 0;
-
-        dest.elements[2][0] = s.z;
-        dest.elements[2][1] = u.z;
-        dest.elements[2][2] = -f.z;
-        dest.elements[2][3] = 0;
-
-        dest.elements[3][0] = -DotProduct(s, eye);
-        dest.elements[3][1] = -DotProduct(u, eye);
-        dest.elements[3][2] = DotProduct(f, eye);
-        dest.elements[3][3] = 1.0f;
-        return dest;
+        ExpressionNode node;
+        node.op = ExpressionOp::SCALAR;
+        node.scalar = scalar;
+        e.nodes.push_back(node);
+        return e.nodes.size() - 1;
     }
 
-    Mat4 Perspective(double fovy, double aspect, double zNear, double zFar)
+    size_t PushUnary(MatrixExpression& e, ExpressionOp op, size_t operand)
     {
-        const double f = 1.0f / tanf(fovy * 0.5f);
-        const double fn = 1.0f / (zNear - zFar);
-        Mat4 dest = { 0 };
-        dest.elements[0][0] = f / aspect;
-        dest.elements[1][1] = f;
-        dest.elements[2][2] = (zNear + zFar) * fn;
-        dest.elements[2][3] = -1.0f;
-        dest.elements[3][2] = 2.0f * zNear * zFar * fn;
-        return dest;
+        GEDO_ASSERT(operand < e.nodes.size());
+        GEDO_ASSERT(op >= ExpressionOp::NEGATE && op <= ExpressionOp::CONVERT);
+        ExpressionNode node;
+        node.op = op;
+        node.left = operand;
+        node.rows = e.nodes[operand].rows;
+        node.cols = e.nodes[operand].cols;
+        node.type = e.nodes[operand].type;
+        e.nodes.push_back(node);
+        return e.nodes.size() - 1;
     }
 
-    double Deg2Rad(double v)
+    size_t PushConvert(MatrixExpression& e, size_t operand, MatrixDataType type)
     {
-        return (PI / 180.0) * v;
+        const size_t node = PushUnary(e, ExpressionOp::CONVERT, operand);
+        e.nodes[node].type = type;
+        return node;
     }
 
-    double Rad2Deg(double v)
+    static bool IsUniformNode(const ExpressionNode& node)
     {
-        return (180.0 / PI) * v;
+        return node.rows == 1 && node.cols == 1;
     }
 
-    double& At(Matrix& m, size_t i, size_t j)
+    bool CanCombine(const MatrixExpression& e, size_t left, size_t right)
     {
-        return m.data[m.rows * i + j];
+        const ExpressionNode& l = e.nodes[left];
+        const ExpressionNode& r = e.nodes[right];
+        return CanBroadcast(l.rows, l.cols, r.rows, r.cols);
     }
 
-    const double& At(const Matrix& m, size_t i, size_t j)
+    size_t PushBinary(MatrixExpression& e, ExpressionOp op, size_t left, size_t right)
     {
-        return m.data[m.rows * i + j];
+        GEDO_ASSERT(left < e.nodes.size() && right < e.nodes.size());
+        GEDO_ASSERT(op >= ExpressionOp::ADD);
+        GEDO_ASSERT(CanCombine(e, left, right));
+        ExpressionNode node;
+        node.op = op;
+        node.left = left;
+        node.right = right;
+        node.rows = BroadcastSize(e.nodes[left].rows, e.nodes[right].rows);
+        node.cols = BroadcastSize(e.nodes[left].cols, e.nodes[right].cols);
+        node.type = PromoteTypes(e.nodes[left].type, e.nodes[right].type);
+        e.nodes.push_back(node);
+        return e.nodes.size() - 1;
     }
 
-    void GetRow(const Matrix& m, size_t row, double* result)
+    template <typename T, typename F>
+    static void UnaryLoop(const T* a, size_t aStride, T* out, size_t n, F f)
     {
-        for (size_t i = 0; i < m.cols; ++i)
+        if (aStride)
         {
-            result[i] = At(m, row, i);
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = f(a[i]);
+            }
         }
-    }
-
-    double DotProduct(const double* v0, const double* v1, size_t size)
-    {
-        double result = 0;
-        for (size_t i = 0; i < size; i++)
+        else
         {
-            result += v0[i] * v1[i];
+            const T v = f(*a);
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = v;
+            }
         }
-        return result;
     }
 
-    void GetCol(const Matrix& m, size_t col, double* result)
+    // a stride of 0 broadcasts the first element.
+    template <typename T, typename F>
+    static void BinaryLoop(const T* a, size_t aStride, const T* b, size_t bStride, T* out, size_t n, F f)
     {
-        for (size_t i = 0; i < m.rows; ++i)
+        if (aStride && bStride)
         {
-            result[i] = At(m, i, col);
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = f(a[i], b[i]);
+            }
         }
-    }
-
-    Matrix CreateMatrix(size_t rows, size_t cols)
-    {
-        Matrix result;
-        result.rows = rows;
-        result.cols = cols;
-        if (rows * cols <= Matrix::stackBufferSize)
+        else if (aStride)
+        {
+            const T bv = *b;
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = f(a[i], bv);
+            }
+        }
+        else if (bStride)
         {
-            result.data = result.stackBuffer;
+            const T av = *a;
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = f(av, b[i]);
+            }
         }
         else
         {
-            result.data = (double*)Allocate(rows * cols * sizeof(double)).data;
+            const T v = f(*a, *b);
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = v;
+            }
         }
-        return result;
     }
 
-    Matrix Zeros(size_t rows, size_t cols)
+    // the functions of VectorMathKernels, a stride of 0 computes one value.
+    static void ApplyVectorMath(VectorMathFunction f, const double* a, size_t aStride, double* out, size_t n)
     {
-        Matrix result = CreateMatrix(rows, cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        if (aStride)
         {
-            result.data[i] = 0;
+            f(a, out, n);
+            return;
         }
-        return result;
-    }
-
-    Matrix Ones(size_t rows, size_t cols)
-    {
-        Matrix result = CreateMatrix(rows, cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        double v = 0;
+        f(a, &v, 1);
+        for (size_t i = 0; i < n; ++i)
         {
-            result.data[i] = 1;
+            out[i] = v;
         }
-        return result;
     }
 
-    Matrix Eye(size_t rows, size_t cols)
+    // single precision tiles are computed in double and rounded.
+    static void ApplyVectorMath(VectorMathFunction f, const float* a, size_t aStride, float* out, size_t n)
     {
-        Matrix result = CreateMatrix(rows, cols);
-        for (size_t i = 0; i < result.rows; ++i)
+        double buffer[EXPRESSION_TILE];
+        for (size_t first = 0; first < n; first += EXPRESSION_TILE)
         {
-            for (size_t j = 0; j < result.cols; ++j)
+            const size_t count = Min(EXPRESSION_TILE, n - first);
+            const size_t loaded = aStride ? count : 1;
+            for (size_t i = 0; i < loaded; ++i)
             {
-                At(result, i, j) = (i == j) ? 1 : 0;
+                buffer[i] = a[(first + i) * aStride];
+            }
+            ApplyVectorMath(f, buffer, aStride, buffer, count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                out[first + i] = (float)buffer[i];
             }
         }
-        return result;
     }
 
-    void FreeMatrix(Matrix& m)
+    // T is float or double, the math functions have overloads for both.
+    template <typename T>
+    static void ApplyUnary(ExpressionOp op, const T* a, size_t aStride, T* out, size_t n)
     {
-        if (m.data && m.data != m.stackBuffer)
+        switch (op)
         {
-            MemoryBlock block;
-            block.data = (uint8_t*)m.data;
-            block.size = m.rows * m.cols * sizeof(double);
-            Deallocate(block);
-            m.data = NULL;
+        case ExpressionOp::NEGATE:  UnaryLoop(a, aStride, out, n, [](T v) { return -v; }); break;
+        case ExpressionOp::NOT:     UnaryLoop(a, aStride, out, n, [](T v) { return v == T(0) ? T(1) : T(0); }); break;
+        case ExpressionOp::ABS:     UnaryLoop(a, aStride, out, n, [](T v) { return fabs(v); }); break;
+        case ExpressionOp::SIN:     ApplyVectorMath(GetVectorMathKernels().sin, a, aStride, out, n); break;
+        case ExpressionOp::COS:     ApplyVectorMath(GetVectorMathKernels().cos, a, aStride, out, n); break;
+        case ExpressionOp::TAN:     ApplyVectorMath(GetVectorMathKernels().tan, a, aStride, out, n); break;
+        case ExpressionOp::ASIN:    ApplyVectorMath(GetVectorMathKernels().asin, a, aStride, out, n); break;
+        case ExpressionOp::ACOS:    ApplyVectorMath(GetVectorMathKernels().acos, a, aStride, out, n); break;
+        case ExpressionOp::ATAN:    ApplyVectorMath(GetVectorMathKernels().atan, a, aStride, out, n); break;
+        case ExpressionOp::EXP:     ApplyVectorMath(GetVectorMathKernels().exp, a, aStride, out, n); break;
+        case ExpressionOp::LOG:     ApplyVectorMath(GetVectorMathKernels().log, a, aStride, out, n); break;
+        case ExpressionOp::SQRT:    ApplyVectorMath(GetVectorMathKernels().sqrt, a, aStride, out, n); break;
+        // the rounding to the new type is done by the caller.
+        case ExpressionOp::CONVERT: UnaryLoop(a, aStride, out, n, [](T v) { return v; }); break;
+        default: GEDO_ASSERT_MSG("not a unary operator."); break;
         }
     }
 
-    bool CanMultiply(const Matrix& m0, const Matrix& m1)
+    template <typename T>
+    static void ApplyBinary(ExpressionOp op, const T* a, size_t aStride, const T* b, size_t bStride, T* out, size_t n)
     {
-        return ((m0.rows == m0.cols == 1) || (m1.rows == m1.cols == 1) ||
-                (m0.cols == m1.rows));
+        switch (op)
+        {
+        case ExpressionOp::ADD:           BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x + y; }); break;
+        case ExpressionOp::SUBTRACT:      BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x - y; }); break;
+        case ExpressionOp::MULTIPLY:      BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x * y; }); break;
+        case ExpressionOp::DIVIDE:        BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x / y; }); break;
+        case ExpressionOp::POW:           BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return pow(x, y); }); break;
+        case ExpressionOp::LESS:          BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x < y ? T(1) : T(0); }); break;
+        case ExpressionOp::GREATER:       BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x > y ? T(1) : T(0); }); break;
+        case ExpressionOp::LESS_EQUAL:    BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x <= y ? T(1) : T(0); }); break;
+        case ExpressionOp::GREATER_EQUAL: BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x >= y ? T(1) : T(0); }); break;
+        case ExpressionOp::EQUAL:         BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x == y ? T(1) : T(0); }); break;
+        case ExpressionOp::NOT_EQUAL:     BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return x != y ? T(1) : T(0); }); break;
+        case ExpressionOp::AND:           BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return (x != T(0) && y != T(0)) ? T(1) : T(0); }); break;
+        case ExpressionOp::OR:            BinaryLoop(a, aStride, b, bStride, out, n, [](T x, T y) { return (x != T(0) || y != T(0)) ? T(1) : T(0); }); break;
+        default: GEDO_ASSERT_MSG("not a binary operator."); break;
+        }
     }
 
-    bool CanAdd(const Matrix& m0, const Matrix& m1)
+    double ApplyUnary(ExpressionOp op, double v)
     {
-        return ((m0.rows == m0.cols == 1) || (m1.rows == m1.cols == 1) ||
-                (m0.rows == m1.rows && m0.cols == m1.cols));
+        double result = 0;
+        ApplyUnary(op, &v, 1, &result, 1);
+        return result;
     }
 
-    bool CanSubtract(const Matrix& m0, const Matrix& m1)
+    double ApplyBinary(ExpressionOp op, double a, double b)
     {
-        return CanAdd(m0, m1);
+        double result = 0;
+        ApplyBinary(op, &a, 1, &b, 1, &result, 1);
+        return result;
     }
 
-    Matrix Multiply(const Matrix& m0, double scalar)
+    // rounds a tile computed in double to type.
+    static void NarrowTile(MatrixDataType type, double* values, size_t n)
     {
-        Matrix result = CreateMatrix(m0.rows, m0.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        switch (type)
         {
-            result.data[i] = m0.data[i] * scalar;
+        case MatrixDataType::FLOAT64:
+            break;
+        case MatrixDataType::FLOAT32:
+            for (size_t i = 0; i < n; ++i)
+            {
+                values[i] = (float)values[i];
+            }
+            break;
+        case MatrixDataType::INT32:
+            for (size_t i = 0; i < n; ++i)
+            {
+                values[i] = NarrowElement<int32_t>(values[i]);
+            }
+            break;
+        case MatrixDataType::UINT8:
+            for (size_t i = 0; i < n; ++i)
+            {
+                values[i] = NarrowElement<uint8_t>(values[i]);
+            }
+            break;
         }
-        return result;
     }
 
-    Matrix Add(const Matrix& m0, double scalar)
+    // single precision tiles only hold FLOAT32 nodes, they don't need rounding.
+    static void NarrowTile(MatrixDataType, float*, size_t)
     {
-        Matrix result = CreateMatrix(m0.rows, m0.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
-        {
-            result.data[i] = m0.data[i] + scalar;
-        }
-        return result;
     }
 
-    Matrix Subtract(const Matrix& m0, double scalar)
+    static bool IsUnaryOp(ExpressionOp op)
     {
-        Matrix result = CreateMatrix(m0.rows, m0.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
-        {
-            result.data[i] = m0.data[i] - scalar;
-        }
-        return result;
+        return op >= ExpressionOp::NEGATE && op <= ExpressionOp::CONVERT;
     }
 
-    Matrix Multiply(const Matrix& m0, const Matrix& m1)
+    static bool IsBinaryOp(ExpressionOp op)
     {
-        assert(CanMultiply(m0, m1));
-        if (m0.rows == m0.cols == 1)
+        return op >= ExpressionOp::ADD;
+    }
+
+    // a node that isn't uniform and is smaller than the root it is used by.
+    static bool IsBroadcastNode(const ExpressionNode& node, const ExpressionNode& root)
+    {
+        return !IsUniformNode(node) && (node.rows != root.rows || node.cols != root.cols);
+    }
+
+    // out = the elements [first, first + n) of the (rows X cols) matrix that
+    // data (dataRows X dataCols) is broadcast to, one run per row.
+    template <typename T>
+    static void GatherBroadcast(const T* data, size_t dataRows, size_t dataCols,
+                                size_t cols, size_t first, size_t n, T* out)
+    {
+        size_t row = first / cols;
+        size_t col = first % cols;
+        for (size_t i = 0; i < n; ++row, col = 0)
         {
-            return Multiply(m1, m0.data[0]);
+            const size_t run = Min(cols - col, n - i);
+            const T* src = data + ((dataRows == 1) ? 0 : row) * dataCols;
+            if (dataCols == 1)
+            {
+                for (size_t j = 0; j < run; ++j)
+                {
+                    out[i + j] = src[0];
+                }
+            }
+            else
+            {
+                GEDO_MEMCPY(out + i, src + col, run * sizeof(T));
+            }
+            i += run;
         }
-        else if (m1.rows == m1.cols == 1)
+    }
+
+    // the tile loop of Evaluate() computed in T, order holds the nodes of root
+    // that aren't uniform. leaves of another type than T are converted to a
+    // tile buffer and so is the root when the result has another type.
+    // broadcast nodes are leaves here, broadcasts[i] holds their elements in T.
+    template <typename T>
+    static void EvaluateTiles(const ExpressionNode* nodes, size_t root,
+                              const Array<size_t, EXPRESSION_INLINE_NODES>& order,
+                              const Array<double, EXPRESSION_INLINE_NODES>& uniformValues,
+                              const Array<const void*, EXPRESSION_INLINE_NODES>& broadcasts, Matrix& result)
+    {
+        const size_t nodeCount = root + 1;
+        const MatrixDataType tileType = MatrixElement<T>::type;
+        Array<T, EXPRESSION_INLINE_NODES> uniforms;
+        uniforms.resize(nodeCount);
+        for (size_t i = 0; i < nodeCount; ++i)
         {
-            return Multiply(m0, m1.data[0]);
+            uniforms[i] = (T)uniformValues[i];
         }
-        else
+        const bool direct = result.type == tileType;
+        Array<size_t, EXPRESSION_INLINE_NODES> slots;
+        slots.resize(nodeCount);
+        size_t slotCount = 0;
+        for (size_t i : order)
         {
-            Matrix result = CreateMatrix(m0.rows, m1.cols);
-            MemoryBlock rowBlock = Allocate(m0.cols * sizeof(double));
-            MemoryBlock colBlock = Allocate(m0.cols * sizeof(double));
-            defer(Deallocate(colBlock));
-            defer(Deallocate(rowBlock));
+            const bool buffered = broadcasts[i] ? true
+                                : nodes[i].op == ExpressionOp::MATRIX ? nodes[i].type != tileType
+                                                                      : (i != root || !direct);
+            if (buffered)
+            {
+                slots[i] = slotCount++;
+            }
+        }
 
-            double* col = (double*)colBlock.data;
-            double* row = (double*)rowBlock.data;
-            for (size_t i = 0; i < result.rows; ++i)
+        const size_t count = result.rows * result.cols;
+        const size_t tiles = (count + EXPRESSION_TILE - 1) / EXPRESSION_TILE;
+        const size_t minTiles = Max<size_t>(PARALLEL_MIN_BATCH / (EXPRESSION_TILE * order.size()), 1);
+        T* resultData = (T*)result.data;
+        uint8_t* resultBytes = (uint8_t*)result.data;
+        const size_t resultElementSize = GetElementSize(result.type);
+        ParallelFor(tiles, minTiles, [&](size_t begin, size_t end) {
+            T* buffers = (T*)GEDO_MALLOC(Max<size_t>(slotCount, 1) * EXPRESSION_TILE * sizeof(T));
+            const T** values = (const T**)GEDO_MALLOC(nodeCount * sizeof(const T*));
+            GEDO_ASSERT(buffers && values);
+            for (size_t t = begin; t < end; ++t)
             {
-                for (size_t j = 0; j < result.cols; ++j)
+                const size_t first = t * EXPRESSION_TILE;
+                const size_t n = Min(EXPRESSION_TILE, count - first);
+                for (size_t i : order)
+                {
+                    const ExpressionNode& node = nodes[i];
+                    T* out = (i == root && direct) ? resultData + first : buffers + slots[i] * EXPRESSION_TILE;
+                    if (broadcasts[i])
+                    {
+                        GatherBroadcast((const T*)broadcasts[i], node.rows, node.cols, result.cols, first, n, out);
+                        values[i] = out;
+                        continue;
+                    }
+                    if (node.op == ExpressionOp::MATRIX)
+                    {
+                        if (node.type == tileType)
+                        {
+                            values[i] = (const T*)node.data + first;
+                            continue;
+                        }
+                        const uint8_t* data = (const uint8_t*)node.data + first * GetElementSize(node.type);
+                        ConvertElementsFrom(node.type, data, 1, out, n);
+                        values[i] = out;
+                        continue;
+                    }
+                    const bool leftUniform = IsUniformNode(nodes[node.left]);
+                    const T* a = leftUniform ? &uniforms[node.left] : values[node.left];
+                    if (IsUnaryOp(node.op))
+                    {
+                        ApplyUnary(node.op, a, leftUniform ? 0 : 1, out, n);
+                    }
+                    else
+                    {
+                        const bool rightUniform = IsUniformNode(nodes[node.right]);
+                        const T* b = rightUniform ? &uniforms[node.right] : values[node.right];
+                        ApplyBinary(node.op, a, leftUniform ? 0 : 1, b, rightUniform ? 0 : 1, out, n);
+                    }
+                    NarrowTile(node.type, out, n);
+                    values[i] = out;
+                }
+                if (!direct)
                 {
-                    GetRow(m0, i, row);
-                    GetCol(m1, j, col);
-                    At(result, i, j) = DotProduct(row, col, m0.cols);
+                    ConvertElementsTo(values[root], 1, result.type, resultBytes + first * resultElementSize, n);
                 }
             }
-            return result;
-        }
+            GEDO_FREE(values);
+            GEDO_FREE(buffers);
+        });
     }
 
-    Matrix Add(const Matrix& m0, const Matrix& m1)
+    Matrix Evaluate(const MatrixExpression& e, size_t root, Allocator& allocator)
     {
-        assert(CanAdd(m0, m1));
-        if (m0.rows == m0.cols == 1)
-        {
-            return Add(m1, m0.data[0]);
-        }
-        else if (m1.rows == m1.cols == 1)
-        {
-            return Add(m0, m1.data[0]);
-        }
-        else
+        GEDO_PROFILE_ZONE("Evaluate");
+        GEDO_ASSERT(root < e.nodes.size());
+        const ExpressionNode* nodes = e.nodes.data();
+        const ExpressionNode& rootNode = nodes[root];
+        const size_t nodeCount = root + 1;
+
+        // find the nodes root depends on, the operands of broadcast nodes are
+        // left to their own evaluation. root is pushed, root + 1 could wrap.
+        Array<uint8_t, EXPRESSION_INLINE_NODES> reachable;
+        reachable.resize(root);
+        reachable.push_back(1);
+        for (size_t i = nodeCount; i-- > 0;)
         {
-            Matrix result = CreateMatrix(m0.rows, m0.cols);
-            for (size_t i = 0; i < result.rows * result.cols; ++i)
+            if (reachable[i] && !IsBroadcastNode(nodes[i], rootNode))
             {
-                result.data[i] = m0.data[i] + m1.data[i];
+                if (IsUnaryOp(nodes[i].op) || IsBinaryOp(nodes[i].op))
+                {
+                    reachable[nodes[i].left] = 1;
+                }
+                if (IsBinaryOp(nodes[i].op))
+                {
+                    reachable[nodes[i].right] = 1;
+                }
             }
-            return result;
         }
-    }
 
-    Matrix Subtract(const Matrix& m0, const Matrix& m1)
-    {
-        assert(CanSubtract(m0, m1));
-        if (m0.rows == m0.cols == 1)
+        // fold the uniform nodes in double rounded to their type, the others
+        // are computed by tiles. they use single precision when everything
+        // that is computed is FLOAT32.
+        Array<double, EXPRESSION_INLINE_NODES> uniformValues;
+        uniformValues.resize(nodeCount);
+        Array<size_t, EXPRESSION_INLINE_NODES> order;
+        bool single = true;
+        for (size_t i = 0; i < nodeCount; ++i)
         {
-            return Subtract(m1, m0.data[0]);
+            if (!reachable[i])
+            {
+                continue;
+            }
+            const ExpressionNode& node = nodes[i];
+            if (IsUniformNode(node))
+            {
+                double v = 0;
+                switch (node.op)
+                {
+                case ExpressionOp::SCALAR: v = node.scalar; break;
+                case ExpressionOp::MATRIX: ConvertElementsFrom(node.type, node.data, 1, &v, 1); break;
+                default:
+                    v = IsUnaryOp(node.op)
+                        ? ApplyUnary(node.op, uniformValues[node.left])
+                        : ApplyBinary(node.op, uniformValues[node.left], uniformValues[node.right]);
+                    NarrowTile(node.type, &v, 1);
+                    break;
+                }
+                uniformValues[i] = v;
+            }
+            else
+            {
+                single = single && (node.op == ExpressionOp::MATRIX || node.type == MatrixDataType::FLOAT32);
+                order.push_back(i);
+            }
         }
-        else if (m1.rows == m1.cols == 1)
+
+        Matrix result = CreateMatrix(rootNode.rows, rootNode.cols, rootNode.type, allocator);
+        if (IsUniformNode(rootNode))
         {
-            return Subtract(m0, m1.data[0]);
+            ConvertElementsTo(&uniformValues[root], 1, result.type, result.data, 1);
+            return result;
         }
-        else
+        const size_t count = rootNode.rows * rootNode.cols;
+        if (rootNode.op == ExpressionOp::MATRIX)
         {
-            Matrix result = CreateMatrix(m0.rows, m0.cols);
-            for (size_t i = 0; i < result.rows * result.cols; ++i)
-            {
-                result.data[i] = m0.data[i] - m1.data[i];
-            }
+            GEDO_MEMCPY(result.data, rootNode.data, count * GetElementSize(rootNode.type));
             return result;
         }
-    }
 
-    Matrix Abs(const Matrix& m)
-    {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        // broadcast nodes are small, they are evaluated once and converted to
+        // the tile type so the tile loop only copies them. they live on the
+        // heap because broadcasts keeps their addresses.
+        const MatrixDataType tileType = single ? MatrixDataType::FLOAT32 : MatrixDataType::FLOAT64;
+        Array<const void*, EXPRESSION_INLINE_NODES> broadcasts;
+        broadcasts.resize(nodeCount);
+        Array<Matrix, 8> temporaries;
+        for (size_t i : order)
         {
-            result.data[i] = fabs(m.data[i]);
+            const ExpressionNode& node = nodes[i];
+            if (!IsBroadcastNode(node, rootNode))
+            {
+                continue;
+            }
+            if (node.op == ExpressionOp::MATRIX && node.type == tileType)
+            {
+                broadcasts[i] = node.data;
+                continue;
+            }
+            Matrix m = CreateHeapMatrix(node.rows, node.cols, tileType);
+            if (node.op == ExpressionOp::MATRIX)
+            {
+                const size_t n = node.rows * node.cols;
+                if (single)
+                {
+                    ConvertElementsFrom(node.type, node.data, 1, (float*)m.data, n);
+                }
+                else
+                {
+                    ConvertElementsFrom(node.type, node.data, 1, m.data, n);
+                }
+            }
+            else
+            {
+                Matrix evaluated = Evaluate(e, i);
+                CopyElements(evaluated, m);
+                FreeMatrix(evaluated);
+            }
+            broadcasts[i] = m.data;
+            temporaries.push_back(m);
         }
-        return result;
-    }
-
-    Matrix Sin(const Matrix& m)
-    {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        if (single)
         {
-            result.data[i] = sin(m.data[i]);
+            EvaluateTiles<float>(nodes, root, order, uniformValues, broadcasts, result);
         }
-        return result;
-    }
-
-    Matrix Cos(const Matrix& m)
-    {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        else
         {
-            result.data[i] = cos(m.data[i]);
+            EvaluateTiles<double>(nodes, root, order, uniformValues, broadcasts, result);
         }
-        return result;
-    }
-
-    Matrix Tan(const Matrix& m)
-    {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        for (Matrix& m : temporaries)
         {
-            result.data[i] = tan(m.data[i]);
+            FreeMatrix(m);
         }
         return result;
     }
+    //----------------------------------------------------------//
 
-    Matrix ASin(const Matrix& m)
-    {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
-        {
-            result.data[i] = asin(m.data[i]);
-        }
-        return result;
-    }
+    //------------------------IO-------------------------------//
+    // the output is collected in one buffer and written when it is full, before
+    // reading input and at exit. a color is only changed between runs of text.
+    static const size_t CONSOLE_BUFFER_SIZE = 1 << 16;
 
-    Matrix ACos(const Matrix& m)
+    struct ConsoleOutput
     {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
-        {
-            result.data[i] = acos(m.data[i]);
-        }
-        return result;
-    }
+        Mutex mutex;
+        char data[CONSOLE_BUFFER_SIZE];
+        size_t used = 0;
+        ConsoleColor color = ConsoleColor::WHITE;
+        bool colorSet = false;  // color is in effect for data.
+    };
 
-    Matrix ATan(const Matrix& m)
+    static void FlushConsoleOutput(ConsoleOutput& output);
+
+    static ConsoleOutput& GetConsoleOutput()
     {
-        Matrix result = CreateMatrix(m.rows, m.cols);
-        for (size_t i = 0; i < result.rows * result.cols; ++i)
+        static ConsoleOutput* output = []()
         {
-            result.data[i] = atan(m.data[i]);
-        }
-        return result;
+            ConsoleOutput* result = new ConsoleOutput();
+            InitMutex(result->mutex);
+            atexit(FlushConsole);
+            return result;
+        }();
+        return *output;
     }
-    //----------------------------------------------------------//
 
-    //------------------------IO-------------------------------//
 #if defined (GEDO_OS_WINDOWS)
-    void PrintToConsole(const char* text, ConsoleColor color)
+    static void WriteConsoleText(ConsoleColor color, const char* text, size_t size)
     {
         HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
         GEDO_ASSERT(hStdout);
-        Utf16String string = UTF8ToUTF16(text, GetDefaultAllocator());
-        defer(FreeUtf16String(string));
+        const int wlen = MultiByteToWideChar(CP_UTF8, 0, text, int(size), NULL, 0);
+        MemoryBlock block = AllocateUninitialized(sizeof(wchar_t) * (wlen + 1));
+        defer(Deallocate(block));
+        wchar_t* wtext = (wchar_t*)block.data;
+        MultiByteToWideChar(CP_UTF8, 0, text, int(size), wtext, wlen);
 
         // Remember how things were when we started
         CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
@@ -1728,11 +9413,50 @@ namespace gedo
         SetConsoleTextAttribute(hStdout, attributes);
 
         DWORD written = 0;
-        WriteConsoleW(hStdout, string.text, string.size, &written, NULL);
+        WriteConsoleW(hStdout, wtext, wlen, &written, NULL);
+    }
+
+    static void FlushConsoleOutput(ConsoleOutput& output)
+    {
+        if (output.used)
+        {
+            WriteConsoleText(output.color, output.data, output.used);
+            output.used = 0;
+        }
+    }
+
+    // the attributes are set per WriteConsoleW so a new color ends the run.
+    static void AppendConsoleOutput(ConsoleOutput& output, const char* text, size_t size, ConsoleColor color)
+    {
+        if (output.color != color)
+        {
+            FlushConsoleOutput(output);
+            output.color = color;
+        }
+        if (output.used + size > CONSOLE_BUFFER_SIZE)
+        {
+            FlushConsoleOutput(output);
+        }
+        if (size > CONSOLE_BUFFER_SIZE)
+        {
+            WriteConsoleText(color, text, size);
+            return;
+        }
+        memcpy(output.data + output.used, text, size);
+        output.used += size;
+    }
+
+    void FlushConsole()
+    {
+        ConsoleOutput& output = GetConsoleOutput();
+        LockMutex(output.mutex);
+        FlushConsoleOutput(output);
+        UnlockMutex(output.mutex);
     }
 
     void ReadFromConsole(char* buffer, size_t bufferSize)
     {
+        FlushConsole();
         HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
         GEDO_ASSERT(hStdin);
         DWORD read = 0;
@@ -1743,8 +9467,36 @@ namespace gedo
         }
     }
 
+    bool ReadLineFromConsole(String& line)
+    {
+        FlushConsole();
+        HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+        GEDO_ASSERT(hStdin);
+        line.clear();
+        char buffer[512];
+        for (;;)
+        {
+            DWORD read = 0;
+            if (!ReadConsoleA(hStdin, buffer, sizeof(buffer), &read, NULL) || !read)
+            {
+                return line.size() != 0;
+            }
+            Append(line, buffer, read);
+            if (buffer[read - 1] == '\n')
+            {
+                line.pop_back();
+                if (line.size() && line[line.size() - 1] == '\r')
+                {
+                    line.pop_back();
+                }
+                return true;
+            }
+        }
+    }
+
     void ClearConsole()
     {
+        FlushConsole();
         HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
         GEDO_ASSERT(hStdout);
 
@@ -1761,45 +9513,136 @@ namespace gedo
         WriteConsoleW(hStdout, sequence, ARRAYSIZE(sequence), &written, NULL);
     }
 #elif defined (GEDO_OS_LINUX)
-    void PrintToConsole(const char* text, ConsoleColor color)
+    static const char CONSOLE_COLOR_RESET[] = "\033[0m";
+
+    static const char* GetColorEscape(ConsoleColor color)
     {
-#define GEDO_CONSOLE_COLOR_RESET  "\033[0m"
-#define GEDO_CONSOLE_COLOR_RED    "\033[31m"
-#define GEDO_CONSOLE_COLOR_GREEN  "\033[32m"
-#define GEDO_CONSOLE_COLOR_BLUE   "\033[34m"
-#define GEDO_CONSOLE_COLOR_WHITE  "\033[37m"
         switch (color)
         {
-        case ConsoleColor::WHITE: printf(GEDO_CONSOLE_COLOR_WHITE); break;
-        case ConsoleColor::RED:   printf(GEDO_CONSOLE_COLOR_RED);   break;
-        case ConsoleColor::BLUE:  printf(GEDO_CONSOLE_COLOR_BLUE);  break;
-        case ConsoleColor::GREEN: printf(GEDO_CONSOLE_COLOR_GREEN); break;
+        case ConsoleColor::RED:   return "\033[31m";
+        case ConsoleColor::GREEN: return "\033[32m";
+        case ConsoleColor::BLUE:  return "\033[34m";
+        default:                  return "\033[37m";
+        }
+    }
+
+    static void WriteConsoleText(const char* text, size_t size)
+    {
+        while (size)
+        {
+            const ssize_t written = write(STDOUT_FILENO, text, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return;
+            }
+            text += written;
+            size -= size_t(written);
+        }
+    }
+
+    static void FlushConsoleOutput(ConsoleOutput& output)
+    {
+        if (output.used)
+        {
+            WriteConsoleText(output.data, output.used);
+            output.used = 0;
+        }
+    }
+
+    static void AppendConsoleOutput(ConsoleOutput& output, const char* text, size_t size)
+    {
+        if (output.used + size > CONSOLE_BUFFER_SIZE)
+        {
+            FlushConsoleOutput(output);
+        }
+        if (size > CONSOLE_BUFFER_SIZE)
+        {
+            WriteConsoleText(text, size);
+            return;
         }
-        printf(text);
-        printf(GEDO_CONSOLE_COLOR_RESET);
+        memcpy(output.data + output.used, text, size);
+        output.used += size;
+    }
+
+    static void AppendConsoleOutput(ConsoleOutput& output, const char* text, size_t size, ConsoleColor color)
+    {
+        if (!output.colorSet || output.color != color)
+        {
+            const char* escape = GetColorEscape(color);
+            AppendConsoleOutput(output, escape, strlen(escape));
+            output.color = color;
+            output.colorSet = true;
+        }
+        AppendConsoleOutput(output, text, size);
+    }
 
-#undef GEDO_CONSOLE_COLOR_RESET
-#undef GEDO_CONSOLE_COLOR_RED
-#undef GEDO_CONSOLE_COLOR_GREEN
-#undef GEDO_CONSOLE_COLOR_BLUE
-#undef GEDO_CONSOLE_COLOR_WHITE
+    void FlushConsole()
+    {
+        ConsoleOutput& output = GetConsoleOutput();
+        LockMutex(output.mutex);
+        if (output.colorSet)
+        {
+            AppendConsoleOutput(output, CONSOLE_COLOR_RESET, sizeof(CONSOLE_COLOR_RESET) - 1);
+            output.colorSet = false;
+        }
+        FlushConsoleOutput(output);
+        UnlockMutex(output.mutex);
     }
 
     void ReadFromConsole(char* buffer, size_t bufferSize)
     {
+        FlushConsole();
         fgets(buffer, bufferSize, stdin);
     }
 
+    bool ReadLineFromConsole(String& line)
+    {
+        FlushConsole();
+        line.clear();
+        char buffer[512];
+        while (fgets(buffer, sizeof(buffer), stdin))
+        {
+            const size_t size = strlen(buffer);
+            Append(line, buffer, size);
+            if (size && buffer[size - 1] == '\n')
+            {
+                line.pop_back();
+                if (line.size() && line[line.size() - 1] == '\r')
+                {
+                    line.pop_back();
+                }
+                return true;
+            }
+        }
+        return line.size() != 0;
+    }
+
     void ClearConsole()
     {
-        printf("\e[1;1H\e[2J");
+        PrintToConsole("\e[1;1H\e[2J");
+        FlushConsole();
     }
 #endif
+    void PrintToConsole(const char* text, size_t size, ConsoleColor color)
+    {
+        ConsoleOutput& output = GetConsoleOutput();
+        LockMutex(output.mutex);
+        AppendConsoleOutput(output, text, size, color);
+        UnlockMutex(output.mutex);
+    }
+
+    void PrintToConsole(const char* text, ConsoleColor color)
+    {
+        PrintToConsole(text, strlen(text), color);
+    }
+
     void PrintToConsole(char c, ConsoleColor color)
     {
-        char text[2] = {};
-        text[0] = c;
-        PrintToConsole(text, color);
+        PrintToConsole(&c, 1, color);
     }
     //----------------------------------------------------------//
 
@@ -1831,25 +9674,307 @@ namespace gedo
         const static double frequency = GetPerformanceFrequency();
         return (in.end - in.start) / frequency;
     }
+
+    int64_t GetTimeNanoseconds()
+    {
+        const static double frequency = GetPerformanceFrequency();
+        LARGE_INTEGER t;
+        QueryPerformanceCounter(&t);
+        return int64_t(t.QuadPart * (1e9 / frequency));
+    }
 #elif defined (GEDO_OS_LINUX)
+    // CLOCK_MONOTONIC is served from the vdso so it doesn't enter the kernel.
+    int64_t GetTimeNanoseconds()
+    {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+    }
+
     void StartStopWatch(StopWatch& in)
     {
-        time_t t;
-        time(&t);
-        in.start = t;
+        in.start = GetTimeNanoseconds();
     }
 
     void StopStopWatch(StopWatch& in)
     {
-        time_t t;
-        time(&t);
-        in.end = t;
+        in.end = GetTimeNanoseconds();
     }
 
     double ElapsedSeconds(const StopWatch& in)
     {
-        return difftime(in.end, in.start);
+        return (in.end - in.start) * 1e-9;
     }
 #endif
+
+    // node 0 is the root of the tree, every thread that opens a zone gets its
+    // own profile the first time.
+    constexpr size_t PROFILER_MAX_ZONES = 1024;
+    constexpr size_t PROFILER_MAX_DEPTH = 256;
+    constexpr size_t PROFILER_MAX_EVENTS = 1 << 20;
+
+    struct ProfileNode
+    {
+        const char* name;
+        int32_t parent;
+        int32_t firstChild;
+        int32_t nextSibling;
+        int64_t count;
+        int64_t inclusiveNs;
+        int64_t childrenNs;
+        size_t bytes;
+    };
+
+    struct ProfileOpenZone
+    {
+        int32_t node;
+        int64_t start;
+        size_t bytes;   // threadAllocatedBytes when it was opened.
+    };
+
+    struct ProfileEvent
+    {
+        int32_t node;
+        int64_t start;
+        int64_t duration;
+    };
+
+    struct ThreadProfile
+    {
+        ProfileNode nodes[PROFILER_MAX_ZONES];
+        size_t nodeCount;
+        ProfileOpenZone stack[PROFILER_MAX_DEPTH];
+        size_t depth;
+        ProfileEvent* events;
+        size_t eventCount;
+        size_t eventCapacity;
+        size_t droppedEvents;
+        int64_t startTime;      // events are relative to it.
+    };
+
+    static volatile bool profilerEnabled = false;
+    // the profile isn't freed when the thread exits, it is kept for reports.
+    static thread_local ThreadProfile* threadProfile = NULL;
+
+    static void ClearThreadProfile(ThreadProfile& profile)
+    {
+        profile.nodes[0] = ProfileNode{"root", -1, -1, -1, 0, 0, 0, 0};
+        profile.nodeCount = 1;
+        profile.depth = 0;
+        profile.eventCount = 0;
+        profile.droppedEvents = 0;
+        profile.startTime = GetTimeNanoseconds();
+    }
+
+    static ThreadProfile& GetThreadProfile()
+    {
+        if (!threadProfile)
+        {
+            // GEDO_MALLOC keeps the profiler out of the bytes it measures.
+            threadProfile = (ThreadProfile*)GEDO_MALLOC(sizeof(ThreadProfile));
+            GEDO_ASSERT(threadProfile);
+            threadProfile->events = NULL;
+            threadProfile->eventCapacity = 0;
+            ClearThreadProfile(*threadProfile);
+        }
+        return *threadProfile;
+    }
+
+    static bool SameZoneName(const char* a, const char* b)
+    {
+        // the same literal can have different addresses in different units.
+        return a == b || strcmp(a, b) == 0;
+    }
+
+    void EnableProfiler(bool enable)
+    {
+        profilerEnabled = enable;
+    }
+
+    bool IsProfilerEnabled()
+    {
+        return profilerEnabled;
+    }
+
+    void ResetProfiler()
+    {
+        ThreadProfile& profile = GetThreadProfile();
+        GEDO_ASSERT(profile.depth == 0);
+        ClearThreadProfile(profile);
+    }
+
+    int32_t BeginProfileZone(const char* name)
+    {
+        if (!profilerEnabled)
+        {
+            return -1;
+        }
+        ThreadProfile& profile = GetThreadProfile();
+        if (profile.depth == PROFILER_MAX_DEPTH)
+        {
+            return -1;
+        }
+        const int32_t parent = profile.depth ? profile.stack[profile.depth - 1].node : 0;
+        int32_t node = profile.nodes[parent].firstChild;
+        while (node != -1 && !SameZoneName(profile.nodes[node].name, name))
+        {
+            node = profile.nodes[node].nextSibling;
+        }
+        if (node == -1)
+        {
+            if (profile.nodeCount == PROFILER_MAX_ZONES)
+            {
+                return -1;
+            }
+            node = int32_t(profile.nodeCount++);
+            profile.nodes[node] = ProfileNode{name, parent, -1, profile.nodes[parent].firstChild, 0, 0, 0, 0};
+            profile.nodes[parent].firstChild = node;
+        }
+        profile.stack[profile.depth++] = ProfileOpenZone{node, GetTimeNanoseconds(), threadAllocatedBytes};
+        return node;
+    }
+
+    void EndProfileZone(int32_t zone)
+    {
+        if (zone < 0)
+        {
+            return;
+        }
+        const int64_t end = GetTimeNanoseconds();
+        ThreadProfile& profile = GetThreadProfile();
+        GEDO_ASSERT(profile.depth && profile.stack[profile.depth - 1].node == zone);
+        const ProfileOpenZone open = profile.stack[--profile.depth];
+        const int64_t elapsed = end - open.start;
+        ProfileNode& node = profile.nodes[zone];
+        node.count++;
+        node.inclusiveNs += elapsed;
+        node.bytes += threadAllocatedBytes - open.bytes;
+        if (node.parent > 0)
+        {
+            profile.nodes[node.parent].childrenNs += elapsed;
+        }
+
+        if (profile.eventCount == profile.eventCapacity)
+        {
+            const size_t capacity = Min(Max(profile.eventCapacity * 2, (size_t)4096), PROFILER_MAX_EVENTS);
+            ProfileEvent* events = capacity > profile.eventCapacity ?
+                (ProfileEvent*)GEDO_REALLOC(profile.events, capacity * sizeof(ProfileEvent)) : NULL;
+            if (!events)
+            {
+                profile.droppedEvents++;
+                return;
+            }
+            profile.events = events;
+            profile.eventCapacity = capacity;
+        }
+        profile.events[profile.eventCount++] = ProfileEvent{zone, open.start - profile.startTime, elapsed};
+    }
+
+    static void PrintProfileLine(const ProfileNode& node, int indent, int64_t count, int64_t inclusiveNs,
+                                 int64_t exclusiveNs, size_t bytes)
+    {
+        char text[300] = {};
+        snprintf(text, sizeof(text), "%*s%-*s %10lld %12.3f %12.3f %14zu\n", indent, "", 32 - indent, node.name,
+                 (long long)count, inclusiveNs * 1e-6, exclusiveNs * 1e-6, bytes);
+        PrintToConsole(text);
+    }
+
+    static void PrintProfileTree(const ThreadProfile& profile, int32_t node, int indent)
+    {
+        for (int32_t child = profile.nodes[node].firstChild; child != -1; child = profile.nodes[child].nextSibling)
+        {
+            const ProfileNode& n = profile.nodes[child];
+            PrintProfileLine(n, Min(indent, 30), n.count, n.inclusiveNs, n.inclusiveNs - n.childrenNs, n.bytes);
+            PrintProfileTree(profile, child, indent + 2);
+        }
+    }
+
+    void PrintProfileReport(bool tree)
+    {
+        const ThreadProfile& profile = GetThreadProfile();
+        char text[300] = {};
+        snprintf(text, sizeof(text), "%-32s %10s %12s %12s %14s\n", "zone", "calls", "incl ms", "excl ms", "bytes");
+        PrintToConsole(text);
+        if (profile.droppedEvents)
+        {
+            snprintf(text, sizeof(text), "(%zu calls are missing from the trace)\n", profile.droppedEvents);
+            PrintToConsole(text);
+        }
+        if (tree)
+        {
+            PrintProfileTree(profile, 0, 0);
+            return;
+        }
+
+        // merge the nodes with the same name, inclusive time only counts the
+        // outermost call of a recursive zone.
+        struct FlatZone
+        {
+            int32_t node;
+            int64_t count;
+            int64_t inclusiveNs;
+            int64_t exclusiveNs;
+            size_t bytes;
+        };
+        Array<FlatZone> zones;
+        for (size_t i = 1; i < profile.nodeCount; ++i)
+        {
+            const ProfileNode& n = profile.nodes[i];
+            bool nested = false;
+            for (int32_t p = n.parent; p > 0 && !nested; p = profile.nodes[p].parent)
+            {
+                nested = SameZoneName(profile.nodes[p].name, n.name);
+            }
+            FlatZone* zone = NULL;
+            for (FlatZone& z : zones)
+            {
+                if (SameZoneName(profile.nodes[z.node].name, n.name))
+                {
+                    zone = &z;
+                    break;
+                }
+            }
+            if (!zone)
+            {
+                zones.push_back(FlatZone{int32_t(i), 0, 0, 0, 0});
+                zone = &zones[zones.size() - 1];
+            }
+            zone->count += n.count;
+            zone->inclusiveNs += nested ? 0 : n.inclusiveNs;
+            zone->exclusiveNs += n.inclusiveNs - n.childrenNs;
+            zone->bytes += nested ? 0 : n.bytes;
+        }
+        QuickSort(zones.data(), zones.size(),
+                  [](const FlatZone& a, const FlatZone& b) { return a.exclusiveNs > b.exclusiveNs; });
+        for (const FlatZone& z : zones)
+        {
+            PrintProfileLine(profile.nodes[z.node], 0, z.count, z.inclusiveNs, z.exclusiveNs, z.bytes);
+        }
+    }
+
+    bool WriteProfileTrace(const char* fileName)
+    {
+        const ThreadProfile& profile = GetThreadProfile();
+        FileWriter writer;
+        if (!OpenFileWriter(writer, fileName))
+        {
+            return false;
+        }
+        char text[400] = {};
+        int length = snprintf(text, sizeof(text), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        WriteToFile(writer, text, length);
+        for (size_t i = 0; i < profile.eventCount; ++i)
+        {
+            // the zone names are identifiers or literals, they aren't escaped.
+            const ProfileEvent& e = profile.events[i];
+            length = snprintf(text, sizeof(text),
+                              "%s\n{\"name\":\"%.200s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+                              i ? "," : "", profile.nodes[e.node].name, e.start * 1e-3, e.duration * 1e-3);
+            WriteToFile(writer, text, length);
+        }
+        length = snprintf(text, sizeof(text), "\n]}\n");
+        WriteToFile(writer, text, length);
+        return CloseFileWriter(writer);
+    }
     //----------------------------------------------------------//
 }
@@ -13,16 +13,21 @@
  * - General algorithms:
  *      - Min,Max,Clamp
  *      - ArrayCount: get the count of a constant sized c array.
- *      - QuickSort.
- *      - BinarySearch.
+ *      - QuickSort, ParallelSort (merge sort on the thread pool).
+ *      - BinarySearch, LowerBound and the Eytzinger layout search.
  * - Memory utils:
  *      provide Allocator interface that proved Allocate and Free functions,
  *      it also provides some ready implementations allocators:
  *      - Malloc allocator: the default c stdlib allocator.
  *      - Arena allocator:  simple linear allocator that allocates block upfront
  * and keep using it, this is very useful if the user wants in temp allocations
- * where the user knows upfront what is the size that they will be using. it
- * also provides a default allocator where the user can set it and it will be
+ * where the user knows upfront what is the size that they will be using.
+ *      - Scratch allocator: an arena for short lived blocks that falls back to
+ * another allocator when it is full and is reset when all its blocks are freed.
+ * AllocateUninitialized() skips the zero fill for blocks that are fully
+ * overwritten (e.g. CreateMatrix).
+ *      - Pool allocator: size class free lists with per thread caches for
+ * many small allocations, large blocks go to malloc. it also provides a default allocator where the user can set it and it will be
  * used in all the functions in this library by default. e.g. Allocator* alloc =
  * CreateMyCustomAllocator(...); SetDefaultAllocator(alloc); MemoryBlock block =
  * ReadFile(fileName); // this memory block will be allocated from alloc. it
@@ -35,21 +40,46 @@
  *      - ArrayView<T>      a non owning view of array of type T.
  *      - StaticArray<T,N>  owning stretchy array of type T allocated on the
  * stack with max size N.
- *      - Array<T,N>        owning stretchy array of type T allocated using
+ *      - Array<T,N>        owning stretchy array of type T, the first N
+ * elements are stored inline and the rest allocated using Allocator*.
+ *      - HashTable<TKey,TValue> open addressing hash table allocated using
  * Allocator*.
- *      - HashTable<T>      TODO.
  * - Maths:
  *      - Math code uses double not float.
  *      - 2D/3D Vector.
  *      - 3x3 Matrix and 4x4 Matrix.
+ *      - Points3d SoA batches transformed by a Mat4 with SIMD, see
+ * TransformPoints().
  *      - operator overloading for +,*,- between different types.
  *      - Matrix/vector and Matrix/Matrix multiplication support.
  *      - Common geometrical operation like DotProduct and CrossProduct,
  * Normalise, Transpose, Rotate.
  *      - commonly used functions in computer graphics like Perspective and
  * lookAt.
- *
- *      TODO: Add SIMD support.
+ *      - Dynamic sized Matrix (row major) with element wise operations and a
+ * cache blocked matrix multiplication (Gemm) that packs the operands into
+ * panels and picks an AVX2/AVX-512 FMA micro kernel at runtime, the naive dot
+ * product loop is kept as MultiplyReference.
+ *      - LU with partial pivoting, Cholesky and householder QR blocked around
+ * Gemm, Solve (MATLAB's \), Inverse and Determinant on top of them.
+ *      - Strided slices as views (SliceView), gather/scatter with index
+ * vectors and masks (GatherElements, ScatterLinear, FillMask, ...).
+ *      - SparseMatrix in CSR/CSC built from triplets or a dense Matrix, the
+ * products and Add/Subtract have overloads for sparse operands.
+ *      - MatrixExpression: a lazy graph of element wise operations, Evaluate()
+ * runs the whole graph in one fused pass over tiles of the output instead of
+ * creating a temporary Matrix per operation.
+ *      - Matrix elements are double, float, int32 or uint8 (MatrixDataType),
+ * ConvertMatrix() casts between them and the expressions and the products
+ * promote mixed operands.
+ * - CPU:
+ *      GetCpuFeatures() reports the SIMD instruction sets available at runtime.
+ * - Threading:
+ *      Threads, Mutex, Semaphore, 64 bit atomics, a lock free single producer
+ * single consumer queue (SpscQueue) and a work stealing thread pool,
+ * ParallelFor(count, minBatch, f) splits [0, count) between the pool threads
+ * and runs serially when count <= minBatch. The Matrix element wise
+ * operations, reductions and Gemm run on the pool.
  * - UUID:
  *      Provides a cross platform UUID generation function and compare.
  * - File I/O:
@@ -58,7 +88,12 @@
  *      - Write whole file          WriteFile(const char* fileName, MemoryBlock block, Allocator& allocator);
  *      - Check if a file exists    DoesFileExist(const char* fileName,Allocator& allocator);
  *      - Get the file size         GetFileSize(const char* fileName, Allocator& allocator);
+ *      - Map a file read only      MapFile(const char* fileName, Allocator& allocator);
+ *        and release it            UnmapFile(MemoryBlock& block);
  *      - Check a path type         GetPathType(const char* path, Allocator& allocator);
+ *      - Buffered writes           OpenFileWriter, WriteToFile, CloseFileWriter.
+ *      - Named matrices in a mappable binary file, see "Matrix files".
+ *      - Delimited text (csv) into a Matrix, see "Text matrices".
  * - Strings:
  *      Provides custom implementation of both String (owning container) and
  * StringView (non owning view). it uses the Allocator* interface for managing
@@ -82,10 +117,17 @@
  *          FillRectangle(ColorBitmap& dest, Rect fillArea, const ColorBitmap& src);
  *          FillRectangle(ColorBitmap& dest, Rect fillArea, const Bitmap& mask, Color c);
  *          FillRectangle(ColorBitmap& dest, Rect fillArea, Color color);
+ *          BlendRectangle(ColorBitmap& dest, Rect blendArea, const ColorBitmap& src);
+ * - Images:
+ *      Read and write PGM/PPM images into a ColorBitmap or a planar Matrix,
+ * ReadImages decodes a batch of images on the thread pool.
  * - Timer:
  *      Provide a way of measuring time between 2 points and then getting this
  * time. it also defines a MACRO  GEDO_TIME_BLOCK(BlockName) that can be used to
  * measure the current block.
+ *      - Profiler: GEDO_PROFILE_ZONE(name) records nested zones (calls,
+ * inclusive/exclusive time, bytes allocated) that can be printed as a flat or
+ * tree report or written as a chrome trace.
  */
 #pragma once
 
@@ -99,6 +141,12 @@
 #error "Not supported OS"
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GEDO_ARCH_X86 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GEDO_ARCH_ARM64 1
+#endif
+
 #if !defined GEDO_ASSERT
 #include <assert.h>
 #define GEDO_ASSERT assert
@@ -112,10 +160,15 @@
 
 #define GEDO_MALLOC malloc
 #define GEDO_FREE free
+#define GEDO_REALLOC realloc
 #define GEDO_MEMSET memset
 #define GEDO_MEMCPY memcpy
+#define GEDO_MEMCMP memcmp
 #endif // GEDO_MALLOC
 
+#include <new> // placement new.
+#include <type_traits> // std::is_trivially_copyable.
+
 #if defined(GEDO_DYNAMIC_LIBRARY) && defined(GEDO_OS_WINDOWS)
 // dynamic library
 #if defined(GEDO_IMPLEMENTATION)
@@ -173,8 +226,10 @@ namespace gedo
         t1 = t;
     }
 
+    // leaves the array split in sorted runs of at most 12 elements, QuickSort
+    // finishes it with an insertion sort.
     template <typename T, typename TPredicate>
-    void QuickSort(T* p, size_t size, TPredicate compare)
+    void QuickSortPartitions(T* p, size_t size, TPredicate compare)
     {
         /* threshold for transitioning to insertion sort */
         while (size > 12)
@@ -222,51 +277,72 @@ namespace gedo
             /* recurse on smaller side, iterate on larger */
             if (j < (size - i))
             {
-                QuickSort(p, j);
+                QuickSortPartitions(p, j, compare);
                 p = p + i;
                 size = size - i;
             }
             else
             {
-                QuickSort(p + i, size - i);
+                QuickSortPartitions(p + i, size - i, compare);
                 size = j;
             }
         }
     }
 
+    template <typename T, typename TPredicate>
+    void QuickSort(T* p, size_t size, TPredicate compare)
+    {
+        QuickSortPartitions(p, size, compare);
+        for (size_t i = 1; i < size; ++i)
+        {
+            T t = static_cast<T&&>(p[i]);
+            size_t j = i;
+            for (; j && compare(t, p[j - 1]); --j)
+            {
+                p[j] = static_cast<T&&>(p[j - 1]);
+            }
+            p[j] = static_cast<T&&>(t);
+        }
+    }
+
     template <typename T>
     void QuickSort(T* p, size_t size)
     {
         QuickSort(p, size, [](const T& a, const T& b) { return a < b; });
     }
 
-    template <typename T, typename TCompare, typename TPredicate>
-    int64_t BinarySearch(T* p, size_t size, const T& key, TCompare compare, TPredicate predicate)
+    // index of the first element of the sorted p for which compare(p[i], key)
+    // is false, size when there is none. the loop only branches on the size
+    // so the compiler turns the comparison into a conditional move.
+    template <typename T, typename TCompare>
+    size_t LowerBound(const T* p, size_t size, const T& key, TCompare compare)
     {
-        size_t low = 0;
-        size_t high = size - 1;
-        while (low <= high)
+        if (!size)
         {
-            const size_t mid = low + (high - low) / 2;
-
-            // Check if key is present at mid 
-            if (predicate(p[mid], key))
-            {
-                return mid;
-            }
-
-            if (compare(p[mid], key))
-            {
-                low = mid + 1;
-            }
-            else
-            {
-                high = mid - 1;
-            }
+            return 0;
+        }
+        const T* base = p;
+        while (size > 1)
+        {
+            const size_t half = size / 2;
+            base = compare(base[half], key) ? base + half : base;
+            size -= half;
         }
+        return (base - p) + compare(*base, key);
+    }
 
-        // if we reach here, then element was not present 
-        return -1;
+    template <typename T>
+    size_t LowerBound(const T* p, size_t size, const T& key)
+    {
+        return LowerBound(p, size, key, [](const T& a, const T& b) { return a < b; });
+    }
+
+    // index of the first element equal to key or -1.
+    template <typename T, typename TCompare, typename TPredicate>
+    int64_t BinarySearch(T* p, size_t size, const T& key, TCompare compare, TPredicate predicate)
+    {
+        const size_t i = LowerBound((const T*)p, size, key, compare);
+        return (i < size && predicate(p[i], key)) ? (int64_t)i : -1;
     }
 
     template <typename T>
@@ -276,6 +352,57 @@ namespace gedo
                             [](const T& a, const T& b) { return a < b; },
                             [](const T& a, const T& b) { return a == b; });
     }
+
+    /*
+     * Eytzinger layout: the sorted values in the order of a breadth first walk
+     * of their binary search tree, the children of node k are 2k and 2k + 1.
+     * the first levels share a few cache lines and the next ones can be
+     * prefetched so it's faster than LowerBound when the same values are
+     * searched many times. tree must hold size + 1 elements, tree[0] is unused.
+     */
+    template <typename T>
+    size_t BuildEytzingerNode(const T* sorted, size_t i, T* tree, size_t k, size_t size)
+    {
+        if (k <= size)
+        {
+            i = BuildEytzingerNode(sorted, i, tree, 2 * k, size);
+            tree[k] = sorted[i++];
+            i = BuildEytzingerNode(sorted, i, tree, 2 * k + 1, size);
+        }
+        return i;
+    }
+
+    template <typename T>
+    void BuildEytzinger(const T* sorted, size_t size, T* tree)
+    {
+        BuildEytzingerNode(sorted, 0, tree, 1, size);
+    }
+
+    // node of the first element for which compare(tree[k], key) is false, 0
+    // when there is none.
+    template <typename T, typename TCompare>
+    size_t EytzingerLowerBound(const T* tree, size_t size, const T& key, TCompare compare)
+    {
+        size_t k = 1;
+        while (k <= size)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            // the 16 great grandchildren of k are next to each other.
+            __builtin_prefetch(tree + 16 * k);
+#endif
+            k = 2 * k + compare(tree[k], key);
+        }
+        // drop the right turns taken after the last left one.
+#if defined(__GNUC__) || defined(__clang__)
+        return k >> __builtin_ffsll((long long)~k);
+#else
+        while (k & 1)
+        {
+            k >>= 1;
+        }
+        return k >> 1;
+#endif
+    }
     //--------------------------------------------------//
 
     //------------------Math----------------------------//
@@ -312,13 +439,102 @@ namespace gedo
         double data[16];
     };
 
+    struct Allocator;
+    GEDO_DEF Allocator& GetDefaultAllocator();
+
+    // element types of Matrix, the values are also used by the matrix files.
+    enum class MatrixDataType : uint32_t
+    {
+        FLOAT64 = 0,
+        FLOAT32 = 1,
+        INT32 = 2,
+        UINT8 = 3
+    };
+
+    GEDO_DEF size_t GetElementSize(MatrixDataType type);
+    // "double", "single", "int32" and "uint8".
+    GEDO_DEF const char* GetTypeName(MatrixDataType type);
+    // the type of the result of an operation between a and b: integers win
+    // over floats and single over double (like matlab), int32 over uint8.
+    GEDO_DEF MatrixDataType PromoteTypes(MatrixDataType a, MatrixDataType b);
+
+    // the C++ type of the elements of each MatrixDataType.
+    template <typename T>
+    struct MatrixElement;
+    template <>
+    struct MatrixElement<double>
+    {
+        static const MatrixDataType type = MatrixDataType::FLOAT64;
+    };
+    template <>
+    struct MatrixElement<float>
+    {
+        static const MatrixDataType type = MatrixDataType::FLOAT32;
+    };
+    template <>
+    struct MatrixElement<int32_t>
+    {
+        static const MatrixDataType type = MatrixDataType::INT32;
+    };
+    template <>
+    struct MatrixElement<uint8_t>
+    {
+        static const MatrixDataType type = MatrixDataType::UINT8;
+    };
+
+    // header of the heap data of matrices, the elements follow it in the same
+    // block. it is freed when the last Matrix referencing it is freed.
+    struct MatrixStorage
+    {
+        volatile int64_t refCount;
+        Allocator* allocator;
+        size_t size;            // bytes of the block, the header included.
+        uint64_t padding;       // keeps the elements 16 byte aligned.
+    };
+
+    // small matrices live in stackBuffer, heap data is a MatrixStorage shared
+    // by all the matrices and views that reference it. copying a Matrix
+    // borrows the heap data (the reference count doesn't change) or copies
+    // the content of stackBuffer, use ShareMatrix() to get a new reference.
     struct Matrix
     {
         static const size_t stackBufferSize = 9;
         double stackBuffer[stackBufferSize] = {};
         size_t rows = 0;
         size_t cols = 0;
+        // element (i, j) is at data[i * rowStride + j * colStride].
+        size_t rowStride = 0;
+        size_t colStride = 1;
+        // the strides are in elements of type, data only points to doubles
+        // when type is FLOAT64, GetData<T>() gives the typed pointer.
         double* data = NULL;
+        MatrixStorage* storage = NULL;  // NULL for stackBuffer or external data.
+        MatrixDataType type = MatrixDataType::FLOAT64;
+
+        Matrix() = default;
+        Matrix(const Matrix& m)
+        {
+            *this = m;
+        }
+        Matrix& operator=(const Matrix& m)
+        {
+            rows = m.rows;
+            cols = m.cols;
+            rowStride = m.rowStride;
+            colStride = m.colStride;
+            storage = m.storage;
+            type = m.type;
+            if (m.data == m.stackBuffer)
+            {
+                GEDO_MEMCPY(stackBuffer, m.stackBuffer, sizeof(stackBuffer));
+                data = stackBuffer;
+            }
+            else
+            {
+                data = m.data;
+            }
+            return *this;
+        }
     };
 
     GEDO_DEF double Deg2Rad(double v);
@@ -374,22 +590,152 @@ namespace gedo
      */
     GEDO_DEF Mat4 LookAt(const Vec3d& eye, const Vec3d& center, const Vec3d& up);
 
+    // m * (p, 1) without the division by w.
+    GEDO_DEF Vec3d TransformPoint(const Mat4& m, const Vec3d& p);
+
+    // a batch of 3D points in SoA layout, point i is (x[i], y[i], z[i]). the
+    // arrays are not owned, ToPoints() views the rows of a 3 X n matrix.
+    struct Points3d
+    {
+        double* x = NULL;
+        double* y = NULL;
+        double* z = NULL;
+        size_t count = 0;
+    };
+
+    // m must be a FLOAT64 (3 X n) matrix with contiguous rows.
+    GEDO_DEF Points3d ToPoints(const Matrix& m);
+    // the batched versions of TransformPoint use SSE2/AVX2/NEON and the
+    // thread pool, result must have the count of points and can be points.
+    GEDO_DEF void TransformPoints(const Mat4& m, const Points3d& points, Points3d& result);
+    // m * (p, 1) divided by w, for projection matrices.
+    GEDO_DEF void ProjectPoints(const Mat4& m, const Points3d& points, Points3d& result);
+    // m * (v, 0), directions aren't translated.
+    GEDO_DEF void TransformVectors(const Mat4& m, const Points3d& vectors, Points3d& result);
+
+    // new matrices are row major, element (i, j) is at data[i * cols + j].
+    // views can have any strides, most kernels copy them to a contiguous
+    // matrix first. At(), GetRow(), GetCol() and the kernels that take a
+    // double scalar only work on FLOAT64 matrices, the others keep the type.
     GEDO_DEF double& At(Matrix& m, size_t i, size_t j);
     GEDO_DEF const double& At(const Matrix& m, size_t i, size_t j);
     GEDO_DEF void GetRow(const Matrix& m, size_t row, double* result);
     GEDO_DEF void GetCol(const Matrix& m, size_t col, double* result);
-    GEDO_DEF Matrix CreateMatrix(size_t rows, size_t cols);
+    template <typename T>
+    T* GetData(const Matrix& m)
+    {
+        GEDO_ASSERT(m.type == MatrixElement<T>::type);
+        return (T*)m.data;
+    }
+    // element (i, j) of a matrix of any type.
+    GEDO_DEF double GetElement(const Matrix& m, size_t i, size_t j);
+    // the data is not initialized, it is returned to allocator by FreeMatrix.
+    GEDO_DEF Matrix CreateMatrix(size_t rows, size_t cols, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix CreateMatrix(size_t rows, size_t cols, MatrixDataType type,
+                                 Allocator& allocator = GetDefaultAllocator());
+    // same as CreateMatrix but small matrices don't use stackBuffer, for data
+    // whose address must not change when the Matrix is copied.
+    GEDO_DEF Matrix CreateHeapMatrix(size_t rows, size_t cols, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix CreateHeapMatrix(size_t rows, size_t cols, MatrixDataType type,
+                                     Allocator& allocator = GetDefaultAllocator());
+    // dest has the size and the type of src, both can have any strides.
+    GEDO_DEF void CopyElements(const Matrix& src, Matrix& dest);
+    // a contiguous copy of m with elements of type. integers are rounded to
+    // nearest (half away from zero) and saturated, NaN becomes 0.
+    GEDO_DEF Matrix ConvertMatrix(const Matrix& m, MatrixDataType type, Allocator& allocator = GetDefaultAllocator());
+    // releases the reference of m, the data is freed with the last one.
     GEDO_DEF void FreeMatrix(Matrix& m);
-    GEDO_DEF Matrix Zeros(size_t rows, size_t cols);
-    GEDO_DEF Matrix Ones(size_t rows, size_t cols);
-    GEDO_DEF Matrix Eye(size_t rows, size_t cols);
+    // a new reference to the data of m in O(1), it must be freed as well.
+    GEDO_DEF Matrix ShareMatrix(const Matrix& m);
+    // a contiguous copy of m.
+    GEDO_DEF Matrix CopyMatrix(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    // copy on write: must be called before writing to m, it copies the data
+    // when other matrices reference it or m is a view.
+    GEDO_DEF void MakeMatrixUnique(Matrix& m);
+    // data[i] is element i in row major order.
+    GEDO_DEF bool IsContiguous(const Matrix& m);
+    // views reference the data of m without copying it and share its
+    // ownership (free them with FreeMatrix), small matrices in stackBuffer
+    // are copied.
+    GEDO_DEF Matrix RowsView(const Matrix& m, size_t first, size_t count);
+    GEDO_DEF Matrix ColsView(const Matrix& m, size_t first, size_t count);
+    GEDO_DEF Matrix TransposedView(const Matrix& m);
+    // every rowStep-th row and colStep-th col from (firstRow, firstCol), a view
+    // like RowsView. the steps are >= 1.
+    GEDO_DEF Matrix SliceView(const Matrix& m, size_t firstRow, size_t rowCount, size_t rowStep,
+                              size_t firstCol, size_t colCount, size_t colStep);
+    /*
+     * gather/scatter with 0 based index vectors, rows (cols) NULL selects the
+     * first rowCount (colCount). linear indices are column major like MATLAB,
+     * index k is element (k % m.rows, k / m.rows). the values of a scatter have
+     * the type of m, a 1 X 1 is written to every selected element. m must be
+     * unique (MakeMatrixUnique) and the values can't reference its data, when
+     * an element is selected twice the last value wins.
+     */
+    GEDO_DEF Matrix GatherElements(const Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols,
+                                   size_t colCount, Allocator& allocator = GetDefaultAllocator());
+    // values is (rowCount X colCount) or 1 X 1.
+    GEDO_DEF void ScatterElements(Matrix& m, const size_t* rows, size_t rowCount, const size_t* cols, size_t colCount,
+                                  const Matrix& values);
+    // the result is (rows X cols) with rows * cols == count, filled in column
+    // major order.
+    GEDO_DEF Matrix GatherLinear(const Matrix& m, const size_t* indices, size_t count, size_t rows, size_t cols,
+                                 Allocator& allocator = GetDefaultAllocator());
+    // element k of values in column major order goes to indices[k].
+    GEDO_DEF void ScatterLinear(Matrix& m, const size_t* indices, size_t count, const Matrix& values);
+    // a mask has the shape of m and selects its elements that are not 0 (NaN too).
+    GEDO_DEF size_t CountMask(const Matrix& mask);
+    // the selected elements in column major order, a (CountMask(mask) X 1).
+    GEDO_DEF Matrix GatherMask(const Matrix& m, const Matrix& mask, Allocator& allocator = GetDefaultAllocator());
+    // value is converted to the type of m like ConvertMatrix, FLOAT64 rows use
+    // SSE2/AVX2/NEON.
+    GEDO_DEF void FillMask(Matrix& m, const Matrix& mask, double value);
+    // all the matrices must have the same number of rows (cols) and the same
+    // type, empty matrices are skipped.
+    GEDO_DEF bool CanConcatHorizontal(const Matrix* matrices, size_t count);
+    GEDO_DEF bool CanConcatVertical(const Matrix* matrices, size_t count);
+    GEDO_DEF Matrix ConcatHorizontal(const Matrix* matrices, size_t count, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix ConcatVertical(const Matrix* matrices, size_t count, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Zeros(size_t rows, size_t cols, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Ones(size_t rows, size_t cols, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Eye(size_t rows, size_t cols, Allocator& allocator = GetDefaultAllocator());
+    /*
+     * two shapes broadcast when each dimension is the same or 1 in one of
+     * them, a dimension of 1 is repeated to the other one so a (1 X n) row
+     * or a (m X 1) column combine with a (m X n) matrix like in MATLAB/NumPy.
+     * the result is (BroadcastSize(rows0, rows1) X BroadcastSize(cols0, cols1)).
+     */
+    GEDO_DEF bool CanBroadcast(size_t rows0, size_t cols0, size_t rows1, size_t cols1);
+    GEDO_DEF size_t BroadcastSize(size_t size0, size_t size1);
     GEDO_DEF bool CanMultiply(const Matrix& m0, const Matrix& m1);
+    // m0 and m1 broadcast.
     GEDO_DEF bool CanAdd(const Matrix& m0, const Matrix& m1);
     GEDO_DEF bool CanSubtract(const Matrix& m0, const Matrix& m1);
-    GEDO_DEF Matrix Multiply(const Matrix& m0, double scalar);
+    GEDO_DEF Matrix Multiply(const Matrix& m0, double scalar, Allocator& allocator = GetDefaultAllocator());
     GEDO_DEF Matrix Add(const Matrix& m0, double scalar);
     GEDO_DEF Matrix Subtract(const Matrix& m0, double scalar);
-    GEDO_DEF Matrix Multiply(const Matrix& m0, const Matrix& m1);
+    // the result has the promoted type, FLOAT32 products are computed in
+    // single precision and integer ones in double then converted.
+    GEDO_DEF Matrix Multiply(const Matrix& m0, const Matrix& m1, Allocator& allocator = GetDefaultAllocator());
+    // naive row by column dot product, kept as a reference for the blocked kernel.
+    GEDO_DEF Matrix MultiplyReference(const Matrix& m0, const Matrix& m1);
+    /*
+     * C = alpha * A * B + beta * C, all matrices are row major.
+     * @param[in] m, n, k   A is (m X k), B is (k X n) and C is (m X n).
+     * @param[in] lda, ldb, ldc  distance in elements between two rows of A, B and C.
+     * when beta == 0 C is not read so it can be uninitialized.
+     */
+    GEDO_DEF void Gemm(size_t m, size_t n, size_t k,
+                       double alpha, const double* a, size_t lda,
+                       const double* b, size_t ldb,
+                       double beta, double* c, size_t ldc);
+    // single precision version, the micro kernel covers twice the columns.
+    GEDO_DEF void Gemm(size_t m, size_t n, size_t k,
+                       float alpha, const float* a, size_t lda,
+                       const float* b, size_t ldb,
+                       float beta, float* c, size_t ldc);
+    // element wise with broadcasting, the operands are read through their
+    // strides so a broadcast row or column is never expanded.
     GEDO_DEF Matrix Add(const Matrix& m0, const Matrix& m1);
     GEDO_DEF Matrix Subtract(const Matrix& m0, const Matrix& m1);
     GEDO_DEF Matrix Abs(const Matrix& m);
@@ -399,6 +745,199 @@ namespace gedo
     GEDO_DEF Matrix ASin(const Matrix& m);
     GEDO_DEF Matrix ACos(const Matrix& m);
     GEDO_DEF Matrix ATan(const Matrix& m);
+    GEDO_DEF Matrix Exp(const Matrix& m);
+    GEDO_DEF Matrix Log(const Matrix& m);
+    GEDO_DEF Matrix Sqrt(const Matrix& m);
+    // m0 ^ m1 element wise, the operands broadcast.
+    GEDO_DEF Matrix Pow(const Matrix& m0, const Matrix& m1);
+    /*
+     * result[i] = f(values[i]) for count elements, result may be values.
+     * with AVX2 and FMA 4 elements are computed at a time by polynomials, the
+     * error compared to the exact result measured on random and edge inputs:
+     *   Exp, Log              < 1 ULP (1 ULP when Exp is subnormal).
+     *   Sin, Cos              < 1 ULP for |x| < 1.6e6, larger x call libm.
+     *   Tan                   < 2.2 ULP for |x| < 1.6e6, larger x call libm.
+     *   ATan                  < 1 ULP
+     *   ASin, ACos            < 2 ULP
+     *   Sqrt                  correctly rounded.
+     * special values follow libm: NaN in NaN out, Log(0) = -inf, Log(x < 0)
+     * and ASin/ACos(|x| > 1) are NaN, Exp overflows to inf and underflows to
+     * 0. without AVX2 every element calls libm.
+     */
+    GEDO_DEF void Sin(const double* values, double* result, size_t count);
+    GEDO_DEF void Cos(const double* values, double* result, size_t count);
+    GEDO_DEF void Tan(const double* values, double* result, size_t count);
+    GEDO_DEF void ASin(const double* values, double* result, size_t count);
+    GEDO_DEF void ACos(const double* values, double* result, size_t count);
+    GEDO_DEF void ATan(const double* values, double* result, size_t count);
+    GEDO_DEF void Exp(const double* values, double* result, size_t count);
+    GEDO_DEF void Log(const double* values, double* result, size_t count);
+    GEDO_DEF void Sqrt(const double* values, double* result, size_t count);
+    // reductions over all the elements of any type, Min/MaxElement of an
+    // empty matrix are +inf/-inf.
+    GEDO_DEF double Sum(const Matrix& m);
+    GEDO_DEF double MinElement(const Matrix& m);
+    GEDO_DEF double MaxElement(const Matrix& m);
+    // sorting keeps the type, NaNs go after +inf. SortValues is a LSD radix
+    // sort on the thread pool, the other kernels use it or ParallelSort.
+    GEDO_DEF void SortValues(double* values, size_t count);
+    GEDO_DEF void SortValues(float* values, size_t count);
+    GEDO_DEF void SortValues(int32_t* values, size_t count);
+    GEDO_DEF void SortValues(uint8_t* values, size_t count);
+    // each column sorted ascending, a row or column vector as a whole.
+    GEDO_DEF Matrix Sort(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    // the rows in lexicographic order of their elements, equal rows keep
+    // their order.
+    GEDO_DEF Matrix SortRows(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    // the distinct elements sorted, a row for a row vector and a column
+    // otherwise.
+    GEDO_DEF Matrix Unique(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    // 1 based column major indices of the elements that are not 0 like
+    // MATLAB, element (i, j) is i + j * rows + 1. a row for a row vector and
+    // a column otherwise.
+    GEDO_DEF Matrix Find(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    // 1 where the element of values is in set and 0 elsewhere, set is laid
+    // out for an Eytzinger search once so it's fast for large values.
+    GEDO_DEF Matrix IsMember(const Matrix& values, const Matrix& set, Allocator& allocator = GetDefaultAllocator());
+    // a contiguous copy of the transpose of m with the type of m.
+    GEDO_DEF Matrix Transpose(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    /*
+     * blocked factorizations of a FLOAT64 row major matrix in place, a panel
+     * of columns is factored at a time and the rest of the matrix is updated
+     * with Gemm so they run on the thread pool.
+     * FactorLU: P * A = L * U for a (n X n) A with partial pivoting, the unit
+     * lower L is stored below the diagonal and U on and above it. row i was
+     * swapped with row pivots[i] >= i. returns false when a pivot is 0, the
+     * factorization is completed anyway.
+     * FactorCholesky: A = L * L' for a symmetric positive definite (n X n) A,
+     * only the lower triangle is read and L replaces it, the upper triangle
+     * is used as scratch. returns false when A is not positive definite.
+     * FactorQR: A = Q * R for a (m X n) A with householder reflections, R
+     * replaces the upper triangle and the vectors v of the reflections
+     * H(i) = I - tau[i] * v * v' (v[0] = 1 is not stored) are stored below
+     * the diagonal, Q = H(0) * H(1) ... tau has min(m, n) elements.
+     */
+    GEDO_DEF bool FactorLU(double* a, size_t n, size_t lda, size_t* pivots);
+    GEDO_DEF bool FactorCholesky(double* a, size_t n, size_t lda);
+    GEDO_DEF void FactorQR(double* a, size_t m, size_t n, size_t lda, double* tau);
+    // the linear algebra kernels compute in double, the result is FLOAT32
+    // when an operand is FLOAT32 and FLOAT64 otherwise. singular, when given,
+    // is set when a pivot or a diagonal element of R is 0, like MATLAB the
+    // result has inf or NaN then.
+    // a and b have the same number of rows.
+    GEDO_DEF bool CanSolve(const Matrix& a, const Matrix& b);
+    /*
+     * x = a \ b like MATLAB: for a square a it solves a * x = b with a
+     * triangular solve when a is triangular, Cholesky when it is symmetric
+     * with a positive diagonal and LU when that fails or otherwise. for more
+     * rows than columns x is the least squares solution and for less rows the
+     * minimum norm one, both from QR.
+     */
+    GEDO_DEF Matrix Solve(const Matrix& a, const Matrix& b, Allocator& allocator = GetDefaultAllocator(),
+                          bool* singular = NULL);
+    // the inverse of a square m, Solve(m, I).
+    GEDO_DEF Matrix Inverse(const Matrix& m, Allocator& allocator = GetDefaultAllocator(), bool* singular = NULL);
+    // the product of the pivots of the LU of a square m, 1 when m is empty.
+    GEDO_DEF double Determinant(const Matrix& m);
+    // the factors packed like FactorLU for a square m, the row permutation
+    // is not returned.
+    GEDO_DEF Matrix LU(const Matrix& m, Allocator& allocator = GetDefaultAllocator(), bool* singular = NULL);
+    // the upper triangular R with R' * R = m for a symmetric positive definite
+    // m like MATLAB chol, positiveDefinite is cleared when it is not.
+    GEDO_DEF Matrix Cholesky(const Matrix& m, Allocator& allocator = GetDefaultAllocator(),
+                             bool* positiveDefinite = NULL);
+    // the (rows X cols) upper triangular R of m = Q * R.
+    GEDO_DEF Matrix QR(const Matrix& m, Allocator& allocator = GetDefaultAllocator());
+    //--------------------------------------------------//
+
+    //-----------------Sparse matrices------------------//
+    /*
+     * compressed sparse rows (CSR) or columns (CSC) of doubles: for CSR the
+     * elements of row i are [offsets[i], offsets[i + 1]) of indices (their
+     * columns, ascending) and values, CSC is the same by columns. the three
+     * arrays are one MatrixStorage block shared like the data of a Matrix,
+     * copying a SparseMatrix borrows it, ShareSparseMatrix() takes a new
+     * reference and FreeSparseMatrix() releases one.
+     * the constructors drop zeros, the kernels keep the elements that cancel
+     * out. kernels convert an operand to the format they need, Transpose()
+     * only swaps the format so it's O(1).
+     */
+    enum class SparseFormat : uint8_t
+    {
+        CSR,
+        CSC
+    };
+
+    struct SparseMatrix
+    {
+        size_t rows = 0;
+        size_t cols = 0;
+        size_t nonZeros = 0;
+        SparseFormat format = SparseFormat::CSR;
+        size_t* offsets = NULL;         // rows + 1 (CSR) or cols + 1 (CSC) elements.
+        double* values = NULL;
+        uint32_t* indices = NULL;       // columns (CSR) or rows (CSC) of the values.
+        MatrixStorage* storage = NULL;  // NULL for external data.
+    };
+
+    // the dimensions must fit in 32 bits, offsets[0] is 0 and the rest is not
+    // initialized.
+    GEDO_DEF SparseMatrix CreateSparseMatrix(size_t rows, size_t cols, size_t nonZeros, SparseFormat format,
+                                             Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF void FreeSparseMatrix(SparseMatrix& m);
+    GEDO_DEF SparseMatrix ShareSparseMatrix(const SparseMatrix& m);
+    GEDO_DEF SparseMatrix CopySparseMatrix(const SparseMatrix& m, Allocator& allocator = GetDefaultAllocator());
+    // m in format, a new reference to m when it already has it.
+    GEDO_DEF SparseMatrix ConvertSparseMatrix(const SparseMatrix& m, SparseFormat format,
+                                              Allocator& allocator = GetDefaultAllocator());
+    // element (rowIndices[k], colIndices[k]) is values[k] for count 0 based
+    // triplets, like MATLAB's sparse() duplicates are summed.
+    GEDO_DEF SparseMatrix CreateSparseFromTriplets(size_t rows, size_t cols, const size_t* rowIndices,
+                                                   const size_t* colIndices, const double* values, size_t count,
+                                                   SparseFormat format = SparseFormat::CSR,
+                                                   Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF SparseMatrix SparseFromDense(const Matrix& m, SparseFormat format = SparseFormat::CSR,
+                                          Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix SparseToDense(const SparseMatrix& m, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF double GetElement(const SparseMatrix& m, size_t i, size_t j);
+    GEDO_DEF SparseMatrix Transpose(const SparseMatrix& m);
+    /*
+     * products with m0.cols == m1.rows, the rows of the result are split
+     * between the threads. sparse * dense is SpMV/SpMM over the rows of a CSR
+     * m0, dense * sparse scatters the rows of a CSR m1 into every row of the
+     * result and sparse * sparse is Gustavson's row by row product with a
+     * dense accumulator per thread, its result is CSR.
+     */
+    GEDO_DEF Matrix Multiply(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Multiply(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF SparseMatrix Multiply(const SparseMatrix& m0, const SparseMatrix& m1,
+                                   Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF SparseMatrix Multiply(const SparseMatrix& m, double scalar, Allocator& allocator = GetDefaultAllocator());
+    // element wise on operands of the same size, sparse with sparse stays
+    // sparse and with a dense matrix the result is dense.
+    GEDO_DEF SparseMatrix Add(const SparseMatrix& m0, const SparseMatrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF SparseMatrix Subtract(const SparseMatrix& m0, const SparseMatrix& m1,
+                                   Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Add(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Add(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Subtract(const SparseMatrix& m0, const Matrix& m1, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF Matrix Subtract(const Matrix& m0, const SparseMatrix& m1, Allocator& allocator = GetDefaultAllocator());
+    //--------------------------------------------------//
+
+    //-----------------CPU------------------------------//
+    struct CpuFeatures
+    {
+        bool sse2 = false;
+        bool sse41 = false;
+        bool avx = false;
+        bool avx2 = false;
+        bool fma = false;
+        bool avx512f = false;
+        bool neon = false;
+    };
+
+    // queried once and cached.
+    GEDO_DEF const CpuFeatures& GetCpuFeatures();
     //--------------------------------------------------//
 
     //-----------------UUID-----------------------------//
@@ -421,32 +960,99 @@ namespace gedo
     struct Allocator
     {
         virtual void ResetAllocator() = 0;
-        virtual MemoryBlock AllocateMemoryBlock(size_t bytes) = 0;
+        // the block is zero filled unless zeroFill is false.
+        virtual MemoryBlock AllocateMemoryBlock(size_t bytes, bool zeroFill) = 0;
         virtual bool FreeMemoryBlock(MemoryBlock& block) = 0;
+        // resizes block keeping its content, the data can move unless inPlace
+        // is set. returns false if it can't and block is left as it is, the
+        // new bytes are not initialized.
+        virtual bool ReallocateMemoryBlock(MemoryBlock& /*block*/, size_t /*bytes*/, bool /*inPlace*/)
+        {
+            return false;
+        }
     };
 
+    // blocks are aligned to LINEAR_ALLOCATOR_ALIGNMENT.
     struct LinearAllocator : Allocator
     {
         size_t offset = 0;
         MemoryBlock arena;
 
         void ResetAllocator() override;
-        MemoryBlock AllocateMemoryBlock(size_t bytes) override;
+        MemoryBlock AllocateMemoryBlock(size_t bytes, bool zeroFill) override;
         bool FreeMemoryBlock(MemoryBlock& block) override;
+        bool ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace) override;
     };
 
     struct MallocAllocator : Allocator
     {
         void ResetAllocator() override;
-        MemoryBlock AllocateMemoryBlock(size_t bytes) override;
+        MemoryBlock AllocateMemoryBlock(size_t bytes, bool zeroFill) override;
+        bool FreeMemoryBlock(MemoryBlock& block) override;
+        bool ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace) override;
+    };
+
+    // short lived blocks come from a LinearAllocator, the ones that don't fit
+    // in it go to fallback. ResetAllocator() releases the whole arena so it
+    // must only be called when liveBlocks is 0.
+    struct ScratchAllocator : Allocator
+    {
+        LinearAllocator* arena = NULL;
+        Allocator* fallback = NULL;
+        size_t liveBlocks = 0;      // arena blocks that are not freed yet.
+
+        void ResetAllocator() override;
+        MemoryBlock AllocateMemoryBlock(size_t bytes, bool zeroFill) override;
+        bool FreeMemoryBlock(MemoryBlock& block) override;
+        bool ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace) override;
+    };
+
+    GEDO_DEF const size_t LINEAR_ALLOCATOR_ALIGNMENT = 64;
+
+    struct PoolAllocatorStats
+    {
+        int64_t allocations = 0;        // blocks given out by the size classes.
+        int64_t cacheHits = 0;          // allocations that didn't take a lock.
+        int64_t frees = 0;
+        int64_t largeAllocations = 0;   // bigger than POOL_MAX_BLOCK_SIZE.
+        int64_t reservedBytes = 0;      // chunks taken from GEDO_MALLOC.
+    };
+
+    struct PoolSizeClass;
+
+    // blocks up to POOL_MAX_BLOCK_SIZE come from a free list per size class,
+    // bigger ones go straight to GEDO_MALLOC. each thread caches free blocks
+    // of the first pool it uses and only takes the class lock to move a batch
+    // between its cache and the shared list. blocks can be freed by any thread.
+    // ResetAllocator() is a no-op, the chunks are released by FreePoolAllocator().
+    struct PoolAllocator : Allocator
+    {
+        int64_t id = 0;                 // owner of the thread caches.
+        PoolSizeClass* classes = NULL;
+        PoolAllocatorStats stats;       // the thread caches add to it in batches.
+
+        void ResetAllocator() override;
+        MemoryBlock AllocateMemoryBlock(size_t bytes, bool zeroFill) override;
         bool FreeMemoryBlock(MemoryBlock& block) override;
+        bool ReallocateMemoryBlock(MemoryBlock& block, size_t bytes, bool inPlace) override;
     };
 
+    GEDO_DEF const size_t POOL_MAX_BLOCK_SIZE = 8192 - 16;
+
     GEDO_DEF Allocator& GetDefaultAllocator();
     GEDO_DEF void SetDefaultAllocator(Allocator& allocator);
 
     GEDO_DEF MemoryBlock Allocate(size_t bytes, Allocator& allocator = GetDefaultAllocator());
+    // for blocks that are fully written before being read.
+    GEDO_DEF MemoryBlock AllocateUninitialized(size_t bytes, Allocator& allocator = GetDefaultAllocator());
+    // block keeps its content and may move, false if allocator can't do it.
+    GEDO_DEF bool Reallocate(MemoryBlock& block, size_t bytes, Allocator& allocator = GetDefaultAllocator());
     GEDO_DEF bool Deallocate(MemoryBlock& block, Allocator& allocator = GetDefaultAllocator());
+    // bytes requested by the calling thread through the functions above since
+    // it started, the difference of two calls is what was allocated between.
+    GEDO_DEF size_t GetAllocatedBytes();
+    // calls to Allocate, AllocateUninitialized and Reallocate by the calling thread.
+    GEDO_DEF size_t GetAllocationCount();
 
     // memory util functions.
     GEDO_DEF bool IsPointerInsideMemoryBlock(const uint8_t* ptr, MemoryBlock block);
@@ -463,6 +1069,241 @@ namespace gedo
 
     GEDO_DEF MallocAllocator* CreateMallocAllocator();
     GEDO_DEF void FreeMallocAllocator(MallocAllocator* allocator);
+
+    GEDO_DEF ScratchAllocator* CreateScratchAllocator(size_t bytes, Allocator& fallback = GetDefaultAllocator());
+    GEDO_DEF void FreeScratchAllocator(ScratchAllocator* allocator);
+
+    // e.g. SetDefaultAllocator(*CreatePoolAllocator()); before anything is
+    // allocated from the default allocator.
+    GEDO_DEF PoolAllocator* CreatePoolAllocator();
+    // all the blocks must be freed, the caches of other threads are dropped
+    // but not reused.
+    GEDO_DEF void FreePoolAllocator(PoolAllocator* allocator);
+    // the counters of the calling thread are up to date, other threads add
+    // theirs whenever they take a class lock.
+    GEDO_DEF PoolAllocatorStats GetPoolAllocatorStats(PoolAllocator& allocator);
+    // gives the blocks cached by the calling thread back to its pool, a thread
+    // calls it before it exits while the pool is still alive. the workers of
+    // the thread pool do.
+    GEDO_DEF void FlushPoolThreadCache();
+    //------------------------------------------------------------//
+
+    //-----------------------------Threading----------------------//
+    typedef void (*ThreadFunction)(void* userData);
+
+    struct Thread
+    {
+        uint64_t handle = 0;
+    };
+
+    // storage for the native objects, they must be initialized before use.
+    struct Mutex
+    {
+        uint64_t storage[8] = {};
+    };
+
+    struct Semaphore
+    {
+        uint64_t storage[4] = {};
+    };
+
+    // the handle is 0 when the system could not create the thread.
+    GEDO_DEF Thread StartThread(ThreadFunction function, void* userData);
+    GEDO_DEF void JoinThread(Thread& thread);
+    GEDO_DEF void YieldThread();
+    GEDO_DEF size_t GetHardwareThreadCount();
+
+    GEDO_DEF void InitMutex(Mutex& mutex);
+    GEDO_DEF void DestroyMutex(Mutex& mutex);
+    GEDO_DEF void LockMutex(Mutex& mutex);
+    GEDO_DEF void UnlockMutex(Mutex& mutex);
+
+    GEDO_DEF void InitSemaphore(Semaphore& semaphore, uint32_t initialCount);
+    GEDO_DEF void DestroySemaphore(Semaphore& semaphore);
+    GEDO_DEF void SignalSemaphore(Semaphore& semaphore, uint32_t count = 1);
+    GEDO_DEF void WaitSemaphore(Semaphore& semaphore);
+
+    // sequentially consistent, AtomicAdd returns the new value.
+    GEDO_DEF int64_t AtomicAdd(volatile int64_t* value, int64_t addend);
+    GEDO_DEF int64_t AtomicLoad(const volatile int64_t* value);
+    GEDO_DEF void AtomicStore(volatile int64_t* value, int64_t newValue);
+    GEDO_DEF bool AtomicCompareExchange(volatile int64_t* value, int64_t expected, int64_t desired);
+
+    // lock free ring between one producer and one consumer thread, it holds
+    // N - 1 items. the items are copied in and out, the slot of a popped item
+    // keeps its bytes until it is reused.
+    template<typename T, size_t N>
+    struct SpscQueue
+    {
+        T items[N];
+        volatile int64_t head = 0;      // next item to pop, written by the consumer.
+        uint8_t padding[56] = {};       // head and tail on their own cache lines.
+        volatile int64_t tail = 0;      // next free slot, written by the producer.
+    };
+
+    // producer only, false when the queue is full.
+    template<typename T, size_t N>
+    bool PushQueue(SpscQueue<T, N>& queue, const T& item)
+    {
+        const int64_t tail = queue.tail;
+        const int64_t next = (tail + 1) % (int64_t)N;
+        if (next == AtomicLoad(&queue.head))
+        {
+            return false;
+        }
+        queue.items[tail] = item;
+        AtomicStore(&queue.tail, next);
+        return true;
+    }
+
+    // consumer only, false when the queue is empty.
+    template<typename T, size_t N>
+    bool PopQueue(SpscQueue<T, N>& queue, T& item)
+    {
+        const int64_t head = queue.head;
+        if (head == AtomicLoad(&queue.tail))
+        {
+            return false;
+        }
+        item = queue.items[head];
+        AtomicStore(&queue.head, (head + 1) % (int64_t)N);
+        return true;
+    }
+
+    // called with a sub range [begin, end) of the work.
+    typedef void (*TaskFunction)(void* userData, size_t begin, size_t end);
+
+    // element count below which the Matrix kernels don't use the thread pool.
+    GEDO_DEF const size_t PARALLEL_MIN_BATCH = 16 * 1024;
+
+    // 0 means one thread per hardware thread, 1 runs everything on the calling
+    // thread. it waits for the ParallelFor calls of other threads to finish and
+    // must not be called from inside one.
+    GEDO_DEF void SetThreadCount(size_t count);
+    GEDO_DEF size_t GetThreadCount();
+
+    // runs task over [0, count) on the thread pool and returns when all of it
+    // is done, the range is split in halves down to batches of at least
+    // minBatch elements and idle threads steal the biggest pending halves.
+    // the calling thread takes part in the work so it's safe to nest.
+    GEDO_DEF void ParallelFor(size_t count, size_t minBatch, void* userData, TaskFunction task);
+
+    // f(size_t begin, size_t end).
+    template <typename F>
+    void ParallelFor(size_t count, size_t minBatch, const F& f)
+    {
+        ParallelFor(count, minBatch, (void*)&f, [](void* userData, size_t begin, size_t end) {
+            (*(const F*)userData)(begin, end);
+        });
+    }
+
+    // elements below which ParallelSort is a QuickSort on the calling thread.
+    GEDO_DEF const size_t PARALLEL_SORT_MIN_SIZE = 64 * 1024;
+
+    // number of elements of a (size) and b that come first in their merge,
+    // the merge takes a[i] before b[j] when they compare equal.
+    template <typename T, typename TPredicate>
+    size_t MergePathSplit(const T* a, size_t sizeA, const T* b, size_t sizeB, size_t diagonal,
+                          TPredicate compare)
+    {
+        size_t low = diagonal > sizeB ? diagonal - sizeB : 0;
+        size_t high = Min(diagonal, sizeA);
+        while (low < high)
+        {
+            const size_t mid = low + (high - low) / 2;
+            if (compare(b[diagonal - mid - 1], a[mid]))
+            {
+                high = mid;
+            }
+            else
+            {
+                low = mid + 1;
+            }
+        }
+        return low;
+    }
+
+    // elements [first, last) of the merge of a and b written to out + first.
+    template <typename T, typename TPredicate>
+    void MergeRange(const T* a, size_t sizeA, const T* b, size_t sizeB, size_t first, size_t last,
+                    T* out, TPredicate compare)
+    {
+        size_t i = MergePathSplit(a, sizeA, b, sizeB, first, compare);
+        size_t j = first - i;
+        const size_t endA = MergePathSplit(a, sizeA, b, sizeB, last, compare);
+        const size_t endB = last - endA;
+        T* dest = out + first;
+        while (i < endA && j < endB)
+        {
+            *dest++ = compare(b[j], a[i]) ? b[j++] : a[i++];
+        }
+        while (i < endA)
+        {
+            *dest++ = a[i++];
+        }
+        while (j < endB)
+        {
+            *dest++ = b[j++];
+        }
+    }
+
+    /*
+     * sorts p with a QuickSort per thread and merges the runs in pairs, every
+     * merge is split along its merge path so all the threads take part until
+     * the last one. it is stable only if compare never finds two elements
+     * equal (e.g. ties broken by the index). T is copied with memcpy.
+     */
+    template <typename T, typename TPredicate>
+    void ParallelSort(T* p, size_t size, TPredicate compare)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "ParallelSort moves the elements with memcpy.");
+        const size_t threads = GetThreadCount();
+        if (threads < 2 || size < PARALLEL_SORT_MIN_SIZE)
+        {
+            QuickSort(p, size, compare);
+            return;
+        }
+        size_t runCount = 1;
+        while (runCount < threads)
+        {
+            runCount *= 2;
+        }
+        const size_t runSize = (size + runCount - 1) / runCount;
+        ParallelFor(runCount, 1, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r)
+            {
+                const size_t first = Min(r * runSize, size);
+                QuickSort(p + first, Min(first + runSize, size) - first, compare);
+            }
+        });
+
+        MemoryBlock block = AllocateUninitialized(size * sizeof(T));
+        T* src = p;
+        T* dest = (T*)block.data;
+        for (size_t width = runSize; width < size; width *= 2)
+        {
+            const size_t pairs = (size + 2 * width - 1) / (2 * width);
+            const size_t parts = Max<size_t>(runCount / pairs, 1);
+            ParallelFor(pairs * parts, 1, [&](size_t begin, size_t end) {
+                for (size_t t = begin; t < end; ++t)
+                {
+                    const size_t first = (t / parts) * 2 * width;
+                    const size_t mid = Min(first + width, size);
+                    const size_t last = Min(first + 2 * width, size);
+                    const size_t count = last - first;
+                    const size_t part = t % parts;
+                    MergeRange(src + first, mid - first, src + mid, last - mid, count * part / parts,
+                               count * (part + 1) / parts, dest + first, compare);
+                }
+            });
+            Swap(src, dest);
+        }
+        if (src != p)
+        {
+            GEDO_MEMCPY(p, src, size * sizeof(T));
+        }
+        Deallocate(block);
+    }
     //------------------------------------------------------------//
 
     //--------------------------------File IO---------------------//
@@ -479,6 +1320,28 @@ namespace gedo
     GEDO_DEF bool DoesFileExist(const char* fileName, Allocator& allocator = GetDefaultAllocator());
     GEDO_DEF int64_t GetFileSize(const char* fileName, Allocator& allocator = GetDefaultAllocator());
     GEDO_DEF PathType GetPathType(const char* path, Allocator& allocator = GetDefaultAllocator());
+    // maps the file read only without copying it, pages are read when they
+    // are first touched. the block isn't null terminated and has size 0 when
+    // the file can't be mapped or is empty, it must be released by UnmapFile.
+    GEDO_DEF MemoryBlock MapFile(const char* fileName, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF void UnmapFile(MemoryBlock& block);
+
+    // buffered sequential writes, the file is created or truncated. writes
+    // larger than the buffer go straight to the file.
+    struct FileWriter
+    {
+        uint64_t handle = 0;
+        Allocator* allocator = NULL;
+        MemoryBlock buffer;
+        size_t used = 0;
+        bool failed = false;
+    };
+
+    GEDO_DEF bool OpenFileWriter(FileWriter& writer, const char* fileName, size_t bufferSize = 1 << 20,
+                                 Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF void WriteToFile(FileWriter& writer, const void* data, size_t size);
+    // flushes and closes the file, returns false if any write failed.
+    GEDO_DEF bool CloseFileWriter(FileWriter& writer);
     //------------------------------------------------------------//
 
     //------------------------------Containers--------------------//
@@ -574,66 +1437,93 @@ namespace gedo
         }
     };
 
+    // inline storage of Array<T, N>, it takes no space when N is 0.
+    template<typename T, size_t N>
+    struct ArrayInlineStorage
+    {
+        alignas(T) uint8_t bytes[N * sizeof(T)];
+
+        T* inlineData()
+        {
+            return (T*)bytes;
+        }
+        const T* inlineData() const
+        {
+            return (const T*)bytes;
+        }
+    };
+
     template<typename T>
-    struct Array
+    struct ArrayInlineStorage<T, 0>
+    {
+        T* inlineData()
+        {
+            return NULL;
+        }
+        const T* inlineData() const
+        {
+            return NULL;
+        }
+    };
+
+    // the first N elements live inside the Array, more than that are moved to
+    // a block from allocator. trivially copyable elements grow with
+    // Allocator::ReallocateMemoryBlock, the others are only grown in place or
+    // moved one by one since they can point to themselves (e.g.
+    // Matrix::stackBuffer).
+    template<typename T, size_t N = 0>
+    struct Array : ArrayInlineStorage<T, N>
     {
         Allocator* allocator = &GetDefaultAllocator();
-        MemoryBlock block;
+        MemoryBlock block;      // empty while the elements are inline.
         size_t count = 0;
 
         Array() = default;
         ~Array()
         {
-            if (block.data)
-            {
-                Deallocate(block, *allocator);
-            }
+            release();
         }
         Array(const Array& s)
         {
             allocator = s.allocator;
-            block = Allocate(s.block.size, *allocator);
-            GEDO_MEMCPY(block.data, s.block.data, block.size);
-            count = s.count;
+            copyFrom(s);
         }
+        // keeps the allocator of this array.
         Array& operator=(const Array& s)
         {
-            allocator = s.allocator;
-            block = Allocate(s.block.size, *allocator);
-            GEDO_MEMCPY(block.data, s.block.data, block.size);
-            count = s.count;
+            if (this != &s)
+            {
+                clear();
+                copyFrom(s);
+            }
             return *this;
         }
         Array(Array&& s) noexcept
         {
             allocator = s.allocator;
-            block = s.block;
-            count = s.count;
-            s.allocator = NULL;
-            s.block = MemoryBlock{};
-            s.count = 0;
+            moveFrom(s);
         }
         Array& operator=(Array&& s) noexcept
         {
-            allocator = s.allocator;
-            block = s.block;
-            count = s.count;
-            s.allocator = NULL;
-            s.block = MemoryBlock{};
-            s.count = 0;
+            if (this != &s)
+            {
+                release();
+                allocator = s.allocator;
+                moveFrom(s);
+            }
             return *this;
         }
         T* data()
         {
-            return (T*)block.data;
+            return block.data ? (T*)block.data : this->inlineData();
         }
         const T* data() const
         {
-            return (const T*)block.data;
+            return block.data ? (const T*)block.data : this->inlineData();
         }
         size_t capacity() const
         {
-            return block.size / sizeof(T);
+            return block.data ? block.size / sizeof(T) : N;
         }
         size_t size() const
         {
@@ -665,29 +1555,64 @@ namespace gedo
             GEDO_ASSERT(i < size());
             return data()[i];
         }
+        // keeps the capacity.
         void clear()
         {
+            destroy(data(), count);
             count = 0;
         }
         void push_back(const T& d)
         {
-            if (size() >= capacity())
+            if (count < capacity())
             {
-                const size_t s = size();
-                resize(s ? 2 * s : 8);
-                count = s;
+                new (data() + count) T(d);
+                count++;
+            }
+            else
+            {
+                // d can be an element of this array.
+                T copy(d);
+                grow(count + 1);
+                new (data() + count) T(static_cast<T&&>(copy));
+                count++;
+            }
+        }
+        void push_back(T&& d)
+        {
+            if (count < capacity())
+            {
+                new (data() + count) T(static_cast<T&&>(d));
+                count++;
+            }
+            else
+            {
+                T moved(static_cast<T&&>(d));
+                grow(count + 1);
+                new (data() + count) T(static_cast<T&&>(moved));
+                count++;
             }
-            data()[count++] = d;
         }
         void pop_back()
         {
+            GEDO_ASSERT(count);
             count--;
+            destroy(data() + count, 1);
         }
+        // new elements are value initialized (0 for numbers).
         void resize(size_t s)
         {
-            if (capacity() < s)
+            if (s < count)
+            {
+                destroy(data() + s, count - s);
+            }
+            else if (s > count)
             {
                 reserve(s);
+                T* d = data();
+                for (size_t i = count; i < s; ++i)
+                {
+                    new (d + i) T();
+                }
             }
             count = s;
         }
@@ -695,20 +1620,379 @@ namespace gedo
         {
             if (capacity() < s)
             {
-                MemoryBlock newBlock = Allocate(s * sizeof(T), *allocator);
-                if (block.data)
+                relocate(s);
+            }
+        }
+
+    private:
+        static const bool trivial = std::is_trivially_copyable<T>::value;
+
+        static void destroy(T* p, size_t n)
+        {
+            if (!std::is_trivially_destructible<T>::value)
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    p[i].~T();
+                }
+            }
+        }
+        // moves n elements to uninitialized dst.
+        static void moveElements(T* dst, T* src, size_t n)
+        {
+            if (trivial)
+            {
+                if (n)
+                {
+                    GEDO_MEMCPY((void*)dst, (const void*)src, n * sizeof(T));
+                }
+                return;
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                new (dst + i) T(static_cast<T&&>(src[i]));
+                src[i].~T();
+            }
+        }
+        void grow(size_t minCapacity)
+        {
+            const size_t c = capacity();
+            relocate(Max(minCapacity, c ? 2 * c : (size_t)8));
+        }
+        // capacity becomes s, s > N.
+        void relocate(size_t s)
+        {
+            const size_t bytes = s * sizeof(T);
+            if (block.data && allocator->ReallocateMemoryBlock(block, bytes, !trivial))
+            {
+                return;
+            }
+            MemoryBlock newBlock = AllocateUninitialized(bytes, *allocator);
+            moveElements((T*)newBlock.data, data(), count);
+            if (block.data)
+            {
+                Deallocate(block, *allocator);
+            }
+            block = newBlock;
+        }
+        void release()
+        {
+            destroy(data(), count);
+            count = 0;
+            if (block.data)
+            {
+                Deallocate(block, *allocator);
+                block = MemoryBlock{};
+            }
+        }
+        // this array is empty.
+        void copyFrom(const Array& s)
+        {
+            reserve(s.count);
+            T* d = data();
+            if (trivial)
+            {
+                if (s.count)
+                {
+                    GEDO_MEMCPY((void*)d, (const void*)s.data(), s.count * sizeof(T));
+                }
+            }
+            else
+            {
+                for (size_t i = 0; i < s.count; ++i)
                 {
-                    GEDO_MEMCPY(newBlock.data, block.data, block.size);
-                    Deallocate(block, *allocator);
+                    new (d + i) T(s.data()[i]);
                 }
-                block = newBlock;
             }
+            count = s.count;
+        }
+        // this array is empty and has no block.
+        void moveFrom(Array& s)
+        {
+            if (s.block.data)
+            {
+                block = s.block;
+                s.block = MemoryBlock{};
+            }
+            else
+            {
+                moveElements(this->inlineData(), s.inlineData(), s.count);
+            }
+            count = s.count;
+            s.count = 0;
         }
     };
 
+    // hashes for the keys of HashTable, other key types provide their own
+    // Hash and KeysEqual overloads (strings are in the Strings section).
+    GEDO_DEF uint64_t Hash(uint64_t v);
+    GEDO_DEF uint64_t Hash(int64_t v);
+    GEDO_DEF uint64_t Hash(uint32_t v);
+    GEDO_DEF uint64_t Hash(int32_t v);
+
+    template<typename T0, typename T1>
+    bool KeysEqual(const T0& k0, const T1& k1)
+    {
+        return k0 == k1;
+    }
+
+    // open addressing with linear probing, the capacity is a power of 2 and
+    // the table grows at 3/4 load. removing an entry shifts the entries that
+    // follow it back so there are no tombstones. lookups accept any type K
+    // with Hash(K) and KeysEqual(TKey, K) (e.g. a StringView for String keys)
+    // so callers don't need to build a key to search.
+    // pointers returned by find and insert are invalid after an insert.
     template<typename TKey, typename TValue>
     struct HashTable
     {
+        struct Entry
+        {
+            TKey key;
+            TValue value;
+        };
+
+        Allocator* allocator = &GetDefaultAllocator();
+        MemoryBlock entriesBlock;
+        MemoryBlock hashesBlock;    // 0 for empty slots.
+        size_t count = 0;
+
+        HashTable() = default;
+        ~HashTable()
+        {
+            Destroy();
+        }
+        HashTable(const HashTable& t)
+        {
+            *this = t;
+        }
+        HashTable& operator=(const HashTable& t)
+        {
+            if (this != &t)
+            {
+                Destroy();
+                allocator = t.allocator;
+                reserve(t.size());
+                for (size_t i = 0; i < t.capacity(); ++i)
+                {
+                    if (t.hashes()[i])
+                    {
+                        insert(t.entries()[i].key, t.entries()[i].value);
+                    }
+                }
+            }
+            return *this;
+        }
+        HashTable(HashTable&& t) noexcept
+        {
+            *this = static_cast<HashTable&&>(t);
+        }
+        HashTable& operator=(HashTable&& t) noexcept
+        {
+            if (this != &t)
+            {
+                Destroy();
+                allocator = t.allocator;
+                entriesBlock = t.entriesBlock;
+                hashesBlock = t.hashesBlock;
+                count = t.count;
+                t.entriesBlock = MemoryBlock{};
+                t.hashesBlock = MemoryBlock{};
+                t.count = 0;
+            }
+            return *this;
+        }
+        size_t size() const
+        {
+            return count;
+        }
+        size_t capacity() const
+        {
+            return hashesBlock.size / sizeof(uint32_t);
+        }
+        void clear()
+        {
+            for (size_t i = 0; i < capacity(); ++i)
+            {
+                if (hashes()[i])
+                {
+                    entries()[i].~Entry();
+                    hashes()[i] = 0;
+                }
+            }
+            count = 0;
+        }
+        // makes room for n entries without growing.
+        void reserve(size_t n)
+        {
+            size_t newCapacity = 16;
+            while (newCapacity * 3 < n * 4)
+            {
+                newCapacity *= 2;
+            }
+            if (newCapacity > capacity())
+            {
+                Rehash(newCapacity);
+            }
+        }
+        template<typename K>
+        TValue* find(const K& key)
+        {
+            const size_t i = FindSlot(key);
+            return i != NOT_FOUND ? &entries()[i].value : NULL;
+        }
+        template<typename K>
+        const TValue* find(const K& key) const
+        {
+            const size_t i = FindSlot(key);
+            return i != NOT_FOUND ? &entries()[i].value : NULL;
+        }
+        template<typename K>
+        bool contains(const K& key) const
+        {
+            return FindSlot(key) != NOT_FOUND;
+        }
+        // adds the key or replaces its value.
+        TValue& insert(const TKey& key, const TValue& value)
+        {
+            const uint32_t h = HashOf(key);
+            size_t i = FindSlot(key, h);
+            if (i != NOT_FOUND)
+            {
+                entries()[i].value = value;
+                return entries()[i].value;
+            }
+            reserve(count + 1);
+            const size_t mask = capacity() - 1;
+            for (i = h & mask; hashes()[i]; i = (i + 1) & mask)
+            {
+            }
+            new (entries() + i) Entry{key, value};
+            hashes()[i] = h;
+            count++;
+            return entries()[i].value;
+        }
+        template<typename K>
+        bool remove(const K& key)
+        {
+            size_t i = FindSlot(key);
+            if (i == NOT_FOUND)
+            {
+                return false;
+            }
+            entries()[i].~Entry();
+            hashes()[i] = 0;
+            count--;
+            // move back the entries of the cluster that can't be reached
+            // anymore through the empty slot.
+            const size_t mask = capacity() - 1;
+            for (size_t j = (i + 1) & mask; hashes()[j]; j = (j + 1) & mask)
+            {
+                const size_t home = hashes()[j] & mask;
+                const bool reachable = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+                if (!reachable)
+                {
+                    new (entries() + i) Entry(static_cast<Entry&&>(entries()[j]));
+                    entries()[j].~Entry();
+                    hashes()[i] = hashes()[j];
+                    hashes()[j] = 0;
+                    i = j;
+                }
+            }
+            return true;
+        }
+        // calls f(key, value) for every entry, in no particular order.
+        template<typename F>
+        void forEach(const F& f) const
+        {
+            for (size_t i = 0; i < capacity(); ++i)
+            {
+                if (hashes()[i])
+                {
+                    f(entries()[i].key, entries()[i].value);
+                }
+            }
+        }
+
+        static const size_t NOT_FOUND = ~(size_t)0;
+
+        Entry* entries() const
+        {
+            return (Entry*)entriesBlock.data;
+        }
+        uint32_t* hashes() const
+        {
+            return (uint32_t*)hashesBlock.data;
+        }
+        template<typename K>
+        static uint32_t HashOf(const K& key)
+        {
+            const uint64_t h = Hash(key);
+            // the top bit marks the slot as used.
+            return (uint32_t)(h ^ (h >> 32)) | 0x80000000u;
+        }
+        template<typename K>
+        size_t FindSlot(const K& key) const
+        {
+            return FindSlot(key, HashOf(key));
+        }
+        template<typename K>
+        size_t FindSlot(const K& key, uint32_t h) const
+        {
+            if (!count)
+            {
+                return NOT_FOUND;
+            }
+            const size_t mask = capacity() - 1;
+            for (size_t i = h & mask; hashes()[i]; i = (i + 1) & mask)
+            {
+                if (hashes()[i] == h && KeysEqual(entries()[i].key, key))
+                {
+                    return i;
+                }
+            }
+            return NOT_FOUND;
+        }
+        void Rehash(size_t newCapacity)
+        {
+            MemoryBlock newEntries = Allocate(newCapacity * sizeof(Entry), *allocator);
+            MemoryBlock newHashes = Allocate(newCapacity * sizeof(uint32_t), *allocator);
+            uint32_t* h = (uint32_t*)newHashes.data;
+            Entry* e = (Entry*)newEntries.data;
+            GEDO_MEMSET(h, 0, newHashes.size);
+            const size_t mask = newCapacity - 1;
+            for (size_t i = 0; i < capacity(); ++i)
+            {
+                if (hashes()[i])
+                {
+                    size_t j = hashes()[i] & mask;
+                    while (h[j])
+                    {
+                        j = (j + 1) & mask;
+                    }
+                    new (e + j) Entry(static_cast<Entry&&>(entries()[i]));
+                    entries()[i].~Entry();
+                    h[j] = hashes()[i];
+                }
+            }
+            if (entriesBlock.data)
+            {
+                Deallocate(entriesBlock, *allocator);
+                Deallocate(hashesBlock, *allocator);
+            }
+            entriesBlock = newEntries;
+            hashesBlock = newHashes;
+        }
+        void Destroy()
+        {
+            if (hashesBlock.data)
+            {
+                clear();
+                Deallocate(entriesBlock, *allocator);
+                Deallocate(hashesBlock, *allocator);
+                entriesBlock = MemoryBlock{};
+                hashesBlock = MemoryBlock{};
+            }
+        }
     };
 
     template <typename T>
@@ -721,6 +2005,86 @@ namespace gedo
     }
     //-------------------------------------------------------------//
 
+    //--------------------------Expressions------------------------//
+    enum class ExpressionOp
+    {
+        // leaves.
+        MATRIX,
+        SCALAR,
+        // unary.
+        NEGATE,
+        NOT,
+        ABS,
+        SIN,
+        COS,
+        TAN,
+        ASIN,
+        ACOS,
+        ATAN,
+        EXP,
+        LOG,
+        SQRT,
+        CONVERT,    // to the type of the node.
+        // binary, MULTIPLY and DIVIDE are element wise.
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        POW,
+        // comparisons and logical operators give 1 or 0.
+        LESS,
+        GREATER,
+        LESS_EQUAL,
+        GREATER_EQUAL,
+        EQUAL,
+        NOT_EQUAL,
+        AND,
+        OR
+    };
+
+    struct ExpressionNode
+    {
+        ExpressionOp op = ExpressionOp::SCALAR;
+        size_t left = 0;            // operand index for unary and binary nodes.
+        size_t right = 0;           // second operand index for binary nodes.
+        const void* data = NULL;    // elements of type when op == MATRIX.
+        double scalar = 0;          // when op == SCALAR.
+        size_t rows = 1;
+        size_t cols = 1;
+        // type of the result of the node: the type of the matrix for leaves,
+        // FLOAT64 for scalars, the operand type for unary nodes and the
+        // promoted type of the operands for binary nodes.
+        MatrixDataType type = MatrixDataType::FLOAT64;
+    };
+
+    // Nodes are appended in order so operands always come before the nodes
+    // that use them, a node is identified by its index. MATRIX leaves only
+    // reference the data of the matrix so it must stay alive until the
+    // expression is evaluated. binary operands broadcast (see CanBroadcast),
+    // nodes smaller than the root are evaluated on their own shape and repeated
+    // tile by tile. every node is rounded to its type so integer nodes
+    // saturate, nodes of FLOAT32 only are computed in single precision.
+    struct MatrixExpression
+    {
+        Array<ExpressionNode> nodes;
+    };
+
+    GEDO_DEF void ClearExpression(MatrixExpression& e);
+    // m must be contiguous, the node points to its data.
+    GEDO_DEF size_t PushMatrix(MatrixExpression& e, const Matrix& m);
+    GEDO_DEF size_t PushScalar(MatrixExpression& e, double scalar);
+    GEDO_DEF size_t PushUnary(MatrixExpression& e, ExpressionOp op, size_t operand);
+    GEDO_DEF size_t PushConvert(MatrixExpression& e, size_t operand, MatrixDataType type);
+    GEDO_DEF bool CanCombine(const MatrixExpression& e, size_t left, size_t right);
+    GEDO_DEF size_t PushBinary(MatrixExpression& e, ExpressionOp op, size_t left, size_t right);
+    // scalar version of the operators, used for constant folding.
+    GEDO_DEF double ApplyUnary(ExpressionOp op, double v);
+    GEDO_DEF double ApplyBinary(ExpressionOp op, double a, double b);
+    // materializes node root and everything it depends on in a single pass,
+    // the result has the type of root.
+    GEDO_DEF Matrix Evaluate(const MatrixExpression& e, size_t root, Allocator& allocator = GetDefaultAllocator());
+    //-------------------------------------------------------------//
+
     //--------------------------Strings----------------------------//
      struct StringView
     {
@@ -756,6 +2120,12 @@ namespace gedo
     GEDO_DEF bool CompareStrings(const String& str1, const char* str2);
     GEDO_DEF bool CompareStrings(const String& str1, const String& str2);
     GEDO_DEF bool CompareStrings(const StringView str1, const StringView str2);
+    // Hash and KeysEqual let String and StringView be used as HashTable keys,
+    // a String and a StringView with the same characters hash the same.
+    GEDO_DEF uint64_t Hash(const String& s);
+    GEDO_DEF uint64_t Hash(const StringView s);
+    GEDO_DEF bool KeysEqual(const String& s0, const String& s1);
+    GEDO_DEF bool KeysEqual(const String& s0, const StringView s1);
     GEDO_DEF void Append(String& string, const char* s);
     GEDO_DEF void Append(String& string, const char* s, size_t length);
     GEDO_DEF void Append(String& string, const String& s);
@@ -772,6 +2142,94 @@ namespace gedo
     GEDO_DEF Array<StringView> SplitStringViewIntoLines(const char* string, char delim, Allocator& allocator = GetDefaultAllocator());
     //-------------------------------------------------------------//
 
+    //--------------------------Matrix files-----------------------//
+    /*
+     * Binary container for named matrices, all values are little endian.
+     * - file header (64 bytes): magic "GEDOMATX", version (u32), record
+     *   count (u32), zeros.
+     * - then for every record a 64 bytes header: rows (u64), cols (u64),
+     *   type (u32), name length (u32), payload bytes (u64), layout (u32),
+     *   zeros (u32), non zeros (u64), zeros. it is followed by the name and
+     *   the payload, both padded with zeros to a multiple of 64 bytes.
+     * - layout 0 is a dense row major payload, 1 (CSR) and 2 (CSC) are a
+     *   FLOAT64 SparseMatrix stored like in memory: the offsets (u64), the
+     *   values and the indices (u32). readers that predate the layout see a
+     *   payload of the wrong size and reject the file.
+     * every part starts at a multiple of 64 bytes so the payloads of a mapped
+     * file are aligned and are used in place, there is nothing to parse.
+     */
+    struct MatrixRecord
+    {
+        StringView name;            // points into the mapping.
+        size_t rows = 0;
+        size_t cols = 0;
+        MatrixDataType type = MatrixDataType::FLOAT64;
+        bool sparse = false;
+        SparseFormat format = SparseFormat::CSR;   // when sparse.
+        size_t nonZeros = 0;                        // when sparse.
+        const void* data = NULL;    // points into the mapping.
+    };
+
+    struct MatrixFile
+    {
+        MemoryBlock mapping;
+        Array<MatrixRecord> records;
+    };
+
+    // maps the file and validates the records, false for corrupted files.
+    GEDO_DEF bool OpenMatrixFile(const char* fileName, MatrixFile& file, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF void CloseMatrixFile(MatrixFile& file);
+    GEDO_DEF const MatrixRecord* FindMatrixRecord(const MatrixFile& file, const StringView name);
+    // copies the record payload into a new matrix, a sparse record is
+    // expanded to a dense one.
+    GEDO_DEF Matrix CreateMatrixFromRecord(const MatrixRecord& record);
+    // the record must be sparse.
+    GEDO_DEF SparseMatrix CreateSparseMatrixFromRecord(const MatrixRecord& record);
+
+    // the header is written first with the number of records that follow.
+    GEDO_DEF void WriteMatrixFileHeader(FileWriter& writer, size_t count);
+    GEDO_DEF void WriteMatrixRecord(FileWriter& writer, const StringView name, const Matrix& m);
+    GEDO_DEF void WriteMatrixRecord(FileWriter& writer, const StringView name, const SparseMatrix& m);
+    //-------------------------------------------------------------//
+
+    //--------------------------Text matrices----------------------//
+    /*
+     * numbers separated by a delimiter with one row per line (csv, tsv, ...).
+     * lines that are empty or only have spaces are skipped, missing and empty
+     * fields are 0 and the matrix has as many columns as the longest line.
+     * spaces around the fields and CR before LF are ignored, the numbers are
+     * parsed by ScanFloat.
+     * the text is split in chunks of TEXT_MATRIX_CHUNK_SIZE at line ends and
+     * parsed in two parallel passes: the first finds the lines and counts the
+     * fields 64 bytes at a time with SSE2/AVX2/NEON masks, the second parses
+     * every chunk straight into its rows of the result.
+     */
+    GEDO_DEF const size_t TEXT_MATRIX_CHUNK_SIZE = 1 << 20;
+
+    struct TextMatrixOptions
+    {
+        // ' ' splits on runs of spaces and tabs, 0 takes the first ',', ';'
+        // or tab of the first line read and ' ' when it has none.
+        char delimiter = ',';
+        size_t skipRows = 0;    // lines skipped at the start, e.g. a header.
+        size_t skipCols = 0;    // fields skipped at the start of every line.
+    };
+
+    struct TextMatrixResult
+    {
+        bool success = false;
+        size_t errorLine = 0;   // 1 based line of the first bad field, 0 if the file can't be read.
+        Matrix matrix;          // FLOAT64, it is returned to the allocator by FreeMatrix.
+    };
+
+    GEDO_DEF TextMatrixResult ParseTextMatrix(const char* text, size_t size, const TextMatrixOptions& options,
+                                              Allocator& allocator = GetDefaultAllocator());
+    // the file is mapped so its pages are only read by the chunk that parses
+    // them and can be dropped once it is done.
+    GEDO_DEF TextMatrixResult ReadTextMatrix(const char* fileName, const TextMatrixOptions& options,
+                                             Allocator& allocator = GetDefaultAllocator());
+    //-------------------------------------------------------------//
+
     //-----------------------------Parsing-------------------------//
     struct Buffer
     {
@@ -789,13 +2247,32 @@ namespace gedo
     GEDO_DEF void SkipToNextLine(Buffer& buffer);
     GEDO_DEF void SkipSingleLineComment(Buffer& buffer);
     GEDO_DEF void SkipWhiteSpaces(Buffer& buffer);
+    // digits with at most one '.', parsed in place.
     GEDO_DEF bool ParseFloat(Buffer& buffer, double& result);
     GEDO_DEF bool ParseIdentifier(Buffer& buffer, String& result);
     GEDO_DEF bool ParseStringLiteral(Buffer& buffer, String& result);
+    // the views point into the buffer data.
+    GEDO_DEF bool ParseIdentifier(Buffer& buffer, StringView& result);
+    GEDO_DEF bool ParseStringLiteral(Buffer& buffer, StringView& result);
     GEDO_DEF bool CompareWordAndSkip(Buffer& buffer, const char* word);
 
     GEDO_DEF bool StringToFloat(const char* string, double& result);
+    // [+-]digits[.digits][(e|E)[+-]digits], inf, infinity and nan in any case,
+    // parsed in place. returns the characters used or 0 when text doesn't
+    // start with a number. up to 2^53 with an exponent in [-22, 22] takes one
+    // multiply or divide, longer numbers go through strtod.
+    GEDO_DEF size_t ScanFloat(const char* text, size_t size, double& result);
+    // the whole view must be a number as in ScanFloat.
+    GEDO_DEF bool StringToFloat(const StringView string, double& result);
     GEDO_DEF bool StringToInt(const char* string, int64_t& result);
+    // the digits that read back as the same double, they are the shortest in
+    // all but rare cases (grisu2). written as an integer, a decimal or with an
+    // exponent (1e-7, 1.5e300). buffer must hold
+    // FLOAT_TO_STRING_SIZE characters, it is null terminated.
+    constexpr size_t FLOAT_TO_STRING_SIZE = 32;
+    GEDO_DEF size_t FloatToString(double value, char* buffer);
+    // the shortest digits that read back as the same float.
+    GEDO_DEF size_t FloatToString(float value, char* buffer);
     //-------------------------------------------------------------//
 
     //------------------------------Bitmap-------------------------//
@@ -830,9 +2307,14 @@ namespace gedo
         Color* data = NULL;
     };
 
+    // the area is clipped to dest, src and mask are read from their top left
+    // corner and clip it too. rows are drawn with SSE2/AVX2/NEON kernels.
     GEDO_DEF void FillRectangle(ColorBitmap& dest, Rect fillArea, const ColorBitmap& src);
+    // the pixels where mask is not 0 are set to c.
     GEDO_DEF void FillRectangle(ColorBitmap& dest, Rect fillArea, const Bitmap& mask, Color c);
     GEDO_DEF void FillRectangle(ColorBitmap& dest, Rect fillArea, Color color);
+    // src over dest, the colors are not premultiplied by alpha.
+    GEDO_DEF void BlendRectangle(ColorBitmap& dest, Rect blendArea, const ColorBitmap& src);
 
     GEDO_DEF Bitmap CreateBitmap(size_t width, size_t height, Allocator& allocator = GetDefaultAllocator());
     GEDO_DEF void FreeBitmap(Bitmap& bitmap, Allocator& allocator = GetDefaultAllocator());
@@ -852,6 +2334,45 @@ namespace gedo
     GEDO_DEF const Color DARK_GREY = CreateColor(30, 30, 30, 255);
     //------------------------------------------------------------//
 
+    //-----------------------------Images--------------------------//
+    /*
+     * binary PGM (P5) and PPM (P6) images with 8 or 16 bit samples, they are
+     * decoded straight from the mapped file. PNG and JPEG need a decoder that
+     * isn't part of Gedo.
+     * in a Matrix the channels are planes stacked vertically: a (channels *
+     * height X width) matrix, red then green then blue, with values in
+     * [0, 255]. the conversions between RGBA8 and the planes use AVX2 when it
+     * is available.
+     */
+    struct ImageInfo
+    {
+        size_t width = 0;
+        size_t height = 0;
+        size_t channels = 0;    // 1 or 3.
+    };
+
+    GEDO_DEF bool ReadImageInfo(const char* fileName, ImageInfo& info);
+    // gray images have r = g = b, alpha is 255.
+    GEDO_DEF bool ReadImage(const char* fileName, ColorBitmap& result, Allocator& allocator = GetDefaultAllocator());
+    GEDO_DEF bool ReadImage(const char* fileName, Matrix& result, Allocator& allocator = GetDefaultAllocator());
+    // decodes images of the same size and channels on the thread pool, row i
+    // of the (count X channels * height * width) result is image i. false when
+    // a file can't be read or doesn't match the first one.
+    GEDO_DEF bool ReadImages(const char* const* fileNames, size_t count, Matrix& result,
+                             Allocator& allocator = GetDefaultAllocator());
+    // P6, alpha is dropped.
+    GEDO_DEF bool WriteImage(const char* fileName, const ColorBitmap& image);
+    // channels 1 writes P5 and 3 writes P6, the values are rounded and clamped
+    // to [0, 255].
+    GEDO_DEF bool WriteImage(const char* fileName, const Matrix& image, size_t channels);
+    // channels 3 gives the r, g, b planes, 4 adds alpha.
+    GEDO_DEF Matrix ColorBitmapToMatrix(const ColorBitmap& image, size_t channels,
+                                        Allocator& allocator = GetDefaultAllocator());
+    // channels 1 (gray), 3 or 4, alpha is 255 without the 4th plane.
+    GEDO_DEF ColorBitmap MatrixToColorBitmap(const Matrix& m, size_t channels,
+                                             Allocator& allocator = GetDefaultAllocator());
+    //-------------------------------------------------------------//
+
     //---------------------IO-------------------------------------//
     enum class ConsoleColor
     {
@@ -860,22 +2381,30 @@ namespace gedo
         GREEN,
         BLUE
     };
-    // utf8 text.
+    // utf8 text, it is buffered until FlushConsole() or the buffer is full.
+    // ReadFromConsole() and exit flush it.
     GEDO_DEF void PrintToConsole(const char* text, ConsoleColor color = ConsoleColor::WHITE);
+    GEDO_DEF void PrintToConsole(const char* text, size_t size, ConsoleColor color = ConsoleColor::WHITE);
     GEDO_DEF void PrintToConsole(char c, ConsoleColor color = ConsoleColor::WHITE);
+    GEDO_DEF void FlushConsole();
     GEDO_DEF void ReadFromConsole(char* buffer, size_t bufferSize);
+    // a whole line of any length without the new line, false at the end of
+    // the input.
+    GEDO_DEF bool ReadLineFromConsole(String& line);
     GEDO_DEF void ClearConsole();
     //------------------------------------------------------------//
 
     //-----------------------Time  -------------------------------//
+    // a zone of the profiler that also prints the time spent in the block.
 #define GEDO_TIME_BLOCK(BlockName)                                             \
+  GEDO_PROFILE_ZONE(BlockName);                                                \
   StopWatch ___timer;                                                          \
   StartStopWatch(___timer);                                                    \
   defer({                                                                      \
     StopStopWatch(___timer);                                                   \
     char buffer[200] = {};                                                     \
-    sprintf(buffer, "Time spent in (%s): %f seconds.\n", BlockName,            \
-            ElapsedSeconds(___timer));                                         \
+    snprintf(buffer, sizeof(buffer), "Time spent in (%s): %f seconds.\n",      \
+             BlockName, ElapsedSeconds(___timer));                             \
     PrintToConsole(buffer);                                                    \
   });
 
@@ -887,5 +2416,45 @@ namespace gedo
     GEDO_DEF void StartStopWatch(StopWatch& in);
     GEDO_DEF void StopStopWatch(StopWatch& in);
     GEDO_DEF double ElapsedSeconds(const StopWatch &in);
+    // monotonic clock with nanosecond resolution, only differences are
+    // meaningful.
+    GEDO_DEF int64_t GetTimeNanoseconds();
+
+    // the profiler records nested zones per thread, a zone is identified by its
+    // name and the zone it was opened in so the same name under different
+    // parents gets separate entries in the tree. for each zone it keeps the
+    // call count, inclusive and exclusive time and the bytes requested through
+    // Allocate/AllocateUninitialized/Reallocate while it was open (children
+    // included). the reports and the trace cover the calling thread.
+    // a zone is a call and a branch when the profiler is disabled (the default).
+#define GEDO_PROFILE_ZONE(ZoneName)                                            \
+  ProfileZoneScope DEFER_3(_zone_)(ZoneName)
+
+    GEDO_DEF void EnableProfiler(bool enable);
+    GEDO_DEF bool IsProfilerEnabled();
+    // drops all the recorded zones of the calling thread, no zone can be open.
+    GEDO_DEF void ResetProfiler();
+    // name must outlive the profile (e.g. a string literal). returns -1 when
+    // the profiler is disabled.
+    GEDO_DEF int32_t BeginProfileZone(const char* name);
+    GEDO_DEF void EndProfileZone(int32_t zone);
+    // flat: one line per zone name sorted by exclusive time, tree: the zones
+    // nested under their parents.
+    GEDO_DEF void PrintProfileReport(bool tree);
+    // chrome://tracing (or perfetto) json with one complete event per zone
+    // call, the newest calls are dropped after PROFILER_MAX_EVENTS.
+    GEDO_DEF bool WriteProfileTrace(const char* fileName);
+
+    struct ProfileZoneScope
+    {
+        int32_t zone;
+        explicit ProfileZoneScope(const char* name) : zone(BeginProfileZone(name)) {}
+        ~ProfileZoneScope()
+        {
+            EndProfileZone(zone);
+        }
+        ProfileZoneScope(const ProfileZoneScope&) = delete;
+        ProfileZoneScope& operator=(const ProfileZoneScope&) = delete;
+    };
     //------------------------------------------------------------//
 }
@@ -0,0 +1,769 @@
+#include "AhmedLab.h"
+#include <stdio.h>
+
+// AhmedLabBench [--quick] [--filter text] [--threads n] [--json file]
+// every benchmark is warmed up, its iteration count is doubled until a run
+// takes the target time and then it is timed a few times, ns/op is the median
+// of the runs. allocations and bytes per op add the ones of the calling thread
+// to the ones the workers of the thread pool make from the default allocator.
+// the json has the same fields in the same order every time so two files can
+// be diffed.
+
+#define BENCH_JSON_VERSION 1
+
+struct BenchResult
+{
+    const char* group = "";
+    char name[64] = {};
+    size_t iterations = 0;
+    double nsPerOp = 0;
+    double nsPerOpMin = 0;
+    double gflops = 0;          // 0 when the op doesn't count its flops.
+    double gbPerSecond = 0;
+    double allocationsPerOp = 0;
+    double bytesAllocatedPerOp = 0;
+};
+
+struct BenchSession
+{
+    bool quick = false;
+    const char* filter = NULL;
+    Array<BenchResult> results;
+};
+
+// keeps the compiler from dropping the results of the ops.
+static volatile double benchSink = 0;
+
+// the counters of GetAllocationCount() belong to the calling thread, the
+// default allocator counts the rest for every thread but the main one.
+static thread_local bool isMainThread = false;
+
+struct CountingAllocator : Allocator
+{
+    Allocator* target = NULL;
+    volatile int64_t allocations = 0;
+    volatile int64_t bytes = 0;
+
+    void ResetAllocator() override
+    {
+        target->ResetAllocator();
+    }
+
+    MemoryBlock AllocateMemoryBlock(size_t size, bool zeroFill) override
+    {
+        if (!isMainThread)
+        {
+            AtomicAdd(&allocations, 1);
+            AtomicAdd(&bytes, (int64_t)size);
+        }
+        return target->AllocateMemoryBlock(size, zeroFill);
+    }
+
+    bool FreeMemoryBlock(MemoryBlock& block) override
+    {
+        return target->FreeMemoryBlock(block);
+    }
+
+    bool ReallocateMemoryBlock(MemoryBlock& block, size_t size, bool inPlace) override
+    {
+        if (!isMainThread && !inPlace)
+        {
+            AtomicAdd(&allocations, 1);
+            AtomicAdd(&bytes, size > block.size ? (int64_t)(size - block.size) : 0);
+        }
+        return target->ReallocateMemoryBlock(block, size, inPlace);
+    }
+};
+
+static CountingAllocator countingAllocator;
+
+static size_t GetTotalAllocationCount()
+{
+    return GetAllocationCount() + (size_t)AtomicLoad(&countingAllocator.allocations);
+}
+
+static size_t GetTotalAllocatedBytes()
+{
+    return GetAllocatedBytes() + (size_t)AtomicLoad(&countingAllocator.bytes);
+}
+
+static bool IsSelected(const BenchSession& session, const char* name)
+{
+    return !session.filter || strstr(name, session.filter);
+}
+
+static double RunIterations(size_t iterations, void (*op)(void*), void* userData)
+{
+    const int64_t start = GetTimeNanoseconds();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        op(userData);
+    }
+    return double(GetTimeNanoseconds() - start);
+}
+
+template <typename F>
+static void CallOp(void* userData)
+{
+    (*(F*)userData)();
+}
+
+// flopsPerOp and bytesPerOp are the work of one call of op, 0 if it doesn't
+// apply. bytesPerOp is the memory the op reads and writes.
+template <typename F>
+static void Measure(BenchSession& session, const char* group, const char* name,
+                    double flopsPerOp, double bytesPerOp, F op)
+{
+    char fullName[64] = {};
+    snprintf(fullName, sizeof(fullName), "%s/%s", group, name);
+    if (!IsSelected(session, fullName))
+    {
+        return;
+    }
+    const double targetNs = session.quick ? 20e6 : 200e6;
+    const size_t repeats = session.quick ? 3 : 5;
+
+    op();
+    size_t iterations = 1;
+    for (;;)
+    {
+        const double ns = RunIterations(iterations, CallOp<F>, &op);
+        if (ns >= targetNs / repeats || iterations >= (size_t(1) << 30))
+        {
+            break;
+        }
+        // jump close to the target once the time is measurable.
+        const double scale = ns > 1e5 ? targetNs / repeats / ns : 8;
+        iterations = Max(iterations * 2, size_t(iterations * Min(scale, 64.0)));
+    }
+
+    double runs[8] = {};
+    const size_t allocations = GetTotalAllocationCount();
+    const size_t bytes = GetTotalAllocatedBytes();
+    for (size_t i = 0; i < repeats; ++i)
+    {
+        runs[i] = RunIterations(iterations, CallOp<F>, &op) / iterations;
+    }
+    const double ops = double(iterations * repeats);
+    QuickSort(runs, repeats);
+
+    BenchResult result;
+    result.group = group;
+    memcpy(result.name, fullName, sizeof(fullName));
+    result.iterations = iterations;
+    result.nsPerOp = runs[repeats / 2];
+    result.nsPerOpMin = runs[0];
+    result.gflops = flopsPerOp / result.nsPerOp;
+    result.gbPerSecond = bytesPerOp / result.nsPerOp;
+    result.allocationsPerOp = (GetTotalAllocationCount() - allocations) / ops;
+    result.bytesAllocatedPerOp = (GetTotalAllocatedBytes() - bytes) / ops;
+    session.results.push_back(result);
+
+    char line[256] = {};
+    snprintf(line, sizeof(line), "%-36s %14.1f %9.2f %9.2f %10.1f %12.0f\n", result.name, result.nsPerOp,
+             result.gflops, result.gbPerSecond, result.allocationsPerOp, result.bytesAllocatedPerOp);
+    PrintToConsole(line);
+}
+
+static Matrix CreateRandomMatrix(size_t rows, size_t cols, uint32_t seed)
+{
+    Matrix m = CreateMatrix(rows, cols);
+    double* data = GetData<double>(m);
+    uint32_t state = seed;
+    for (size_t i = 0; i < rows * cols; ++i)
+    {
+        // xorshift32, the values are in [-1, 1).
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state / 2147483648.0 - 1;
+    }
+    return m;
+}
+
+//---------------------------Gedo kernels--------------------
+static void BenchMultiply(BenchSession& session)
+{
+    // --quick leaves out the largest size.
+    const size_t sizes[] = {64, 256, 1024};
+    for (size_t i = 0; i < (session.quick ? 2 : 3); ++i)
+    {
+        const size_t n = sizes[i];
+        Matrix a = CreateRandomMatrix(n, n, 1);
+        Matrix b = CreateRandomMatrix(n, n, 2);
+        Matrix af = ConvertMatrix(a, MatrixDataType::FLOAT32);
+        Matrix bf = ConvertMatrix(b, MatrixDataType::FLOAT32);
+        defer({
+            FreeMatrix(a);
+            FreeMatrix(b);
+            FreeMatrix(af);
+            FreeMatrix(bf);
+        });
+        const double flops = 2.0 * n * n * n;
+        char name[32] = {};
+        snprintf(name, sizeof(name), "f64/%zu", n);
+        Measure(session, "multiply", name, flops, 3.0 * n * n * sizeof(double), [&]() {
+            Matrix c = Multiply(a, b);
+            benchSink = GetData<double>(c)[0];
+            FreeMatrix(c);
+        });
+        snprintf(name, sizeof(name), "f32/%zu", n);
+        Measure(session, "multiply", name, flops, 3.0 * n * n * sizeof(float), [&]() {
+            Matrix c = Multiply(af, bf);
+            benchSink = GetData<float>(c)[0];
+            FreeMatrix(c);
+        });
+    }
+}
+
+static void BenchLinearAlgebra(BenchSession& session)
+{
+    // --quick leaves out the largest size.
+    const size_t sizes[] = {128, 512, 1024};
+    for (size_t i = 0; i < (session.quick ? 2 : 3); ++i)
+    {
+        const size_t n = sizes[i];
+        Matrix a = CreateRandomMatrix(n, n, 10);
+        Matrix b = CreateRandomMatrix(n, 1, 11);
+        // a' * a + n * I is symmetric positive definite.
+        Matrix at = TransposedView(a);
+        Matrix spd = Multiply(at, a);
+        for (size_t k = 0; k < n; ++k)
+        {
+            spd.data[k * n + k] += double(n);
+        }
+        defer({
+            FreeMatrix(a);
+            FreeMatrix(b);
+            FreeMatrix(at);
+            FreeMatrix(spd);
+        });
+        const double bytes = double(n * n * sizeof(double));
+        char name[32] = {};
+        snprintf(name, sizeof(name), "solve_lu/%zu", n);
+        Measure(session, "linalg", name, 2.0 / 3 * n * n * n, bytes, [&]() {
+            Matrix x = Solve(a, b);
+            benchSink = x.data[0];
+            FreeMatrix(x);
+        });
+        snprintf(name, sizeof(name), "solve_chol/%zu", n);
+        Measure(session, "linalg", name, 1.0 / 3 * n * n * n, bytes, [&]() {
+            Matrix x = Solve(spd, b);
+            benchSink = x.data[0];
+            FreeMatrix(x);
+        });
+        snprintf(name, sizeof(name), "qr/%zu", n);
+        Measure(session, "linalg", name, 4.0 / 3 * n * n * n, bytes, [&]() {
+            Matrix r = QR(a);
+            benchSink = r.data[0];
+            FreeMatrix(r);
+        });
+        snprintf(name, sizeof(name), "inv/%zu", n);
+        Measure(session, "linalg", name, 2.0 * n * n * n, bytes, [&]() {
+            Matrix inverse = Inverse(a);
+            benchSink = inverse.data[0];
+            FreeMatrix(inverse);
+        });
+    }
+}
+
+// perRow elements at random columns of every row, like a mesh or a graph.
+static SparseMatrix CreateRandomSparse(size_t n, size_t perRow, uint32_t seed)
+{
+    Array<size_t> rows;
+    Array<size_t> cols;
+    Matrix values = CreateRandomMatrix(n * perRow, 1, seed);
+    defer(FreeMatrix(values));
+    uint32_t state = seed;
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (size_t k = 0; k < perRow; ++k)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            rows.push_back(i);
+            cols.push_back(state % n);
+        }
+    }
+    return CreateSparseFromTriplets(n, n, rows.data(), cols.data(), values.data, rows.size());
+}
+
+static void BenchSparse(BenchSession& session)
+{
+    const size_t sizes[] = {10000, 100000, 1000000};
+    const size_t perRow = 8;
+    for (size_t i = 0; i < (session.quick ? 2 : 3); ++i)
+    {
+        const size_t n = sizes[i];
+        SparseMatrix a = CreateRandomSparse(n, perRow, 12);
+        SparseMatrix b = CreateRandomSparse(n, perRow, 13);
+        Matrix x = CreateRandomMatrix(n, 1, 14);
+        Matrix block = CreateRandomMatrix(n, 16, 15);
+        defer({
+            FreeSparseMatrix(a);
+            FreeSparseMatrix(b);
+            FreeMatrix(x);
+            FreeMatrix(block);
+        });
+        // the values and indices of a are read once per product.
+        const double bytes = double(a.nonZeros * (sizeof(double) + sizeof(uint32_t)));
+        char name[32] = {};
+        snprintf(name, sizeof(name), "spmv/%zu", n);
+        Measure(session, "sparse", name, 2.0 * a.nonZeros, bytes, [&]() {
+            Matrix y = Multiply(a, x);
+            benchSink = y.data[0];
+            FreeMatrix(y);
+        });
+        snprintf(name, sizeof(name), "spmm16/%zu", n);
+        Measure(session, "sparse", name, 2.0 * a.nonZeros * block.cols, bytes, [&]() {
+            Matrix y = Multiply(a, block);
+            benchSink = y.data[0];
+            FreeMatrix(y);
+        });
+        snprintf(name, sizeof(name), "spgemm/%zu", n);
+        Measure(session, "sparse", name, 2.0 * a.nonZeros * perRow, bytes, [&]() {
+            SparseMatrix c = Multiply(a, b);
+            benchSink = double(c.nonZeros);
+            FreeSparseMatrix(c);
+        });
+        snprintf(name, sizeof(name), "add/%zu", n);
+        Measure(session, "sparse", name, double(a.nonZeros + b.nonZeros), 2 * bytes, [&]() {
+            SparseMatrix c = Add(a, b);
+            benchSink = double(c.nonZeros);
+            FreeSparseMatrix(c);
+        });
+    }
+}
+
+static void BenchElementWise(BenchSession& session)
+{
+    const size_t sizes[] = {100, 1000, 3000};
+    for (size_t i = 0; i < (session.quick ? 2 : 3); ++i)
+    {
+        const size_t n = sizes[i];
+        Matrix a = CreateRandomMatrix(n, n, 3);
+        Matrix b = CreateRandomMatrix(n, n, 4);
+        Matrix row = CreateRandomMatrix(1, n, 5);
+        defer({
+            FreeMatrix(a);
+            FreeMatrix(b);
+            FreeMatrix(row);
+        });
+        const double count = double(n * n);
+        char name[32] = {};
+        snprintf(name, sizeof(name), "add/%zu", n);
+        Measure(session, "elementwise", name, count, 3 * count * sizeof(double), [&]() {
+            Matrix c = Add(a, b);
+            benchSink = GetData<double>(c)[0];
+            FreeMatrix(c);
+        });
+        snprintf(name, sizeof(name), "add_row/%zu", n);
+        Measure(session, "elementwise", name, count, 2 * count * sizeof(double), [&]() {
+            Matrix c = Add(a, row);
+            benchSink = GetData<double>(c)[0];
+            FreeMatrix(c);
+        });
+        // a * 2 + b / 3 - 1 in a single pass.
+        snprintf(name, sizeof(name), "fused/%zu", n);
+        Measure(session, "elementwise", name, 4 * count, 3 * count * sizeof(double), [&]() {
+            MatrixExpression e;
+            const size_t left = PushBinary(e, ExpressionOp::MULTIPLY, PushMatrix(e, a), PushScalar(e, 2));
+            const size_t right = PushBinary(e, ExpressionOp::DIVIDE, PushMatrix(e, b), PushScalar(e, 3));
+            const size_t sum = PushBinary(e, ExpressionOp::ADD, left, right);
+            const size_t root = PushBinary(e, ExpressionOp::SUBTRACT, sum, PushScalar(e, 1));
+            Matrix c = Evaluate(e, root);
+            benchSink = GetData<double>(c)[0];
+            FreeMatrix(c);
+        });
+        snprintf(name, sizeof(name), "sum/%zu", n);
+        Measure(session, "elementwise", name, count, count * sizeof(double), [&]() {
+            benchSink = Sum(a);
+        });
+    }
+}
+
+static void BenchVectorMath(BenchSession& session)
+{
+    const size_t count = 1 << 20;
+    Matrix values = CreateRandomMatrix(1, count, 6);
+    Matrix result = CreateMatrix(1, count);
+    defer({
+        FreeMatrix(values);
+        FreeMatrix(result);
+    });
+    const double* x = GetData<double>(values);
+    double* y = GetData<double>(result);
+    const double bytes = 2.0 * count * sizeof(double);
+    // the functions don't count flops, ns/op / 2^20 is the time per element.
+    Measure(session, "vecmath", "sin/1M", 0, bytes, [&]() {
+        Sin(x, y, count);
+        benchSink = y[0];
+    });
+    Measure(session, "vecmath", "exp/1M", 0, bytes, [&]() {
+        Exp(x, y, count);
+        benchSink = y[0];
+    });
+    Measure(session, "vecmath", "atan/1M", 0, bytes, [&]() {
+        ATan(x, y, count);
+        benchSink = y[0];
+    });
+}
+
+static void BenchSort(BenchSession& session)
+{
+    const size_t count = 1 << 20;
+    Matrix values = CreateRandomMatrix(count, 1, 7);
+    Matrix set = CreateRandomMatrix(1 << 16, 1, 8);
+    Matrix pairs = CreateRandomMatrix(count / 2, 2, 9);
+    defer({
+        FreeMatrix(values);
+        FreeMatrix(set);
+        FreeMatrix(pairs);
+    });
+    const double bytes = 2.0 * count * sizeof(double);
+    Measure(session, "sort", "sort/1M", 0, bytes, [&]() {
+        Matrix sorted = Sort(values);
+        benchSink = sorted.data[0];
+        FreeMatrix(sorted);
+    });
+    Measure(session, "sort", "sortrows/512kx2", 0, bytes, [&]() {
+        Matrix sorted = SortRows(pairs);
+        benchSink = sorted.data[0];
+        FreeMatrix(sorted);
+    });
+    Measure(session, "sort", "ismember/1M_64k", 0, bytes, [&]() {
+        Matrix found = IsMember(values, set);
+        benchSink = found.data[0];
+        FreeMatrix(found);
+    });
+}
+
+static void BenchPoints(BenchSession& session)
+{
+    const size_t sizes[] = {10000, 1000000};
+    const Mat4 view = LookAt(Vec3d{1, 2, 3}, Vec3d{0, 0, 0}, Vec3d{0, 1, 0});
+    const Mat4 projection = Perspective(1.0, 1.5, 0.1, 100) * view;
+    for (size_t i = 0; i < (session.quick ? 1 : 2); ++i)
+    {
+        const size_t n = sizes[i];
+        Matrix a = CreateRandomMatrix(3, n, 16);
+        Matrix b = CreateMatrix(3, n);
+        defer({
+            FreeMatrix(a);
+            FreeMatrix(b);
+        });
+        const Points3d points = ToPoints(a);
+        Points3d result = ToPoints(b);
+        // 3 rows of 3 multiply adds, the projection adds w and its division.
+        const double bytes = double(6 * n * sizeof(double));
+        char name[32] = {};
+        snprintf(name, sizeof(name), "transform/%zu", n);
+        Measure(session, "points", name, 18.0 * n, bytes, [&]() {
+            TransformPoints(view, points, result);
+            benchSink = result.x[0];
+        });
+        snprintf(name, sizeof(name), "project/%zu", n);
+        Measure(session, "points", name, 28.0 * n, bytes, [&]() {
+            ProjectPoints(projection, points, result);
+            benchSink = result.x[0];
+        });
+    }
+}
+
+static void BenchBitmap(BenchSession& session)
+{
+    const size_t width = 1920;
+    const size_t height = 1080;
+    ColorBitmap dest = CreateColorBitmap(width, height);
+    ColorBitmap src = CreateColorBitmap(width, height);
+    Bitmap mask = CreateBitmap(width, height);
+    defer({
+        FreeColorBitmap(dest);
+        FreeColorBitmap(src);
+        FreeBitmap(mask);
+    });
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        src.data[i] = CreateColor(uint8_t(i), uint8_t(i >> 8), uint8_t(i >> 16), uint8_t(i * 7));
+        mask.data[i] = (i / 3) & 1;
+    }
+    Rect area;
+    area.width = width;
+    area.height = height;
+    const double pixels = double(width * height);
+    Measure(session, "bitmap", "fill_color/1080p", 0, pixels * sizeof(Color), [&]() {
+        FillRectangle(dest, area, CreateColor(10, 20, 30, 255));
+        benchSink = dest.data[0].r;
+    });
+    Measure(session, "bitmap", "fill_mask/1080p", 0, pixels * (2 * sizeof(Color) + 1), [&]() {
+        FillRectangle(dest, area, mask, CreateColor(10, 20, 30, 255));
+        benchSink = dest.data[0].r;
+    });
+    Measure(session, "bitmap", "copy/1080p", 0, pixels * 2 * sizeof(Color), [&]() {
+        FillRectangle(dest, area, src);
+        benchSink = dest.data[0].r;
+    });
+    Measure(session, "bitmap", "blend/1080p", 0, pixels * 3 * sizeof(Color), [&]() {
+        BlendRectangle(dest, area, src);
+        benchSink = dest.data[0].r;
+    });
+}
+
+// 64 blocks of mixed sizes are allocated and freed in reverse order per op.
+static void BenchAllocator(BenchSession& session, const char* name, Allocator& allocator, bool reset)
+{
+    Measure(session, "allocator", name, 0, 0, [&]() {
+        MemoryBlock blocks[64];
+        for (size_t i = 0; i < 64; ++i)
+        {
+            blocks[i] = AllocateUninitialized(16 + (i * 37 % 64) * 32, allocator);
+            blocks[i].data[0] = uint8_t(i);
+        }
+        benchSink = blocks[63].data[0];
+        for (size_t i = 64; i--;)
+        {
+            Deallocate(blocks[i], allocator);
+        }
+        if (reset)
+        {
+            allocator.ResetAllocator();
+        }
+    });
+}
+
+static void BenchAllocators(BenchSession& session)
+{
+    MallocAllocator* mallocAllocator = CreateMallocAllocator();
+    PoolAllocator* pool = CreatePoolAllocator();
+    LinearAllocator* linear = CreateLinearAllocator(MegaBytesToBytes(1));
+    ScratchAllocator* scratch = CreateScratchAllocator(MegaBytesToBytes(1), *mallocAllocator);
+    defer({
+        FreeScratchAllocator(scratch);
+        FreeLinearAllocator(linear);
+        FreePoolAllocator(pool);
+        FreeMallocAllocator(mallocAllocator);
+    });
+    BenchAllocator(session, "malloc/64", *mallocAllocator, false);
+    BenchAllocator(session, "pool/64", *pool, false);
+    BenchAllocator(session, "linear/64", *linear, true);
+    BenchAllocator(session, "scratch/64", *scratch, false);
+}
+//-----------------------------------------------------------
+
+//---------------------------Interpreter---------------------
+// statements of every kind the lexer knows, about count lines.
+static String GenerateScript(size_t count)
+{
+    String script;
+    char line[200] = {};
+    for (size_t i = 0; i < count; ++i)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            snprintf(line, sizeof(line), "x%zu = [1.5, 2, 3; 4, 5, %zu] * (y + 2.25) / 3;\n", i, i);
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "if x%zu >= 10 && !(z != 2) || w < 1\n", i - 1);
+            break;
+        case 2:
+            snprintf(line, sizeof(line), "    s = sum(sin(x%zu) - transpose(x%zu)), t = \"text %zu\"\n", i - 2, i - 2, i);
+            break;
+        default:
+            snprintf(line, sizeof(line), "end\n");
+            break;
+        }
+        Append(script, line);
+    }
+    return script;
+}
+
+static void BenchFrontEnd(BenchSession& session)
+{
+    const size_t lines = session.quick ? 10000 : 100000;
+    const String script = GenerateScript(lines);
+    const double bytes = double(script.size());
+    char name[32] = {};
+    snprintf(name, sizeof(name), "tokenize/%zuk_lines", lines / 1000);
+    Measure(session, "frontend", name, 0, bytes, [&]() {
+        Buffer buffer;
+        buffer.data = script.data();
+        buffer.size = script.size();
+        const LexerResult result = Tokenize(buffer);
+        benchSink = double(result.tokens.size());
+    });
+
+    Buffer buffer;
+    buffer.data = script.data();
+    buffer.size = script.size();
+    const LexerResult tokens = Tokenize(buffer);
+    snprintf(name, sizeof(name), "compile/%zuk_lines", lines / 1000);
+    Measure(session, "frontend", name, 0, bytes, [&]() {
+        Program program;
+        const CompileResult result = Compile(tokens, program);
+        benchSink = double(result.success + program.code.size());
+    });
+
+    // the same numbers once as a line of csv and once null terminated.
+    String csv;
+    String numbers;
+    Array<size_t> offsets;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        char number[FLOAT_TO_STRING_SIZE] = {};
+        const size_t length = FloatToString(i * 0.37 - 1000, number);
+        Append(csv, number, length);
+        Append(csv, ',');
+        offsets.push_back(numbers.size());
+        Append(numbers, number, length + 1);
+    }
+    Append(csv, '\0');
+    const double csvBytes = double(csv.size() - 1);
+    Measure(session, "strings", "split/100k", 0, csvBytes, [&]() {
+        const Array<String> parts = SplitString(csv.data(), ',');
+        benchSink = double(parts.size());
+    });
+    Measure(session, "strings", "split_view/100k", 0, csvBytes, [&]() {
+        const Array<StringView> parts = SplitStringView(csv.data(), ',');
+        benchSink = double(parts.size());
+    });
+    // the same numbers as 20000 lines of 5 fields.
+    String table;
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        Append(table, numbers.data() + offsets[i]);
+        Append(table, i % 5 == 4 ? '\n' : ',');
+    }
+    Measure(session, "strings", "csv/100k", 0, double(table.size()), [&]() {
+        TextMatrixOptions options;
+        TextMatrixResult result = ParseTextMatrix(table.data(), table.size(), options);
+        benchSink = result.matrix.data[0];
+        FreeMatrix(result.matrix);
+    });
+    Measure(session, "strings", "to_float/100k", 0, double(numbers.size()), [&]() {
+        double total = 0;
+        for (size_t offset : offsets)
+        {
+            double value = 0;
+            StringToFloat(numbers.data() + offset, value);
+            total += value;
+        }
+        benchSink = total;
+    });
+}
+
+static void BenchScripts(BenchSession& session)
+{
+    struct Script
+    {
+        const char* name;
+        const char* text;
+    };
+    const Script scripts[] = {
+        {"loop/10k", "i = 0;\ns = 0;\nwhile i < 10000\n    s = s + i * 2;\n    i = i + 1;\nend\n"},
+        {"calls/10k", "func f(a, b)\n    return a * b + 1\nend\ni = 0;\nwhile i < 10000\n    x = f(i, 2);\n"
+                      "    i = i + 1;\nend\n"},
+        {"matrix/256", "a = ones(256, 256);\nb = a * a + sin(a) / 3;\nc = sum(transpose(b) - b);\n"},
+    };
+    for (const Script& script : scripts)
+    {
+        State state;
+        Measure(session, "scripts", script.name, 0, 0, [&]() {
+            ProcessInput(state, script.text);
+        });
+    }
+}
+//-----------------------------------------------------------
+
+static void WriteJson(const BenchSession& session, const char* fileName)
+{
+    FileWriter writer;
+    if (!OpenFileWriter(writer, fileName))
+    {
+        PrintMessage(MessageLevel::ERROR, "Can't write the json file.\n");
+        return;
+    }
+    const CpuFeatures& cpu = GetCpuFeatures();
+    char text[512] = {};
+    snprintf(text, sizeof(text),
+             "{\n  \"version\": %d,\n  \"cpu\": {\"sse2\": %d, \"sse41\": %d, \"avx\": %d, \"avx2\": %d, "
+             "\"fma\": %d, \"avx512f\": %d, \"neon\": %d},\n  \"threads\": %zu,\n  \"quick\": %d,\n"
+             "  \"benchmarks\": [\n",
+             BENCH_JSON_VERSION, cpu.sse2, cpu.sse41, cpu.avx, cpu.avx2, cpu.fma, cpu.avx512f, cpu.neon,
+             GetThreadCount(), session.quick);
+    WriteToFile(writer, text, strlen(text));
+    for (size_t i = 0; i < session.results.size(); ++i)
+    {
+        const BenchResult& r = session.results[i];
+        snprintf(text, sizeof(text),
+                 "    {\"name\": \"%s\", \"group\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, "
+                 "\"ns_per_op_min\": %.1f, \"gflops\": %.3f, \"gb_per_s\": %.3f, \"allocations_per_op\": %.2f, "
+                 "\"bytes_allocated_per_op\": %.1f}%s\n",
+                 r.name, r.group, r.iterations, r.nsPerOp, r.nsPerOpMin, r.gflops, r.gbPerSecond,
+                 r.allocationsPerOp, r.bytesAllocatedPerOp, i + 1 < session.results.size() ? "," : "");
+        WriteToFile(writer, text, strlen(text));
+    }
+    const char* end = "  ]\n}\n";
+    WriteToFile(writer, end, strlen(end));
+    if (!CloseFileWriter(writer))
+    {
+        PrintMessage(MessageLevel::ERROR, "Can't write the json file.\n");
+    }
+}
+
+int main(int argc, char const* argv[])
+{
+    // same allocator as the interpreter.
+    isMainThread = true;
+    countingAllocator.target = CreatePoolAllocator();
+    SetDefaultAllocator(countingAllocator);
+    BenchSession session;
+    const char* jsonFile = NULL;
+    size_t threads = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (CompareStrings(argv[i], "--quick"))
+        {
+            session.quick = true;
+        }
+        else if (CompareStrings(argv[i], "--filter") && i + 1 < argc)
+        {
+            session.filter = argv[++i];
+        }
+        else if (CompareStrings(argv[i], "--json") && i + 1 < argc)
+        {
+            jsonFile = argv[++i];
+        }
+        else if (CompareStrings(argv[i], "--threads") && i + 1 < argc)
+        {
+            threads = size_t(atoi(argv[++i]));
+        }
+        else
+        {
+            PrintToConsole("usage: AhmedLabBench [--quick] [--filter text] [--threads n] [--json file]\n");
+            return 1;
+        }
+    }
+    SetThreadCount(threads);
+
+    PrintToConsole("benchmark                                   ns/op   GFLOP/s      GB/s  allocs/op  bytes/op\n",
+                   ConsoleColor::GREEN);
+    BenchMultiply(session);
+    BenchLinearAlgebra(session);
+    BenchSparse(session);
+    BenchElementWise(session);
+    BenchVectorMath(session);
+    BenchSort(session);
+    BenchPoints(session);
+    BenchBitmap(session);
+    BenchAllocators(session);
+    BenchFrontEnd(session);
+    BenchScripts(session);
+
+    if (jsonFile)
+    {
+        WriteJson(session, jsonFile);
+    }
+    return 0;
+}
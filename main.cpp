@@ -1,16 +1,53 @@
 ﻿#include "AhmedLab.h"
+#include <stdio.h>
 #define PROMPT_TEXT ">>"
+#define CONTINUE_TEXT ".."
+
+// there is no window yet, the frames of imshow and plot go to files.
+void PresentToFile(void*, size_t figure, const ColorBitmap& frame)
+{
+    char fileName[64] = {};
+    snprintf(fileName, sizeof(fileName), "figure%zu.ppm", figure);
+    WriteImage(fileName, frame);
+}
 
 int main(int argc, char const* argv[])
 {
-    if (argc == 2)
+    // the interpreter makes many small allocations of the same few sizes.
+    SetDefaultAllocator(*CreatePoolAllocator());
+    // [--profile] [--no-cache] file: runs the script, --profile runs it with
+    // "profile on" and prints the report.
+    bool profile = false;
+    bool cache = true;
+    for (int i = 1; i + 1 < argc; ++i)
     {
-        MemoryBlock fileData = ReadFile(argv[1]);
+        profile |= CompareStrings(argv[i], "--profile");
+        cache &= !CompareStrings(argv[i], "--no-cache");
+    }
+    if (argc >= 2)
+    {
+        MemoryBlock fileData = MapFile(argv[argc - 1]);
         if (fileData.size)
         {
-            defer(Deallocate(fileData));
+            defer(UnmapFile(fileData));
+            String cacheFile;
+            Append(cacheFile, argv[argc - 1]);
+            Append(cacheFile, ".cache");
+            Append(cacheFile, '\0');
+            Renderer renderer;
+            StartRenderer(renderer, PresentToFile, NULL);
             State state;
-            ProcessInput(state, (const char*)fileData.data);
+            state.renderer = &renderer;
+            if (profile)
+            {
+                ProcessInput(state, "profile on");
+            }
+            ProcessScript(state, (const char*)fileData.data, fileData.size, cache ? cacheFile.data() : NULL);
+            if (profile)
+            {
+                ProcessInput(state, "profile report");
+            }
+            StopRenderer(renderer);
         }
         else
         {
@@ -19,13 +56,34 @@ int main(int argc, char const* argv[])
         return 0;
     }
 
+    Renderer renderer;
+    StartRenderer(renderer, PresentToFile, NULL);
     State state;
-    char input[500] = {};
+    state.renderer = &renderer;
+    // an input goes on over the next lines while it has an open block or
+    // bracket, an empty line ends it anyway.
+    String input;
+    String line;
     for (;;)
     {
-        PrintToConsole(PROMPT_TEXT, ConsoleColor::GREEN);
-        ReadFromConsole(input, sizeof(input));
-        ProcessInput(state, input);
+        PrintToConsole(input.size() ? CONTINUE_TEXT : PROMPT_TEXT, ConsoleColor::GREEN);
+        if (!ReadLineFromConsole(line))
+        {
+            break;
+        }
+        const bool emptyLine = line.size() == 0;
+        Append(input, line);
+        Append(input, '\n');
+        if (emptyLine || IsInputComplete(input.data(), input.size()))
+        {
+            ProcessInput(state, input.data(), input.size());
+            input.clear();
+        }
+    }
+    if (input.size())
+    {
+        ProcessInput(state, input.data(), input.size());
     }
+    StopRenderer(renderer);
     return 0;
-}
\ No newline at end of file
+}